@@ -10,9 +10,16 @@
 #include "debug.h"
 #include "lib/string.h"
 #include "mm.h"
+#include "kmem.h"
 
 static char* __module = "HD    ";
 
+/*
+ * Object caches for the semaphores and return codes of requests
+ */
+static kmem_cache_t hd_sem_cache = KMEM_CACHE_INITIALIZER("hd_sem", sizeof(semaphore_t));
+static kmem_cache_t hd_rc_cache = KMEM_CACHE_INITIALIZER("hd_rc", sizeof(int));
+
 
 /*
  * According to the ATA/ATAPI specification, ASCII strings are transferred
@@ -66,7 +73,7 @@ static void init_request(hd_request_t* request, minor_dev_t minor_dev,
     /*
      * Allocate memory for semaphore
      */
-    request->semaphore = (semaphore_t*) kmalloc(sizeof(semaphore_t));
+    request->semaphore = (semaphore_t*) kmem_cache_alloc(&hd_sem_cache);
     KASSERT(request->semaphore);
     sem_init(request->semaphore, 0);
 }
@@ -96,7 +103,7 @@ static int hd_put_request(hd_request_queue_t* queue, minor_dev_t minor_dev,
      * Allocate memory for return code in kernel heap - this makes sure
      * that we are able to access the pointer from every context
      */
-    rc_ptr = (int*) kmalloc(sizeof(int));
+    rc_ptr = (int*) kmem_cache_alloc(&hd_rc_cache);
     if (0 == rc_ptr) {
         ERROR("Could not allocate memory for error code\n");
         return ENOMEM;
@@ -134,8 +141,8 @@ static int hd_put_request(hd_request_queue_t* queue, minor_dev_t minor_dev,
     spinlock_release(&(queue->device_lock), &eflags);
     sem_down(sem);
     rc = *rc_ptr;
-    kfree(rc_ptr);
-    kfree(sem);
+    kmem_cache_free(&hd_rc_cache, rc_ptr);
+    kmem_cache_free(&hd_sem_cache, sem);
     if (rc)
         return EIO;
     return 0;
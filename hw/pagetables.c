@@ -4,7 +4,8 @@
  * This module contains functions to handle
  * page tables on the x86 architecture
  * We only support 32 bit paging at the moment
- * with a page size of 4 kB
+ * with a page size of 4 kB and, if the CPU supports
+ * PSE, 4 MB pages mapped directly by the page table directory
  */
 
 #include "pagetables.h"
@@ -15,25 +16,57 @@
  * @rw - set to one to allow writes to the page
  * @us - user/supervisor flag, if 0 page is reserved for supervisor mode
  * @pcd - set to one to disable caching of this page
+ * @g - set to one to mark the page as global, this is ignored unless the PGE bit in CR4 is set
  * @page_base - 32 bit base address of page, must be a multiple of page size
  * Present bit = 1
  * Accessed = 0
  * dirty = 0
  * PWT = 0
+ * COW = 0
+ * shared = 0
  * Return value:
  * the newly created page table entry
  */
-pte_t pte_create (u8 rw, u8 us, u8 pcd, u32 page_base) {
+pte_t pte_create (u8 rw, u8 us, u8 pcd, u8 g, u32 page_base) {
     pte_t pte;
     pte.a = 0;
     pte.d = 0;
     pte.page_base = (page_base >> 12);
     pte.pcd = pcd;
     pte.pwt = 0;
-    pte.reserved0 = 0;
+    pte.ps = 0;
+    pte.g = g;
+    pte.cow = 0;
+    pte.shared = 0;
+    pte.swapped = 0;
     pte.rw = rw;
     pte.us = us;
     pte.p = 1;
     return pte;
 }
 
+
+/*
+ * Create a page table directory entry which maps a 4 MB page. This requires
+ * that the PSE bit in CR4 is set
+ * Parameters:
+ * @rw - set to one to allow writes to the page
+ * @us - user/supervisor flag, if 0 page is reserved for supervisor mode
+ * @pcd - set to one to disable caching of this page
+ * @g - set to one to mark the page as global, this is ignored unless the PGE bit in CR4 is set
+ * @page_base - 32 bit base address of page, must be a multiple of 4 MB
+ * Present bit = 1
+ * Page size = 1
+ * Accessed = 0
+ * dirty = 0
+ * PWT = 0
+ * COW = 0
+ * shared = 0
+ * Return value:
+ * the newly created page table directory entry
+ */
+pte_t pde_create_large (u8 rw, u8 us, u8 pcd, u8 g, u32 page_base) {
+    pte_t pde = pte_create(rw, us, pcd, g, page_base & ~(PDE_LARGE_PAGE_SIZE - 1));
+    pde.ps = 1;
+    return pde;
+}
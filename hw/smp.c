@@ -277,6 +277,13 @@ void smp_start_aps() {
      * and copy content of CR3 to address 0x10014
      */
     *((u32*)(AP_CR3_ADDR+AP_DS*0x10)) = get_cr3();
+    /*
+     * The APs need the same setting of CR4 as the page tables might
+     * contain 4 MB pages and global pages. CR4 is only read if the BSP supports
+     * PSE or PGE, as the register does not exist on very old CPUs
+     */
+    *((u32*)(AP_CR4_ADDR+AP_DS*0x10)) = (cpu_has_feature(0, CPUID_FEATURE_PSE)
+            || cpu_has_feature(0, CPUID_FEATURE_PGE)) ? get_cr4() : 0;
     /*
      * Now try to bring up all CPUs
      */
@@ -308,8 +315,13 @@ static void smp_idle_loop() {
      */
     if (SMP_BSP_ID + 1 == cpuid)
         do_pre_init_tests_ap();
+    /*
+     * Use idle time to zero pages for the memory manager, and halt only
+     * if there is nothing left to do
+     */
     while (1) {
-        asm("hlt");
+        if (0 == mm_refill_zero_pool())
+            asm("hlt");
     }
 }
 
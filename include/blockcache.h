@@ -8,11 +8,74 @@
 #include "ktypes.h"
 #include "lib/unistd.h"
 
+/*
+ * Number of buckets in the hash table of the cache
+ */
+#define BC_HASH_BUCKETS 256
+
+/*
+ * Number of buffers which we allocate before we start to
+ * evict buffers from the cache
+ */
+#define BC_MAX_BUFFERS 1024
+
+/*
+ * Number of dirty buffers above which the flusher thread is woken up
+ * in write-back mode
+ */
+#define BC_DIRTY_THRESHOLD (BC_MAX_BUFFERS / 4)
+
+/*
+ * Interval in seconds in which the flusher thread writes back dirty buffers
+ */
+#define BC_FLUSH_SECONDS 5
+
+/*
+ * Maximum number of consecutive blocks which are transferred
+ * to or from a device with one request
+ */
+#define BC_MAX_RUN 32
+
+/*
+ * Size of the read-ahead queue
+ */
+#define BC_RA_QUEUE_SIZE 256
+
+/*
+ * Minimum and maximum size of a read-ahead window in blocks
+ */
+#define BC_RA_MIN_WINDOW 4
+#define BC_RA_MAX_WINDOW 64
+
+/*
+ * Statistics of the block cache
+ */
+typedef struct {
+    u32 hits;                  // number of lookups which found the block in the cache
+    u32 misses;                // number of lookups which had to go to the device
+    u32 buffers;               // number of buffers currently allocated
+    u32 evictions;             // number of buffers which have been reused for a different block
+    u32 dirty;                 // number of dirty buffers
+    u32 flushed;               // number of dirty buffers written back to disk
+    u32 ra_reads;              // number of blocks read by the read-ahead thread
+    u32 ra_used;               // number of prefetched blocks which have been used (recent history only)
+    u32 ra_wasted;             // number of prefetched blocks evicted before use (recent history only)
+} bc_stats_t;
+
 void bc_init();
 int bc_open(dev_t dev);
 int bc_close(dev_t dev);
 int bc_read_bytes(u32 block, u32 bytes, void* buffer, dev_t device, u32 offset);
 int bc_write_bytes(u32 block, u32 bytes, void* buffer, dev_t device, u32 offset);
+void bc_invalidate(dev_t device);
+int bc_sync(dev_t device);
+void bc_start_flusher();
+void bc_do_tick();
+void bc_start_readahead();
+void bc_prefetch(dev_t dev, u32 block);
+u32 bc_ra_window_limit();
+void bc_get_stats(bc_stats_t* stats);
+void bc_print_stats();
 void bc_test_cross_page_read();
 
 #endif /* _BLOCKCACHE_H_ */
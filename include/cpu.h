@@ -80,8 +80,10 @@ typedef struct _cpu_t {
  * bits 32 - 63 are used to store the feature flags returned in
  * ECX by CPUID.EAX=1.
  */
+#define CPUID_FEATURE_PSE (1 << 3)
 #define CPUID_FEATURE_TSC (1 << 4)
 #define CPUID_FEATURE_MSR (1 << 5)
+#define CPUID_FEATURE_PGE (1 << 13)
 #define CPUID_FEATURE_FXSAVE (1 << 24)
 #define CPUID_FEATURE_SSE (1 << 25)
 /*
@@ -0,0 +1,46 @@
+/*
+ * dcache.h
+ */
+
+#ifndef _DCACHE_H_
+#define _DCACHE_H_
+
+#include "ktypes.h"
+#include "lib/sys/types.h"
+
+/*
+ * Number of buckets in the hash table of the dentry cache
+ */
+#define DCACHE_HASH_BUCKETS 256
+
+/*
+ * Number of entries in the dentry cache
+ */
+#define DCACHE_ENTRIES 1024
+
+/*
+ * Maximum length of a name which is stored in the cache. Longer
+ * names are not cached
+ */
+#define DCACHE_NAME_LEN 32
+
+/*
+ * Statistics of the dentry cache
+ */
+typedef struct {
+    u32 hits;                  // number of lookups which found a positive entry
+    u32 negative_hits;         // number of lookups which found a negative entry
+    u32 misses;                // number of lookups which did not find an entry
+    u32 entries;               // number of entries currently in use
+} dcache_stats_t;
+
+void dcache_init();
+int dcache_lookup(dev_t dev, ino_t parent, char* name, int length, ino_t* inode_nr);
+void dcache_enter(dev_t dev, ino_t parent, char* name, int length, ino_t inode_nr);
+void dcache_remove(dev_t dev, ino_t parent, char* name, int length);
+void dcache_purge(dev_t dev, ino_t parent);
+void dcache_purge_dev(dev_t dev);
+void dcache_get_stats(dcache_stats_t* stats);
+void dcache_print_stats();
+
+#endif /* _DCACHE_H_ */
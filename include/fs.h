@@ -49,6 +49,9 @@ typedef struct {
     void (*inode_release)(struct _inode_t* inode);
     int (*inode_flush)(struct _inode_t* inode);
     int (*inode_link)(struct _inode_t* dir, char* name, struct _inode_t* inode);
+    int (*inode_readahead)(struct _inode_t* inode, ssize_t bytes, off_t offset);
+    int (*inode_next_direntry)(struct _inode_t* inode, off_t* offset, direntry_t* direntry);
+    int (*inode_lookup)(struct _inode_t* dir, char* name, int length, ino_t* inode_nr);
 } inode_ops_t;
 
 /*
@@ -90,6 +93,7 @@ typedef struct _superblock_t{
     inode_t* (*get_inode)(dev_t, ino_t);
     void (*release_superblock)(struct _superblock_t* superblock);
     int (*is_busy)(struct _superblock_t* superblock);
+    int (*sync)(struct _superblock_t* superblock);           // write back cached metadata, may be 0
 } superblock_t;
 
 /*
@@ -126,6 +130,9 @@ typedef struct _open_file_t {
     semaphore_t sem;        // Semaphore to protect access to inner state of file
     spinlock_t lock;        // spinlock to protect reference count
     u32 flags;              // flags which have been used to open the file
+    off_t ra_next;          // offset at which we expect the next read if access is sequential
+    off_t ra_end;           // end of the area for which a read-ahead has already been started
+    u32 ra_window;          // current size of the read-ahead window in blocks
     struct _open_file_t* next;
     struct _open_file_t* prev;
 } open_file_t;
@@ -160,6 +167,11 @@ typedef struct _fs_process_t {
 #define FS_READ 0
 #define FS_WRITE 1
 
+/*
+ * Size of the read-ahead window in blocks when sequential access has been detected
+ */
+#define FS_RA_MIN_WINDOW 4
+
 /*
  * The public interface of the file system is split in two parts. The first part consists
  * of functions which operate directly on the level of inodes.
@@ -169,6 +181,9 @@ inode_t* fs_get_inode_for_name(char* path, inode_t* inode_at);
 int fs_mount(inode_t* mount_point, dev_t device, fs_implementation_t* fs);
 int fs_unmount(inode_t* mounted_on);
 ssize_t fs_read(open_file_t* file, size_t bytes, void* buffer);
+ssize_t fs_read_inode(inode_t* inode, off_t offset, ssize_t bytes, void* buffer);
+ssize_t fs_write_inode(inode_t* inode, off_t offset, ssize_t bytes, void* buffer);
+struct _pc_page_t* fs_get_page(inode_t* inode, off_t offset);
 ssize_t fs_write(open_file_t* file, size_t bytes, void* buffer);
 ssize_t fs_lseek(open_file_t* file, off_t offset, int whence);
 ssize_t fs_readdir(open_file_t* file, direntry_t* direntry);
@@ -180,6 +195,7 @@ void fs_clone(u32 source_pid, u32 target_pid);
 int fs_print_open_files();
 int fs_get_dirname(inode_t* inode, char* buffer, size_t n);
 ssize_t fs_ftruncate(open_file_t* file, off_t size);
+int fs_get_mappable_inode(int fd, int write, inode_t** inode);
 
 /*
  * The public interface below this line corresponds to system calls
@@ -228,5 +244,7 @@ int do_ioctl(int fd, unsigned int cmd, void* arg);
 int do_setsockopt(int fd, int level, int option, void* option_value, unsigned int option_len);
 int do_getsockaddr(int fd, struct sockaddr* laddr, struct sockaddr* faddr, socklen_t* addrlen);
 int do_ftruncate(int fd, off_t size);
+int do_sync();
+int do_fsync(int fd);
 
 #endif /* _FS_H_ */
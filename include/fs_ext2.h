@@ -44,6 +44,30 @@ typedef struct {
     u32 s_feature_incompat;
     u32 s_feature_ro_compat;
     u32 s_uuid[4];
+    char s_volume_name[16];
+    char s_last_mounted[64];
+    u32 s_algo_bitmap;
+    u8 s_prealloc_blocks;
+    u8 s_prealloc_dir_blocks;
+    u16 s_reserved_gdt_blocks;
+    u32 s_journal_uuid[4];
+    u32 s_journal_inum;
+    u32 s_journal_dev;
+    u32 s_last_orphan;
+    u32 s_hash_seed[4];
+    u8 s_def_hash_version;
+    u8 s_jnl_backup_type;
+    u16 s_desc_size;
+    u32 s_default_mount_opts;
+    u32 s_first_meta_bg;
+    u32 s_mkfs_time;
+    u32 s_jnl_blocks[17];
+    u32 s_blocks_count_hi;
+    u32 s_r_blocks_count_hi;
+    u32 s_free_blocks_hi;
+    u16 s_min_extra_isize;
+    u16 s_want_extra_isize;
+    u32 s_flags;
 } __attribute__ ((packed)) ext2_superblock_t;
 
 /*
@@ -101,6 +125,75 @@ typedef struct {
     u8 file_type;
 } __attribute__ ((packed)) ext2_direntry_t;
 
+/*
+ * The root block of a hashed directory index (htree). The block starts
+ * with the entries for . and .., where the entry for .. covers the remainder
+ * of the block, so that the block is a valid directory block. This structure
+ * follows the entries for . and .. and is followed by the index entries
+ */
+typedef struct {
+    u32 reserved_zero;
+    u8 hash_version;
+    u8 info_length;
+    u8 indirect_levels;
+    u8 unused_flags;
+} __attribute__ ((packed)) ext2_dx_root_info_t;
+
+/*
+ * An entry in an index block of a hashed directory. The block number is the
+ * logical block number within the directory. In the first entry of an index
+ * block, the hash is replaced by the limit and the count of entries in the block
+ */
+typedef struct {
+    u32 hash;
+    u32 block;
+} __attribute__ ((packed)) ext2_dx_entry_t;
+
+typedef struct {
+    u16 limit;
+    u16 count;
+    u32 block;
+} __attribute__ ((packed)) ext2_dx_countlimit_t;
+
+/*
+ * Number of buckets in the hash table of the inode cache of each mounted
+ * ext2 instance and maximum number of unreferenced inodes which are kept
+ * in the cache
+ */
+#define EXT2_INODE_HASH_BUCKETS 64
+#define EXT2_INODE_LRU_SIZE 128
+
+/*
+ * A bucket in the hash table of the inode cache
+ */
+typedef struct {
+    struct _ext2_inode_data_t* head;             // first inode in chain
+    spinlock_t lock;                             // protects the chain and the reference counts of all inodes in it
+} ext2_inode_bucket_t;
+
+/*
+ * The allocation bitmaps of a block group which are kept in memory. A bitmap
+ * is read from disk when it is used for the first time and written back by
+ * fs_ext2_sync or when the file system is released
+ */
+typedef struct {
+    u8* block_bitmap;                            // block bitmap or 0 if not yet loaded
+    u8* inode_bitmap;                            // inode bitmap or 0 if not yet loaded
+    int block_bitmap_dirty;                      // block bitmap has been changed since it was written back
+    int inode_bitmap_dirty;                      // inode bitmap has been changed since it was written back
+} ext2_group_t;
+
+/*
+ * Maximum number of blocks allocated at once when filling a hole in a blocklist
+ */
+#define EXT2_MAX_ALLOC_RUN 32
+
+/*
+ * Number of blocks which are reserved in addition to the blocks needed
+ * when a regular file grows
+ */
+#define EXT2_PREALLOC_BLOCKS 8
+
 /*
  * This structure is used to keep track of all metadata which
  * belong to one mounted ext2 instance
@@ -113,12 +206,17 @@ typedef struct _ext2_metadata_t {
     u32 bgdt_size;                               // number of entries in the block group descriptor table
     u32 bgdt_blocks;                             // number of blocks occupied by the block group descriptor table
     semaphore_t sb_lock;                         // lock to protect the superblock structure
+    ext2_group_t* groups;                        // cached allocation bitmaps, one entry per block group, protected by sb_lock
     struct _ext2_metadata_t* next;
     struct _ext2_metadata_t* prev;
-    struct _ext2_inode_data_t* inodes_head;
-    struct _ext2_inode_data_t* inodes_tail;
+    ext2_inode_bucket_t inode_hash[EXT2_INODE_HASH_BUCKETS];   // hash table of cached inodes
+    struct _ext2_inode_data_t* lru_head;         // least recently used unreferenced inode
+    struct _ext2_inode_data_t* lru_tail;         // most recently used unreferenced inode
+    u32 lru_count;                               // number of inodes on the LRU list
+    u32 inode_hits;                              // number of inode lookups served from the cache
+    u32 inode_misses;                            // number of inode lookups which had to go to the disk
     int reference_count;                         // number of times this structure is referenced from outside the module
-    spinlock_t lock;                             // this lock protects the chain of inodes attached to this structure and the reference count of each inode
+    spinlock_t lock;                             // this lock protects the LRU list of unreferenced inodes and the statistics
 } ext2_metadata_t;
 
 /*
@@ -130,8 +228,12 @@ typedef struct _ext2_inode_data_t {
     ext2_inode_t* ext2_inode;                    // ext2 inode
     inode_t* inode;                              // inode as visible to the generic FS layer
     int reference_count;                         // Number of references to this inode
-    struct _ext2_inode_data_t* next;
-    struct _ext2_inode_data_t* prev;
+    int on_lru;                                  // set if the inode is on the LRU list
+    u32 prealloc_block;                          // first block of the preallocation window
+    u32 prealloc_count;                          // number of blocks left in the preallocation window
+    struct _ext2_inode_data_t* hash_next;        // next inode in hash chain
+    struct _ext2_inode_data_t* next;             // next inode on LRU list
+    struct _ext2_inode_data_t* prev;             // previous inode on LRU list
 } ext2_inode_data_t;
 
 #define EXT2_SUPERBLOCK_SIZE 1024
@@ -161,6 +263,37 @@ typedef struct _ext2_inode_data_t {
  */
 #define EXT2_S_IFREG 0100000
 
+/*
+ * Directory index feature flag, the inode flag marking an indexed directory
+ * and the superblock flags which select signed or unsigned directory hashes
+ */
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x20
+#define EXT2_INDEX_FL 0x1000
+#define EXT2_FLAGS_SIGNED_HASH 0x1
+#define EXT2_FLAGS_UNSIGNED_HASH 0x2
+
+/*
+ * Hash versions used by directory indices
+ */
+#define EXT2_HASH_LEGACY 0
+#define EXT2_HASH_HALF_MD4 1
+#define EXT2_HASH_TEA 2
+#define EXT2_HASH_LEGACY_UNSIGNED 3
+#define EXT2_HASH_HALF_MD4_UNSIGNED 4
+#define EXT2_HASH_TEA_UNSIGNED 5
+
+/*
+ * Maximum number of index levels (including the root) in a directory index
+ */
+#define EXT2_DX_MAX_LEVELS 2
+
+/*
+ * Offset of the root info structure within the root block of an index and
+ * offset of the index entries in an interior index block
+ */
+#define EXT2_DX_ROOT_INFO_OFFSET 24
+#define EXT2_DX_NODE_OFFSET 8
+
 
 /*
  * Some operations
@@ -168,6 +301,7 @@ typedef struct _ext2_inode_data_t {
 #define EXT2_OP_READ 0
 #define EXT2_OP_WRITE 1
 #define EXT2_OP_TRUNC 2
+#define EXT2_OP_READAHEAD 3
 
 int fs_ext2_probe(dev_t device);
 superblock_t* fs_ext2_get_superblock(dev_t device);
@@ -175,6 +309,7 @@ int fs_ext2_is_busy(superblock_t* super);
 int fs_ext2_init();
 inode_t* fs_ext2_get_inode(dev_t device, ino_t inode_nr);
 void fs_ext2_release_superblock(superblock_t* superblock);
+int fs_ext2_sync(superblock_t* superblock);
 ssize_t fs_ext2_inode_read(struct _inode_t* inode, ssize_t bytes, off_t offset,
         void* data);
 ssize_t fs_ext2_inode_write(struct _inode_t* inode, ssize_t bytes, off_t offset,
@@ -188,6 +323,11 @@ inode_t* fs_ext2_inode_clone(struct _inode_t* inode);
 void fs_ext2_inode_release(struct _inode_t* inode);
 int fs_ext2_inode_flush(struct _inode_t* inode);
 int fs_ext2_inode_link(inode_t* dir, char* name, struct _inode_t* inode);
+int fs_ext2_inode_readahead(struct _inode_t* inode, ssize_t bytes, off_t offset);
+int fs_ext2_next_direntry(struct _inode_t* inode, off_t* offset,
+        direntry_t* direntry);
+int fs_ext2_lookup(struct _inode_t* dir, char* name, int length, ino_t* inode_nr);
+u32 fs_ext2_dx_hash(char* name, int length, int version, u32* seed);
 int fs_ext2_print_cache_info();
 
 #endif /* _FS_EXT2_H_ */
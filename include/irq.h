@@ -108,6 +108,12 @@ typedef struct _isr_handler_t {
  */
 #define IPI_DEBUG 0x82
 
+/*
+ * This vector is used for IPIs which ask a CPU to invalidate
+ * entries in its TLB (see mm_tlb_batch_flush)
+ */
+#define IPI_TLB_SHOOTDOWN 0x84
+
 /*
  * Interrupts enabled?
  */
@@ -0,0 +1,114 @@
+/*
+ * kmem.h
+ */
+
+#ifndef _KMEM_H_
+#define _KMEM_H_
+
+#include "ktypes.h"
+#include "locks.h"
+#include "smp_const.h"
+
+/*
+ * Each CPU keeps a small stack of free objects for each cache from which objects are
+ * allocated without taking the lock of the cache. This stack holds up to KMEM_CPU_CACHE_SIZE
+ * objects and is refilled from resp. drained to the slabs in batches of KMEM_CPU_CACHE_BATCH objects
+ */
+#define KMEM_CPU_CACHE_SIZE 16
+#define KMEM_CPU_CACHE_BATCH 8
+
+/*
+ * A slab is a block of KMEM_SLAB_MIN_SIZE bytes or a power of two multiple thereof, aligned to its size.
+ * We use the smallest slab size which holds at least KMEM_SLAB_MIN_OBJECTS objects, but never more than
+ * KMEM_SLAB_MAX_SIZE bytes
+ */
+#define KMEM_SLAB_MIN_SIZE 4096
+#define KMEM_SLAB_MAX_SIZE 32768
+#define KMEM_SLAB_MIN_OBJECTS 8
+
+/*
+ * Objects are aligned to this boundary
+ */
+#define KMEM_ALIGN 8
+
+/*
+ * Number of completely free slabs which a cache keeps before returning slabs to the kernel heap
+ */
+#define KMEM_FREE_SLABS 1
+
+/*
+ * Header at the start of each slab
+ */
+typedef struct _kmem_slab_t {
+    struct _kmem_cache_t* cache;         // the cache to which the slab belongs
+    void* free;                          // first free object, free objects are chained through their first word
+    u32 in_use;                          // number of objects which are not on the free list of the slab
+    struct _kmem_slab_t* next;
+    struct _kmem_slab_t* prev;
+} kmem_slab_t;
+
+/*
+ * Per-CPU stack of free objects
+ */
+typedef struct {
+    void* objects[KMEM_CPU_CACHE_SIZE];  // the free objects
+    int count;                           // number of objects on the stack
+    u32 allocs;                          // number of allocations done on this CPU
+    u32 frees;                           // number of objects freed on this CPU
+    u32 hits;                            // allocations served without refilling the stack
+} kmem_cpu_cache_t;
+
+/*
+ * An object cache. Caches are usually defined statically using KMEM_CACHE_INITIALIZER,
+ * the remaining fields are set up when the first object is allocated
+ */
+typedef struct _kmem_cache_t {
+    char* name;                          // name of the cache, used for debugging output
+    u32 object_size;                     // size of an object as requested
+    int ready;                           // set once the slab geometry has been determined
+    u32 size;                            // size of an object including padding
+    u32 slab_size;                       // size of a slab in bytes
+    u32 objects_per_slab;                // number of objects in a slab
+    spinlock_t lock;                     // protects the slab lists and the counters below
+    kmem_slab_t* partial_head;           // slabs with free objects which are partially used
+    kmem_slab_t* partial_tail;
+    kmem_slab_t* full_head;              // slabs without free objects
+    kmem_slab_t* full_tail;
+    kmem_slab_t* free_head;              // slabs which are not used at all
+    kmem_slab_t* free_tail;
+    u32 slabs;                           // number of slabs
+    u32 free_slabs;                      // number of slabs on the free list
+    u32 refills;                         // number of refills of a per-CPU stack
+    u32 drains;                          // number of drains of a per-CPU stack
+    kmem_cpu_cache_t cpu_cache[SMP_MAX_CPU];
+    struct _kmem_cache_t* next;          // list of all caches
+    struct _kmem_cache_t* prev;
+} kmem_cache_t;
+
+/*
+ * Static initializer for a cache
+ */
+#define KMEM_CACHE_INITIALIZER(cache_name, size) { .name = (cache_name), .object_size = (size) }
+
+/*
+ * Usage statistics of a cache
+ */
+typedef struct {
+    u32 object_size;                     // size of an object including padding
+    u32 slabs;                           // number of slabs
+    u32 objects;                         // number of objects which fit into the slabs
+    u32 active;                          // number of objects currently allocated
+    u32 cached;                          // number of free objects on the per-CPU stacks
+    u32 allocs;                          // total number of allocations
+    u32 frees;                           // total number of frees
+    u32 hits;                            // allocations served from the per-CPU stacks without a refill
+    u32 refills;                         // number of refills of the per-CPU stacks
+    u32 drains;                          // number of drains of the per-CPU stacks
+} kmem_cache_stats_t;
+
+void* kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* object);
+void kmem_cache_get_stats(kmem_cache_t* cache, kmem_cache_stats_t* stats);
+void kmem_print_stats();
+
+#endif /* _KMEM_H_ */
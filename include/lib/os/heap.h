@@ -7,6 +7,17 @@
 
 #include "types.h"
 
+/*
+ * Free chunks are kept on segregated free lists (bins), sorted by their size.
+ * Small chunks are sorted into bins which are __HEAP_SMALL_STEP bytes apart, for
+ * sizes of __HEAP_SMALL_LIMIT bytes and more, each power of two is split into
+ * __HEAP_SUB_BINS bins
+ */
+#define __HEAP_SMALL_LIMIT 256
+#define __HEAP_SMALL_STEP 8
+#define __HEAP_SUB_BINS 4
+#define __HEAP_BINS 128
+
 /*
  * This data structure defines a heap
  * Note that this heap can be placed
@@ -14,12 +25,17 @@
  * The function extension is invoked when the heap
  * needs to be extended and is supposed to
  * return the new current top of the heap
+ * If validate is set, the entire heap is checked
+ * for consistency after each operation. As this
+ * is expensive, it should only be used for debugging
  */
 typedef struct {
     unsigned int start;
     unsigned int current_top;
     unsigned int (*extension)(unsigned int size, unsigned int current_top);
     int validate;
+    unsigned int bin_map[__HEAP_BINS / 32];
+    void* bins[__HEAP_BINS];
 } heap_t;
 
 /*
@@ -29,14 +45,28 @@ typedef struct {
  * simply a pointer to the corresponding
  * header, whereas the headers form
  * a linked list
+ * The header is padded to eight bytes so that
+ * header and footer together occupy a multiple
+ * of four bytes and chunks stay aligned
  */
 
 typedef struct {
     void* footer;
     unsigned char last :1;
     unsigned char used :1;
+    unsigned char reserved[3];
 } __attribute__ ((packed)) heap_chunk_header_t;
 
+/*
+ * A free chunk which is on one of the bins stores
+ * the pointers to its neighbours on the bin in
+ * the first bytes of its usable area
+ */
+typedef struct {
+    heap_chunk_header_t* next;
+    heap_chunk_header_t* prev;
+} heap_chunk_links_t;
+
 /*
  * Internal error codes
  */
@@ -45,6 +75,7 @@ typedef struct {
 #define __HEAP_EFOOTER 3
 #define __HEAP_ECHUNKRANGE 4
 #define __HEAP_ESIZE 5
+#define __HEAP_EBIN 6
 
 int __ctOS_heap_init(heap_t* heap, unsigned int first, unsigned int last, unsigned int(*extension)(unsigned int, unsigned int));
 void* __ctOS_heap_malloc(heap_t* heap, unsigned int size);
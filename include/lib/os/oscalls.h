@@ -86,5 +86,9 @@ int __ctOS_setsid();
 pid_t __ctOS_getsid(pid_t pid);
 int __ctOS_link(const char *path1, const char *path2);
 int __ctOS_ftruncate(int fd, off_t size);
+int __ctOS_sync();
+int __ctOS_fsync(int fd);
+unsigned int __ctOS_mmap(void* addr, size_t len, int prot, int flags, int fd, off_t offset);
+int __ctOS_munmap(void* addr, size_t len);
 
 #endif /* __OSCALLS_H_ */
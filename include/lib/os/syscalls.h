@@ -80,6 +80,10 @@
 #define __SYSNO_FTRUNCATE 68
 #define __SYSNO_OPENAT 69
 #define __SYSNO_FCHDIR 70
+#define __SYSNO_SYNC 71
+#define __SYSNO_FSYNC 72
+#define __SYSNO_MMAP 73
+#define __SYSNO_MUNMAP 74
 
 
 unsigned int __ctOS_syscall (unsigned int __sysno, int argc, ...);
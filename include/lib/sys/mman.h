@@ -0,0 +1,36 @@
+/*
+ * mman.h
+ *
+ */
+
+#ifndef _MMAN_H_
+#define _MMAN_H_
+
+#include "types.h"
+
+/*
+ * Protection of a mapping
+ */
+#define PROT_NONE 0x0
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC 0x4
+
+/*
+ * Flags for mmap
+ */
+#define MAP_SHARED 0x1
+#define MAP_PRIVATE 0x2
+#define MAP_FIXED 0x10
+#define MAP_ANONYMOUS 0x20
+#define MAP_ANON MAP_ANONYMOUS
+
+/*
+ * Return value of mmap in case of an error
+ */
+#define MAP_FAILED ((void*) -1)
+
+void* mmap(void* addr, size_t len, int prot, int flags, int fildes, off_t off);
+int munmap(void* addr, size_t len);
+
+#endif /* _MMAN_H_ */
@@ -36,6 +36,132 @@ typedef struct {
 
 typedef pte_t ptd_t[MM_PT_ENTRIES];
 
+/*
+ * Each CPU keeps a small stack of free physical pages, called a magazine, from which single pages
+ * are allocated without taking the lock of the physical memory manager. A magazine holds up to
+ * MM_MAGAZINE_SIZE pages and is refilled from resp. drained to the buddy allocator in batches of
+ * MM_MAGAZINE_BATCH pages
+ */
+#define MM_MAGAZINE_SIZE 32
+#define MM_MAGAZINE_BATCH 16
+
+typedef struct {
+    u32 pages[MM_MAGAZINE_SIZE];    // page numbers of the free pages in the magazine
+    int count;                      // number of pages in the magazine
+    u32 hits;                       // allocations served without refilling the magazine
+    u32 refills;                    // number of refills
+    u32 drains;                     // number of drains
+    spinlock_t lock;                // protects the magazine
+} page_magazine_t;
+
+/*
+ * Statistics for the magazine of a CPU
+ */
+typedef struct {
+    u32 pages;
+    u32 hits;
+    u32 refills;
+    u32 drains;
+} mm_magazine_stats_t;
+
+/*
+ * Pages whose TLB entries need to be invalidated on other CPUs are collected in a batch of up to
+ * MM_TLB_BATCH_PAGES pages which is sent to each of these CPUs with one IPI. A CPU which has more than
+ * MM_TLB_FLUSH_THRESHOLD pages to invalidate reloads CR3 instead of invalidating the pages one by one
+ */
+#define MM_TLB_BATCH_PAGES 32
+#define MM_TLB_FLUSH_THRESHOLD 8
+
+/*
+ * A batch of TLB invalidations. Physical pages which were mapped by the invalidated entries are only
+ * released once the batch has been flushed, as other CPUs could still access them until then
+ */
+typedef struct {
+    u32 pid;                                // address space to which the pages belong
+    int count;                              // number of pages in the batch
+    int flush_all;                          // flush the entire TLB
+    u32 pages[MM_TLB_BATCH_PAGES];          // virtual addresses of the pages
+    u32 phys_pages[MM_TLB_BATCH_PAGES];     // physical pages to be released after the flush or 0
+} mm_tlb_batch_t;
+
+/*
+ * Each CPU has a mailbox into which other CPUs place TLB invalidation requests
+ * before sending an IPI
+ */
+typedef struct {
+    spinlock_t lock;                        // protects pages, count, flush_all and requested
+    u32 pages[MM_TLB_FLUSH_THRESHOLD];      // pages to be invalidated
+    int count;                              // number of pages to be invalidated
+    int flush_all;                          // set if the entire TLB needs to be flushed
+    u32 requested;                          // number of the last request placed in the mailbox
+    u32 done;                               // number of the last request which has been processed
+    u32 ipis;                               // IPIs sent by this CPU
+    u32 invalidated;                        // pages invalidated by this CPU on request
+    u32 full_flushes;                       // CR3 reloads done by this CPU on request
+} tlb_mailbox_t;
+
+/*
+ * The idle tasks keep a pool of up to MM_ZERO_POOL_SIZE physical pages which have already been filled
+ * with zeroes. The pool is only refilled while more than MM_ZERO_POOL_MIN_FREE pages are free
+ */
+#define MM_ZERO_POOL_SIZE 64
+#define MM_ZERO_POOL_MIN_FREE 1024
+
+/*
+ * Statistics of the pool of zeroed pages
+ */
+typedef struct {
+    u32 pages;                              // pages currently in the pool
+    u32 hits;                               // zeroed pages requested and taken from the pool
+    u32 misses;                             // zeroed pages requested while the pool was empty
+    u32 filled;                             // pages zeroed by the idle tasks
+} mm_zero_pool_stats_t;
+
+/*
+ * If the CPU supports PSE, the identity mapped kernel area, the ramdisk and large anonymous regions in the
+ * user area are mapped with 4 MB pages, i.e. with blocks of order MM_LARGE_PAGE_ORDER which are mapped directly
+ * by an entry in the page table directory. MM_CR4_PSE is the bit in CR4 which enables 4 MB pages
+ */
+#define MM_LARGE_PAGE_SIZE PDE_LARGE_PAGE_SIZE
+#define MM_LARGE_PAGE_ORDER 10
+#define MM_CR4_PSE (1 << 4)
+
+/*
+ * If the CPU supports PGE, all pages in the common area are marked global so that their TLB entries survive the reload
+ * of CR3 during a task switch. MM_CR4_PGE is the bit in CR4 which enables global pages
+ */
+#define MM_CR4_PGE (1 << 7)
+
+/*
+ * Anonymous pages in the user area can be written to a swap device which is divided into slots of one page.
+ * At most MM_SWAP_MAX_SLOTS slots are used. Pages are swapped out when an allocation which may sleep finds
+ * less than MM_SWAP_MIN_FREE free pages in addition to the pages it needs
+ */
+#define MM_SWAP_MAX_SLOTS 32768
+#define MM_SWAP_MIN_FREE 128
+
+/*
+ * Statistics of the swap device
+ */
+typedef struct {
+    u32 slots;                              // number of slots on the swap device
+    u32 used;                               // slots currently in use
+    u32 swap_outs;                          // pages written to the swap device
+    u32 swap_ins;                           // pages read back from the swap device
+    u32 second_chances;                     // pages skipped by the clock as they had been accessed
+    u32 cancelled;                          // pages accessed again while they were written
+    u32 rollbacks;                          // pages mapped again as the process entered the kernel
+} mm_swap_stats_t;
+
+/*
+ * Statistics on TLB shootdowns for a CPU
+ */
+typedef struct {
+    u32 ipis;
+    u32 invalidated;
+    u32 full_flushes;
+} mm_tlb_stats_t;
+
 /*
  * This structure describes an allocated area on the stack
  * The id is always equal to the id of the respective task
@@ -50,6 +176,34 @@ typedef struct _stack_allocator_t {
     struct _stack_allocator_t* prev;
 } stack_allocator_t;
 
+/*
+ * A region in the user area which is not mapped when it is set up, but populated page by page
+ * when a page fault occurs (demand paging). The content of the page at a virtual address is taken
+ * from the file at offset + (address - file_start) for file_start <= address < file_end, and
+ * zero between file_end and mem_end. This is used by the ELF loader to map the segments of an
+ * executable and by mmap, i.e. the list of user segments of an address space is the list of its
+ * memory mappings
+ */
+typedef struct _user_segment_t {
+    u32 start;                          // first byte of the region, page aligned
+    u32 end;                            // last byte of the region
+    u32 file_start;                     // first address filled from the file
+    u32 file_end;                       // first address after the data filled from the file
+    u32 mem_end;                        // first address after the zero-filled area
+    u32 offset;                         // file offset corresponding to file_start
+    u32 flags;                          // MM_SEGMENT_* flags
+    struct _inode_t* inode;             // the file, we hold a reference on it
+    struct _user_segment_t* next;
+    struct _user_segment_t* prev;
+} user_segment_t;
+
+/*
+ * Flags of a user segment
+ */
+#define MM_SEGMENT_READ 0x1             // pages can be accessed, otherwise an access leads to a SIGSEGV
+#define MM_SEGMENT_WRITE 0x2            // pages are mapped writable
+#define MM_SEGMENT_SHARED 0x4           // pages are shared with child processes and written back to the file
+
 /*
  * Within the memory manager, this structure describes an address space
  * aka process. The address space ID is always equal to the process ID
@@ -60,8 +214,11 @@ typedef struct {
     u32 valid;                   // indicates whether this table slot is valid
     u32 brk;                     // current program break, i.e. first byte above heap
     u32 end_data;                // last byte of data section, including BSS
+    u32 stack_base;              // lowest address of the mapped part of the user space stack
     stack_allocator_t* head;     // head of stack allocator queue
     stack_allocator_t* tail;     // tail of stack allocator queue
+    user_segment_t* segments_head;  // regions in the user area populated on demand
+    user_segment_t* segments_tail;
     spinlock_t lock;             // lock to protect against concurrent access
 } address_space_t;
 
@@ -118,6 +275,13 @@ typedef struct {
  */
 #define MM_PHYS_MEM_PAGES (( 0xffffffff / MM_PAGE_SIZE))
 
+/*
+ * The largest block of physical memory which can be allocated at once
+ * is 2^MM_BUDDY_MAX_ORDER pages, i.e. 4 MB
+ */
+#define MM_BUDDY_MAX_ORDER 10
+#define MM_BUDDY_ORDERS (MM_BUDDY_MAX_ORDER + 1)
+
 /*
  * The first address of high memory. We do not try to reserve pages
  * below this address
@@ -194,9 +358,16 @@ typedef struct {
 #define MM_STACK_PAGES_TASK 4
 /*
  * The initial size of the user space stack
- * in pages.
+ * in pages. Additional pages are mapped when
+ * the stack grows
+ */
+#define MM_STACK_PAGES_TASK_USER 4
+/*
+ * Maximum size of the user space stack in pages. This area
+ * below the top of the user space stack is reserved for the
+ * stack and cannot be used by the heap or user segments
  */
-#define MM_STACK_PAGES_TASK_USER 32
+#define MM_STACK_PAGES_USER_MAX 2048
 /*
  * Number of pages which we leave empty between two consecutive
  * stacks for two tasks within the same process
@@ -208,6 +379,13 @@ typedef struct {
  */
 #define MM_VIRTUAL_TOS_USER ((MM_VIRTUAL_TOS - MM_PAGE_SIZE*(MM_STACK_PAGES)))
 
+/*
+ * First address above the area in which mmap places mappings. Mappings are placed top-down
+ * below this address and above the program break, leaving one unused page below the area
+ * reserved for the user space stack
+ */
+#define MM_MMAP_TOP (MM_PAGE_START(MM_PAGE(MM_VIRTUAL_TOS_USER) - MM_STACK_PAGES_USER_MAX - 1))
+
 /*
  * Number of bytes which we can assume at least for RAM disk and kernel heap
  */
@@ -246,7 +424,26 @@ u32 mm_clone(int pid, int new_task_id);
 int mm_have_ramdisk();
 u32 mm_get_initrd_base();
 u32 mm_get_initrd_top();
+u32 mm_get_phys_pages(int order);
+void mm_put_phys_pages(u32 page_base, int order);
+u32 mm_phys_free_blocks(int order);
+int mm_phys_page_mapped(u32 page_base);
+void mm_get_magazine_stats(int cpu, mm_magazine_stats_t* stats);
+void mm_tlb_switch(int cpuid, u32 pid);
+void mm_tlb_batch_init(mm_tlb_batch_t* batch);
+void mm_tlb_batch_add(mm_tlb_batch_t* batch, u32 page, u32 phys_page);
+void mm_tlb_batch_flush(mm_tlb_batch_t* batch);
+void mm_handle_tlb_ipi();
+void mm_get_tlb_stats(int cpu, mm_tlb_stats_t* stats);
+u32 mm_get_zeroed_page();
+int mm_refill_zero_pool();
+void mm_get_zero_pool_stats(mm_zero_pool_stats_t* stats);
+void mm_swap_init();
+void mm_swap_reserve(u32 pages);
+void mm_get_swap_stats(mm_swap_stats_t* stats);
 u32 mm_map_user_segment(u32 region_base, u32 region_end);
+int mm_add_user_segment(u32 region_base, u32 region_end, u32 file_start, u32 file_end, u32 mem_end, u32 offset,
+        struct _inode_t* inode);
 u32 mm_init_user_area();
 void mm_teardown_user_area();
 u32 mm_get_kernel_stack(u32 task_id);
@@ -254,6 +451,8 @@ void mm_print_vmem();
 void mm_print_pmem();
 u32 mm_map_memio(u32 phys_base, u32 size);
 u32 do_sbrk(u32 size);
+u32 do_mmap(u32 addr, u32 len, int prot, int flags, int fd, u32 offset);
+int do_munmap(u32 addr, u32 len);
 u32 mm_get_top_of_common_stack();
 int mm_validate_buffer(u32 buffer, u32 len, int read_write);
 int mm_handle_page_fault(ir_context_t* ir_context);
@@ -0,0 +1,63 @@
+/*
+ * pagecache.h
+ */
+
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+#include "ktypes.h"
+#include "locks.h"
+#include "fs.h"
+#include "lib/sys/types.h"
+
+/*
+ * Number of buckets in the hash table of the page cache
+ */
+#define PC_HASH_BUCKETS 256
+
+/*
+ * Maximum number of pages in the page cache
+ */
+#define PC_MAX_PAGES 1024
+
+/*
+ * A page in the page cache
+ */
+typedef struct _pc_page_t {
+    dev_t dev;                               // device on which the file is located
+    ino_t inode_nr;                          // inode number of the file
+    u32 index;                               // index of the page within the file
+    u8* data;                                // the data, a page aligned page taken from the kernel heap
+    u32 phys;                                // physical address of the data
+    int ref_count;                           // number of users of the page, protected by pc_lock
+    int valid;                               // set once the data has been read from the file
+    int hashed;                              // set if the page is in a hash chain
+    semaphore_t mutex;                       // held while the data is read from the file
+    struct _pc_page_t* hash_next;            // next page in hash chain
+    struct _pc_page_t* next;                 // next page in LRU list
+    struct _pc_page_t* prev;                 // previous page in LRU list
+} pc_page_t;
+
+/*
+ * Statistics of the page cache
+ */
+typedef struct {
+    u32 hits;                  // number of lookups which found the page in the cache
+    u32 misses;                // number of lookups which had to read the page from the file
+    u32 pages;                 // number of pages currently in the cache
+    u32 allocated;             // number of pages for which memory has been allocated
+    u32 evictions;             // number of pages which have been reused for other data
+} pc_stats_t;
+
+void pc_init();
+pc_page_t* pc_get_page(inode_t* inode, u32 index);
+void pc_release_page(pc_page_t* page);
+ssize_t pc_read(inode_t* inode, off_t offset, ssize_t bytes, void* buffer);
+void pc_update(inode_t* inode, off_t offset, ssize_t bytes, void* data);
+void pc_truncate(dev_t dev, ino_t inode_nr, off_t size);
+void pc_purge(dev_t dev, ino_t inode_nr);
+void pc_purge_dev(dev_t dev);
+void pc_get_stats(pc_stats_t* stats);
+void pc_print_stats();
+
+#endif /* _PAGECACHE_H_ */
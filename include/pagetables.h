@@ -18,11 +18,21 @@ typedef struct {
     u8 pcd : 1 ; // page-level cache disable
     u8 a : 1; // accessed
     u8 d : 1; // dirty
-    u8 reserved0 : 5; // reserved or ignored
+    u8 ps : 1; // page size, if set in a page table directory entry, the entry maps a 4 MB page
+    u8 g : 1; // global, if set the TLB entry for the page is not flushed when CR3 is loaded (requires PGE)
+    u8 cow : 1; // available to software, set by the memory manager for pages shared copy-on-write
+    u8 shared : 1; // available to software, set by the memory manager for pages of shared mappings
+    u8 swapped : 1; // available to software, set by the memory manager if p = 0 and the page has been written to the swap device
     u32 page_base : 20 ; // upper 20 bits of page base address
 } __attribute ((packed)) pte_t;
 
 
-pte_t pte_create (u8 rw, u8 us, u8 pcd, u32 page_base);
+/*
+ * Size of a page mapped by a single page table directory entry with the ps bit set
+ */
+#define PDE_LARGE_PAGE_SIZE (4*1024*1024)
+
+pte_t pte_create (u8 rw, u8 us, u8 pcd, u8 g, u32 page_base);
+pte_t pde_create_large (u8 rw, u8 us, u8 pcd, u8 g, u32 page_base);
 
 #endif /* _PAGETABLES_H_ */
@@ -69,7 +69,7 @@ typedef struct _task_t {
     u32 sig_pending;                             // signals pending
     int intr;                                    // set if a sleep has been interrupted
     int idle;                                    // set if this task is the idle task for a CPU
-    int floating;                                // task has been removed from scheduler queue but not yet switched away from
+    int floating;                                // task has been blocked or preempted but not yet switched away from
     int cpuid;                                   // ID of CPU to which we are bound or -1
     int fpu;                                     // this flag is set if the task has used the FPU since we have saved the FPU state
     u8* fpu_save_area;                           // a pointer to a 512 byte array in which the FPU state is saved
@@ -238,6 +238,7 @@ dev_t pm_get_cterm();
 pid_t do_getsid(pid_t pid);
 int do_times(struct __ktms* times);
 int pm_pgrp_in_session(int pid, int pgrp);
+int pm_proc_in_user_space(int pid);
 void pm_validate();
 void wakeup_task(ecb_t* ecb);
 void pm_handle_nm_trap();
@@ -18,6 +18,8 @@ typedef struct _runnable_t {
     int priority;                  // priority
     int reschedule;                // perform scheduling operation
     int valid;                     // is this a valid runnable?
+    int bound;                     // runnable must not be moved to another CPU
+    u32 enqueued;                  // tick count of the CPU when the runnable was added to the ready queue
     struct _runnable_t* next;      // next in ready queue
     struct _runnable_t* prev;      // previous in ready queue
 } runnable_t;
@@ -48,6 +50,18 @@ typedef struct {
  */
 #define SCHED_IPI 0x83
 
+/*
+ * Load balancing. A busy CPU checks every SCHED_BALANCE_TICKS ticks whether it can steal
+ * runnables from the CPU with the longest ready queue, an idle CPU does this at every tick and
+ * whenever it is about to select its idle task. Runnables are only stolen if the ready queue of the
+ * other CPU is at least SCHED_IMBALANCE entries longer than our own, and only if they have been
+ * waiting for at least SCHED_CACHE_HOT_TICKS ticks, as their data is likely to be still in the cache
+ * of the other CPU otherwise
+ */
+#define SCHED_BALANCE_TICKS ((HZ / 10))
+#define SCHED_IMBALANCE 2
+#define SCHED_CACHE_HOT_TICKS 2
+
 
 void sched_init();
 void sched_add_idle_task(int task_id, int cpuid);
@@ -17,6 +17,7 @@
  * - status field used by the AP to signal that it has reached the protected mode
  * - address of CR3 which the AP is supposed to use
  * - address of CPU id which the AP is supposed to use
+ * - address of CR4 which the AP is supposed to use
  */
 #define AP_DS 0x1000
 #define AP_RM_STATUS_ADDR 0x0
@@ -24,6 +25,7 @@
 #define AP_PM_STATUS_ADDR 0x10
 #define AP_CR3_ADDR 0x14
 #define AP_CPUID_ADDR 0x18
+#define AP_CR4_ADDR 0x1c
 
 /*
  * Number of CPUs which we support
@@ -32,6 +32,8 @@ int enable_paging();
 int disable_paging();
 u32 get_cr0();
 u32 put_cr0();
+u32 get_cr4();
+void put_cr4(u32 cr4);
 u32 reload_cr3();
 void invlpg(u32 virtual_address);
 void goto_ring3(u32 entry_point, u32 esp);
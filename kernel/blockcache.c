@@ -1,13 +1,64 @@
 /*
  * blockcache.c
- * This module is not yet implemented in this release of ctOS, but only
- * contains stubs
  *
  * The block cache is located between the file system layer and the actual device drivers
  * for block devices. Its purpose is to cache read blocks in memory in order to speed up
  * read and write operations. The block cache uses the services offered by the device
  * driver manager to retrieve function pointers for the read, write, open and close
  * operations of a specific device
+ *
+ * The cache consists of a pool of buffers, each of which holds the content of exactly one block
+ * of BLOCK_SIZE bytes. A buffer is identified by the pair (device, block number). To locate a
+ * buffer quickly, all buffers which are currently assigned to a block are kept in a hash table
+ * with BC_HASH_BUCKETS buckets. Each bucket has its own spinlock which protects the chain of
+ * buffers in this bucket as well as the reference count of each buffer in the chain.
+ *
+ * Buffers are reference counted. A reference is held by a thread while it is operating on the
+ * buffer, i.e. while it reads the buffer from disk or copies data from or to the buffer. Buffers
+ * with reference count zero are kept in a global LRU list, with the least recently used buffer at
+ * the head of the list. When a new buffer is needed and the maximum number of buffers BC_MAX_BUFFERS
+ * has been reached, the head of the LRU list is evicted and reused. Buffers which are no longer
+ * associated with a block (for instance after bc_invalidate) are also kept on the LRU list, at its
+ * head, so that they are reused first.
+ *
+ * The content of a buffer is protected by a mutex which is part of the buffer. This mutex is held
+ * while the buffer is filled from disk and while data is copied into or out of the buffer. As
+ * disk I/O might sleep, no spinlock is held while the mutex is taken.
+ *
+ * Two write modes are supported. In write-through mode, a write updates the buffer and then
+ * immediately writes the block to the device. In write-back mode, which is selected by the kernel
+ * parameter bc_writeback, a write only updates the buffer and marks it as dirty. Dirty buffers are
+ * kept on a list of dirty buffers and written to the device by a kernel thread (the flusher) which is
+ * woken up periodically by the timer and whenever the number of dirty buffers exceeds
+ * BC_DIRTY_THRESHOLD. bc_sync can be used to force a flush of all dirty buffers of a device.
+ *
+ * Being on the dirty list counts as a reference to a buffer, so that dirty buffers are never on the LRU
+ * list and never evicted. As a buffer on the LRU list has reference count zero, a buffer can never be
+ * on the LRU list and the dirty list at the same time, and both lists use the same link fields.
+ *
+ * To support sequential read-ahead, the file system can ask the cache to prefetch blocks using bc_prefetch.
+ * These requests are put into a queue which is processed asynchronously by a second kernel thread, the
+ * read-ahead thread. Buffers filled by the read-ahead thread are flagged until they are accessed by a
+ * regular read. If a flagged buffer is evicted, the prefetch was wasted. The ratio of used and wasted
+ * prefetches is used to limit the size of the read-ahead window (see bc_ra_window_limit).
+ *
+ * Locking strategy:
+ *
+ * 1) bucket->lock - protects the hash chain of a bucket, the reference counts of all buffers in this
+ *    chain and the statistics of the bucket
+ * 2) lru_lock - protects the LRU list, the on_lru flags of all buffers and the buffer count
+ * 3) dirty_lock - protects the list of dirty buffers and the number of dirty buffers
+ * 4) ra_lock - protects the read-ahead queue
+ * 5) buffer->mutex - protects the data, the valid flag and the dirty flag of a buffer as well as the
+ *    prefetched flag of a buffer which is in use
+ *
+ * If both spinlocks are needed, the bucket lock needs to be acquired first. As the eviction code starts
+ * with a look at the LRU list, it needs to drop the LRU lock, get the bucket lock of the victim and then
+ * validate that the victim is still unused. The dirty_lock and the ra_lock are never held while any
+ * other spinlock is acquired.
+ *
+ * Buffers are never returned to the kernel heap once they have been allocated, so that a pointer to a
+ * buffer remains valid even if the buffer is reused for a different block in the meantime.
  */
 
 #include "blockcache.h"
@@ -17,27 +68,141 @@
 #include "lib/string.h"
 #include "mm.h"
 #include "kerrno.h"
+#include "locks.h"
+#include "lists.h"
+#include "params.h"
+#include "lib/os/syscalls.h"
 
 /*
  * A local loglevel
  */
 int __bc_loglevel = 0;
 
+static char* __module = "BC    ";
+
 #define BC_DEBUG(...) do {if (__bc_loglevel > 0 ) { kprintf("DEBUG at %s@%d (%s): ", __FILE__, __LINE__, __FUNCTION__); \
         kprintf(__VA_ARGS__); }} while (0)
 
+/*
+ * A buffer in the cache
+ */
+typedef struct _bc_buffer_t {
+    dev_t dev;                               // device on which the cached block is located
+    u32 block;                               // number of the cached block
+    u8* data;                                // BLOCK_SIZE bytes of data
+    int ref_count;                           // number of references, protected by the lock of the bucket
+    int hashed;                              // set if the buffer is in a hash chain
+    int on_lru;                              // set if the buffer is on the LRU list
+    int valid;                               // set if data reflects the content of the block on disk
+    int dirty;                               // set if data has been changed but not yet written to disk
+    int prefetched;                          // set if data has been read ahead and not yet been used
+    semaphore_t mutex;                       // mutex to protect data, valid flag and dirty flag
+    struct _bc_buffer_t* hash_next;          // next buffer in hash chain
+    struct _bc_buffer_t* next;               // next buffer in LRU list or dirty list
+    struct _bc_buffer_t* prev;               // previous buffer in LRU list or dirty list
+} bc_buffer_t;
+
+/*
+ * A bucket in the hash table
+ */
+typedef struct {
+    bc_buffer_t* head;                       // first buffer in chain
+    spinlock_t lock;                         // lock protecting the chain
+    u32 hits;                                // number of lookups which found the block in this bucket
+    u32 misses;                              // number of lookups which did not find the block
+} bc_bucket_t;
 
+/*
+ * The hash table
+ */
+static bc_bucket_t buckets[BC_HASH_BUCKETS];
+
+/*
+ * The LRU list, the total number of buffers and the number of evictions
+ */
+static bc_buffer_t* lru_head = 0;
+static bc_buffer_t* lru_tail = 0;
+static spinlock_t lru_lock;
+static u32 buffer_count = 0;
+static u32 evictions = 0;
+
+/*
+ * The list of dirty buffers and the number of buffers on it
+ */
+static bc_buffer_t* dirty_head = 0;
+static bc_buffer_t* dirty_tail = 0;
+static spinlock_t dirty_lock;
+static u32 dirty_count = 0;
+static u32 flushed = 0;
+
+/*
+ * Write mode - set to 1 for write-back mode
+ */
+static int write_back = 0;
+
+/*
+ * The flusher thread waits on this semaphore
+ */
+static semaphore_t flush_mutex;
+static int flusher_running = 0;
+
+/*
+ * A request in the read-ahead queue
+ */
+typedef struct {
+    dev_t dev;
+    u32 block;
+} bc_ra_request_t;
+
+/*
+ * The read-ahead queue, the semaphore on which the read-ahead thread waits
+ * and statistics on read-ahead
+ */
+static bc_ra_request_t ra_queue[BC_RA_QUEUE_SIZE];
+static u32 ra_head = 0;
+static u32 ra_tail = 0;
+static spinlock_t ra_lock;
+static semaphore_t ra_mutex;
+static int ra_running = 0;
+static u32 ra_reads = 0;
+static u32 ra_used = 0;
+static u32 ra_wasted = 0;
 
 /*
  * Initialize block cache
  */
 void bc_init() {
-
+    int i;
+    for (i = 0; i < BC_HASH_BUCKETS; i++) {
+        buckets[i].head = 0;
+        buckets[i].hits = 0;
+        buckets[i].misses = 0;
+        spinlock_init(&buckets[i].lock);
+    }
+    lru_head = 0;
+    lru_tail = 0;
+    buffer_count = 0;
+    evictions = 0;
+    spinlock_init(&lru_lock);
+    dirty_head = 0;
+    dirty_tail = 0;
+    dirty_count = 0;
+    flushed = 0;
+    spinlock_init(&dirty_lock);
+    ra_head = 0;
+    ra_tail = 0;
+    ra_reads = 0;
+    ra_used = 0;
+    ra_wasted = 0;
+    spinlock_init(&ra_lock);
+    write_back = (1 == params_get_int("bc_writeback"));
+    if (write_back) {
+        MSG("Using write-back mode for block cache\n");
+    }
 }
 
 /*
- * Read the given number of blocks from the cache or - if necessary - from
- * the device
+ * Read the given number of blocks from the device
  * Parameters:
  * @device - the device from which to read
  * @blocks - the number of blocks to read
@@ -65,7 +230,7 @@ ssize_t
         bc_read_impl;
 
 /*
- * Write the given number of blocks to the cache or to the device.
+ * Write the given number of blocks to the device
  * Parameters:
  * @device - the device to which to write
  * @blocks - the number of blocks to write
@@ -128,11 +293,724 @@ int bc_close(dev_t dev) {
     return ops->close(MINOR(dev));
 }
 
+/****************************************************************************************
+ * The following functions manage the buffers in the cache                              *
+ ***************************************************************************************/
+
+/*
+ * Compute the index of the hash bucket for a given block
+ * Parameter:
+ * @dev - the device
+ * @block - the block number
+ * Return value:
+ * the index of the bucket
+ */
+static u32 bc_hash(dev_t dev, u32 block) {
+    return (block + (((u32) dev) << 7)) % BC_HASH_BUCKETS;
+}
+
+/*
+ * Locate a buffer in a hash chain. The caller needs to hold the lock
+ * on the bucket
+ * Parameter:
+ * @bucket - the bucket
+ * @dev - the device
+ * @block - the block number
+ * Return value:
+ * the buffer or 0 if the block is not cached
+ */
+static bc_buffer_t* lookup(bc_bucket_t* bucket, dev_t dev, u32 block) {
+    bc_buffer_t* buffer = bucket->head;
+    while (buffer) {
+        if ((buffer->dev == dev) && (buffer->block == block))
+            return buffer;
+        buffer = buffer->hash_next;
+    }
+    return 0;
+}
+
+/*
+ * Remove a buffer from the hash chain of a bucket. The caller needs to hold the lock
+ * on the bucket
+ * Parameter:
+ * @bucket - the bucket
+ * @buffer - the buffer to be removed
+ */
+static void unhash(bc_bucket_t* bucket, bc_buffer_t* buffer) {
+    bc_buffer_t* current = bucket->head;
+    if (current == buffer) {
+        bucket->head = buffer->hash_next;
+    }
+    else {
+        while (current->hash_next != buffer)
+            current = current->hash_next;
+        current->hash_next = buffer->hash_next;
+    }
+    buffer->hash_next = 0;
+    buffer->hashed = 0;
+}
+
+/*
+ * Take an additional reference on a buffer which has been found in a hash chain and
+ * remove it from the LRU list if needed. The caller needs to hold the lock on the bucket
+ * Parameter:
+ * @buffer - the buffer
+ * Locks:
+ * lru_lock
+ */
+static void reference(bc_buffer_t* buffer) {
+    u32 eflags;
+    buffer->ref_count++;
+    if (buffer->on_lru) {
+        spinlock_get(&lru_lock, &eflags);
+        LIST_REMOVE(lru_head, lru_tail, buffer);
+        buffer->on_lru = 0;
+        spinlock_release(&lru_lock, &eflags);
+    }
+}
+
+/*
+ * Allocate a new buffer from the kernel heap
+ * Return value:
+ * the buffer or 0 if we are running out of memory
+ */
+static bc_buffer_t* new_buffer() {
+    bc_buffer_t* buffer;
+    if (0 == (buffer = (bc_buffer_t*) kmalloc(sizeof(bc_buffer_t)))) {
+        ERROR("Could not allocate memory for buffer\n");
+        return 0;
+    }
+    if (0 == (buffer->data = (u8*) kmalloc(BLOCK_SIZE))) {
+        ERROR("Could not allocate memory for buffer data\n");
+        kfree((void*) buffer);
+        return 0;
+    }
+    buffer->ref_count = 0;
+    buffer->hashed = 0;
+    buffer->on_lru = 0;
+    buffer->valid = 0;
+    buffer->dirty = 0;
+    buffer->prefetched = 0;
+    buffer->hash_next = 0;
+    sem_init(&buffer->mutex, 1);
+    return buffer;
+}
+
+/*
+ * Get a buffer which is not associated with any block. If the maximum number of buffers
+ * has not yet been reached, a new buffer is allocated. Otherwise the least recently used
+ * buffer is evicted. If all buffers are in use, we exceed the limit and allocate an additional
+ * buffer
+ * Return value:
+ * a buffer with reference count zero which is neither hashed nor on the LRU list
+ * 0 if we are running out of memory
+ * Locks:
+ * lru_lock
+ * lock of the bucket of the victim
+ */
+static bc_buffer_t* get_free_buffer() {
+    u32 eflags;
+    u32 bucket_eflags;
+    bc_buffer_t* victim;
+    bc_bucket_t* bucket;
+    bc_buffer_t* buffer;
+    while (1) {
+        spinlock_get(&lru_lock, &eflags);
+        victim = lru_head;
+        if ((buffer_count < BC_MAX_BUFFERS) || (0 == victim)) {
+            buffer_count++;
+            spinlock_release(&lru_lock, &eflags);
+            if (0 == (buffer = new_buffer())) {
+                spinlock_get(&lru_lock, &eflags);
+                buffer_count--;
+                spinlock_release(&lru_lock, &eflags);
+            }
+            return buffer;
+        }
+        /*
+         * Free buffers which are not hashed can be taken right away
+         */
+        if (0 == victim->hashed) {
+            LIST_REMOVE(lru_head, lru_tail, victim);
+            victim->on_lru = 0;
+            spinlock_release(&lru_lock, &eflags);
+            return victim;
+        }
+        /*
+         * Otherwise we need the bucket lock first. Drop the LRU lock, get both locks
+         * in the right order and check that nobody has grabbed the victim in the meantime
+         */
+        bucket = buckets + bc_hash(victim->dev, victim->block);
+        spinlock_release(&lru_lock, &eflags);
+        spinlock_get(&bucket->lock, &bucket_eflags);
+        spinlock_get(&lru_lock, &eflags);
+        if ((victim->on_lru) && (0 == victim->ref_count) && (victim->hashed)
+                && (bucket == buckets + bc_hash(victim->dev, victim->block))) {
+            LIST_REMOVE(lru_head, lru_tail, victim);
+            victim->on_lru = 0;
+            evictions++;
+            if (victim->prefetched) {
+                victim->prefetched = 0;
+                ra_wasted++;
+            }
+            spinlock_release(&lru_lock, &eflags);
+            unhash(bucket, victim);
+            spinlock_release(&bucket->lock, &bucket_eflags);
+            BC_DEBUG("Evicted block %d on device %x\n", victim->block, victim->dev);
+            return victim;
+        }
+        spinlock_release(&lru_lock, &eflags);
+        spinlock_release(&bucket->lock, &bucket_eflags);
+    }
+    return 0;
+}
+
+/*
+ * Get a reference to the buffer for a given block. If the block is not yet cached, a buffer
+ * is assigned to it, but the data is not yet read from the device, i.e. the valid flag of the
+ * buffer will be zero
+ * Parameter:
+ * @dev - the device
+ * @block - the block number
+ * @prefetch - set this if the buffer is requested by the read-ahead thread, this will exclude
+ * the request from the hit and miss statistics
+ * Return value:
+ * the buffer or 0 if we are running out of memory
+ * Locks:
+ * lock of the bucket
+ * Reference counts:
+ * the reference count of the returned buffer is incremented by one
+ */
+static bc_buffer_t* get_buffer(dev_t dev, u32 block, int prefetch) {
+    u32 eflags;
+    bc_bucket_t* bucket = buckets + bc_hash(dev, block);
+    bc_buffer_t* buffer;
+    bc_buffer_t* free_buffer;
+    spinlock_get(&bucket->lock, &eflags);
+    if ((buffer = lookup(bucket, dev, block))) {
+        reference(buffer);
+        if (!prefetch)
+            bucket->hits++;
+        spinlock_release(&bucket->lock, &eflags);
+        return buffer;
+    }
+    spinlock_release(&bucket->lock, &eflags);
+    /*
+     * Not in the cache. Get a free buffer and check again as
+     * another thread might have added the block in the meantime
+     */
+    if (0 == (free_buffer = get_free_buffer())) {
+        return 0;
+    }
+    spinlock_get(&bucket->lock, &eflags);
+    if ((buffer = lookup(bucket, dev, block))) {
+        reference(buffer);
+        if (!prefetch)
+            bucket->hits++;
+        spinlock_release(&bucket->lock, &eflags);
+        /*
+         * Return the free buffer to the head of the LRU list
+         */
+        spinlock_get(&lru_lock, &eflags);
+        LIST_ADD_FRONT(lru_head, lru_tail, free_buffer);
+        free_buffer->on_lru = 1;
+        spinlock_release(&lru_lock, &eflags);
+        return buffer;
+    }
+    free_buffer->dev = dev;
+    free_buffer->block = block;
+    free_buffer->valid = 0;
+    free_buffer->ref_count = 1;
+    free_buffer->hashed = 1;
+    free_buffer->hash_next = bucket->head;
+    bucket->head = free_buffer;
+    if (!prefetch)
+        bucket->misses++;
+    spinlock_release(&bucket->lock, &eflags);
+    return free_buffer;
+}
+
+/*
+ * Drop a reference to a buffer. If the reference count drops to zero, the buffer
+ * is added to the tail of the LRU list. A buffer which does not hold valid data is
+ * added to the head of the list instead
+ * Parameter:
+ * @buffer - the buffer
+ * Locks:
+ * lock on the bucket
+ * lru_lock
+ */
+static void put_buffer(bc_buffer_t* buffer) {
+    u32 eflags;
+    u32 lru_eflags;
+    bc_bucket_t* bucket = buckets + bc_hash(buffer->dev, buffer->block);
+    spinlock_get(&bucket->lock, &eflags);
+    buffer->ref_count--;
+    if (0 == buffer->ref_count) {
+        spinlock_get(&lru_lock, &lru_eflags);
+        if (buffer->valid) {
+            LIST_ADD_END(lru_head, lru_tail, buffer);
+        }
+        else {
+            LIST_ADD_FRONT(lru_head, lru_tail, buffer);
+        }
+        buffer->on_lru = 1;
+        spinlock_release(&lru_lock, &lru_eflags);
+    }
+    spinlock_release(&bucket->lock, &eflags);
+}
+
+/*
+ * Make sure that a buffer contains the data of the block on disk. The caller needs
+ * to hold the mutex of the buffer
+ * Parameter:
+ * @buffer - the buffer
+ * Return value:
+ * 0 upon success
+ * EIO if the read from the device failed
+ */
+static int fill_buffer(bc_buffer_t* buffer) {
+    if (buffer->valid)
+        return 0;
+    if (bc_read(buffer->dev, 1, buffer->block, buffer->data) <= 0) {
+        ERROR("Disk read error\n");
+        return EIO;
+    }
+    buffer->valid = 1;
+    return 0;
+}
+
+/*
+ * Get references to the buffers for a range of consecutive blocks and acquire
+ * their mutexes. As the mutexes are always acquired in ascending block order,
+ * two threads working on overlapping ranges cannot deadlock
+ * Parameter:
+ * @dev - the device
+ * @block - the first block
+ * @count - number of blocks, at most BC_MAX_RUN
+ * @buffers - array in which the buffers are stored
+ * Return value:
+ * 0 upon success
+ * ENOMEM if no buffer could be allocated
+ */
+static int get_buffers(dev_t dev, u32 block, u32 count, bc_buffer_t** buffers) {
+    u32 i;
+    for (i = 0; i < count; i++) {
+        if (0 == (buffers[i] = get_buffer(dev, block + i, 0))) {
+            while (i) {
+                i--;
+                mutex_up(&buffers[i]->mutex);
+                put_buffer(buffers[i]);
+            }
+            return ENOMEM;
+        }
+        sem_down(&buffers[i]->mutex);
+    }
+    return 0;
+}
+
+/*
+ * Release the mutexes of a range of buffers and drop the references
+ * Parameter:
+ * @buffers - the buffers
+ * @count - number of buffers
+ */
+static void put_buffers(bc_buffer_t** buffers, u32 count) {
+    u32 i;
+    for (i = 0; i < count; i++) {
+        mutex_up(&buffers[i]->mutex);
+        put_buffer(buffers[i]);
+    }
+}
+
+/*
+ * Read a run of buffers for consecutive blocks from the device using one single
+ * request. The caller needs to hold the mutexes of all buffers. If no bounce
+ * buffer can be allocated, the blocks are read one by one
+ * Parameter:
+ * @buffers - the buffers
+ * @count - number of buffers
+ * Return value:
+ * 0 upon success
+ * EIO if the read from the device failed
+ */
+static int read_run(bc_buffer_t** buffers, u32 count) {
+    u8* data;
+    u32 i;
+    int rc;
+    if ((1 == count) || (0 == (data = (u8*) kmalloc(count * BLOCK_SIZE)))) {
+        for (i = 0; i < count; i++) {
+            if ((rc = fill_buffer(buffers[i])))
+                return rc;
+        }
+        return 0;
+    }
+    if (bc_read(buffers[0]->dev, count, buffers[0]->block, data) <= 0) {
+        ERROR("Disk read error\n");
+        kfree(data);
+        return EIO;
+    }
+    for (i = 0; i < count; i++) {
+        memcpy(buffers[i]->data, data + i * BLOCK_SIZE, BLOCK_SIZE);
+        buffers[i]->valid = 1;
+    }
+    kfree(data);
+    return 0;
+}
+
+/*
+ * Write a run of buffers for consecutive blocks to the device using one single
+ * request. The caller needs to hold the mutexes of all buffers. If no bounce buffer
+ * can be allocated, the blocks are written one by one
+ * Parameter:
+ * @buffers - the buffers
+ * @count - number of buffers
+ * Return value:
+ * 0 upon success
+ * EIO if the write to the device failed
+ */
+static int write_run(bc_buffer_t** buffers, u32 count) {
+    u8* data;
+    u32 i;
+    if ((1 == count) || (0 == (data = (u8*) kmalloc(count * BLOCK_SIZE)))) {
+        for (i = 0; i < count; i++) {
+            if (bc_write(buffers[i]->dev, 1, buffers[i]->block, buffers[i]->data) <= 0) {
+                ERROR("Disk write error\n");
+                return EIO;
+            }
+        }
+        return 0;
+    }
+    for (i = 0; i < count; i++) {
+        memcpy(data + i * BLOCK_SIZE, buffers[i]->data, BLOCK_SIZE);
+    }
+    if (bc_write(buffers[0]->dev, count, buffers[0]->block, data) <= 0) {
+        ERROR("Disk write error\n");
+        kfree(data);
+        return EIO;
+    }
+    kfree(data);
+    return 0;
+}
+
+/*
+ * Make sure that all buffers in a range of buffers for consecutive blocks
+ * are valid. Each run of buffers which are not valid is read with one
+ * request. The caller needs to hold the mutexes of all buffers
+ * Parameter:
+ * @buffers - the buffers
+ * @count - number of buffers
+ * Return value:
+ * 0 upon success
+ * EIO if the read from the device failed
+ */
+static int fill_buffers(bc_buffer_t** buffers, u32 count) {
+    u32 i = 0;
+    u32 run;
+    int rc;
+    while (i < count) {
+        if (buffers[i]->valid) {
+            i++;
+            continue;
+        }
+        run = 1;
+        while ((i + run < count) && (0 == buffers[i + run]->valid))
+            run++;
+        if ((rc = read_run(buffers + i, run)))
+            return rc;
+        i += run;
+    }
+    return 0;
+}
+
+/*
+ * Mark a buffer as dirty and add it to the list of dirty buffers. The caller needs to
+ * hold the mutex of the buffer and a reference to it
+ * Parameter:
+ * @buffer - the buffer
+ * Locks:
+ * lock on the bucket
+ * dirty_lock
+ * Reference count:
+ * if the buffer was clean, the reference count is increased by one
+ */
+static void mark_dirty(bc_buffer_t* buffer) {
+    u32 eflags;
+    bc_bucket_t* bucket;
+    if (buffer->dirty)
+        return;
+    buffer->dirty = 1;
+    /*
+     * As we hold a reference, the buffer is not on the LRU list
+     * and cannot be unhashed
+     */
+    bucket = buckets + bc_hash(buffer->dev, buffer->block);
+    spinlock_get(&bucket->lock, &eflags);
+    buffer->ref_count++;
+    spinlock_release(&bucket->lock, &eflags);
+    spinlock_get(&dirty_lock, &eflags);
+    LIST_ADD_END(dirty_head, dirty_tail, buffer);
+    dirty_count++;
+    spinlock_release(&dirty_lock, &eflags);
+}
+
+/*
+ * Write a run of buffers for consecutive blocks which have been removed from the dirty
+ * list back to disk and drop the references held by the dirty list. If the write fails,
+ * the buffers are added to the dirty list again
+ * Parameter:
+ * @buffers - the buffers, sorted by block number
+ * @count - number of buffers
+ * Return value:
+ * 0 upon success
+ * EIO if the write operation failed
+ * Locks:
+ * buffer->mutex for each buffer
+ * dirty_lock
+ */
+static int flush_buffers(bc_buffer_t** buffers, u32 count) {
+    u32 eflags;
+    u32 i;
+    for (i = 0; i < count; i++)
+        sem_down(&buffers[i]->mutex);
+    /*
+     * A buffer on the dirty list is always dirty, as only the flusher
+     * clears the dirty flag after removing the buffer from the list
+     */
+    if (write_run(buffers, count)) {
+        for (i = 0; i < count; i++)
+            mutex_up(&buffers[i]->mutex);
+        spinlock_get(&dirty_lock, &eflags);
+        for (i = 0; i < count; i++) {
+            LIST_ADD_END(dirty_head, dirty_tail, buffers[i]);
+        }
+        dirty_count += count;
+        spinlock_release(&dirty_lock, &eflags);
+        return EIO;
+    }
+    for (i = 0; i < count; i++) {
+        buffers[i]->dirty = 0;
+        flushed++;
+    }
+    put_buffers(buffers, count);
+    return 0;
+}
+
+/*
+ * Write all dirty buffers of a device back to disk. To avoid that we run forever
+ * if other threads keep on writing to the device, only as many buffers as were dirty
+ * when the function was entered are flushed. Buffers for consecutive blocks which are
+ * adjacent on the dirty list - as is the case for sequential writes - are written
+ * with one request
+ * Parameter:
+ * @device - the device or DEVICE_NONE to flush all devices
+ * Return value:
+ * 0 upon success
+ * EIO if at least one block could not be written
+ * Locks:
+ * dirty_lock
+ */
+int bc_sync(dev_t device) {
+    u32 eflags;
+    u32 count;
+    u32 run;
+    bc_buffer_t* buffer;
+    bc_buffer_t* next;
+    bc_buffer_t* buffers[BC_MAX_RUN];
+    int rc = 0;
+    spinlock_get(&dirty_lock, &eflags);
+    count = dirty_count;
+    spinlock_release(&dirty_lock, &eflags);
+    while (count) {
+        spinlock_get(&dirty_lock, &eflags);
+        buffer = dirty_head;
+        if (DEVICE_NONE != device) {
+            while (buffer && (buffer->dev != device))
+                buffer = buffer->next;
+        }
+        if (0 == buffer) {
+            spinlock_release(&dirty_lock, &eflags);
+            break;
+        }
+        run = 0;
+        while (buffer && (run < count) && (run < BC_MAX_RUN)) {
+            if (run && ((buffer->dev != buffers[0]->dev) || (buffer->block != buffers[run - 1]->block + 1)))
+                break;
+            next = buffer->next;
+            LIST_REMOVE(dirty_head, dirty_tail, buffer);
+            buffers[run] = buffer;
+            run++;
+            buffer = next;
+        }
+        dirty_count -= run;
+        spinlock_release(&dirty_lock, &eflags);
+        count -= run;
+        if (flush_buffers(buffers, run))
+            rc = EIO;
+    }
+    return rc;
+}
+
+/*
+ * This is the flusher thread which writes dirty buffers back to disk
+ * whenever it is woken up
+ */
+static void flusher_thread(void* arg) {
+    while (1) {
+        sem_down(&flush_mutex);
+        BC_DEBUG("Flusher woken up, %d dirty buffers\n", dirty_count);
+        bc_sync(DEVICE_NONE);
+    }
+}
+
+/*
+ * Start the flusher thread if we are in write-back mode. This needs to
+ * be called once we are able to create kernel threads
+ */
+void bc_start_flusher() {
+    u32 thread;
+    if (0 == write_back)
+        return;
+    sem_init(&flush_mutex, 0);
+    if (__ctOS_syscall(__SYSNO_PTHREAD_CREATE, 4, &thread, 0, flusher_thread, 0)) {
+        ERROR("Error while launching flusher thread\n");
+        return;
+    }
+    flusher_running = 1;
+}
+
+/*
+ * This function is called periodically by the timer interrupt handler on the BSP
+ * and wakes up the flusher thread
+ */
+void bc_do_tick() {
+    if (flusher_running)
+        mutex_up(&flush_mutex);
+}
+
+/*
+ * Read a block into the cache on behalf of the read-ahead thread
+ * Parameter:
+ * @dev - the device
+ * @block - the block to be read
+ */
+static void prefetch_block(dev_t dev, u32 block) {
+    bc_buffer_t* buffer;
+    if (0 == (buffer = get_buffer(dev, block, 1))) {
+        return;
+    }
+    sem_down(&buffer->mutex);
+    if (0 == buffer->valid) {
+        if (0 == fill_buffer(buffer)) {
+            buffer->prefetched = 1;
+            ra_reads++;
+        }
+    }
+    mutex_up(&buffer->mutex);
+    put_buffer(buffer);
+}
+
+/*
+ * This is the read-ahead thread which processes the read-ahead queue
+ */
+static void ra_thread(void* arg) {
+    u32 eflags;
+    bc_ra_request_t request;
+    while (1) {
+        sem_down(&ra_mutex);
+        while (1) {
+            spinlock_get(&ra_lock, &eflags);
+            if (ra_head == ra_tail) {
+                spinlock_release(&ra_lock, &eflags);
+                break;
+            }
+            request = ra_queue[ra_head % BC_RA_QUEUE_SIZE];
+            ra_head++;
+            spinlock_release(&ra_lock, &eflags);
+            prefetch_block(request.dev, request.block);
+        }
+    }
+}
+
+/*
+ * Start the read-ahead thread. This needs to be called once we are able to
+ * create kernel threads. Until then, all read-ahead requests are ignored
+ */
+void bc_start_readahead() {
+    u32 thread;
+    sem_init(&ra_mutex, 0);
+    if (__ctOS_syscall(__SYSNO_PTHREAD_CREATE, 4, &thread, 0, ra_thread, 0)) {
+        ERROR("Error while launching read-ahead thread\n");
+        return;
+    }
+    ra_running = 1;
+}
+
+/*
+ * Ask the cache to read a block asynchronously. If the block is already in the
+ * cache or the read-ahead queue is full, the request is ignored
+ * Parameter:
+ * @dev - the device
+ * @block - the block
+ * Locks:
+ * lock on the bucket
+ * ra_lock
+ */
+void bc_prefetch(dev_t dev, u32 block) {
+    u32 eflags;
+    bc_bucket_t* bucket = buckets + bc_hash(dev, block);
+    bc_buffer_t* buffer;
+    if (0 == ra_running)
+        return;
+    spinlock_get(&bucket->lock, &eflags);
+    buffer = lookup(bucket, dev, block);
+    spinlock_release(&bucket->lock, &eflags);
+    if (buffer)
+        return;
+    spinlock_get(&ra_lock, &eflags);
+    if (ra_tail - ra_head == BC_RA_QUEUE_SIZE) {
+        spinlock_release(&ra_lock, &eflags);
+        BC_DEBUG("Read-ahead queue full\n");
+        return;
+    }
+    ra_queue[ra_tail % BC_RA_QUEUE_SIZE].dev = dev;
+    ra_queue[ra_tail % BC_RA_QUEUE_SIZE].block = block;
+    ra_tail++;
+    spinlock_release(&ra_lock, &eflags);
+    mutex_up(&ra_mutex);
+}
+
+/*
+ * Return the maximum size of a read-ahead window in blocks. This is BC_RA_MAX_WINDOW
+ * as long as most of the prefetched blocks are actually used, and is reduced proportionally
+ * to the fraction of prefetched blocks which have been used if this fraction drops below 50%.
+ * To make sure that we only consider recent history, the counters are halved once their sum
+ * exceeds BC_MAX_BUFFERS
+ * Return value:
+ * maximum number of blocks to be read ahead
+ */
+u32 bc_ra_window_limit() {
+    u32 used = ra_used;
+    u32 wasted = ra_wasted;
+    u32 limit;
+    if (used + wasted > BC_MAX_BUFFERS) {
+        ra_used = used / 2;
+        ra_wasted = wasted / 2;
+    }
+    if ((used + wasted < BC_RA_MAX_WINDOW) || (2 * used >= used + wasted))
+        return BC_RA_MAX_WINDOW;
+    limit = (2 * BC_RA_MAX_WINDOW * used) / (used + wasted);
+    return (limit < BC_RA_MIN_WINDOW) ? BC_RA_MIN_WINDOW : limit;
+}
+
 /*
  * This is the main interface function to read a given number of bytes
  * from disk or the cache, starting at a specified offset within the block.
  * Note that the blocksize is supposed to be 1024 throughout and needs to
  * be converted to the actual block size by the device driver
+ * The request is processed in chunks of up to BC_MAX_RUN blocks. Within
+ * each chunk, consecutive blocks which are not cached are read from the
+ * device with one single request
  * Parameter:
  * @block - block where we start reading
  * @bytes - number of bytes to read
@@ -141,26 +1019,44 @@ int bc_close(dev_t dev) {
  * @offset - offset within the block where we start reading
  * Return value:
  * 0 upon success
- * ENOMEM if memory could not be allocated for temporary buffer
+ * ENOMEM if no buffer could be allocated in the cache
  * EIO if read from device failed
  */
 int bc_read_bytes(u32 block, u32 bytes, void* buffer, dev_t device, u32 offset) {
-    void* tmp;
+    bc_buffer_t* buffers[BC_MAX_RUN];
+    u32 count;
+    u32 chunk;
+    u32 i;
     int rc;
-    int blocks_to_read = ((bytes + offset - 1) / BLOCK_SIZE) + 1;
-    tmp = (void*) kmalloc(blocks_to_read * BLOCK_SIZE);
-    if (0 == tmp) {
-        ERROR("Could not allocate memory for buffer\n");
-        return ENOMEM;
+    if (offset >= BLOCK_SIZE) {
+        block = block + offset / BLOCK_SIZE;
+        offset = offset % BLOCK_SIZE;
     }
-    rc = bc_read(device, blocks_to_read, block, tmp);
-    if (rc <= 0) {
-        ERROR("Disk read error\n");
-        kfree(tmp);
-        return EIO;
+    while (bytes) {
+        count = (offset + bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (count > BC_MAX_RUN)
+            count = BC_MAX_RUN;
+        if ((rc = get_buffers(device, block, count, buffers))) {
+            return rc;
+        }
+        if ((rc = fill_buffers(buffers, count))) {
+            put_buffers(buffers, count);
+            return rc;
+        }
+        for (i = 0; i < count; i++) {
+            chunk = ((BLOCK_SIZE - offset) < bytes) ? (BLOCK_SIZE - offset) : bytes;
+            if (buffers[i]->prefetched) {
+                buffers[i]->prefetched = 0;
+                ra_used++;
+            }
+            memcpy(buffer, buffers[i]->data + offset, chunk);
+            buffer += chunk;
+            bytes -= chunk;
+            offset = 0;
+        }
+        put_buffers(buffers, count);
+        block += count;
     }
-    memcpy(buffer, tmp + offset, bytes);
-    kfree(tmp);
     return 0;
 }
 
@@ -169,9 +1065,14 @@ int bc_read_bytes(u32 block, u32 bytes, void* buffer, dev_t device, u32 offset)
  * to disk or to the cache, starting at a specified offset within the block
  * Note that the blocksize is supposed to be 1024 throughout and needs to
  * be converted to the actual block size by the device driver
- * Special care is taken to make sure that partial blocks at the start or
- * end of a write request are read first from the device so that no stale
- * data is written
+ * Partial blocks at the start or end of a write request which are not
+ * yet cached are read first from the device so that no stale data is written
+ * The request is processed in chunks of up to BC_MAX_RUN blocks. In write-through
+ * mode, each chunk is written to the device with one single request
+ * In write-back mode, the data is only written to the cache and the buffer
+ * is marked as dirty. If the number of dirty buffers exceeds BC_DIRTY_THRESHOLD,
+ * the flusher thread is woken up, or - if it is not yet running - the
+ * device is synced directly
  * Parameter:
  * @block - block where we start writing
  * @bytes - number of bytes to write
@@ -180,69 +1081,128 @@ int bc_read_bytes(u32 block, u32 bytes, void* buffer, dev_t device, u32 offset)
  * @offset - offset within the block where we start writing
  * Return value:
  * 0 upon success
- * ENOMEM if memory could not be allocated for temporary buffer
- * EIO if read from device failed
- * EINVAL if the offset exceeds the block size
+ * ENOMEM if no buffer could be allocated in the cache
+ * EIO if read from or write to the device failed
  */
 int bc_write_bytes(u32 block, u32 bytes, void* buffer, dev_t device, u32 offset) {
-    void* tmp;
+    bc_buffer_t* buffers[BC_MAX_RUN];
+    u32 count;
+    u32 chunk;
+    u32 i;
     int rc;
-    int first_partial = 0;
     BC_DEBUG("block=%d, bytes=%d, offset=%d\n", block, bytes, offset);
     if (offset >= BLOCK_SIZE) {
         block = block + offset / BLOCK_SIZE;
         offset = offset % BLOCK_SIZE;
     }
-    int blocks_to_write = ((bytes + offset - 1) / BLOCK_SIZE) + 1;
-    tmp = (void*) kmalloc(blocks_to_write * BLOCK_SIZE);
-    BC_DEBUG("block=%d, bytes=%d, blocks_to_write=%d, offset=%d\n", block, bytes, blocks_to_write, offset);
-    if (0 == tmp) {
-        ERROR("Could not allocate memory for buffer\n");
-        return ENOMEM;
-    }
-    /*
-     * Check whether we have any partial block at the start or
-     * end of the data to be written. If yes, reads these blocks
-     * first from disk into our temporary buffer to avoid writing
-     * random data
-     */
-    if ((offset % BLOCK_SIZE)) {
-        /*
-         * Read first block
-         */
-        BC_DEBUG("Reading block %d\n", block);
-        first_partial = 1;
-        rc = bc_read(device, 1, block, tmp);
-        if (rc <= 0) {
-            ERROR("Disk read error, rc=-%d\n", (-1)*rc);
+    while (bytes) {
+        count = (offset + bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (count > BC_MAX_RUN)
+            count = BC_MAX_RUN;
+        if ((rc = get_buffers(device, block, count, buffers))) {
+            return rc;
+        }
+        for (i = 0; i < count; i++) {
+            chunk = ((BLOCK_SIZE - offset) < bytes) ? (BLOCK_SIZE - offset) : bytes;
+            /*
+             * If we only write a part of the block, make sure that
+             * the rest of the buffer is up to date
+             */
+            if (chunk < BLOCK_SIZE) {
+                if ((rc = fill_buffer(buffers[i]))) {
+                    put_buffers(buffers, count);
+                    return rc;
+                }
+            }
+            memcpy(buffers[i]->data + offset, buffer, chunk);
+            buffers[i]->valid = 1;
+            if (write_back) {
+                mark_dirty(buffers[i]);
+            }
+            buffer += chunk;
+            bytes -= chunk;
+            offset = 0;
+        }
+        if ((0 == write_back) && write_run(buffers, count)) {
+            for (i = 0; i < count; i++)
+                buffers[i]->valid = 0;
+            put_buffers(buffers, count);
             return EIO;
         }
+        put_buffers(buffers, count);
+        block += count;
     }
-    if ((offset + bytes) % BLOCK_SIZE) {
-        /*
-         * Read last block if not yet done in the IF block above
-         */
-        if (!((first_partial == 1) && (blocks_to_write == 1))) {
-            BC_DEBUG("Reading last block %d\n", block + blocks_to_write-1);
-            rc = bc_read(device, 1, block + blocks_to_write - 1, tmp
-                    + (blocks_to_write - 1) * BLOCK_SIZE);
-            if (rc <= 0) {
-                ERROR("Disk read error, rc=-%d\n", (-1)*rc);
-                return EIO;
+    if (dirty_count > BC_DIRTY_THRESHOLD) {
+        if (flusher_running)
+            mutex_up(&flush_mutex);
+        else
+            return bc_sync(device);
+    }
+    return 0;
+}
+
+/*
+ * Remove all blocks of a device from the cache. Buffers which are currently
+ * in use or dirty are not touched
+ * Parameter:
+ * @device - the device
+ * Locks:
+ * lock on each bucket
+ * lru_lock
+ */
+void bc_invalidate(dev_t device) {
+    int i;
+    u32 eflags;
+    u32 lru_eflags;
+    bc_buffer_t* buffer;
+    bc_buffer_t* next;
+    for (i = 0; i < BC_HASH_BUCKETS; i++) {
+        spinlock_get(&buckets[i].lock, &eflags);
+        buffer = buckets[i].head;
+        while (buffer) {
+            next = buffer->hash_next;
+            if ((buffer->dev == device) && (0 == buffer->ref_count)) {
+                unhash(buckets + i, buffer);
+                buffer->valid = 0;
+                buffer->prefetched = 0;
+                /*
+                 * Move buffer to the head of the LRU list so that it is
+                 * reused first
+                 */
+                spinlock_get(&lru_lock, &lru_eflags);
+                if (buffer->on_lru) {
+                    LIST_REMOVE(lru_head, lru_tail, buffer);
+                }
+                LIST_ADD_FRONT(lru_head, lru_tail, buffer);
+                buffer->on_lru = 1;
+                spinlock_release(&lru_lock, &lru_eflags);
             }
+            buffer = next;
         }
+        spinlock_release(&buckets[i].lock, &eflags);
     }
-    BC_DEBUG("Copying %d bytes to tmp+%d\n", bytes, offset);
-    memcpy(tmp + offset, buffer, bytes);
-    BC_DEBUG("Writing temporary area back to block %d\n", block);
-    rc = bc_write(device, blocks_to_write, block, tmp);
-    if (rc <= 0) {
-        ERROR("Disk write error\n");
-        kfree(tmp);
-        return EIO;
+}
+
+/*
+ * Get statistics on the cache
+ * Parameter:
+ * @stats - structure which will be filled with the statistics
+ */
+void bc_get_stats(bc_stats_t* stats) {
+    int i;
+    stats->hits = 0;
+    stats->misses = 0;
+    for (i = 0; i < BC_HASH_BUCKETS; i++) {
+        stats->hits += buckets[i].hits;
+        stats->misses += buckets[i].misses;
     }
-    kfree(tmp);
-    return 0;
+    stats->buffers = buffer_count;
+    stats->evictions = evictions;
+    stats->dirty = dirty_count;
+    stats->flushed = flushed;
+    stats->ra_reads = ra_reads;
+    stats->ra_used = ra_used;
+    stats->ra_wasted = ra_wasted;
 }
 
 
@@ -250,6 +1210,28 @@ int bc_write_bytes(u32 block, u32 bytes, void* buffer, dev_t device, u32 offset)
  * Everything below this line is for debugging only            *
  **************************************************************/
 
+/*
+ * Print statistics of the block cache
+ */
+void bc_print_stats() {
+    bc_stats_t stats;
+    bc_get_stats(&stats);
+    PRINT("Block cache statistics\n");
+    PRINT("----------------------\n");
+    PRINT("Buffers:     %d (maximum %d)\n", stats.buffers, BC_MAX_BUFFERS);
+    PRINT("Hits:        %d\n", stats.hits);
+    PRINT("Misses:      %d\n", stats.misses);
+    PRINT("Evictions:   %d\n", stats.evictions);
+    PRINT("Dirty:       %d\n", stats.dirty);
+    PRINT("Flushed:     %d\n", stats.flushed);
+    PRINT("Write mode:  %s\n", write_back ? "write-back" : "write-through");
+    PRINT("Read-ahead:  %d blocks read, %d used, %d wasted, window limit %d\n", stats.ra_reads, stats.ra_used,
+            stats.ra_wasted, bc_ra_window_limit());
+    if (stats.hits + stats.misses) {
+        PRINT("Hit rate:    %d %%\n", (stats.hits * 100) / (stats.hits + stats.misses));
+    }
+}
+
 
 /*
  * A testcase designed to test cross-page boundary reads from a disk
@@ -0,0 +1,339 @@
+/*
+ * dcache.c
+ *
+ * The dentry cache is used by the generic file system layer to speed up the resolution of path names.
+ * It maps a pair (directory, name) to the number of the inode to which the directory entry with this name
+ * refers, so that a lookup of a path component does not need to scan the directory. A directory is identified
+ * by the device on which it is located and its inode number.
+ *
+ * The cache also stores negative entries, i.e. entries with inode number zero, which record the fact that
+ * a directory does not contain an entry with the given name. This speeds up repeated searches for files which
+ * do not exist, like the search for an executable along a search path.
+ *
+ * The cache consists of a fixed number DCACHE_ENTRIES of entries which are kept in a hash table with
+ * DCACHE_HASH_BUCKETS buckets. In addition, all entries are kept on an LRU list, with the least recently
+ * used entry at the head. When a new entry is added, the entry at the head of the list is reused. Entries
+ * which are not in use are also kept on the LRU list, at its head. Names which are longer than DCACHE_NAME_LEN
+ * are not cached.
+ *
+ * The cache itself does not know anything about the content of directories. It is the responsibility of the
+ * file system layer to keep the cache consistent, i.e. to add entries only while holding a lock on the directory
+ * which prevents concurrent changes and to remove all entries which are affected by a change of a directory
+ * while holding the write lock on the directory.
+ *
+ * All data structures of the cache are protected by the spinlock dcache_lock.
+ */
+
+#include "dcache.h"
+#include "debug.h"
+#include "locks.h"
+#include "lists.h"
+#include "lib/string.h"
+
+/*
+ * A local loglevel
+ */
+int __dcache_loglevel = 0;
+
+#define DCACHE_DEBUG(...) do {if (__dcache_loglevel > 0 ) { kprintf("DEBUG at %s@%d (%s): ", __FILE__, __LINE__, __FUNCTION__); \
+        kprintf(__VA_ARGS__); }} while (0)
+
+/*
+ * An entry in the cache
+ */
+typedef struct _dcache_entry_t {
+    dev_t dev;                               // device on which the directory is located
+    ino_t parent;                            // inode number of the directory
+    ino_t inode_nr;                          // inode number of the entry or zero for a negative entry
+    int length;                              // length of the name
+    char name[DCACHE_NAME_LEN];              // name, not necessarily null terminated
+    int hashed;                              // set if the entry is in use and in a hash chain
+    struct _dcache_entry_t* hash_next;       // next entry in hash chain
+    struct _dcache_entry_t* next;            // next entry in LRU list
+    struct _dcache_entry_t* prev;            // previous entry in LRU list
+} dcache_entry_t;
+
+/*
+ * The entries, the hash table and the LRU list
+ */
+static dcache_entry_t entries[DCACHE_ENTRIES];
+static dcache_entry_t* buckets[DCACHE_HASH_BUCKETS];
+static dcache_entry_t* lru_head = 0;
+static dcache_entry_t* lru_tail = 0;
+static spinlock_t dcache_lock;
+
+/*
+ * Statistics
+ */
+static u32 hits = 0;
+static u32 negative_hits = 0;
+static u32 misses = 0;
+static u32 used = 0;
+
+/*
+ * Initialize the cache
+ */
+void dcache_init() {
+    int i;
+    for (i = 0; i < DCACHE_HASH_BUCKETS; i++) {
+        buckets[i] = 0;
+    }
+    lru_head = 0;
+    lru_tail = 0;
+    for (i = 0; i < DCACHE_ENTRIES; i++) {
+        entries[i].hashed = 0;
+        entries[i].hash_next = 0;
+        LIST_ADD_END(lru_head, lru_tail, entries + i);
+    }
+    hits = 0;
+    negative_hits = 0;
+    misses = 0;
+    used = 0;
+    spinlock_init(&dcache_lock);
+}
+
+/*
+ * Compute the hash value of a name within a directory
+ * Parameter:
+ * @dev - the device
+ * @parent - the inode number of the directory
+ * @name - the name
+ * @length - the length of the name
+ * Return value:
+ * the index of the bucket
+ */
+static u32 dcache_hash(dev_t dev, ino_t parent, char* name, int length) {
+    u32 hash = dev * 31 + parent;
+    int i;
+    for (i = 0; i < length; i++) {
+        hash = hash * 31 + (u8) name[i];
+    }
+    return hash % DCACHE_HASH_BUCKETS;
+}
+
+/*
+ * Locate an entry in the cache. The caller needs to hold the lock
+ * Parameter:
+ * @bucket - the bucket
+ * @dev - the device
+ * @parent - the inode number of the directory
+ * @name - the name
+ * @length - the length of the name
+ * Return value:
+ * the entry or 0 if there is no entry for the name
+ */
+static dcache_entry_t* lookup(u32 bucket, dev_t dev, ino_t parent, char* name, int length) {
+    dcache_entry_t* entry = buckets[bucket];
+    while (entry) {
+        if ((entry->dev == dev) && (entry->parent == parent) && (entry->length == length)
+                && (0 == strncmp(entry->name, name, length)))
+            return entry;
+        entry = entry->hash_next;
+    }
+    return 0;
+}
+
+/*
+ * Remove an entry from its hash chain and move it to the head of the LRU list
+ * so that it is reused first. The caller needs to hold the lock
+ * Parameter:
+ * @entry - the entry
+ */
+static void drop_entry(dcache_entry_t* entry) {
+    dcache_entry_t* prev;
+    u32 bucket;
+    if (0 == entry->hashed)
+        return;
+    bucket = dcache_hash(entry->dev, entry->parent, entry->name, entry->length);
+    if (buckets[bucket] == entry) {
+        buckets[bucket] = entry->hash_next;
+    }
+    else {
+        prev = buckets[bucket];
+        while (prev && (prev->hash_next != entry))
+            prev = prev->hash_next;
+        if (prev)
+            prev->hash_next = entry->hash_next;
+    }
+    entry->hashed = 0;
+    entry->hash_next = 0;
+    used--;
+    LIST_REMOVE(lru_head, lru_tail, entry);
+    LIST_ADD_FRONT(lru_head, lru_tail, entry);
+}
+
+/*
+ * Look up a name in a directory
+ * Parameter:
+ * @dev - the device on which the directory is located
+ * @parent - the inode number of the directory
+ * @name - the name, not necessarily null terminated
+ * @length - the length of the name
+ * @inode_nr - the inode number of the entry will be stored here, zero for a negative entry
+ * Return value:
+ * 1 if an entry was found in the cache
+ * 0 if there is no entry in the cache
+ * Locks:
+ * dcache_lock
+ */
+int dcache_lookup(dev_t dev, ino_t parent, char* name, int length, ino_t* inode_nr) {
+    u32 eflags;
+    u32 bucket;
+    dcache_entry_t* entry;
+    if ((length <= 0) || (length > DCACHE_NAME_LEN))
+        return 0;
+    bucket = dcache_hash(dev, parent, name, length);
+    spinlock_get(&dcache_lock, &eflags);
+    if (0 == (entry = lookup(bucket, dev, parent, name, length))) {
+        misses++;
+        spinlock_release(&dcache_lock, &eflags);
+        return 0;
+    }
+    *inode_nr = entry->inode_nr;
+    if (entry->inode_nr)
+        hits++;
+    else
+        negative_hits++;
+    /*
+     * Move entry to the end of the LRU list
+     */
+    LIST_REMOVE(lru_head, lru_tail, entry);
+    LIST_ADD_END(lru_head, lru_tail, entry);
+    spinlock_release(&dcache_lock, &eflags);
+    return 1;
+}
+
+/*
+ * Add an entry to the cache or update an existing entry. The caller needs to
+ * hold at least a read lock on the directory
+ * Parameter:
+ * @dev - the device on which the directory is located
+ * @parent - the inode number of the directory
+ * @name - the name, not necessarily null terminated
+ * @length - the length of the name
+ * @inode_nr - the inode number of the entry or zero to add a negative entry
+ * Locks:
+ * dcache_lock
+ */
+void dcache_enter(dev_t dev, ino_t parent, char* name, int length, ino_t inode_nr) {
+    u32 eflags;
+    u32 bucket;
+    dcache_entry_t* entry;
+    if ((length <= 0) || (length > DCACHE_NAME_LEN))
+        return;
+    bucket = dcache_hash(dev, parent, name, length);
+    spinlock_get(&dcache_lock, &eflags);
+    if (0 == (entry = lookup(bucket, dev, parent, name, length))) {
+        /*
+         * Reuse least recently used entry
+         */
+        entry = lru_head;
+        drop_entry(entry);
+        entry->dev = dev;
+        entry->parent = parent;
+        entry->length = length;
+        memcpy(entry->name, name, length);
+        entry->hash_next = buckets[bucket];
+        buckets[bucket] = entry;
+        entry->hashed = 1;
+        used++;
+    }
+    entry->inode_nr = inode_nr;
+    LIST_REMOVE(lru_head, lru_tail, entry);
+    LIST_ADD_END(lru_head, lru_tail, entry);
+    spinlock_release(&dcache_lock, &eflags);
+}
+
+/*
+ * Remove the entry for a name in a directory from the cache. This needs to be called
+ * whenever a directory entry is added, removed or changed, while holding the write lock
+ * on the directory
+ * Parameter:
+ * @dev - the device on which the directory is located
+ * @parent - the inode number of the directory
+ * @name - the name, not necessarily null terminated
+ * @length - the length of the name
+ * Locks:
+ * dcache_lock
+ */
+void dcache_remove(dev_t dev, ino_t parent, char* name, int length) {
+    u32 eflags;
+    dcache_entry_t* entry;
+    if ((length <= 0) || (length > DCACHE_NAME_LEN))
+        return;
+    spinlock_get(&dcache_lock, &eflags);
+    if ((entry = lookup(dcache_hash(dev, parent, name, length), dev, parent, name, length))) {
+        DCACHE_DEBUG("Removing entry for inode %d in directory %d\n", entry->inode_nr, parent);
+        drop_entry(entry);
+    }
+    spinlock_release(&dcache_lock, &eflags);
+}
+
+/*
+ * Remove all entries for a directory from the cache. This needs to be called when
+ * a directory is removed, as its inode number might be reused later
+ * Parameter:
+ * @dev - the device on which the directory is located
+ * @parent - the inode number of the directory
+ * Locks:
+ * dcache_lock
+ */
+void dcache_purge(dev_t dev, ino_t parent) {
+    u32 eflags;
+    int i;
+    spinlock_get(&dcache_lock, &eflags);
+    for (i = 0; i < DCACHE_ENTRIES; i++) {
+        if ((entries[i].hashed) && (entries[i].dev == dev) && (entries[i].parent == parent))
+            drop_entry(entries + i);
+    }
+    spinlock_release(&dcache_lock, &eflags);
+}
+
+/*
+ * Remove all entries for a device from the cache. This needs to be called when
+ * a device is unmounted
+ * Parameter:
+ * @dev - the device
+ * Locks:
+ * dcache_lock
+ */
+void dcache_purge_dev(dev_t dev) {
+    u32 eflags;
+    int i;
+    spinlock_get(&dcache_lock, &eflags);
+    for (i = 0; i < DCACHE_ENTRIES; i++) {
+        if ((entries[i].hashed) && (entries[i].dev == dev))
+            drop_entry(entries + i);
+    }
+    spinlock_release(&dcache_lock, &eflags);
+}
+
+/*
+ * Get statistics on the cache
+ * Parameter:
+ * @stats - structure which will be filled with the statistics
+ */
+void dcache_get_stats(dcache_stats_t* stats) {
+    stats->hits = hits;
+    stats->negative_hits = negative_hits;
+    stats->misses = misses;
+    stats->entries = used;
+}
+
+/***************************************************************
+ * Everything below this line is for debugging only            *
+ **************************************************************/
+
+/*
+ * Print statistics of the dentry cache
+ */
+void dcache_print_stats() {
+    dcache_stats_t stats;
+    dcache_get_stats(&stats);
+    PRINT("Dentry cache statistics\n");
+    PRINT("-----------------------\n");
+    PRINT("Entries:        %d (maximum %d)\n", stats.entries, DCACHE_ENTRIES);
+    PRINT("Hits:           %d\n", stats.hits);
+    PRINT("Negative hits:  %d\n", stats.negative_hits);
+    PRINT("Misses:         %d\n", stats.misses);
+}
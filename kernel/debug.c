@@ -78,6 +78,10 @@
 #include "ip.h"
 #include "multiboot.h"
 #include "acpi.h"
+#include "blockcache.h"
+#include "dcache.h"
+#include "pagecache.h"
+#include "kmem.h"
 
 extern int (*mm_page_mapped)(u32);
 
@@ -242,6 +246,9 @@ static u32 virt_to_phys(pte_t* ptd, u32 virtual, int* errno) {
         *errno = 1;
         return 0;
     }
+    if (ptd[ptd_offset].ps) {
+        return (virtual % MM_LARGE_PAGE_SIZE) + (ptd[ptd_offset].page_base * MM_PAGE_SIZE);
+    }
     pt = (pte_t*) MM_VIRTUAL_PT_ENTRY(ptd_offset,0);
     if (0 == pt[pt_offset].p) {
         *errno = 2;
@@ -457,6 +464,10 @@ static void print_usage() {
     PRINT("multiboot - print multiboot information\n");
     PRINT("acpi - print basic ACPI information\n");
     PRINT("madt - print the MADT ACPI table\n");
+    PRINT("bc - print block cache statistics\n");
+    PRINT("dc - print dentry cache statistics\n");
+    PRINT("pgc - print page cache statistics\n");
+    PRINT("kmem - print object cache statistics\n");
 }
 
 /*
@@ -988,6 +999,18 @@ void debug_main(ir_context_t* ir_context) {
         else if (0 == strncmp("madt", cmd, 4)) {
             acpi_print_madt();
         }
+        else if (0 == strncmp("bc", cmd, 2)) {
+            bc_print_stats();
+        }
+        else if (0 == strncmp("dc", cmd, 2)) {
+            dcache_print_stats();
+        }
+        else if (0 == strncmp("pgc", cmd, 3)) {
+            pc_print_stats();
+        }
+        else if (0 == strncmp("kmem", cmd, 4)) {
+            kmem_print_stats();
+        }
         else {
             print_usage(line);
         }
@@ -101,25 +101,23 @@ elf32_phdr_t* elf_get_program_header(elf_metadata_t* md, int index) {
 }
 
 /*
- * Utility function to read a segment from an ELF
- * executable into memory
+ * Utility function to set up a segment from an ELF executable. The segment
+ * is not read into memory, but registered with the memory manager which will
+ * populate its pages from the file when they are accessed for the first time
  * Parameter:
- * @fd - file descriptor to read from
- * @phdr - ELF program header of segment to read from
+ * @inode - the inode of the executable
+ * @phdr - ELF program header of segment to set up
  * Return value:
  * ENOMEM if no memory could be allocated for the ELF segments
- * ENOEXEC if the read from the ELF file failed
+ * ENOEXEC if the segment is not valid
  * 0 upon success
  */
-static int elf_read_segment(int fd, elf32_phdr_t* phdr) {
+static int elf_read_segment(inode_t* inode, elf32_phdr_t* phdr) {
     u32 segment_base;
     u32 segment_end;
     u32 segment_top;
-    u32 mem_base;
     u32 page_offset;
-    ssize_t rc;
-    char* ptr;
-    u32 i;
+    int rc;
     /*
      * Determine layout of segment in memory
      */
@@ -127,33 +125,21 @@ static int elf_read_segment(int fd, elf32_phdr_t* phdr) {
     segment_end = phdr->p_vaddr + phdr->p_memsz - 1;
     segment_top = (segment_end / phdr->p_align + 1) * phdr->p_align - 1;
     page_offset = (phdr->p_vaddr % phdr->p_align);
-    /*
-     * Get memory for segment
-     */
-    mem_base = mm_map_user_segment(segment_base, segment_top);
-    if (0 == mem_base) {
-        ERROR("Could not allocate memory for ELF segment\n");
-        return ENOMEM;
-    }
-    /*
-     * Read segment into memory
-     */
-    rc = do_lseek(fd, (phdr->p_offset - page_offset), SEEK_SET);
-    if (rc < 0) {
-        ERROR("Seek failed with rc=%d, phdr->p_offset=%d, page_offset=%d\n", rc, phdr->p_offset, page_offset);
-        return ENOEXEC;
-    }
-    rc = do_read(fd, (void*) mem_base, phdr->p_filesz + page_offset);
-    if (rc <= 0) {
-        ERROR("Read failed with rc=%d\n", rc);
+    if ((phdr->p_filesz > phdr->p_memsz) || (phdr->p_offset < page_offset)) {
+        ERROR("Invalid segment, p_offset=%d, p_filesz=%d, p_memsz=%d\n", phdr->p_offset, phdr->p_filesz, phdr->p_memsz);
         return ENOEXEC;
     }
     /*
-     * Finally fill up with zeroes
+     * Register segment with the memory manager. As in the file, the data starts at
+     * the segment base, so that the first page is filled with data from the file
+     * completely, and the area after the data up to p_memsz is filled with zeroes
      */
-    ptr = (char*) (mem_base + phdr->p_filesz + page_offset);
-    for (i = 0; i < (phdr->p_memsz - phdr->p_filesz); i++)
-        ptr[i] = 0;
+    rc = mm_add_user_segment(segment_base, segment_top, segment_base, phdr->p_vaddr + phdr->p_filesz,
+            phdr->p_vaddr + phdr->p_memsz, phdr->p_offset - page_offset, inode);
+    if (rc) {
+        ERROR("Could not add ELF segment, rc=%d\n", rc);
+        return (ENOMEM == rc) ? ENOMEM : ENOEXEC;
+    }
     return 0;
 }
 
@@ -170,9 +156,10 @@ static int elf_read_segment(int fd, elf32_phdr_t* phdr) {
  */
 int elf_load_executable(char* path, u32* entry_point, int validate_only) {
     int fd;
-    int rc;
+    int rc = 0;
     elf_metadata_t elf_meta;
     elf32_phdr_t* phdr;
+    inode_t* inode = 0;
     int index = 0;
     /*
      * Open file and read ELF metadata
@@ -181,37 +168,46 @@ int elf_load_executable(char* path, u32* entry_point, int validate_only) {
     if (fd < 0) {
         return ENOEXEC;
     }
-    rc = elf_get_metadata(fd, &elf_meta);
-    if (rc) {
+    elf_meta.file_header = 0;
+    elf_meta.program_header_table = 0;
+    if (elf_get_metadata(fd, &elf_meta)) {
+        elf_free_metadata(&elf_meta);
+        do_close(fd);
         return ENOEXEC;
     }
-    while ((phdr = elf_get_program_header(&elf_meta, index))) {
+    if (0 == validate_only) {
+        if (0 == (inode = fs_get_inode_for_name(path, 0))) {
+            elf_free_metadata(&elf_meta);
+            do_close(fd);
+            return ENOEXEC;
+        }
+    }
+    while ((0 == rc) && (phdr = elf_get_program_header(&elf_meta, index))) {
         if (phdr->p_type == PT_LOAD) {
-            if ((phdr->p_align % MM_PAGE_SIZE)) {
-                elf_free_metadata(&elf_meta);
-                return ENOEXEC;
+            if ((0 == phdr->p_align) || (phdr->p_align % MM_PAGE_SIZE)) {
+                rc = ENOEXEC;
             }
             /*
-             * Only read data if validate_only is false
+             * Only set up segments if validate_only is false
              */
-            if (0 == validate_only) {
-                rc = elf_read_segment(fd, phdr);
-                if (rc) {
-                    elf_free_metadata(&elf_meta);
-                    return ENOEXEC;
-                }
+            else if (0 == validate_only) {
+                if (elf_read_segment(inode, phdr))
+                    rc = ENOEXEC;
             }
         }
         /*
          * Dynamic libraries are not yet supported
          */
         if (phdr->p_type == PT_INTERP) {
-            elf_free_metadata(&elf_meta);
-            return ENOEXEC;
+            rc = ENOEXEC;
         }
         index++;
     }
-    *entry_point = elf_meta.file_header->e_entry;
+    if (0 == rc)
+        *entry_point = elf_meta.file_header->e_entry;
     elf_free_metadata(&elf_meta);
-    return 0;
+    if (inode)
+        inode->iops->inode_release(inode);
+    do_close(fd);
+    return rc;
 }
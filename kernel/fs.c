@@ -20,6 +20,8 @@
 #include "dm.h"
 #include "drivers.h"
 #include "blockcache.h"
+#include "dcache.h"
+#include "pagecache.h"
 #include "lib/fcntl.h"
 #include "lib/os/stat.h"
 #include "tty.h"
@@ -443,6 +445,8 @@ int fs_init(dev_t root) {
     int rc = EINVAL;
     int mounted = 0;
     rw_lock_init(&mount_point_lock);
+    dcache_init();
+    pc_init();
     open_files_head = 0;
     open_files_tail = 0;
     spinlock_init(&open_files_lock);
@@ -514,6 +518,8 @@ static int unmount_root() {
         rw_lock_release_write_lock(&mount_point_lock);
         return EBUSY;
     }
+    if (root_inode->super->sync)
+        root_inode->super->sync(root_inode->super);
     root_inode->iops->inode_release(root_inode);
     root_inode = 0;
     rw_lock_release_write_lock(&mount_point_lock);
@@ -658,11 +664,22 @@ int fs_unmount(inode_t* mounted_root) {
      */
     this_mount_point->mounted_on->mount_point = 0;
     LIST_REMOVE(mount_points_head, mount_points_tail, this_mount_point);
+    if (this_mount_point->root->super->sync)
+        this_mount_point->root->super->sync(this_mount_point->root->super);
     this_mount_point->mounted_on->iops->inode_release(
             this_mount_point->mounted_on);
     this_mount_point->root->iops->inode_release(this_mount_point->root);
     kfree(this_mount_point);
     rw_lock_release_write_lock(&mount_point_lock);
+    /*
+     * Drop all cached directory entries and pages of the device, write back
+     * all dirty blocks and drop the blocks from the cache, so that a device
+     * which is mounted again later is read from disk
+     */
+    dcache_purge_dev(mounted_device);
+    pc_purge_dev(mounted_device);
+    bc_sync(mounted_device);
+    bc_invalidate(mounted_device);
     return 0;
 }
 
@@ -952,6 +969,31 @@ static void split_path(char* parent_dir, char* path, char* name, int split) {
 }
 
 
+/*
+ * Get the next entry of a directory. The position within the directory is
+ * described by a cursor which is opaque to the caller and needs to be zero
+ * when the first entry is requested. If the file system supports the inode
+ * operation inode_next_direntry, the cursor is passed to the file system which
+ * will then continue where the previous call stopped. Otherwise, the cursor is
+ * interpreted as index of the entry and inode_get_direntry is used
+ * Parameter:
+ * @dir - the directory inode to read
+ * @cursor - the cursor, will be advanced to the next entry
+ * @direntry - the directory entry to be filled
+ * Return value:
+ * 0 upon success
+ * -1 if there are no more entries
+ * EIO if an error occurred
+ */
+static int next_direntry(inode_t* dir, off_t* cursor, direntry_t* direntry) {
+    int rc;
+    if (dir->iops->inode_next_direntry)
+        return dir->iops->inode_next_direntry(dir, cursor, direntry);
+    if (0 == (rc = dir->iops->inode_get_direntry(dir, *cursor, direntry)))
+        (*cursor)++;
+    return rc;
+}
+
 /*
  * Given an inode which represents a directory, scan the directory
  * for a given inode and return its name. The returned string is to
@@ -964,16 +1006,15 @@ static void split_path(char* parent_dir, char* path, char* name, int split) {
  */
 static char* scan_directory_by_inode(inode_t* dir,
         int wanted) {
-    int i = 0;
+    off_t cursor = 0;
     direntry_t direntry;
     char* name = 0;
     validate_inode(dir);
-    while (0 == dir->iops->inode_get_direntry(dir, i, &direntry)) {
+    while (0 == next_direntry(dir, &cursor, &direntry)) {
         if (direntry.inode_nr == wanted) {
             if ((name = kmalloc(strlen(direntry.name)+1)))
                 strcpy(name, direntry.name);
         }
-        i++;
     }
     return name;
 }
@@ -1002,7 +1043,10 @@ static char* scan_directory_by_inode_lock(inode_t* dir,
 
 /*
  * Given an inode which represents a directory, scan the directory
- * for a given name. If the name is found, return the inode.
+ * for a given name. If the name is found, return the inode. The
+ * dentry cache is consulted first, and the result of the scan - positive
+ * or negative - is added to the dentry cache. The caller needs to hold
+ * at least a read lock on the directory
  * Parameter:
  * @dir - the directory inode to read
  * @name - the path component to look for (not necessarily null terminated)
@@ -1014,20 +1058,62 @@ static char* scan_directory_by_inode_lock(inode_t* dir,
  */
 static inode_t* scan_directory_by_name(inode_t* dir,
         char* name, int length) {
-    int i = 0;
+    off_t cursor = 0;
     direntry_t direntry;
+    ino_t inode_nr;
+    int rc;
     validate_inode(dir);
     if (0 == length)
         return 0;
-    while (0 == dir->iops->inode_get_direntry(dir, i, &direntry)) {
-        if ((0 == strncmp(direntry.name, name, length) && (length == strlen(direntry.name)))) {
-            return dir->super->get_inode(dir->dev, direntry.inode_nr);
+    if (S_ISDIR(dir->mode) && dcache_lookup(dir->dev, dir->inode_nr, name, length, &inode_nr)) {
+        if (0 == inode_nr)
+            return 0;
+        return dir->super->get_inode(dir->dev, inode_nr);
+    }
+    /*
+     * Use the lookup function of the file system if there is one, otherwise
+     * scan the directory
+     */
+    if (dir->iops->inode_lookup) {
+        rc = dir->iops->inode_lookup(dir, name, length, &inode_nr);
+    }
+    else {
+        while (0 == (rc = next_direntry(dir, &cursor, &direntry))) {
+            if ((0 == strncmp(direntry.name, name, length) && (length == strlen(direntry.name)))) {
+                inode_nr = direntry.inode_nr;
+                break;
+            }
         }
-        i++;
     }
+    if (0 == rc) {
+        if (S_ISDIR(dir->mode))
+            dcache_enter(dir->dev, dir->inode_nr, name, length, inode_nr);
+        return dir->super->get_inode(dir->dev, inode_nr);
+    }
+    /*
+     * Only add a negative entry if we have reached the end of the directory
+     */
+    if (S_ISDIR(dir->mode) && (-1 == rc))
+        dcache_enter(dir->dev, dir->inode_nr, name, length, 0);
     return 0;
 }
 
+/*
+ * Update the dentry cache after a new inode has been created in a directory.
+ * The entry for the name is removed. If the new inode is a directory, all
+ * entries for a directory which previously had the same inode number are removed
+ * as well, as the file system has already added the entries . and .. to it
+ * Parameter:
+ * @dir - the directory
+ * @name - the name of the new inode
+ * @inode - the new inode
+ */
+static void dcache_created(inode_t* dir, char* name, inode_t* inode) {
+    dcache_remove(dir->dev, dir->inode_nr, name, strlen(name));
+    if (S_ISDIR(inode->mode))
+        dcache_purge(inode->dev, inode->inode_nr);
+}
+
 /*
  * Given an inode which represents a directory, scan the directory
  * for a given name, locking the directory for read during the scan
@@ -1508,6 +1594,9 @@ open_file_t* fs_open(inode_t* inode, int flags) {
         validate_inode(inode);
     of->cursor = 0;
     of->flags = flags;
+    of->ra_next = 0;
+    of->ra_end = 0;
+    of->ra_window = 0;
     of->pipe = 0;
     of->socket = 0;
     if (inode->iops)
@@ -1626,7 +1715,9 @@ static ssize_t fs_rw_chr(inode_t* inode, ssize_t bytes, void* data, int rw, u32
 
 /*
  * Implementation of the inode read/write operation for a
- * regular file
+ * regular file. Reads from a regular file are done through the
+ * page cache, and data written is copied into the pages which are
+ * already in the cache
  * Parameter:
  * @file - the file from which we read or to which we write
  * @bytes - bytes to read/write
@@ -1642,8 +1733,11 @@ static ssize_t fs_rw_reg(open_file_t* file, ssize_t bytes, void* data, int rw) {
     ssize_t rc = 0;
     if (FS_READ == rw) {
         rw_lock_get_read_lock(&file->inode->rw_lock);
-        rc = file->inode->iops->inode_read(file->inode, bytes, file->cursor,
-            data);
+        if (S_ISREG(file->inode->mode))
+            rc = pc_read(file->inode, file->cursor, bytes, data);
+        else
+            rc = file->inode->iops->inode_read(file->inode, bytes, file->cursor,
+                data);
         rw_lock_release_read_lock(&file->inode->rw_lock);
     }
     else {
@@ -1657,6 +1751,8 @@ static ssize_t fs_rw_reg(open_file_t* file, ssize_t bytes, void* data, int rw) {
         }
         rc = file->inode->iops->inode_write(file->inode, bytes, file->cursor,
                 data);
+        if ((rc > 0) && S_ISREG(file->inode->mode))
+            pc_update(file->inode, file->cursor, rc, data);
         rw_lock_release_write_lock(&file->inode->rw_lock);
     }
     return rc;
@@ -1664,7 +1760,8 @@ static ssize_t fs_rw_reg(open_file_t* file, ssize_t bytes, void* data, int rw) {
 
 /*
  * Implementation of the inode read/write operation for a
- * directory
+ * directory. When reading, the cursor of the file is advanced
+ * to the next directory entry
  * Parameter:
  * @file - the file from which we read or to which we write
  * @direntry - buffer
@@ -1680,12 +1777,58 @@ static ssize_t fs_rw_dir(open_file_t* file, direntry_t* direntry,  int rw) {
     ssize_t rc = 0;
     if (FS_READ == rw) {
         rw_lock_get_read_lock(&file->inode->rw_lock);
-        rc = file->inode->iops->inode_get_direntry(file->inode, file->cursor, direntry);
+        rc = next_direntry(file->inode, &file->cursor, direntry);
         rw_lock_release_read_lock(&file->inode->rw_lock);
     }
     return rc;
 }
 
+/*
+ * Detect sequential access to a regular file and start a read-ahead if needed.
+ * A read is considered sequential if it starts where the previous read ended.
+ * For every sequential read, the read-ahead window is doubled, up to the limit
+ * determined by the block cache based on the fraction of prefetched blocks which
+ * have actually been used. Any other access resets the window
+ * Parameter:
+ * @file - the open file
+ * @offset - offset at which the read started
+ * @bytes - number of bytes read
+ * Locks:
+ * read lock on inode
+ */
+static void fs_readahead(open_file_t* file, off_t offset, ssize_t bytes) {
+    u32 limit;
+    off_t start;
+    off_t end;
+    if ((!S_ISREG(file->inode->mode)) || (0 == file->inode->iops->inode_readahead))
+        return;
+    if (offset != file->ra_next) {
+        file->ra_next = offset + bytes;
+        file->ra_end = 0;
+        file->ra_window = 0;
+        return;
+    }
+    file->ra_next = offset + bytes;
+    limit = bc_ra_window_limit();
+    file->ra_window = (file->ra_window) ? 2 * file->ra_window : FS_RA_MIN_WINDOW;
+    if (file->ra_window > limit)
+        file->ra_window = limit;
+    /*
+     * Only ask for the part of the window which has not yet been
+     * read ahead
+     */
+    start = (file->ra_end > file->ra_next) ? file->ra_end : file->ra_next;
+    end = file->ra_next + file->ra_window * BLOCK_SIZE;
+    if (end <= start)
+        return;
+    rw_lock_get_read_lock(&file->inode->rw_lock);
+    if (file->inode->iops->inode_readahead(file->inode, end - start, start)) {
+        FS_DEBUG("Read-ahead failed\n");
+    }
+    rw_lock_release_read_lock(&file->inode->rw_lock);
+    file->ra_end = end;
+}
+
 /*
  * Read from an open file
  * Parameter:
@@ -1740,6 +1883,8 @@ ssize_t fs_read(open_file_t* file, size_t bytes, void* buffer) {
          * Temporarily get read lock and do actual read operation
          */
         rc = fs_rw_reg(file, bytes, buffer, FS_READ);
+        if (rc > 0)
+            fs_readahead(file, file->cursor, rc);
         if (rc >= 0)
             file->cursor += rc;
         sem_up(&file->sem);
@@ -1748,6 +1893,78 @@ ssize_t fs_read(open_file_t* file, size_t bytes, void* buffer) {
 }
 
 
+/*
+ * Read from a regular file which is given by its inode, without going through
+ * an open file. This is used by the memory manager to populate pages of an
+ * executable on demand which cannot be mapped from the page cache
+ * Parameter:
+ * @inode - the inode
+ * @offset - offset within the file at which we start to read
+ * @bytes - number of bytes to read
+ * @buffer - buffer to which data is written
+ * Return value:
+ * the number of bytes read
+ * -EIO if the operation failed
+ * Locks:
+ * rw_lock on inode
+ */
+ssize_t fs_read_inode(inode_t* inode, off_t offset, ssize_t bytes, void* buffer) {
+    ssize_t rc;
+    rw_lock_get_read_lock(&inode->rw_lock);
+    rc = pc_read(inode, offset, bytes, buffer);
+    rw_lock_release_read_lock(&inode->rw_lock);
+    return rc;
+}
+
+/*
+ * Get the page of the page cache which holds the data of a regular file at a given offset
+ * Parameter:
+ * @inode - the inode
+ * @offset - offset within the file, needs to be a multiple of the page size
+ * Return value:
+ * the page, which needs to be released again with pc_release_page, or 0 if the page could
+ * not be provided
+ * Locks:
+ * rw_lock on inode
+ */
+pc_page_t* fs_get_page(inode_t* inode, off_t offset) {
+    pc_page_t* page;
+    rw_lock_get_read_lock(&inode->rw_lock);
+    page = pc_get_page(inode, offset / MM_PAGE_SIZE);
+    rw_lock_release_read_lock(&inode->rw_lock);
+    return page;
+}
+
+/*
+ * Write to a regular file which is given by its inode, without going through
+ * an open file. This is used by the memory manager to write back pages of a shared
+ * file mapping. The file is never extended, i.e. data beyond the current end of the
+ * file is ignored
+ * Parameter:
+ * @inode - the inode
+ * @offset - offset within the file at which we start to write
+ * @bytes - number of bytes to write
+ * @buffer - buffer containing the data
+ * Return value:
+ * the number of bytes written
+ * -EIO if the operation failed
+ * Locks:
+ * rw_lock on inode
+ */
+ssize_t fs_write_inode(inode_t* inode, off_t offset, ssize_t bytes, void* buffer) {
+    ssize_t rc = 0;
+    rw_lock_get_write_lock(&inode->rw_lock);
+    if (offset < inode->size) {
+        if (bytes > inode->size - offset)
+            bytes = inode->size - offset;
+        rc = inode->iops->inode_write(inode, bytes, offset, buffer);
+        if (rc > 0)
+            pc_update(inode, offset, rc, buffer);
+    }
+    rw_lock_release_write_lock(&inode->rw_lock);
+    return rc;
+}
+
 /*
  * Read from an open directory
  * Parameter:
@@ -1785,9 +2002,6 @@ ssize_t fs_readdir(open_file_t* file, direntry_t* direntry) {
     else {
         rc = fs_rw_dir(file, direntry, FS_READ);
     }
-    if (0 == rc) {
-        file->cursor++;
-    }
     if ((rc < 0) && (rc != -1))
         rc = rc * (-1);
     sem_up(&file->sem);
@@ -1876,6 +2090,8 @@ ssize_t fs_ftruncate(open_file_t* file, off_t size) {
         rw_lock_get_write_lock(&file->inode->rw_lock);
         if (file->inode->iops->inode_trunc) {
             rc = file->inode->iops->inode_trunc(file->inode, size);
+            if (0 == rc)
+                pc_truncate(file->inode->dev, file->inode->inode_nr, size);
         }
         else {
             rc = EOPNOTSUPP;
@@ -2201,6 +2417,11 @@ static inode_t* check_inode(int create, int excl, char* path, int mode, int* sta
                 parent_inode->iops->inode_release(parent_inode);
                 return 0;
             }
+            dcache_created(parent_inode, name, inode);
+            /*
+             * The inode number might have been used by a file which has been removed
+             */
+            pc_purge(inode->dev, inode->inode_nr);
         }
     }
     else {
@@ -2365,6 +2586,7 @@ int do_openat(char* path, int flags, int mode, int at) {
             return -EIO;
         }
         FS_DEBUG("inode->size = %d\n", inode->size);
+        pc_truncate(inode->dev, inode->inode_nr, 0);
         rw_lock_release_write_lock(&inode->rw_lock);
     }
     inode->iops->inode_release(inode);
@@ -2440,6 +2662,7 @@ int do_mkdir(char* path, int mode) {
             parent_inode->iops->inode_release(parent_inode);
             return -EIO;
         }
+        dcache_created(parent_inode, name, inode);
     }
     else {
         /*
@@ -2708,6 +2931,128 @@ int do_ftruncate(int fd, off_t size) {
     return rc;
 }
 
+/*
+ * Ask the file system implementations to write back metadata which they keep
+ * in memory to the block cache. This is done for the file system on the specified
+ * device or for all mounted file systems if the device is DEVICE_NONE
+ * Parameter:
+ * @device - the device or DEVICE_NONE
+ * Return value:
+ * 0 upon success
+ * EIO if an IO error occurred
+ * Locks:
+ * mount_point_lock
+ */
+static int sync_superblocks(dev_t device) {
+    mount_point_t* mount_point;
+    superblock_t* super;
+    int rc = 0;
+    rw_lock_get_read_lock(&mount_point_lock);
+    if (root_inode && ((DEVICE_NONE == device) || (root_inode->dev == device))) {
+        super = root_inode->super;
+        if (super->sync && super->sync(super))
+            rc = EIO;
+    }
+    LIST_FOREACH(mount_points_head, mount_point) {
+        if ((DEVICE_NONE == device) || (mount_point->device == device)) {
+            super = mount_point->root->super;
+            if (super->sync && super->sync(super))
+                rc = EIO;
+        }
+    }
+    rw_lock_release_read_lock(&mount_point_lock);
+    return rc;
+}
+
+/*
+ * Implementation of the sync system call. Write all metadata cached
+ * by the file systems and all dirty blocks in the block cache back to disk
+ * Return value:
+ * 0 upon success
+ * -EIO if an IO error occurred
+ */
+int do_sync() {
+    if (sync_superblocks(DEVICE_NONE))
+        return -EIO;
+    if (bc_sync(DEVICE_NONE))
+        return -EIO;
+    return 0;
+}
+
+/*
+ * Implementation of the fsync system call. As the file system layer does not
+ * keep any dirty data itself, this will write all metadata cached by the file system
+ * and all dirty blocks of the device on which the file is located back to disk
+ * Parameter:
+ * @fd - file descriptor
+ * Return value:
+ * 0 upon success
+ * -EBADF if the file descriptor is not valid
+ * -EINVAL if the file descriptor does not refer to a file
+ * -EIO if an IO error occurred
+ */
+int do_fsync(int fd) {
+    int pid = pm_get_pid();
+    open_file_t* of;
+    int rc = 0;
+    if (0 == (of = get_file(fs_process + pid, fd))) {
+        return -EBADF;
+    }
+    if (0 == of->inode) {
+        fs_close(of);
+        return -EINVAL;
+    }
+    if (of->inode->super && of->inode->super->sync && of->inode->super->sync(of->inode->super))
+        rc = -EIO;
+    if (bc_sync(of->inode->dev))
+        rc = -EIO;
+    /*
+     * Call close to decrease reference count again
+     */
+    fs_close(of);
+    return rc;
+}
+
+/*
+ * Get a reference to the inode behind a file descriptor so that the file can be mapped
+ * into memory by mmap. Only regular files which have been opened for reading can be mapped
+ * Parameter:
+ * @fd - file descriptor
+ * @write - set this to 1 if changes to the mapping are written back to the file
+ * @inode - the inode is stored here, the caller is responsible for releasing the reference
+ * Return value:
+ * 0 upon success
+ * EBADF if the file descriptor is not valid
+ * EACCES if the file has not been opened for reading or write is set and the file has not
+ * been opened for writing
+ * ENODEV if the file is not a regular file
+ */
+int fs_get_mappable_inode(int fd, int write, inode_t** inode) {
+    int pid = pm_get_pid();
+    open_file_t* of;
+    int rc = 0;
+    if (0 == (of = get_file(fs_process + pid, fd))) {
+        return EBADF;
+    }
+    if ((0 == of->inode) || (!S_ISREG(of->inode->mode))) {
+        rc = ENODEV;
+    }
+    else if (O_WRONLY == (of->flags & O_ACCMODE)) {
+        rc = EACCES;
+    }
+    else if (write && (O_RDWR != (of->flags & O_ACCMODE))) {
+        rc = EACCES;
+    }
+    else {
+        *inode = of->inode->iops->inode_clone(of->inode);
+    }
+    /*
+     * Call close to decrease reference count again
+     */
+    fs_close(of);
+    return rc;
+}
+
 /*
  * Implementation of the lseek system call
  * Parameter:
@@ -3028,6 +3373,15 @@ static int unlink_inode(inode_t* inode, inode_t* dir, char* name) {
      * danger of a deadlock here
      */
     rc = inode->iops->inode_unlink(dir, name, 0);
+    /*
+     * Remove the entry from the dentry cache. If we have removed a directory,
+     * drop all entries for this directory as well
+     */
+    if (0 == rc) {
+        dcache_remove(dir->dev, dir->inode_nr, name, strlen(name));
+        if (S_ISDIR(inode->mode))
+            dcache_purge(inode->dev, inode->inode_nr);
+    }
     /*
      * Release lock again
      */
@@ -3359,12 +3713,21 @@ int do_rename(char* old, char* new) {
                     goto exit;
                 }
             }
+            if (S_ISDIR(new_inode->mode))
+                dcache_purge(new_inode->dev, new_inode->inode_nr);
         }
         /*
          * Add directory entry pointing to old to new directory
          */
         FS_DEBUG("Adding new link for %s to target directory\n", new_name);
         rc = new_parent_inode->iops->inode_link(new_parent_inode, new_name, old_inode);
+        /*
+         * The entry for the new name has been removed or replaced. If we move a
+         * directory, its entry .. has been changed as well
+         */
+        dcache_remove(new_parent_inode->dev, new_parent_inode->inode_nr, new_name, strlen(new_name));
+        if (S_ISDIR(old_inode->mode))
+            dcache_remove(old_inode->dev, old_inode->inode_nr, "..", 2);
         /*
          * Release lock on new parent inode again
          */
@@ -3389,6 +3752,9 @@ int do_rename(char* old, char* new) {
         if (rc) {
             FS_DEBUG("Return code of unlink: %d\n", rc);
         }
+        else {
+            dcache_remove(old_parent_inode->dev, old_parent_inode->inode_nr, old_name, strlen(old_name));
+        }
         /*
          * Release lock again
          */
@@ -3548,6 +3914,10 @@ int do_link(char* old, char* new) {
      */
     FS_DEBUG("Adding new link for %s to target directory\n", new_name);
     rc = new_parent_inode->iops->inode_link(new_parent_inode, new_name, old_inode);
+    /*
+     * Remove a negative entry for the new name from the dentry cache
+     */
+    dcache_remove(new_parent_inode->dev, new_parent_inode->inode_nr, new_name, strlen(new_name));
     /*
      * Release lock on new parent inode again
      */
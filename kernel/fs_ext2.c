@@ -21,6 +21,7 @@
 #include "timer.h"
 #include "lib/sys/stat.h"
 #include "lib/utime.h"
+#include "kmem.h"
 
 /*
  * The inode operations structure which we use
@@ -35,7 +36,10 @@ static inode_ops_t ext2_iops = {
         fs_ext2_inode_clone,
         fs_ext2_inode_release,
         fs_ext2_inode_flush,
-        fs_ext2_inode_link
+        fs_ext2_inode_link,
+        fs_ext2_inode_readahead,
+        fs_ext2_next_direntry,
+        fs_ext2_lookup
 };
 
 /*
@@ -57,6 +61,14 @@ static ext2_metadata_t* ext2_metadata_head;
 static ext2_metadata_t* ext2_metadata_tail;
 static spinlock_t ext2_metadata_lock;
 
+/*
+ * Object caches for the in-memory inode structures and for indirect blocks
+ */
+static kmem_cache_t inode_cache = KMEM_CACHE_INITIALIZER("inode", sizeof(inode_t));
+static kmem_cache_t ext2_inode_cache = KMEM_CACHE_INITIALIZER("ext2_inode", sizeof(ext2_inode_t));
+static kmem_cache_t ext2_inode_data_cache = KMEM_CACHE_INITIALIZER("ext2_inode_data", sizeof(ext2_inode_data_t));
+static kmem_cache_t indirect_block_cache = KMEM_CACHE_INITIALIZER("ext2_indirect", BLOCK_SIZE);
+
 /*
  * Data structures:
  *
@@ -67,9 +79,16 @@ static spinlock_t ext2_metadata_lock;
  * To organize these data structures, for both inodes and superblocks, there are special containers realized by
  * the structures ext2_metadata_t and ext2_inode_data_t which link to the VFS level inodes as well as to their
  * EXT2 specific equivalents. For each superblock which is in the superblock cache, there is one instance of the
- * structure ext2_metadata_t which also contains a linked list of cached inodes for this superblock. In addition,
+ * structure ext2_metadata_t which also contains the cache of inodes for this superblock. In addition,
  * a copy of the block group descriptor table (bgdt_t) is stored within this data structure.
  *
+ * The inode cache is a hash table with EXT2_INODE_HASH_BUCKETS buckets, keyed by the inode number. Each bucket
+ * contains a chain of ext2_inode_data_t structures linked via hash_next. When the reference count of an inode drops
+ * to zero, the inode is not removed from the cache immediately, but added to the end of a list of unreferenced inodes
+ * (the LRU list), so that re-opening a recently used file does not require a disk access. If the LRU list grows beyond
+ * EXT2_INODE_LRU_SIZE entries, the inode at its head is removed from the cache. Inodes whose link count on disk has
+ * dropped to zero are never added to the LRU list, but removed from disk and from the cache immediately.
+ *
  *
  *   superblock_t
  *    A        |
@@ -79,7 +98,7 @@ static spinlock_t ext2_metadata_lock;
  *  ext2_metadata_t
  *    |      |    A
  *    V      |    |
- *  bgdt_t   |    ---------------> ext2_inode_data_t <--> ext2_inode_data_t <--> ...  <<<< this is the inode cache
+ *  bgdt_t   |    ---------------> ext2_inode_data_t --> ext2_inode_data_t --> ...  <<<< this is a hash chain of the inode cache
  *           |                         A        |
  *           V                         |        |
  *         ext2_superblock_t           |        |
@@ -90,7 +109,7 @@ static spinlock_t ext2_metadata_lock;
  * - from ext2_metadata_t to superblock_t - use pointer ext2_metadata_t.super
  * - from ext2_metadata_t to ext2_superblock_t - use pointer ext2_metadata_t.ext2_super
  * - from superblock_t to ext2_metadata_t - user pointer superblock_t.data, cast to ext2_metadata_t*
- * - from ext2_metadata_t to linked list of ext2_inode_data_t structures (i.e. to the inode cache) - use pointer inodes_head
+ * - from ext2_metadata_t to the chains of ext2_inode_data_t structures (i.e. to the inode cache) - use the array inode_hash
  * - from ext2_inode_data_t to inode_t - use pointer ext2_inode_data_t.ext2_inode
  * - from ext2_inode_data_t to ext2_metadata_t - use pointer ext2_inode_data_t.ext2_meta
  * - from inode_t to ext2_inode_data_t - cast pointer inode_t.data to ext2_inode_data_t*
@@ -102,8 +121,10 @@ static spinlock_t ext2_metadata_lock;
  * Reference counts
  *
  * Both ext2_inode_data_t and ext2_metadata_t have a reference count. As ext2_inode_data_t contains a backward reference to
- * the corresponding instance of ext2_metadata_t, the reference count of any instance of ext2_metadata_t is at least the number
- * of entries in its inode cache.
+ * the corresponding instance of ext2_metadata_t, the reference count of any instance of ext2_metadata_t is at least the sum
+ * of the reference counts of the entries in its inode cache. Inodes on the LRU list have reference count zero and do not hold
+ * a reference to the metadata structure, so that they do not keep the file system busy. They are destroyed together with
+ * the metadata structure.
  *
  * When a file system is mounted, the reference count of its superblock as well as the reference count of its root inode
  * are one (note that the VFS only maintains a reference of the root inode and derives the reference to the root superblock
@@ -114,9 +135,11 @@ static spinlock_t ext2_metadata_lock;
  * The following locks are used in this module:
  * 1) ext2_metadata_lock - protect the list of metadata structures. Also get this lock whenever a reference count of one
  *    of the ext2_metadata_t instances in the list is changed
- * 2) ext2_metadata_t.lock - protect the inode cache for this superblock. Also get this lock whenever a reference count of
- *    one of the inodes in the cache is changed
- * 3) ext2_metadata_t.sb_lock - this semaphore is used to protect the content of the ext2 superblock and the block group
+ * 2) ext2_metadata_t.inode_hash[].lock - protect a hash chain of the inode cache for this superblock. Also get this lock whenever
+ *    a reference count of one of the inodes in the chain is changed
+ * 3) ext2_metadata_t.lock - protect the LRU list of unreferenced inodes and the on_lru flag of each inode. If this lock is needed
+ *    together with the lock on a hash chain, the lock on the hash chain needs to be acquired first
+ * 4) ext2_metadata_t.sb_lock - this semaphore is used to protect the content of the ext2 superblock and the block group
  *    descriptor table as well as the inode and block bitmap
  *
  *
@@ -141,6 +164,12 @@ static spinlock_t ext2_metadata_lock;
  * to the function is the block number on the device of the block which we visit. The counters bytes_processed
  * and blocks_processed are expected to be updated by the callback function if it could process the block successfully.
  *
+ * If the flag coalesce is set in the request, walk_blocklist detects runs of data blocks which are physically
+ * consecutive on the device and invokes process_block only once for each run, with the field run set to the
+ * number of blocks in the run. In this case, first_byte refers to the first block of the run and last_byte to the
+ * last block of the run. This allows the read and write callbacks to hand over an entire run to the block cache
+ * which will then transfer it from or to the device with one request instead of one request per block
+ *
  * Setting the abort flag will cause the blocklist to be stopped at this point
  *
  */
@@ -159,12 +188,48 @@ typedef struct _blocklist_walk_t {
     ext2_metadata_t* ext2_meta;                  // ext2 metadata structure
     u32 block_group_nr;                          // number of block group in which the inode we process is located
     ext2_inode_t* ext2_inode;                    // the inode which we process
+    ext2_inode_data_t* ext2_inode_data;          // inode data of the inode, holding its preallocation window
     int abort;                                   // a callback function can set this to stop the walk
+    int coalesce;                                // if this is set, runs of consecutive blocks are processed at once
+    u32 run;                                     // number of consecutive blocks to be processed by the callback
     u32 first_byte;                              // first byte to be processed within the current block
     u32 last_byte;                               // last byte to be processed within the current block
     int (*process_block)(struct _blocklist_walk_t * request, u32 block_nr);
 } blocklist_walk_t;
 
+/*
+ * Large directories can be organized as a hashed tree (htree) if the file system has the feature
+ * EXT2_FEATURE_COMPAT_DIR_INDEX. Such a directory is marked with the inode flag EXT2_INDEX_FL. Its first
+ * block is the root of the index. It starts with valid directory entries for . and .. so that code which
+ * does not know about the index sees a directory block with two entries. Behind these entries, the root
+ * block contains a list of index entries, each of which maps a hash value to a block in the directory. The
+ * entries are sorted by the hash value, and all directory entries whose name hashes to a value which is at least
+ * the hash of an index entry and less than the hash of the next index entry are stored in the block referenced by
+ * the index entry. The hash of the first index entry is replaced by the number of entries and the maximum number
+ * of entries in the block. If the index has two levels, the root refers to interior index blocks which have the
+ * same layout, but start with an empty directory entry covering the entire block. The lowest bit of the hash in an
+ * index entry is set if the leaf block continues a sequence of entries with the same hash from the preceding leaf.
+ *
+ * When walking down the index, the visited index blocks are kept in an array of frames. A frame contains a copy of
+ * the index block and a pointer to the index entry which was followed
+ */
+typedef struct {
+    u32 block;                                   // logical block number of the index block within the directory
+    u8* data;                                    // content of the index block
+    ext2_dx_entry_t* entries;                    // first index entry in the block
+    ext2_dx_entry_t* at;                         // index entry which has been followed
+} dx_frame_t;
+
+/*
+ * When a leaf block is split, the entries in it are sorted by hash value
+ * using an array of these structures
+ */
+typedef struct {
+    u32 hash;                                    // hash value of the name
+    u32 offset;                                  // offset of the entry within the block
+    u32 size;                                    // number of bytes needed by the entry
+} dx_map_t;
+
 /*
  * Forward declarations
  */
@@ -311,6 +376,18 @@ static ext2_metadata_t* read_meta(dev_t device) {
         kfree((void*) meta);
         return 0;
     }
+    /*
+     * Set up the array of cached bitmaps. The bitmaps themselves are
+     * only read when they are needed
+     */
+    meta->groups = (ext2_group_t*) kmalloc(meta->bgdt_size * sizeof(ext2_group_t));
+    if (0 == meta->groups) {
+        ERROR("Could not allocate memory for block group bitmaps\n");
+        destroy_meta(meta);
+        kfree((void*) meta);
+        return 0;
+    }
+    memset((void*) meta->groups, 0, meta->bgdt_size * sizeof(ext2_group_t));
     return meta;
 }
 
@@ -382,7 +459,7 @@ static ext2_inode_t* get_ext2_inode(ino_t inode_nr, ext2_metadata_t* meta) {
      * inode table
      */
     block = bgd->bg_inode_table;
-    if (0 == (ext2_inode = (ext2_inode_t*) kmalloc(sizeof(ext2_inode_t)))) {
+    if (0 == (ext2_inode = (ext2_inode_t*) kmem_cache_alloc(&ext2_inode_cache))) {
         ERROR("Could not get memory for inode\n");
         return 0;
     }
@@ -393,7 +470,7 @@ static ext2_inode_t* get_ext2_inode(ino_t inode_nr, ext2_metadata_t* meta) {
     if (bc_read_bytes(block, sizeof(ext2_inode_t), ext2_inode, meta->device,
             index * sizeof(ext2_inode_t))) {
         ERROR("Error while reading from disk\n");
-        kfree((void*) ext2_inode);
+        kmem_cache_free(&ext2_inode_cache, ext2_inode);
         return 0;
     }
     return ext2_inode;
@@ -447,118 +524,301 @@ static int put_inode(ext2_metadata_t* ext2_meta, inode_t* inode) {
  * An EXT2 file system manages block and block groupa in bitmask stored on the device   *
  * The following functions are used to allocate new blocks on the device and to free    *
  * allocated blocks again                                                               *
+ *                                                                                      *
+ * The block bitmap and the inode bitmap of a block group are read from disk when they  *
+ * are needed for the first time and are then kept in memory in the array groups of    *
+ * the metadata structure. Changes are only applied to these copies, which are marked  *
+ * as dirty and written back to the block cache by flush_bitmaps                        *
  ***************************************************************************************/
 
 /*
- * Utility function to allocate a free block and mark it
- * as used. This function does not acquire any locks but
- * assumes that the caller has done this
+ * Return the number of blocks in a block group. All block groups have
+ * s_blocks_per_group blocks, except the last one which ends at the end
+ * of the file system
+ * Parameter:
+ * @ext2_meta - ext2 metadata structure for the file system
+ * @block_group_nr - the number of the block group
+ * Return value:
+ * the number of blocks in the block group
+ */
+static u32 blocks_in_group(ext2_metadata_t* ext2_meta, u32 block_group_nr) {
+    ext2_superblock_t* ext2_super = ext2_meta->ext2_super;
+    u32 first_block = block_group_nr * ext2_super->s_blocks_per_group + ext2_super->s_first_data_block;
+    if (first_block + ext2_super->s_blocks_per_group > ext2_super->s_blocks_count)
+        return ext2_super->s_blocks_count - first_block;
+    return ext2_super->s_blocks_per_group;
+}
+
+/*
+ * Return the number of inodes in a block group
+ * Parameter:
+ * @ext2_meta - ext2 metadata structure for the file system
+ * @block_group_nr - the number of the block group
+ * Return value:
+ * the number of inodes in the block group
+ */
+static u32 inodes_in_group(ext2_metadata_t* ext2_meta, u32 block_group_nr) {
+    ext2_superblock_t* ext2_super = ext2_meta->ext2_super;
+    u32 first_inode = block_group_nr * ext2_super->s_inodes_per_group;
+    if (first_inode + ext2_super->s_inodes_per_group > ext2_super->s_inodes_count)
+        return ext2_super->s_inodes_count - first_inode;
+    return ext2_super->s_inodes_per_group;
+}
+
+/*
+ * Load a bitmap into memory unless this has been done before. The caller
+ * needs to hold sb_lock
+ * Parameter:
+ * @ext2_meta - ext2 metadata structure for the file system
+ * @bitmap - the pointer to the cached bitmap in the group structure
+ * @block_nr - the block on the device in which the bitmap is stored
+ * Return value:
+ * the cached bitmap or 0 if the bitmap could not be read
+ */
+static u8* load_bitmap(ext2_metadata_t* ext2_meta, u8** bitmap, u32 block_nr) {
+    if (*bitmap)
+        return *bitmap;
+    if (0 == (*bitmap = (u8*) kmalloc(BLOCK_SIZE))) {
+        ERROR("Could not allocate memory for bitmap\n");
+        return 0;
+    }
+    if (bc_read_bytes(block_nr, BLOCK_SIZE, (void*) *bitmap, ext2_meta->device, 0)) {
+        ERROR("Could not read bitmap from device\n");
+        kfree((void*) *bitmap);
+        *bitmap = 0;
+        return 0;
+    }
+    return *bitmap;
+}
+
+/*
+ * Get the block bitmap of a block group, reading it from the device if needed.
+ * The caller needs to hold sb_lock
+ * Parameter:
+ * @ext2_meta - ext2 metadata structure for the file system
+ * @block_group_nr - the number of the block group
+ * Return value:
+ * the cached block bitmap or 0 if the bitmap could not be read
+ */
+static u8* get_block_bitmap(ext2_metadata_t* ext2_meta, u32 block_group_nr) {
+    return load_bitmap(ext2_meta, &ext2_meta->groups[block_group_nr].block_bitmap,
+            ext2_meta->bgdt[block_group_nr].bg_block_bitmap);
+}
+
+/*
+ * Get the inode bitmap of a block group, reading it from the device if needed.
+ * The caller needs to hold sb_lock
+ * Parameter:
+ * @ext2_meta - ext2 metadata structure for the file system
+ * @block_group_nr - the number of the block group
+ * Return value:
+ * the cached inode bitmap or 0 if the bitmap could not be read
+ */
+static u8* get_inode_bitmap(ext2_metadata_t* ext2_meta, u32 block_group_nr) {
+    return load_bitmap(ext2_meta, &ext2_meta->groups[block_group_nr].inode_bitmap,
+            ext2_meta->bgdt[block_group_nr].bg_inode_bitmap);
+}
+
+/*
+ * Write all dirty bitmaps back to the block cache. The caller needs
+ * to hold sb_lock
+ * Parameter:
+ * @ext2_meta - ext2 metadata structure for the file system
+ * Return value:
+ * 0 if the operation was successful
+ * EIO if a bitmap could not be written
+ */
+static int flush_bitmaps(ext2_metadata_t* ext2_meta) {
+    ext2_group_t* group;
+    int i;
+    if (0 == ext2_meta->groups)
+        return 0;
+    for (i = 0; i < ext2_meta->bgdt_size; i++) {
+        group = ext2_meta->groups + i;
+        if (group->block_bitmap_dirty) {
+            if (bc_write_bytes(ext2_meta->bgdt[i].bg_block_bitmap, BLOCK_SIZE,
+                    (void*) group->block_bitmap, ext2_meta->device, 0)) {
+                ERROR("Could not write block bitmap to device\n");
+                return EIO;
+            }
+            group->block_bitmap_dirty = 0;
+        }
+        if (group->inode_bitmap_dirty) {
+            if (bc_write_bytes(ext2_meta->bgdt[i].bg_inode_bitmap, BLOCK_SIZE,
+                    (void*) group->inode_bitmap, ext2_meta->device, 0)) {
+                ERROR("Could not write inode bitmap to device\n");
+                return EIO;
+            }
+            group->inode_bitmap_dirty = 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Find the first free bit in a bitmap, starting at a given bit. The bitmap is
+ * scanned one dword at a time, skipping dwords in which all bits are set
+ * Parameter:
+ * @bitmap - the bitmap
+ * @start - the bit at which we start the search
+ * @bits - the number of valid bits in the bitmap
+ * Return value:
+ * the index of the first free bit at or after start or bits if there is no free bit
+ */
+static u32 find_free_bit(u8* bitmap, u32 start, u32 bits) {
+    u32* words = (u32*) bitmap;
+    u32 word;
+    u32 i;
+    u32 bit;
+    if (start >= bits)
+        return bits;
+    i = start / 32;
+    /*
+     * Mark the bits in the first dword which are below start as used
+     */
+    word = words[i] | ((1U << (start % 32)) - 1);
+    while (0xffffffff == word) {
+        i++;
+        if (i * 32 >= bits)
+            return bits;
+        word = words[i];
+    }
+    bit = i * 32;
+    while (word & 0x1) {
+        word = word >> 1;
+        bit++;
+    }
+    return (bit < bits) ? bit : bits;
+}
+
+/*
+ * Determine the number of free bits in a bitmap starting at a given free bit
+ * Parameter:
+ * @bitmap - the bitmap
+ * @start - the first bit
+ * @bits - the number of valid bits in the bitmap
+ * @max - maximum number of bits to count
+ * Return value:
+ * the number of consecutive free bits starting at start, at most max
+ */
+static u32 free_run_length(u8* bitmap, u32 start, u32 bits, u32 max) {
+    u32 count = 0;
+    u32 bit = start;
+    while ((count < max) && (bit < bits)) {
+        /*
+         * Skip entire dwords if they are completely free
+         */
+        if ((0 == bit % 32) && (bit + 32 <= bits) && (count + 32 <= max)
+                && (0 == ((u32*) bitmap)[bit / 32])) {
+            count += 32;
+            bit += 32;
+            continue;
+        }
+        if (BITFIELD_GET_BIT(bitmap, bit))
+            break;
+        count++;
+        bit++;
+    }
+    return count;
+}
+
+/*
+ * Utility function to allocate a run of consecutive free blocks within a
+ * block group and mark them as used. The search starts at the block with
+ * index goal within the group and wraps around at the end of the group.
+ * This function does not acquire any locks but assumes that the caller has
+ * done this
  * Parameter:
  * @ext2_meta - ext2 metadata structure for the file system
- * @bgd - block group descriptor of block group in which we try to allocate a block
+ * @block_group_nr - block group in which we try to allocate blocks
+ * @goal - index of the block within the group at which the search starts
+ * @count - maximum number of blocks to allocate
+ * @allocated - number of allocated blocks will be stored here
  * @errno - will be set if an error occured
  * Return value:
- * number of newly allocated block or zero if no free block could be found
+ * number of first newly allocated block or zero if no free block could be found
  */
-static u32 allocate_block_in_group(ext2_metadata_t* ext2_meta, ext2_bgd_t* bgd, int *errno) {
-    u8 block_bitmap[BLOCK_SIZE];
-    int rc;
+static u32 allocate_blocks_in_group(ext2_metadata_t* ext2_meta, u32 block_group_nr, u32 goal,
+        u32 count, u32* allocated, int *errno) {
+    ext2_bgd_t* bgd = ext2_meta->bgdt + block_group_nr;
     ext2_superblock_t* ext2_super = ext2_meta->ext2_super;
-    u32 block_group_nr = (bgd - ext2_meta->bgdt) / sizeof(ext2_bgd_t);
-    u32 blocks_in_group;
+    u8* block_bitmap;
+    u32 blocks;
+    u32 index;
+    u32 run;
     u32 i;
-    u32 block_nr = 0;
     /*
      * If there is no free block at all in this group, return immediately
      */
     if (0 == bgd->bg_free_blocks_count)
         return 0;
-    /*
-     * We first read the block bitmap for this group. Recall that the block
-     * bitmap is the third block in the block group (block 0 is the superblock
-     * copy, block 1 is the block group descriptor table copy). We can get the block
-     * number from the field bg_block_bitmap
-     */
-    rc = bc_read_bytes(bgd->bg_block_bitmap, BLOCK_SIZE, (void*) block_bitmap,
-            ext2_meta->device, 0);
-    if (rc) {
-        ERROR("Could not read block bitmap from device\n");
-        *errno = rc;
+    if (0 == (block_bitmap = get_block_bitmap(ext2_meta, block_group_nr))) {
+        *errno = EIO;
         return 0;
     }
     /*
-     * Next we need to find out how many blocks our block group has. If the block group is
-     * the last block group on the file system, i.e. of the block_group_nr is equal to the number
-     * of entries in the block group descriptor table, the number of blocks is computed as s_blocks_count % s_block_per_group
-     * unless s_blocks_count is an exact multiple of s_blocks_per_group
-     * If this is not the last block, the number of blocks is s_blocks_per_group.
-     */
-    if ((ext2_meta->bgdt_size - 1 == block_group_nr)
-            && (ext2_super->s_blocks_count % ext2_super->s_blocks_per_group)) {
-        blocks_in_group = ext2_super->s_blocks_count
-                % ext2_super->s_blocks_per_group;
-    }
-    else {
-        blocks_in_group = ext2_super->s_blocks_per_group;
-    }
-    /*
-     * Now scan block bitmap until we find a free block. Note that we can
-     * find the first block of the block group by subtracting the number of
-     * blocks allocated by the block group descriptor table plus one from the
-     * block number of the bitmap itself stored in bg_block_bitmap in the
-     * block group descriptor
+     * Scan block bitmap for a free block, starting at the goal. If we
+     * do not find anything, start over at the beginning of the group
      */
-    for (i = 0; i < blocks_in_group; i++) {
-        if (0 == BITFIELD_GET_BIT(block_bitmap,i)) {
-            block_nr = i + bgd->bg_block_bitmap - ext2_meta->bgdt_blocks - 1;
-            BITFIELD_SET_BIT(block_bitmap,i);
-            break;
-        }
-    }
+    blocks = blocks_in_group(ext2_meta, block_group_nr);
+    index = find_free_bit(block_bitmap, goal, blocks);
+    if ((index == blocks) && (goal > 0))
+        index = find_free_bit(block_bitmap, 0, blocks);
+    if (index == blocks)
+        return 0;
     /*
-     * If we have found a free block, write the changed block map back to disk
+     * Extend the run as far as possible and mark all blocks in it as used
      */
-    if (block_nr) {
-        rc = bc_write_bytes(bgd->bg_block_bitmap, BLOCK_SIZE,
-                (void*) block_bitmap, ext2_meta->device, 0);
-        if (rc) {
-            ERROR("Could not write block bitmap to device\n");
-            *errno = rc;
-            return 0;
-        }
-        bgd->bg_free_blocks_count--;
-        ext2_super->s_free_blocks_count--;
-        if (put_meta(ext2_meta)) {
-            ERROR("Could not write changed metadata back to disk\n");
-            *errno = EIO;
-            return 0;
-        }
+    run = free_run_length(block_bitmap, index, blocks, count);
+    for (i = index; i < index + run; i++)
+        BITFIELD_SET_BIT(block_bitmap, i);
+    ext2_meta->groups[block_group_nr].block_bitmap_dirty = 1;
+    bgd->bg_free_blocks_count -= run;
+    ext2_super->s_free_blocks_count -= run;
+    if (put_meta(ext2_meta)) {
+        ERROR("Could not write changed metadata back to disk\n");
+        *errno = EIO;
+        return 0;
     }
-    return block_nr;
+    *allocated = run;
+    return block_group_nr * ext2_super->s_blocks_per_group + ext2_super->s_first_data_block + index;
 }
 
 /*
- * Utility function to allocate a free block and mark it
- * as used. The function will first try to allocate a block
- * in the block group block_group_nr. If that fails, other block
- * groups will be scanned as well
+ * Utility function to allocate up to count consecutive free blocks and mark them
+ * as used. The function will first try to allocate the blocks
+ * in the block group block_group_nr, starting at the block goal if goal is not zero.
+ * If that fails, other block groups will be scanned as well
  * Parameter:
  * @ext2_meta - ext2 metadata structure for the file system
  * @block_group_nr - preferred block group number
+ * @goal - preferred block or zero
+ * @count - maximum number of blocks to allocate
+ * @allocated - number of allocated blocks will be stored here
  * @errno - will be set if an unrecoverable error occurred
  * Return value:
- * number of newly allocated block or zero if no free block could be found
+ * number of the first newly allocated block or zero if no free block could be found
  * Locks:
  * sb_lock in ext2_metadata structure
  */
-static u32 allocate_block(ext2_metadata_t* ext2_meta, u32 block_group_nr, int* errno) {
-    ext2_bgd_t* bgd;
+static u32 allocate_blocks(ext2_metadata_t* ext2_meta, u32 block_group_nr, u32 goal,
+        u32 count, u32* allocated, int* errno) {
+    ext2_superblock_t* ext2_super = ext2_meta->ext2_super;
     int i;
+    int rc = 0;
     u32 block_nr = 0;
+    u32 index = 0;
     if (block_group_nr >= ext2_meta->bgdt_size) {
         ERROR("Preferred block group number exceeds allowed range\n");
         return 0;
     }
+    /*
+     * If a goal has been specified, start the search there
+     */
+    if ((goal >= ext2_super->s_first_data_block) && (goal < ext2_super->s_blocks_count)) {
+        block_group_nr = (goal - ext2_super->s_first_data_block) / ext2_super->s_blocks_per_group;
+        index = (goal - ext2_super->s_first_data_block) % ext2_super->s_blocks_per_group;
+    }
     /*
      * Get lock
      */
@@ -567,24 +827,22 @@ static u32 allocate_block(ext2_metadata_t* ext2_meta, u32 block_group_nr, int* e
      * Check superblock flag to see if the superblock already indicates
      * that no blocks are left
      */
-    if (0 == ext2_meta->ext2_super->s_free_blocks_count) {
+    if (0 == ext2_super->s_free_blocks_count) {
         mutex_up(&ext2_meta->sb_lock);
         return 0;
     }
     /*
-     * First try the block which is preferred
+     * First try the block group which is preferred
      */
-    bgd = ext2_meta->bgdt + block_group_nr;
-    block_nr = allocate_block_in_group(ext2_meta, bgd, errno);
+    block_nr = allocate_blocks_in_group(ext2_meta, block_group_nr, index, count, allocated, &rc);
     /*
      * If we could not find an entry here, repeat this for all other block groups as well
      */
-    if (0 == block_nr) {
+    if ((0 == block_nr) && (0 == rc)) {
         for (i = 0; i < ext2_meta->bgdt_size; i++) {
             if (i != block_group_nr) {
-                block_nr = allocate_block_in_group(ext2_meta, ext2_meta->bgdt
-                        + i, errno);
-                if (block_nr)
+                block_nr = allocate_blocks_in_group(ext2_meta, i, 0, count, allocated, &rc);
+                if ((block_nr) || (rc))
                     break;
             }
         }
@@ -593,66 +851,70 @@ static u32 allocate_block(ext2_metadata_t* ext2_meta, u32 block_group_nr, int* e
      * Release lock
      */
     mutex_up(&ext2_meta->sb_lock);
+    if (rc)
+        *errno = rc;
     return block_nr;
 }
 
 /*
- * Deallocate a block
+ * Deallocate a run of consecutive blocks within one block group
  * Parameter:
  * @ext2_meta - the metadata structure of the file system
- * @block_nr - the number of the block to be deallocated
+ * @block_nr - the number of the first block to be deallocated
+ * @count - the number of blocks to be deallocated
  * Return value:
  * 0 if the operation was successful
  * EIO if an error occurred
  * Locks:
  * sb_lock in metadata structure
  */
-static int deallocate_block(ext2_metadata_t* ext2_meta, u32 block_nr) {
+static int deallocate_blocks(ext2_metadata_t* ext2_meta, u32 block_nr, u32 count) {
     u32 block_group_nr;
     u32 index;
+    u32 i;
     ext2_bgd_t* bgd;
-    u8 block_bitmap[BLOCK_SIZE];
+    u8* block_bitmap;
     /*
      * Determine block group number and index within group
      */
-    block_group_nr = (block_nr - 1) / ext2_meta->ext2_super->s_blocks_per_group;
-    index = (block_nr - 1) % ext2_meta->ext2_super->s_blocks_per_group;
+    block_group_nr = (block_nr - ext2_meta->ext2_super->s_first_data_block) / ext2_meta->ext2_super->s_blocks_per_group;
+    index = (block_nr - ext2_meta->ext2_super->s_first_data_block) % ext2_meta->ext2_super->s_blocks_per_group;
     if (block_group_nr >= ext2_meta->bgdt_size) {
         PANIC("Invalid block group number %d\n", block_group_nr);
     }
+    if (index + count > ext2_meta->ext2_super->s_blocks_per_group) {
+        PANIC("Run of %d blocks starting at block %d crosses block group boundary\n", count, block_nr);
+    }
     /*
      * Get lock
      */
     sem_down(&ext2_meta->sb_lock);
     /*
-     * Get entry in block group descriptor table and read block bitmap into
-     * memory
+     * Get entry in block group descriptor table and block bitmap
      */
     bgd = ext2_meta->bgdt+block_group_nr;
-    if (bc_read_bytes(bgd->bg_block_bitmap, BLOCK_SIZE, (void*) block_bitmap, ext2_meta->device, 0)) {
+    if (0 == (block_bitmap = get_block_bitmap(ext2_meta, block_group_nr))) {
         ERROR("Could not read block bitmap from disk\n");
         mutex_up(&ext2_meta->sb_lock);
         return EIO;
     }
     /*
-     * Flag block as unused and write back to disk
+     * Flag blocks as unused
      */
-    if (0 == BITFIELD_GET_BIT(block_bitmap, index)) {
-        PANIC("Block %d within group not in use", index);
-        mutex_up(&ext2_meta->sb_lock);
-        return EIO;
-    }
-    BITFIELD_CLEAR_BIT(block_bitmap, index);
-    if (bc_write_bytes(bgd->bg_block_bitmap, BLOCK_SIZE, (void*) block_bitmap, ext2_meta->device, 0)) {
-        PANIC("Could not write block bitmap to disk\n");
-        mutex_up(&ext2_meta->sb_lock);
-        return EIO;
+    for (i = index; i < index + count; i++) {
+        if (0 == BITFIELD_GET_BIT(block_bitmap, i)) {
+            PANIC("Block %d within group not in use", i);
+            mutex_up(&ext2_meta->sb_lock);
+            return EIO;
+        }
+        BITFIELD_CLEAR_BIT(block_bitmap, i);
     }
+    ext2_meta->groups[block_group_nr].block_bitmap_dirty = 1;
     /*
      * Update block group descriptor and super block
      */
-    ext2_meta->ext2_super->s_free_blocks_count++;
-    bgd->bg_free_blocks_count++;
+    ext2_meta->ext2_super->s_free_blocks_count += count;
+    bgd->bg_free_blocks_count += count;
     if (put_meta(ext2_meta)) {
         PANIC("Could not write changed metadata back to disk\n");
         mutex_up(&ext2_meta->sb_lock);
@@ -665,6 +927,21 @@ static int deallocate_block(ext2_metadata_t* ext2_meta, u32 block_nr) {
     return 0;
 }
 
+/*
+ * Deallocate a block
+ * Parameter:
+ * @ext2_meta - the metadata structure of the file system
+ * @block_nr - the number of the block to be deallocated
+ * Return value:
+ * 0 if the operation was successful
+ * EIO if an error occurred
+ * Locks:
+ * sb_lock in metadata structure
+ */
+static int deallocate_block(ext2_metadata_t* ext2_meta, u32 block_nr) {
+    return deallocate_blocks(ext2_meta, block_nr, 1);
+}
+
 /****************************************************************************************
  * Free and available inodes are marked in a bitmask within the EXT2 file system meta-  *
  * data on disk. These functions operate in this bitmask                                *
@@ -677,7 +954,6 @@ static int deallocate_block(ext2_metadata_t* ext2_meta, u32 block_nr) {
  * Return value:
  * 0 if operation was successful
  * EIO if an I/O error occurred
- * ENOMEM if there was not sufficient memory to complete the operation
  * Locks:
  * sb_lock in metadata structure
  */
@@ -688,13 +964,6 @@ static int deallocate_inode(inode_t* inode) {
     u8* inode_bitmap;
     ext2_bgd_t* bgd;
     ext2_inode_t ext2_inode;
-    /*
-     * Allocate memory for bitmap
-     */
-    if (0 == (inode_bitmap = (u8*) kmalloc(BLOCK_SIZE))) {
-        ERROR("Could not allocate memory for inode bitmap\n");
-        return ENOMEM;
-    }
      /*
      * Get block group number and index of inode in group
      */
@@ -705,28 +974,22 @@ static int deallocate_inode(inode_t* inode) {
     }
     sem_down(&ext2_meta->sb_lock);
     /*
-     * Load inode bitmap
+     * Get inode bitmap
      */
     bgd = ext2_meta->bgdt + block_group_nr;
-    if (bc_read_bytes(bgd->bg_inode_bitmap, BLOCK_SIZE, (void*) inode_bitmap, ext2_meta->device, 0)) {
+    if (0 == (inode_bitmap = get_inode_bitmap(ext2_meta, block_group_nr))) {
         ERROR("Could not read inode bitmap from disk\n");
         mutex_up(&ext2_meta->sb_lock);
-        kfree((void*) inode_bitmap);
         return EIO;
     }
     if (0 == BITFIELD_GET_BIT(inode_bitmap, inode_in_group)) {
         PANIC("Trying to free unallocated inode\n");
     }
     /*
-     * Mark inode as unused and write bitmap back to disk
+     * Mark inode as unused
      */
     BITFIELD_CLEAR_BIT(inode_bitmap, inode_in_group);
-    if (bc_write_bytes(bgd->bg_inode_bitmap, BLOCK_SIZE, (void*) inode_bitmap, ext2_meta->device, 0)) {
-        PANIC("Could not write inode bitmap to disk\n");
-        mutex_up(&ext2_meta->sb_lock);
-        kfree((void*) inode_bitmap);
-        return EIO;
-    }
+    ext2_meta->groups[block_group_nr].inode_bitmap_dirty = 1;
     /*
      * Overwrite entry in inode table with zeroes
      */
@@ -734,7 +997,6 @@ static int deallocate_inode(inode_t* inode) {
     if (bc_write_bytes(bgd->bg_inode_table, sizeof(ext2_inode_t), (void*) &ext2_inode, ext2_meta->device,
             inode_in_group*sizeof(ext2_inode_t))) {
         PANIC("Could not write inode bitmap to disk\n");
-        kfree((void*) inode_bitmap);
         mutex_up(&ext2_meta->sb_lock);
         return EIO;
     }
@@ -748,11 +1010,9 @@ static int deallocate_inode(inode_t* inode) {
     if (put_meta(ext2_meta)) {
         PANIC("Could not write metadata back to disk\n");
         mutex_up(&ext2_meta->sb_lock);
-        kfree((void*) inode_bitmap);
         return EIO;
     }
     mutex_up(&ext2_meta->sb_lock);
-    kfree((void*) inode_bitmap);
     return 0;
 }
 
@@ -771,88 +1031,45 @@ static u32 allocate_inode_in_group(ext2_metadata_t* ext2_meta, int block_group_n
     u8* inode_bitmap;
     ext2_bgd_t* bgd = ext2_meta->bgdt + block_group_nr;
     ext2_superblock_t* ext2_super = ext2_meta->ext2_super;
-    u32 inodes_in_group;
-    int rc;
-    int i;
+    u32 inodes;
+    u32 index;
     u32 inode_nr;
-    if (0 == (inode_bitmap = (u8*) kmalloc(BLOCK_SIZE))) {
-        ERROR("Could not allocate memory for inode bitmap\n");
-        return ENOMEM;
-    }
-    /*
-     * We first read the inode bitmap for this group. We can get the block
-     * number from the field bg_block_bitmap
-     */
-    rc = bc_read_bytes(bgd->bg_inode_bitmap, BLOCK_SIZE, (void*) inode_bitmap,
-            ext2_meta->device, 0);
-    if (rc) {
-        ERROR("Could not read inode bitmap from device\n");
-        *errno = rc;
-        kfree((void*) inode_bitmap);
+    if (0 == (inode_bitmap = get_inode_bitmap(ext2_meta, block_group_nr))) {
+        *errno = EIO;
         return 0;
     }
-    /*
-     * Next we need to find out how many inodes our block group has. If the block group is
-     * the last block group on the file system, i.e. of the block_group_nr is equal to the number
-     * of entries in the block group descriptor table, the number of inodes is computed as s_inodes_count % s_inodes_per_group
-     * unless s_inodes_count is an exact multiple of s_inodes_per_group
-     * If this is not the last block, the number of inodes is s_inodes_per_group.
-     */
-    if ((block_group_nr == ext2_meta->bgdt_size - 1)
-            && (ext2_super->s_inodes_count % ext2_super->s_inodes_per_group)) {
-        inodes_in_group = ext2_super->s_inodes_count
-                % ext2_super->s_inodes_per_group;
-    }
-    else {
-        inodes_in_group = ext2_super->s_inodes_per_group;
-    }
     /*
      * Now scan inode bitmap until we find a free slot. Recall
      * that by convention, inode 1 is the first inode (not inode zero!)
      */
-    for (i = 0; i < inodes_in_group; i++) {
-        if (0 == BITFIELD_GET_BIT(inode_bitmap,i)) {
-            inode_nr = i+1 + block_group_nr*ext2_super->s_inodes_per_group;
-            EXT2_DEBUG("Allocated inode %d\n", inode_nr);
-            BITFIELD_SET_BIT(inode_bitmap,i);
-            break;
+    inodes = inodes_in_group(ext2_meta, block_group_nr);
+    index = find_free_bit(inode_bitmap, 0, inodes);
+    if (index == inodes)
+        return 0;
+    inode_nr = index + 1 + block_group_nr*ext2_super->s_inodes_per_group;
+    EXT2_DEBUG("Allocated inode %d\n", inode_nr);
+    BITFIELD_SET_BIT(inode_bitmap, index);
+    ext2_meta->groups[block_group_nr].inode_bitmap_dirty = 1;
+    bgd->bg_free_inodes_count--;
+    ext2_super->s_free_inode_count--;
+    /*
+     * If the inode represents a directory, we need to increase the used directory counter
+     * as well
+     */
+    if (isdir) {
+        bgd->bg_used_dirs_count++;
+        if (0 == bgd->bg_used_dirs_count) {
+            PANIC("Overflow in bg_used_dirs_count\n");
         }
     }
     /*
-     * If we have found a free inode, write the changed inode map back to disk
+     * Write block group descriptor and superblock table back to disk
      */
-    if (inode_nr) {
-        rc = bc_write_bytes(bgd->bg_inode_bitmap, BLOCK_SIZE,
-                (void*) inode_bitmap, ext2_meta->device, 0);
-        if (rc) {
-            PANIC("Could not write inode bitmap to device\n");
-            *errno = rc;
-            kfree((void*) inode_bitmap);
-            return 0;
-        }
-        bgd->bg_free_inodes_count--;
-        ext2_super->s_free_inode_count--;
-        /*
-         * If the inode represents a directory, we need to increase the used directory counter
-         * as well
-         */
-        if (isdir) {
-            bgd->bg_used_dirs_count++;
-            if (0 == bgd->bg_used_dirs_count) {
-                PANIC("Overflow in bg_used_dirs_count\n");
-            }
-        }
-        /*
-         * Write block group descriptor and superblock table back to disk
-         */
-        if (put_meta(ext2_meta)) {
-            PANIC("Could not write file system meta data to disk - disk write error\n");
-            kfree((void*) inode_bitmap);
-            *errno = rc;
-            return 0;
-        }
+    if (put_meta(ext2_meta)) {
+        PANIC("Could not write file system meta data to disk - disk write error\n");
+        *errno = EIO;
+        return 0;
     }
-    kfree((void*) inode_bitmap);
     return inode_nr;
 }
 
@@ -980,6 +1197,7 @@ static ext2_metadata_t* clone_meta(ext2_metadata_t* meta) {
  */
 static ext2_metadata_t* new_meta() {
     ext2_metadata_t* meta = 0;
+    int i;
     if (0 == (meta = (ext2_metadata_t*) kmalloc(sizeof(ext2_metadata_t)))) {
         ERROR("Could not get superblock from disk - out of memory\n");
         return 0;
@@ -993,8 +1211,16 @@ static ext2_metadata_t* new_meta() {
         return 0;
     }
     meta->bgdt = 0;
-    meta->inodes_head = 0;
-    meta->inodes_tail = 0;
+    meta->groups = 0;
+    for (i = 0; i < EXT2_INODE_HASH_BUCKETS; i++) {
+        meta->inode_hash[i].head = 0;
+        spinlock_init(&meta->inode_hash[i].lock);
+    }
+    meta->lru_head = 0;
+    meta->lru_tail = 0;
+    meta->lru_count = 0;
+    meta->inode_hits = 0;
+    meta->inode_misses = 0;
     meta->reference_count = 1;
     spinlock_init(&(meta->lock));
     sem_init(&meta->sb_lock, 1);
@@ -1002,24 +1228,38 @@ static ext2_metadata_t* new_meta() {
 }
 
 /*
- * Destroy a metadata structure and return the allocated memory
+ * Destroy a metadata structure and return the allocated memory. This
+ * includes all inodes which are still in the inode cache
  * Parameter:
  * @meta - the data to be destroyed
  */
 static void destroy_meta(ext2_metadata_t* meta) {
     ext2_inode_data_t* current;
     ext2_inode_data_t* next;
+    int i;
     if (meta->ext2_super)
         kfree(meta->ext2_super);
+    if (meta->groups) {
+        for (i = 0; i < meta->bgdt_size; i++) {
+            if (meta->groups[i].block_bitmap)
+                kfree(meta->groups[i].block_bitmap);
+            if (meta->groups[i].inode_bitmap)
+                kfree(meta->groups[i].inode_bitmap);
+        }
+        kfree(meta->groups);
+    }
     if (meta->bgdt)
         kfree(meta->bgdt);
     if (meta->super)
         kfree(meta->super);
-    current = meta->inodes_head;
-    while (current) {
-        next = current->next;
-        destroy_ext2_inode_data(current);
-        current = next;
+    for (i = 0; i < EXT2_INODE_HASH_BUCKETS; i++) {
+        current = meta->inode_hash[i].head;
+        while (current) {
+            next = current->hash_next;
+            destroy_ext2_inode_data(current);
+            kmem_cache_free(&ext2_inode_data_cache, current);
+            current = next;
+        }
     }
 }
 
@@ -1036,6 +1276,7 @@ static void init_super(ext2_metadata_t* meta) {
     meta->super->root = EXT2_ROOT_INODE;
     meta->super->data = (void*) meta;
     meta->super->is_busy = fs_ext2_is_busy;
+    meta->super->sync = fs_ext2_sync;
 }
 
 /*
@@ -1110,15 +1351,44 @@ void fs_ext2_release_superblock(superblock_t* superblock) {
     if (0 == meta->reference_count) {
         EXT2_DEBUG("Reference count of superblock dropped to zero\n");
         LIST_REMOVE(ext2_metadata_head, ext2_metadata_tail, meta);
+        spinlock_release(&ext2_metadata_lock, &eflags);
+        /*
+         * As the structure is no longer on the list, nobody else can
+         * reach it and we can write back the bitmaps without holding the lock
+         */
+        if (flush_bitmaps(meta)) {
+            ERROR("Could not write back bitmaps\n");
+        }
         destroy_meta(meta);
         kfree((void*) meta);
+        return;
     }
     spinlock_release(&ext2_metadata_lock, &eflags);
 }
 
+/*
+ * Write back the allocation bitmaps which are cached in memory
+ * to the block cache
+ * Parameter:
+ * @superblock - the superblock of the file system
+ * Return value:
+ * 0 if the operation was successful
+ * EIO if an error occurred
+ * Locks:
+ * sb_lock in metadata structure
+ */
+int fs_ext2_sync(superblock_t* superblock) {
+    ext2_metadata_t* meta = (ext2_metadata_t*) superblock->data;
+    int rc;
+    sem_down(&meta->sb_lock);
+    rc = flush_bitmaps(meta);
+    mutex_up(&meta->sb_lock);
+    return rc;
+}
+
 /****************************************************************************************
- * Attached to each superblock, there is a list of associated cached inodes. This cache *
- * is managed by the following functions                                                *
+ * Attached to each superblock, there is a hash table of associated cached inodes. This *
+ * cache is managed by the following functions                                          *
  ****************************************************************************************/
 
 /*
@@ -1136,7 +1406,7 @@ void fs_ext2_release_superblock(superblock_t* superblock) {
  */
 static ext2_inode_data_t* init_ext2_inode_data(inode_t* inode, ext2_inode_t* ext2_inode, ext2_metadata_t* meta) {
     ext2_inode_data_t* ext2_inode_data = 0;
-    if (0 == (ext2_inode_data = (ext2_inode_data_t*) kmalloc(sizeof(ext2_inode_data_t)))) {
+    if (0 == (ext2_inode_data = (ext2_inode_data_t*) kmem_cache_alloc(&ext2_inode_data_cache))) {
         ERROR("Could not allocate memory for ext2 inode data structure\n");
         return 0;
     }
@@ -1144,6 +1414,10 @@ static ext2_inode_data_t* init_ext2_inode_data(inode_t* inode, ext2_inode_t* ext
     ext2_inode_data->ext2_inode = ext2_inode;
     ext2_inode_data->ext2_meta = meta;
     ext2_inode_data->reference_count = 1;
+    ext2_inode_data->on_lru = 0;
+    ext2_inode_data->prealloc_block = 0;
+    ext2_inode_data->prealloc_count = 0;
+    ext2_inode_data->hash_next = 0;
     return ext2_inode_data;
 }
 
@@ -1155,9 +1429,9 @@ static ext2_inode_data_t* init_ext2_inode_data(inode_t* inode, ext2_inode_t* ext
  */
 static void destroy_ext2_inode_data(ext2_inode_data_t* ext2_inode_data) {
     if (ext2_inode_data->ext2_inode)
-        kfree(ext2_inode_data->ext2_inode);
+        kmem_cache_free(&ext2_inode_cache, ext2_inode_data->ext2_inode);
     if (ext2_inode_data->inode)
-        kfree(ext2_inode_data->inode);
+        kmem_cache_free(&inode_cache, ext2_inode_data->inode);
 }
 
 /*
@@ -1173,7 +1447,7 @@ static void destroy_ext2_inode_data(ext2_inode_data_t* ext2_inode_data) {
  */
 static inode_t* init_inode(ext2_inode_t* ext2_inode, ext2_metadata_t* ext2_meta, u32 inode_nr) {
     inode_t* inode = 0;
-    if (0 == (inode = (inode_t*) kmalloc(sizeof(inode_t)))) {
+    if (0 == (inode = (inode_t*) kmem_cache_alloc(&inode_cache))) {
         ERROR("Could not allocate memory for inode\n");
         return 0;
     }
@@ -1199,15 +1473,115 @@ static inode_t* init_inode(ext2_inode_t* ext2_inode, ext2_metadata_t* ext2_meta,
     return inode;
 }
 
+/*
+ * Return the bucket in the inode hash table in which an inode is stored
+ */
+static ext2_inode_bucket_t* inode_bucket(ext2_metadata_t* meta, ino_t inode_nr) {
+    return meta->inode_hash + (inode_nr % EXT2_INODE_HASH_BUCKETS);
+}
+
+/*
+ * Locate an inode in a hash chain. The caller needs to hold the lock on the bucket
+ * Parameter:
+ * @bucket - the bucket
+ * @inode_nr - the inode number
+ * Return value:
+ * the ext2 inode data structure or 0 if the inode is not in the chain
+ */
+static ext2_inode_data_t* lookup_inode(ext2_inode_bucket_t* bucket, ino_t inode_nr) {
+    ext2_inode_data_t* ext2_inode_data = bucket->head;
+    while (ext2_inode_data) {
+        if (ext2_inode_data->inode->inode_nr == inode_nr)
+            return ext2_inode_data;
+        ext2_inode_data = ext2_inode_data->hash_next;
+    }
+    return 0;
+}
+
+/*
+ * Remove an inode from its hash chain. The caller needs to hold the lock on the bucket
+ * Parameter:
+ * @bucket - the bucket
+ * @ext2_inode_data - the inode to be removed
+ */
+static void unhash_inode(ext2_inode_bucket_t* bucket, ext2_inode_data_t* ext2_inode_data) {
+    ext2_inode_data_t* prev;
+    if (bucket->head == ext2_inode_data) {
+        bucket->head = ext2_inode_data->hash_next;
+        return;
+    }
+    prev = bucket->head;
+    while (prev && (prev->hash_next != ext2_inode_data))
+        prev = prev->hash_next;
+    if (prev)
+        prev->hash_next = ext2_inode_data->hash_next;
+}
+
+/*
+ * Add a reference to an inode in the cache and remove it from the LRU
+ * list if this is the first reference. The caller needs to hold the lock
+ * on the bucket
+ * Parameter:
+ * @meta - the ext2 metadata structure
+ * @ext2_inode_data - the inode
+ * Locks:
+ * meta->lock
+ */
+static void reference_inode(ext2_metadata_t* meta, ext2_inode_data_t* ext2_inode_data) {
+    u32 eflags;
+    if ((0 == ext2_inode_data->reference_count++) && (ext2_inode_data->on_lru)) {
+        spinlock_get(&meta->lock, &eflags);
+        LIST_REMOVE(meta->lru_head, meta->lru_tail, ext2_inode_data);
+        meta->lru_count--;
+        ext2_inode_data->on_lru = 0;
+        spinlock_release(&meta->lock, &eflags);
+    }
+}
+
 /*
  * Add a fully prepared inode to the cache - this
- * is just a wrapper around LIST_ADD which gets the necessary lock
+ * is just a wrapper around adding the inode to its hash chain
+ * which gets the necessary lock
  */
 static void store_inode(ext2_metadata_t* ext2_metadata, ext2_inode_data_t* ext2_inode_data) {
     u32 eflags;
-    spinlock_get(&ext2_metadata->lock, &eflags);
-    LIST_ADD_END(ext2_metadata->inodes_head, ext2_metadata->inodes_tail, ext2_inode_data);
-    spinlock_release(&ext2_metadata->lock, &eflags);
+    ext2_inode_bucket_t* bucket = inode_bucket(ext2_metadata, ext2_inode_data->inode->inode_nr);
+    spinlock_get(&bucket->lock, &eflags);
+    ext2_inode_data->hash_next = bucket->head;
+    bucket->head = ext2_inode_data;
+    spinlock_release(&bucket->lock, &eflags);
+}
+
+/*
+ * Remove an unreferenced inode from the cache and free the memory occupied
+ * by it. If the inode has been referenced again in the meantime or has been
+ * put back onto the LRU list, nothing is done. As the inode might have been
+ * removed from the cache by another thread in the meantime, it is identified by its
+ * inode number
+ * Parameter:
+ * @meta - the ext2 metadata structure
+ * @inode_nr - the number of the inode
+ * Locks:
+ * lock on the bucket
+ */
+static void evict_inode(ext2_metadata_t* meta, ino_t inode_nr) {
+    u32 eflags;
+    ext2_inode_bucket_t* bucket = inode_bucket(meta, inode_nr);
+    ext2_inode_data_t* ext2_inode_data;
+    spinlock_get(&bucket->lock, &eflags);
+    ext2_inode_data = lookup_inode(bucket, inode_nr);
+    if (ext2_inode_data && (0 == ext2_inode_data->reference_count) && (0 == ext2_inode_data->on_lru)) {
+        unhash_inode(bucket, ext2_inode_data);
+    }
+    else {
+        ext2_inode_data = 0;
+    }
+    spinlock_release(&bucket->lock, &eflags);
+    if (ext2_inode_data) {
+        EXT2_DEBUG("Evicting inode %d from cache\n", inode_nr);
+        destroy_ext2_inode_data(ext2_inode_data);
+        kmem_cache_free(&ext2_inode_data_cache, ext2_inode_data);
+    }
 }
 
 /*
@@ -1219,6 +1593,7 @@ static void store_inode(ext2_metadata_t* ext2_metadata, ext2_inode_data_t* ext2_
  * Return value:
  * a pointer to the inode or 0 if the operation failed
  * Locks:
+ * lock on the bucket of the inode hash table
  * spinlock in superblock meta data structure (meta->lock)
  * Reference counts:
  * - reference count of inode data structure is incremented by one
@@ -1228,24 +1603,25 @@ static inode_t* get_inode(ino_t inode_nr, ext2_metadata_t* meta) {
     ext2_inode_t* ext2_inode;
     ext2_inode_data_t* ext2_inode_data;
     ext2_inode_data_t* check;
+    ext2_inode_bucket_t* bucket = inode_bucket(meta, inode_nr);
     u32 eflags;
     /*
      * Already in cache?
      */
     EXT2_DEBUG("Looking for inode %d in cache\n", inode_nr);
-    spinlock_get(&meta->lock, &eflags);
-    LIST_FOREACH(meta->inodes_head, ext2_inode_data) {
-        if (ext2_inode_data->inode->inode_nr == inode_nr) {
-            ext2_inode_data->reference_count++;
-            spinlock_release(&meta->lock, &eflags);
-            return ext2_inode_data->inode;
-        }
+    spinlock_get(&bucket->lock, &eflags);
+    if ((ext2_inode_data = lookup_inode(bucket, inode_nr))) {
+        reference_inode(meta, ext2_inode_data);
+        spinlock_release(&bucket->lock, &eflags);
+        meta->inode_hits++;
+        return ext2_inode_data->inode;
     }
     /*
      * Inode is not yet in cache. Get it from disk. Make sure to release
      * spinlock first as this might involve sleeping
      */
-    spinlock_release(&meta->lock, &eflags);
+    spinlock_release(&bucket->lock, &eflags);
+    meta->inode_misses++;
     if (0 == (ext2_inode = get_ext2_inode(inode_nr, meta))) {
         ERROR("Could not get ext2 inode from disk\n");
         return 0;
@@ -1262,29 +1638,29 @@ static inode_t* get_inode(ino_t inode_nr, ext2_metadata_t* meta) {
      */
     if (0 == (ext2_inode_data = init_ext2_inode_data(inode, ext2_inode, meta))) {
         ERROR("Could not allocate memory\n");
-        kfree((void*) inode);
+        kmem_cache_free(&inode_cache, inode);
         return 0;
     }
     /*
      * Another thread might have added an entry for this
      * inode in parallel in the meantime. To avoid duplicates,
-     * we check the list again, this time while having the lock.
+     * we check the chain again, this time while having the lock.
      */
-    spinlock_get(&meta->lock, &eflags);
-    LIST_FOREACH(meta->inodes_head, check) {
-        if (check->inode->inode_nr == inode_nr) {
-            destroy_ext2_inode_data(ext2_inode_data);
-            kfree((void*) ext2_inode_data);
-            spinlock_release(&meta->lock, &eflags);
-            return check->inode;
-        }
+    spinlock_get(&bucket->lock, &eflags);
+    if ((check = lookup_inode(bucket, inode_nr))) {
+        reference_inode(meta, check);
+        spinlock_release(&bucket->lock, &eflags);
+        destroy_ext2_inode_data(ext2_inode_data);
+        kmem_cache_free(&ext2_inode_data_cache, ext2_inode_data);
+        return check->inode;
     }
     /*
      * Still not there - add it
      */
-    LIST_ADD_END(meta->inodes_head, meta->inodes_tail, ext2_inode_data);
+    ext2_inode_data->hash_next = bucket->head;
+    bucket->head = ext2_inode_data;
     inode->data = (void*) ext2_inode_data;
-    spinlock_release(&meta->lock, &eflags);
+    spinlock_release(&bucket->lock, &eflags);
     return inode;
 }
 
@@ -1323,7 +1699,7 @@ inode_t* fs_ext2_get_inode(dev_t device, ino_t inode_nr) {
  * Return value:
  * a pointer to the inode
  * Locks:
- * lock on ext2 metadata structure for this inode
+ * lock on the bucket of the inode hash table
  * Reference counts:
  * - increase reference count of returned inode by one
  * - increase reference count of associated superblock by one
@@ -1341,9 +1717,10 @@ inode_t* fs_ext2_inode_clone(inode_t* inode) {
      * itself
      */
     ext2_metadata_t* meta = clone_meta(idata->ext2_meta);
-    spinlock_get(&meta->lock, &eflags);
+    ext2_inode_bucket_t* bucket = inode_bucket(meta, inode->inode_nr);
+    spinlock_get(&bucket->lock, &eflags);
     idata->reference_count++;
-    spinlock_release(&meta->lock, &eflags);
+    spinlock_release(&bucket->lock, &eflags);
     return inode;
 }
 
@@ -1379,7 +1756,76 @@ int fs_ext2_is_busy(superblock_t* super) {
  ****************************************************************************************/
 
 /*
- *  Load an indirect block (which can be a double indirect block, a single indirect block
+ * Return the blocks left in the preallocation window of an inode to the
+ * free blocks of the file system
+ * Parameter:
+ * @ext2_inode_data - the inode data structure
+ * Return value:
+ * 0 if the operation was successful
+ * EIO if an error occurred
+ */
+static int discard_prealloc(ext2_inode_data_t* ext2_inode_data) {
+    u32 block_nr = ext2_inode_data->prealloc_block;
+    u32 count = ext2_inode_data->prealloc_count;
+    ext2_inode_data->prealloc_block = 0;
+    ext2_inode_data->prealloc_count = 0;
+    if (0 == count)
+        return 0;
+    EXT2_DEBUG("Discarding %d preallocated blocks starting at block %d\n", count, block_nr);
+    return deallocate_blocks(ext2_inode_data->ext2_meta, block_nr, count);
+}
+
+/*
+ * Allocate up to count consecutive blocks for the file which is processed by a
+ * blocklist walk. For a regular file, the blocks are taken from the preallocation
+ * window of the inode, i.e. a run of blocks which has been reserved for the file
+ * when it was extended before. If the window is empty or does not start at the
+ * goal, a new run of blocks is allocated which exceeds the number of requested
+ * blocks by EXT2_PREALLOC_BLOCKS, and the blocks which are not used yet become
+ * the new preallocation window. This keeps a file which grows in small steps
+ * contiguous on the device even if several files grow at the same time
+ * Parameters:
+ * @request - the request describing the block walk
+ * @goal - the preferred first block or zero
+ * @count - the maximum number of blocks to allocate
+ * @allocated - number of allocated blocks will be stored here
+ * @errno - will be set if an unrecoverable error occurred
+ * Return value:
+ * the number of the first allocated block or zero if no free block could be found
+ */
+static u32 allocate_file_blocks(blocklist_walk_t* request, u32 goal, u32 count,
+        u32* allocated, int* errno) {
+    ext2_inode_data_t* ext2_inode_data = request->ext2_inode_data;
+    u32 block_nr;
+    u32 run = 0;
+    if ((0 == ext2_inode_data) || (!S_ISREG(request->ext2_inode->i_mode)))
+        return allocate_blocks(request->ext2_meta, request->block_group_nr, goal, count, allocated, errno);
+    /*
+     * If the caller asks for blocks at a different position, the window is of no use
+     */
+    if ((ext2_inode_data->prealloc_count) && (goal) && (goal != ext2_inode_data->prealloc_block)) {
+        if (discard_prealloc(ext2_inode_data)) {
+            *errno = EIO;
+            return 0;
+        }
+    }
+    if (0 == ext2_inode_data->prealloc_count) {
+        block_nr = allocate_blocks(request->ext2_meta, request->block_group_nr, goal,
+                count + EXT2_PREALLOC_BLOCKS, &run, errno);
+        if (0 == block_nr)
+            return 0;
+        ext2_inode_data->prealloc_block = block_nr;
+        ext2_inode_data->prealloc_count = run;
+    }
+    block_nr = ext2_inode_data->prealloc_block;
+    *allocated = (count < ext2_inode_data->prealloc_count) ? count : ext2_inode_data->prealloc_count;
+    ext2_inode_data->prealloc_block += *allocated;
+    ext2_inode_data->prealloc_count -= *allocated;
+    return block_nr;
+}
+
+/*
+ *  Load an indirect block (which can be a double indirect block, a single indirect block
  *  or a triple indirect block) into memory.
  *  If the block number requested is zero, a new block will be allocated, filled with
  *  zeroes and written to disk
@@ -1396,10 +1842,11 @@ int fs_ext2_is_busy(superblock_t* super) {
 static u32* load_indirect_block(blocklist_walk_t* request, u32* block_nr,
         int* dirty, int* errno) {
     u32* indirect_block;
+    u32 allocated;
     /*
      * Try to allocate new block in memory first
      */
-    if (0 == (indirect_block = (u32*) kmalloc(BLOCK_SIZE))) {
+    if (0 == (indirect_block = (u32*) kmem_cache_alloc(&indirect_block_cache))) {
         ERROR("Could not allocate indirect block\n");
         return 0;
     }
@@ -1416,10 +1863,9 @@ static u32* load_indirect_block(blocklist_walk_t* request, u32* block_nr,
              * Allocate a new block,
              * fill it with zeroes and write it to *block_nr
              */
-            *block_nr = allocate_block(request->ext2_meta,
-                    request->block_group_nr, errno);
+            *block_nr = allocate_file_blocks(request, 0, 1, &allocated, errno);
             if (0 == *block_nr) {
-                kfree(indirect_block);
+                kmem_cache_free(&indirect_block_cache, indirect_block);
                 return 0;
             }
             request->ext2_inode->i_blocks += (BLOCK_SIZE / 512);
@@ -1428,7 +1874,7 @@ static u32* load_indirect_block(blocklist_walk_t* request, u32* block_nr,
                     request->device, 0)) {
                 ERROR("Could not write newly allocated indirect block to disk\n");
                 *errno = EIO;
-                kfree(indirect_block);
+                kmem_cache_free(&indirect_block_cache, indirect_block);
                 return 0;
             }
             *dirty = 1;
@@ -1447,37 +1893,69 @@ static u32* load_indirect_block(blocklist_walk_t* request, u32* block_nr,
                 request->device, 0)) {
             ERROR("Could not read indirect block from disk\n");
             *errno = EIO;
-            kfree(indirect_block);
+            kmem_cache_free(&indirect_block_cache, indirect_block);
             return 0;
         }
     }
     return indirect_block;
 }
 
+/*
+ * Return the number of bytes to be processed by a callback, i.e. the number of
+ * bytes from the first byte in the first block of the current run up to the last
+ * byte in the last block of the current run
+ * Parameters:
+ * @request - the request describing the block walk
+ * Return value:
+ * number of bytes to be processed
+ */
+static u32 run_bytes(blocklist_walk_t* request) {
+    return (request->run - 1) * BLOCK_SIZE + request->last_byte - request->first_byte + 1;
+}
+
 /*
  * Callback function to read from a block. This function is called once
- * for every data block by walk_blocklist. It is responsible for performing
- * the appropriate action on the block and updating the fields bytes_processed
- * and blocks_processed of the request structure.
+ * for every run of consecutive data blocks by walk_blocklist. It is responsible
+ * for performing the appropriate action on the blocks and updating the fields
+ * bytes_processed and blocks_processed of the request structure.
  * When it is invoked, bytes_processed and blocks_processed contain the number
  * of blocks and bytes already processed during the walk up to this point
  * Parameters:
  * @request - the request describing the block walk
- * @block_nr - the logical block number on the device of the block to be processed
+ * @block_nr - the logical block number on the device of the first block to be processed
  * Return value:
  * 0 upon success
  * EIO in case an error occurs
  */
 static int read_block(blocklist_walk_t* request, u32 block_nr) {
+    u32 bytes = run_bytes(request);
     if (block_nr) {
-        if (bc_read_bytes(block_nr, request->last_byte - request->first_byte + 1, request->data
+        if (bc_read_bytes(block_nr, bytes, request->data
                 + request->bytes_processed, request->device, request->first_byte)) {
             ERROR("Error while reading from device\n");
             return EIO;
         }
     }
     else {
-        memset(request->data + request->bytes_processed, 0,request->last_byte - request->first_byte + 1 );
+        memset(request->data + request->bytes_processed, 0, bytes);
+    }
+    request->bytes_processed += bytes;
+    request->blocks_processed += request->run;
+    return 0;
+}
+
+/*
+ * Callback function for read-ahead. This function is called once for every
+ * data block by walk_blocklist and asks the block cache to prefetch the block
+ * Parameters:
+ * @request - the request describing the block walk
+ * @block_nr - the logical block number on the device of the block to be processed
+ * Return value:
+ * 0
+ */
+static int readahead_block(blocklist_walk_t* request, u32 block_nr) {
+    if (block_nr) {
+        bc_prefetch(request->device, block_nr);
     }
     request->bytes_processed += request->last_byte - request->first_byte + 1;
     request->blocks_processed++;
@@ -1486,30 +1964,31 @@ static int read_block(blocklist_walk_t* request, u32 block_nr) {
 
 /*
  * Callback function to write to a block. This function is called once
- * for every data block by walk_blocklist. It is responsible for performing
- * the appropriate action on the block and updating the fields bytes_processed
- * and blocks_processed of the request structure.
+ * for every run of consecutive data blocks by walk_blocklist. It is responsible
+ * for performing the appropriate action on the blocks and updating the fields
+ * bytes_processed and blocks_processed of the request structure.
  * When it is invoked, bytes_processed and blocks_processed contain the number
  * of blocks and bytes already processed during the walk up to this point
  * Parameters:
  * @request - the request describing the block walk
- * @block_nr - the logical block number on the device of the block to be processed
+ * @block_nr - the logical block number on the device of the first block to be processed
  * Return value:
  * 0 upon success
  * EIO if an error occurred
  */
 static int write_block(blocklist_walk_t* request, u32 block_nr) {
+    u32 bytes = run_bytes(request);
     if (0 == block_nr) {
         ERROR("Block number 0 not valid for writing\n");
         return EIO;
     }
-    if (bc_write_bytes(block_nr, request->last_byte - request->first_byte + 1, request->data
+    if (bc_write_bytes(block_nr, bytes, request->data
             + request->bytes_processed, request->device, request->first_byte)) {
         ERROR("Error while writing to device\n");
         return EIO;
     }
-    request->bytes_processed += request->last_byte - request->first_byte + 1;
-    request->blocks_processed++;
+    request->bytes_processed += bytes;
+    request->blocks_processed += request->run;
     return 0;
 }
 
@@ -1540,10 +2019,76 @@ static int truncate_block(blocklist_walk_t* request, u32 block_nr) {
     return 0;
 }
 
+/*
+ * Allocate a block for an entry in a blocklist if the entry is zero, i.e. if
+ * we hit upon a hole, and the flag allocate in the request structure is set.
+ * If the following entries of the blocklist are holes as well, blocks for up to
+ * EXT2_MAX_ALLOC_RUN entries are allocated at once, using a run of consecutive
+ * blocks on the device if possible. The blocks are taken from the preallocation
+ * window of the inode or - if the window does not fit - searched for right
+ * behind the block referenced by the preceding entry
+ * Parameters:
+ * @request - a pointer to the block walk structure
+ * @blocklist - the blocklist
+ * @index - the index of the entry in the blocklist
+ * @blocks - the number of entries in the blocklist
+ * @dirty - this flag will be set if the blocklist has been modified
+ * Return value:
+ * EIO if the allocation failed
+ * 0 if the operation is successful or the device is full - in the latter case,
+ * the abort flag in the request is set
+ */
+static int allocate_entry(blocklist_walk_t* request, u32* blocklist, u32 index, u32 blocks, int* dirty) {
+    int errno = 0;
+    u32 count = 1;
+    u32 goal = 0;
+    u32 allocated = 0;
+    u32 block_nr;
+    u32 i;
+    if ((1 != request->allocate) || (blocklist[index]))
+        return 0;
+    /*
+     * If the entry in the blocklist is zero, this implies that we hit upon a hole,
+     * i.e. an unallocated area. In this case we need to allocate a new block and
+     * add it to the blocklist if the flag allocate in the request structure is set.
+     * As all entries of the blocklist are within the range which we process, we can
+     * fill all holes following this entry as well
+     */
+    while ((index + count < blocks) && (0 == blocklist[index + count]) && (count < EXT2_MAX_ALLOC_RUN))
+        count++;
+    if (index > 0)
+        goal = blocklist[index - 1] ? blocklist[index - 1] + 1 : 0;
+    block_nr = allocate_file_blocks(request, goal, count, &allocated, &errno);
+    if (0 == block_nr) {
+        /*
+         * If an error occured, return EIO. Otherwise simply return
+         * zero and set the the abort flag in the request so that the
+         * operation aborts silently
+         */
+        if (errno) {
+            ERROR("Could not allocate additional block for file\n");
+            return EIO;
+        }
+        EXT2_DEBUG("Device full\n");
+        request->abort = 1;
+        return 0;
+    }
+    EXT2_DEBUG("Allocated %d blocks starting at block %d\n", allocated, block_nr);
+    for (i = 0; i < allocated; i++)
+        blocklist[index + i] = block_nr + i;
+    /*
+     * Recall that i_blocks is measured in units of 512 bytes!!
+     */
+    (request->ext2_inode->i_blocks) += allocated * (BLOCK_SIZE / 512);
+    *dirty = 1;
+    return 0;
+}
+
 /*
  * This utility function will process a part of a file
  * determined by a blocklist, i.e. an array of dwords
- * containing block addresses. For each data block, it
+ * containing block addresses. For each data block - or for each run of
+ * consecutive data blocks if request->coalesce is set - it
  * will invoke the callback function request->process_block
  * Parameters:
  * @request - a pointer to the block walk structure
@@ -1557,55 +2102,45 @@ static int truncate_block(blocklist_walk_t* request, u32 block_nr) {
  */
 static int walk_blocklist(blocklist_walk_t* request, u32* blocklist,
         u32 blocks, int* dirty) {
-    u32 i;
-    int errno = 0;
+    u32 i = 0;
+    u32 j;
+    u32 run;
     /*
      * Walk through blocklist
      */
-    for (i = 0; i < blocks; i++) {
+    while (i < blocks) {
         /*
          * Allocate block if needed
          */
-        if ((1 == request->allocate) && (0 == blocklist[i])) {
-            /*
-             * If the entry in the blocklist is zero, this implies that we hit upon a hole,
-             * i.e. an unallocated area. In this case we need to allocate a new block and
-             * add it to the blocklist if the flag allocate in the request structure is set
-             */
-            blocklist[i] = allocate_block(request->ext2_meta,
-                    request->block_group_nr, &errno);
-            if (0 == blocklist[i]) {
-                /*
-                 * If an error occured, return EIO. Otherwise simply return
-                 * zero and set the the abort flag in the request so that the
-                 * operation aborts silently
-                 */
-                if (errno) {
-                    ERROR("Could not allocate additional block for file\n");
+        if (allocate_entry(request, blocklist, i, blocks, dirty))
+            return EIO;
+        if (request->abort)
+            return 0;
+        /*
+         * Determine the length of the run of physically consecutive blocks
+         * starting at this block, allocating blocks on the way if needed. Holes
+         * are never part of a run
+         */
+        run = 1;
+        if (request->coalesce && blocklist[i]) {
+            while (i + run < blocks) {
+                if (allocate_entry(request, blocklist, i + run, blocks, dirty))
                     return EIO;
-                }
-                else {
-                    EXT2_DEBUG("Device full\n");
-                    request->abort = 1;
-                    return 0;
-                }
+                if ((request->abort) || (blocklist[i + run] != blocklist[i] + run))
+                    break;
+                run++;
             }
-            EXT2_DEBUG("Allocated block %d\n", blocklist[i]);
-            /*
-             * Recall that i_blocks is measured in units of 512 bytes!!
-             */
-            (request->ext2_inode->i_blocks) += BLOCK_SIZE / 512;
-            *dirty = 1;
         }
+        request->run = run;
         /*
-         * Determine first and last byte within this block which we
+         * Determine first and last byte within this run which we
          * will read. For the first block, the first byte is the offset, for all other blocks the
          * first byte is zero. For the last block, the last byte is the last byte (offset+bytes-1)
          * to be read/written modulo the block size, for all others it is the last byte within the block
          */
         request->first_byte = (request->blocks_processed == 0) ? (request->offset
                 % BLOCK_SIZE) : 0;
-        request->last_byte = (request->blocks_processed == (request->last_block
+        request->last_byte = (request->blocks_processed + run - 1 == (request->last_block
                 - request->first_block)) ? ((request->bytes + request->offset - 1)
                         % BLOCK_SIZE) : (BLOCK_SIZE - 1);
         if (request->process_block(request, blocklist[i])) {
@@ -1613,13 +2148,20 @@ static int walk_blocklist(blocklist_walk_t* request, u32* blocklist,
             return EIO;
         }
         /*
-         * If the flag request->zero is set, set the blocklist entry in the inode to zero. We also mark
+         * If the flag request->zero is set, set the blocklist entries in the inode to zero. We also mark
          * the blocklist as dirty so it will be written back to disk
          */
         if (1 == request->zero) {
-            blocklist[i] = 0;
+            for (j = i; j < i + run; j++)
+                blocklist[j] = 0;
             *dirty = 1;
         }
+        i += run;
+        /*
+         * If the device filled up while we were collecting the run, stop here
+         */
+        if (request->abort)
+            return 0;
     }
     return 0;
 }
@@ -1697,7 +2239,7 @@ static int walk_indirect_block(blocklist_walk_t* request, u32 indirect_start,
             + (actual_start - indirect_start), actual_end - actual_start + 1,
             &blocklist_dirty)) {
         ERROR("Could not walk blocklist\n");
-        kfree((void*) indirect_block);
+        kmem_cache_free(&indirect_block_cache, indirect_block);
         return EIO;
     }
     /*
@@ -1707,7 +2249,7 @@ static int walk_indirect_block(blocklist_walk_t* request, u32 indirect_start,
         if (bc_write_bytes(*block_nr, BLOCK_SIZE, (void*) indirect_block,
                 request->device, 0)) {
             ERROR("Could not write changed indirect block to disk\n");
-            kfree((void*) indirect_block);
+            kmem_cache_free(&indirect_block_cache, indirect_block);
             return EIO;
         }
     }
@@ -1722,7 +2264,7 @@ static int walk_indirect_block(blocklist_walk_t* request, u32 indirect_start,
      * in the first few entries that we have not seen
      */
     indirect_block_empty = blocklist_is_empty(indirect_block, actual_start - indirect_start);
-    kfree((void*) indirect_block);
+    kmem_cache_free(&indirect_block_cache, indirect_block);
 
     /*
      * If requested deallocate indirect block
@@ -1814,7 +2356,7 @@ static int walk_double_indirect_block(blocklist_walk_t* request,
         if (walk_indirect_block(request, indirect_start, double_indirect_block
                 + block_ptr, &blocklist_dirty)) {
             ERROR("Reading indirect block failed\n");
-            kfree((void*)double_indirect_block);
+            kmem_cache_free(&indirect_block_cache, double_indirect_block);
             return EIO;
         }
         if (request->abort)
@@ -1829,12 +2371,12 @@ static int walk_double_indirect_block(blocklist_walk_t* request,
         if (bc_write_bytes(*block_nr, BLOCK_SIZE,
                 (void*) double_indirect_block, request->device, 0)) {
             ERROR("I/O error while writing changed block to device\n");
-            kfree((void*)double_indirect_block);
+            kmem_cache_free(&indirect_block_cache, double_indirect_block);
             return EIO;
         }
     }
     int double_indirect_block_empty = blocklist_is_empty(double_indirect_block, block_ptr);
-    kfree(double_indirect_block);
+    kmem_cache_free(&indirect_block_cache, double_indirect_block);
     /*
      * If requested deallocate double indirect block but only
      * if no blocks are used in front of the area that we have walked
@@ -1903,7 +2445,7 @@ static int walk_triple_indirect_block(blocklist_walk_t* request,
                 + block_ptr * EXT2_DOUBLE_INDIRECT_BLOCKS,
                 triple_indirect_block + block_ptr, &blocklist_dirty)) {
             ERROR("Could not read double indirect block from disk\n");
-            kfree((void*)triple_indirect_block);
+            kmem_cache_free(&indirect_block_cache, triple_indirect_block);
             return EIO;
         }
         if (request->abort)
@@ -1918,12 +2460,12 @@ static int walk_triple_indirect_block(blocklist_walk_t* request,
         if (bc_write_bytes(*block_nr, BLOCK_SIZE,
                 (void*) triple_indirect_block, request->device, 0)) {
             ERROR("Could not read triple indirect block from disk\n");
-            kfree((void*)triple_indirect_block);
+            kmem_cache_free(&indirect_block_cache, triple_indirect_block);
             return EIO;
         }
     }
     int triple_indirect_block_empty = blocklist_is_empty(triple_indirect_block, block_ptr);
-    kfree((void*)triple_indirect_block);
+    kmem_cache_free(&indirect_block_cache, triple_indirect_block);
     /*
      * If requested deallocate triple indirect block
      */
@@ -1946,7 +2488,7 @@ static int walk_triple_indirect_block(blocklist_walk_t* request,
  * Utility function to initialize a blocklist walk
  * Parameters:
  * @request - the request structure to be initialized
- * @ext2_inode - the ext2 inode from which we read
+ * @ext2_inode_data - the inode data of the inode from which we read
  * @bytes - the number of bytes to read
  * @offset - the offset at which we start reading
  * @data - the buffer to which we write
@@ -1955,11 +2497,12 @@ static int walk_triple_indirect_block(blocklist_walk_t* request,
  * @ext2_meta - ext2 metadata structure to use
  * @block_group_nr - number of block group in which the inode is located
  */
-static void init_request(blocklist_walk_t* request, ext2_inode_t* ext2_inode,
+static void init_request(blocklist_walk_t* request, ext2_inode_data_t* ext2_inode_data,
         ssize_t bytes, off_t offset, void* data, dev_t device, int op,
         ext2_metadata_t* ext2_meta, u32 block_group_nr) {
+    ext2_inode_t* ext2_inode = ext2_inode_data->ext2_inode;
     request->bytes = bytes;
-    if ((request->bytes + offset > ext2_inode->i_size) && (EXT2_OP_READ == op))
+    if ((request->bytes + offset > ext2_inode->i_size) && ((EXT2_OP_READ == op) || (EXT2_OP_READAHEAD == op)))
         request->bytes = ext2_inode->i_size - offset;
     request->offset = offset;
     request->data = data;
@@ -1969,20 +2512,30 @@ static void init_request(blocklist_walk_t* request, ext2_inode_t* ext2_inode,
         request->allocate = 0;
         request->deallocate = 0;
         request->zero = 0;
+        request->coalesce = 1;
         request->process_block = read_block;
     }
     else  if (EXT2_OP_WRITE == op) {
         request->allocate = 1;
         request->deallocate = 0;
         request->zero = 0;
+        request->coalesce = 1;
         request->process_block = write_block;
     }
     else if (EXT2_OP_TRUNC == op) {
         request->allocate = 0;
         request->deallocate = 1;
         request->zero = 1;
+        request->coalesce = 0;
         request->process_block = truncate_block;
     }
+    else if (EXT2_OP_READAHEAD == op) {
+        request->allocate = 0;
+        request->deallocate = 0;
+        request->zero = 0;
+        request->coalesce = 0;
+        request->process_block = readahead_block;
+    }
     else
         PANIC("Invalid operation number\n");
     /*
@@ -2008,6 +2561,7 @@ static void init_request(blocklist_walk_t* request, ext2_inode_t* ext2_inode,
      */
     request->block_group_nr = block_group_nr;
     request->ext2_inode = ext2_inode;
+    request->ext2_inode_data = ext2_inode_data;
 }
 
 /****************************************************************************************
@@ -2020,7 +2574,8 @@ static void init_request(blocklist_walk_t* request, ext2_inode_t* ext2_inode,
  * @inode - the inode from which we read
  * @bytes - the number of bytes to read
  * @offset - the offset in bytes at which we start reading
- * @op - EXT2_OP_READ to read, EXT2_OP_WRITE to write, EXT2_OP_TRUNC to deallocate all blocks used by the file
+ * @op - EXT2_OP_READ to read, EXT2_OP_WRITE to write, EXT2_OP_TRUNC to deallocate all blocks used by the file,
+ * EXT2_OP_READAHEAD to ask the block cache to prefetch the blocks
  * Return value:
  * number of bytes read if the operation was successful
  * -EIO if the operation failed
@@ -2047,7 +2602,7 @@ static ssize_t fs_ext2_inode_rw(struct _inode_t* inode, ssize_t bytes,
     /*
      * Validate parameters
      */
-    if ((bytes <= 0) || ((offset >= ext2_inode->i_size) && (EXT2_OP_READ == op))) {
+    if ((bytes <= 0) || ((offset >= ext2_inode->i_size) && ((EXT2_OP_READ == op) || (EXT2_OP_READAHEAD == op)))) {
         return 0;
     }
     /*
@@ -2057,7 +2612,7 @@ static ssize_t fs_ext2_inode_rw(struct _inode_t* inode, ssize_t bytes,
     /*
      * Set up request structure
      */
-    init_request(&request, ext2_inode, bytes, offset, data, inode->dev, op,
+    init_request(&request, (ext2_inode_data_t*) inode->data, bytes, offset, data, inode->dev, op,
             ext2_meta, block_group_nr);
     /*
      * Is a part of the requested area within the part of the file
@@ -2183,6 +2738,23 @@ ssize_t fs_ext2_inode_read(struct _inode_t* inode, ssize_t bytes, off_t offset,
     return fs_ext2_inode_rw(inode, bytes, offset, data, EXT2_OP_READ);
 }
 
+/*
+ * Start an asynchronous read-ahead for a range of an inode, i.e. ask the block
+ * cache to prefetch all data blocks within this range. Indirect blocks are read
+ * synchronously
+ * Parameters:
+ * @inode - the inode
+ * @bytes - the number of bytes to read ahead
+ * @offset - the offset in bytes at which the read-ahead starts
+ * Return value:
+ * 0 upon success
+ * -EIO if an indirect block could not be read
+ */
+int fs_ext2_inode_readahead(struct _inode_t* inode, ssize_t bytes, off_t offset) {
+    ssize_t rc = fs_ext2_inode_rw(inode, bytes, offset, 0, EXT2_OP_READAHEAD);
+    return (rc < 0) ? rc : 0;
+}
+
 /*
  * Write to an inode.
  * Parameters:
@@ -2309,126 +2881,1221 @@ static void wipe_inode(inode_t* inode) {
 
 
 /****************************************************************************************
- * The following functions handle directory operations                                  *
+ * The following functions implement hashed directory indices (htree). The layout of an *
+ * index is described at the definition of dx_frame_t                                   *
  ****************************************************************************************/
 
 /*
- * Get a directory entry from an inode
+ * Mask to extract the block number from the block field of an index entry
+ */
+#define DX_BLOCK_MASK 0x00ffffff
+
+/*
+ * Size of a directory entry with a name of length n, aligned to a dword boundary
+ */
+#define DX_REC_LEN(n) ((sizeof(ext2_direntry_t) + (n) + 3) & ~0x3)
+
+/*
+ * Basic functions and constants of the half MD4 hash
+ */
+#define DX_ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define DX_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define DX_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define DX_H(x, y, z) ((x) ^ (y) ^ (z))
+#define DX_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = DX_ROL(a, s))
+#define DX_K2 013240474631U
+#define DX_K3 015666365641U
+
+/*
+ * Transformation used by the half MD4 hash
  * Parameter:
- * @inode - the inode from which we read the entry
- * @index - the index of the entry within the directory, starting with zero
+ * @buf - the hash state
+ * @in - eight dwords of input
+ */
+static void dx_half_md4(u32* buf, u32* in) {
+    u32 a = buf[0];
+    u32 b = buf[1];
+    u32 c = buf[2];
+    u32 d = buf[3];
+    /*
+     * Round 1
+     */
+    DX_ROUND(DX_F, a, b, c, d, in[0], 3);
+    DX_ROUND(DX_F, d, a, b, c, in[1], 7);
+    DX_ROUND(DX_F, c, d, a, b, in[2], 11);
+    DX_ROUND(DX_F, b, c, d, a, in[3], 19);
+    DX_ROUND(DX_F, a, b, c, d, in[4], 3);
+    DX_ROUND(DX_F, d, a, b, c, in[5], 7);
+    DX_ROUND(DX_F, c, d, a, b, in[6], 11);
+    DX_ROUND(DX_F, b, c, d, a, in[7], 19);
+    /*
+     * Round 2
+     */
+    DX_ROUND(DX_G, a, b, c, d, in[1] + DX_K2, 3);
+    DX_ROUND(DX_G, d, a, b, c, in[3] + DX_K2, 5);
+    DX_ROUND(DX_G, c, d, a, b, in[5] + DX_K2, 9);
+    DX_ROUND(DX_G, b, c, d, a, in[7] + DX_K2, 13);
+    DX_ROUND(DX_G, a, b, c, d, in[0] + DX_K2, 3);
+    DX_ROUND(DX_G, d, a, b, c, in[2] + DX_K2, 5);
+    DX_ROUND(DX_G, c, d, a, b, in[4] + DX_K2, 9);
+    DX_ROUND(DX_G, b, c, d, a, in[6] + DX_K2, 13);
+    /*
+     * Round 3
+     */
+    DX_ROUND(DX_H, a, b, c, d, in[3] + DX_K3, 3);
+    DX_ROUND(DX_H, d, a, b, c, in[7] + DX_K3, 9);
+    DX_ROUND(DX_H, c, d, a, b, in[2] + DX_K3, 11);
+    DX_ROUND(DX_H, b, c, d, a, in[6] + DX_K3, 15);
+    DX_ROUND(DX_H, a, b, c, d, in[1] + DX_K3, 3);
+    DX_ROUND(DX_H, d, a, b, c, in[5] + DX_K3, 9);
+    DX_ROUND(DX_H, c, d, a, b, in[0] + DX_K3, 11);
+    DX_ROUND(DX_H, b, c, d, a, in[4] + DX_K3, 15);
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+/*
+ * Transformation used by the TEA hash
+ * Parameter:
+ * @buf - the hash state
+ * @in - four dwords of input
+ */
+static void dx_tea(u32* buf, u32* in) {
+    u32 sum = 0;
+    u32 b0 = buf[0];
+    u32 b1 = buf[1];
+    int n = 16;
+    do {
+        sum += 0x9e3779b9;
+        b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+        b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+    } while (--n);
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+/*
+ * Get a character of a name as a signed or unsigned value
+ */
+static int dx_char(char* name, int i, int is_unsigned) {
+    if (is_unsigned)
+        return (int) ((u8) name[i]);
+    return (int) ((signed char) name[i]);
+}
+
+/*
+ * The legacy hash function
+ * Parameter:
+ * @name - the name
+ * @length - length of the name
+ * @is_unsigned - treat characters as unsigned values
  * Return value:
- * 0 upon success
- * EIO if the directory inode could not be read
- * -1 if the directory entry could not be found
+ * the hash value
  */
-int fs_ext2_get_direntry(struct _inode_t* inode, off_t index,
-        direntry_t* direntry) {
-    ext2_direntry_t ext2_direntry;
-    u32 offset = 0;
-    u32 read = 0;
-    u32 name_len;
-    /*
-     * If size of inode is zero, the directory has been removed, but is still
-     * present on the disk as there are still pending references to it. Return -1
-     */
-    if (0 == inode->size) {
-        return -1;
-    }
-    EXT2_DEBUG("Starting walk of directory\n");
-    while (read <= index) {
-        if (fs_ext2_inode_read(inode, sizeof(ext2_direntry_t), offset,
-                (void*) &ext2_direntry) != sizeof(ext2_direntry)) {
-            ERROR("Could not read directory entry from inode (%d, %d)\n", inode->dev, inode->inode_nr);
-            return EIO;
+static u32 dx_legacy(char* name, int length, int is_unsigned) {
+    u32 hash;
+    u32 hash0 = 0x12a3fe2d;
+    u32 hash1 = 0x37abe8f9;
+    int i;
+    for (i = 0; i < length; i++) {
+        hash = hash1 + (hash0 ^ (dx_char(name, i, is_unsigned) * 7152373));
+        if (hash & 0x80000000)
+            hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+/*
+ * Convert a part of a name into the input of a hash transformation, padding it
+ * with a value derived from the length of the name
+ * Parameter:
+ * @name - the remaining part of the name
+ * @length - the number of remaining characters
+ * @buf - the input dwords
+ * @num - the number of input dwords
+ * @is_unsigned - treat characters as unsigned values
+ */
+static void dx_str2hashbuf(char* name, int length, u32* buf, int num, int is_unsigned) {
+    u32 pad;
+    u32 val;
+    int i;
+    pad = (u32) length | ((u32) length << 8);
+    pad |= pad << 16;
+    val = pad;
+    if (length > num * 4)
+        length = num * 4;
+    for (i = 0; i < length; i++) {
+        val = dx_char(name, i, is_unsigned) + (val << 8);
+        if (3 == (i % 4)) {
+            *buf++ = val;
+            val = pad;
+            num--;
         }
-        /*
-         * Ignore directory entries with inode number set to zero
-         */
-        if (ext2_direntry.inode) {
-            /*
-             * If this is the entry we are looking for, copy data from
-             * it to direntry structure
-             */
-            if (read == index) {
-                direntry->inode_nr = ext2_direntry.inode;
-                name_len = ext2_direntry.name_len;
-                if (name_len > FILE_NAME_MAX - 1)
-                    name_len = FILE_NAME_MAX - 1;
-                if (fs_ext2_inode_read(inode, name_len, offset
-                        + sizeof(ext2_direntry_t), direntry->name) != name_len) {
-                    ERROR("Could not read file name from directory inode\n");
-                    return EIO;
-                }
-                (direntry->name)[name_len] = 0;
-                EXT2_DEBUG("Found entry with inode nr %d\n", direntry->inode_nr);
-                return 0;
-            }
-            /*
-             * Verify that length is a multiple of 4
-             */
-            if (ext2_direntry.rec_len % sizeof(u32)) {
-                PANIC("Length of directory entry %d in inode %d is %d - not a multiple of 4\n", read,
-                        inode->inode_nr, ext2_direntry.rec_len);
-                return EIO;
+    }
+    if (--num >= 0)
+        *buf++ = val;
+    while (--num >= 0)
+        *buf++ = pad;
+}
+
+/*
+ * Compute the hash value of a name as used by directory indices. The lowest bit of
+ * the hash value is always cleared
+ * Parameter:
+ * @name - the name, not necessarily null terminated
+ * @length - the length of the name
+ * @version - the hash version (EXT2_HASH_*)
+ * @seed - the seed as stored in the superblock, if all dwords are zero, a default seed is used
+ * Return value:
+ * the hash value
+ */
+u32 fs_ext2_dx_hash(char* name, int length, int version, u32* seed) {
+    u32 buf[4];
+    u32 in[8];
+    u32 hash;
+    int is_unsigned = 0;
+    buf[0] = 0x67452301;
+    buf[1] = 0xefcdab89;
+    buf[2] = 0x98badcfe;
+    buf[3] = 0x10325476;
+    if (seed && (seed[0] || seed[1] || seed[2] || seed[3]))
+        memcpy((void*) buf, (void*) seed, 4 * sizeof(u32));
+    switch (version) {
+        case EXT2_HASH_LEGACY_UNSIGNED:
+            is_unsigned = 1;
+        case EXT2_HASH_LEGACY:
+            hash = dx_legacy(name, length, is_unsigned);
+            break;
+        case EXT2_HASH_HALF_MD4_UNSIGNED:
+            is_unsigned = 1;
+        case EXT2_HASH_HALF_MD4:
+            while (length > 0) {
+                dx_str2hashbuf(name, length, in, 8, is_unsigned);
+                dx_half_md4(buf, in);
+                length -= 32;
+                name += 32;
             }
-            read++;
-        }
-        else {
-            if (0 == ext2_direntry.rec_len) {
-                PANIC("Got invalid directory inode entry with length and inode zero- can this be true?\n");
+            hash = buf[1];
+            break;
+        case EXT2_HASH_TEA_UNSIGNED:
+            is_unsigned = 1;
+        case EXT2_HASH_TEA:
+            while (length > 0) {
+                dx_str2hashbuf(name, length, in, 4, is_unsigned);
+                dx_tea(buf, in);
+                length -= 16;
+                name += 16;
             }
-        }
-        /*
-         * Advance to next entry
-         */
-        offset += ext2_direntry.rec_len;
-        if (offset >= inode->size)
+            hash = buf[0];
             break;
+        default:
+            return 0;
     }
-    return -1;
+    hash &= ~0x1;
+    /*
+     * The largest value is reserved as end-of-directory marker by other implementations
+     */
+    if (0xfffffffe == hash)
+        hash = 0xfffffffc;
+    return hash;
 }
 
 /*
- * Perform some validations on a directory entry and a directory
+ * Check whether a directory is indexed and the index may be used
  * Parameter:
- * @ext2_direntry - the entry to be validated
- * @dir - the directory to be validated
+ * @dir - the directory
  * Return value:
- * 1 if a problem has been found
- * 0 if all validations are successful
+ * 1 if the directory is indexed
+ * 0 otherwise
  */
-static int validate_direntry(ext2_direntry_t* direntry, inode_t* dir) {
-    if (direntry->rec_len % 4) {
-        ERROR("Record length of entry for inode %d in directory inode %d is not a multiple of four!\n",
-                direntry->inode, dir->inode_nr);
-        return 1;
-    }
-    if (dir->size % BLOCK_SIZE) {
-        ERROR("Size of directory inode %d is not a multiple of the block size\n", dir->inode_nr);
-        return 1;
+static int dx_is_indexed(inode_t* dir) {
+    ext2_inode_data_t* ext2_inode_data = (ext2_inode_data_t*) dir->data;
+    if (0 == (ext2_inode_data->ext2_inode->i_flags & EXT2_INDEX_FL))
+        return 0;
+    if (0 == (ext2_inode_data->ext2_meta->ext2_super->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX))
+        return 0;
+    return 1;
+}
+
+/*
+ * Get the hash version of an index
+ * Parameter:
+ * @dir - the directory
+ * @root - the root block of the index
+ * Return value:
+ * the hash version, adjusted to the signedness used by the file system
+ */
+static int dx_version(inode_t* dir, u8* root) {
+    ext2_superblock_t* ext2_super = ((ext2_inode_data_t*) dir->data)->ext2_meta->ext2_super;
+    int version = ((ext2_dx_root_info_t*) (root + EXT2_DX_ROOT_INFO_OFFSET))->hash_version;
+    if ((version <= EXT2_HASH_TEA) && (ext2_super->s_flags & EXT2_FLAGS_UNSIGNED_HASH))
+        version += EXT2_HASH_LEGACY_UNSIGNED;
+    return version;
+}
+
+/*
+ * Hash a file name for a directory index. The seed is copied out of the packed superblock first, as
+ * we cannot pass a pointer to it
+ * Parameter:
+ * @dir - the directory
+ * @name - the name
+ * @length - the length of the name
+ * @version - the hash version as returned by dx_version
+ * Return value:
+ * the hash value
+ */
+static u32 dx_hash(inode_t* dir, char* name, int length, int version) {
+    u32 seed[4];
+    memcpy((void*) seed, (void*) ((ext2_inode_data_t*) dir->data)->ext2_meta->ext2_super->s_hash_seed, sizeof(seed));
+    return fs_ext2_dx_hash(name, length, version, seed);
+}
+
+/*
+ * Get the maximum number of entries in an index block
+ * Parameter:
+ * @level - the level of the block, 0 = root
+ */
+static int dx_limit(int level) {
+    if (0 == level)
+        return (BLOCK_SIZE - EXT2_DX_ROOT_INFO_OFFSET - sizeof(ext2_dx_root_info_t)) / sizeof(ext2_dx_entry_t);
+    return (BLOCK_SIZE - EXT2_DX_NODE_OFFSET) / sizeof(ext2_dx_entry_t);
+}
+
+/*
+ * Read a block of a directory
+ * Parameter:
+ * @dir - the directory
+ * @block - the logical block number within the directory
+ * @data - buffer of BLOCK_SIZE bytes
+ * Return value:
+ * 0 upon success
+ * EIO if the block could not be read
+ */
+static int dx_read_block(inode_t* dir, u32 block, u8* data) {
+    if (fs_ext2_inode_read(dir, BLOCK_SIZE, block * BLOCK_SIZE, (void*) data) != BLOCK_SIZE) {
+        ERROR("Could not read block %d of directory inode %d\n", block, dir->inode_nr);
+        return EIO;
     }
     return 0;
 }
 
 /*
- * This function will try to splice a new directory entry into an existing entry by making use
- * of free space between the end of the file name and the end of the entry.
+ * Write a block of a directory
  * Parameter:
- * @existing_entry - the existing entry
- * @new_entry - the new entry
- * @dir - the inode representing the directory
- * @offset - the offset in bytes of the existing entry within the directory inode
- * @name - the name of the inode described by the new entry
+ * @dir - the directory
+ * @block - the logical block number within the directory
+ * @data - buffer of BLOCK_SIZE bytes
  * Return value:
- * 0 if the operation could not be completed because the existing entry is too small
- * -1 if an error occurred
- * 1 if the operation could be completed
+ * 0 upon success
+ * EIO if the block could not be written
  */
-static int splice_direntry(ext2_direntry_t* existing_entry, ext2_direntry_t* new_entry, inode_t* dir, u32 offset, char* name) {
-    u32 first_free_byte;
-    void* buffer;
-    if (validate_direntry(existing_entry, dir)) {
+static int dx_write_block(inode_t* dir, u32 block, u8* data) {
+    if (fs_ext2_inode_write(dir, BLOCK_SIZE, block * BLOCK_SIZE, (void*) data) != BLOCK_SIZE) {
+        ERROR("Could not write block %d of directory inode %d\n", block, dir->inode_nr);
+        return EIO;
+    }
+    return 0;
+}
+
+/*
+ * Validate a directory entry within a directory block
+ * Parameter:
+ * @data - the directory block
+ * @offset - offset of the entry within the block
+ * Return value:
+ * 1 if the entry is valid
+ * 0 otherwise
+ */
+static int dx_valid_entry(u8* data, u32 offset) {
+    ext2_direntry_t* entry = (ext2_direntry_t*) (data + offset);
+    if ((entry->rec_len < sizeof(ext2_direntry_t)) || (entry->rec_len % 4)
+            || (offset + entry->rec_len > BLOCK_SIZE)
+            || (sizeof(ext2_direntry_t) + entry->name_len > entry->rec_len)) {
+        ERROR("Invalid directory entry at offset %d in directory block\n", offset);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Release the frames used during a walk through an index
+ * Parameter:
+ * @frames - the frames
+ * @levels - the number of frames in use
+ */
+static void dx_release(dx_frame_t* frames, int levels) {
+    int i;
+    for (i = 0; i < levels; i++) {
+        kfree((void*) frames[i].data);
+    }
+}
+
+/*
+ * Walk down the index of a directory to the leaf block which contains
+ * the entries for a given name
+ * Parameter:
+ * @dir - the directory
+ * @name - the name, not necessarily null terminated
+ * @length - the length of the name
+ * @hash - the hash value of the name will be stored here
+ * @frames - array of EXT2_DX_MAX_LEVELS frames which will be filled, the caller needs to release them using dx_release
+ * @levels - the number of frames which have been filled will be stored here
+ * Return value:
+ * 0 upon success
+ * EIO if a block could not be read
+ * ENOMEM if we are running out of memory
+ * EINVAL if the index is damaged or uses a feature which we do not support
+ */
+static int dx_probe(inode_t* dir, char* name, int length, u32* hash, dx_frame_t* frames, int* levels) {
+    ext2_dx_root_info_t* info;
+    ext2_dx_countlimit_t* countlimit;
+    ext2_dx_entry_t* low;
+    ext2_dx_entry_t* high;
+    ext2_dx_entry_t* mid;
+    u32 block = 0;
+    int depth = 1;
+    int level;
+    int rc;
+    *levels = 0;
+    for (level = 0; level < depth; level++) {
+        if (0 == (frames[level].data = (u8*) kmalloc(BLOCK_SIZE))) {
+            ERROR("Could not allocate memory for index block\n");
+            return ENOMEM;
+        }
+        *levels = level + 1;
+        frames[level].block = block;
+        if ((rc = dx_read_block(dir, block, frames[level].data)))
+            return rc;
+        if (0 == level) {
+            info = (ext2_dx_root_info_t*) (frames[0].data + EXT2_DX_ROOT_INFO_OFFSET);
+            if ((info->reserved_zero) || (info->hash_version > EXT2_HASH_TEA)
+                    || (info->info_length != sizeof(ext2_dx_root_info_t))
+                    || (info->indirect_levels >= EXT2_DX_MAX_LEVELS) || (info->unused_flags & 0x1)) {
+                ERROR("Unsupported or invalid index in directory inode %d\n", dir->inode_nr);
+                return EINVAL;
+            }
+            depth = info->indirect_levels + 1;
+            *hash = dx_hash(dir, name, length, dx_version(dir, frames[0].data));
+            frames[0].entries = (ext2_dx_entry_t*) (frames[0].data + EXT2_DX_ROOT_INFO_OFFSET + info->info_length);
+        }
+        else {
+            frames[level].entries = (ext2_dx_entry_t*) (frames[level].data + EXT2_DX_NODE_OFFSET);
+        }
+        countlimit = (ext2_dx_countlimit_t*) frames[level].entries;
+        if ((0 == countlimit->count) || (countlimit->count > countlimit->limit)
+                || (countlimit->limit != dx_limit(level))) {
+            ERROR("Invalid index block %d in directory inode %d\n", block, dir->inode_nr);
+            return EINVAL;
+        }
+        /*
+         * Locate the last entry whose hash is less than or equal to the hash we
+         * are looking for. The first entry does not have a hash and covers all hash
+         * values below the hash of the second entry
+         */
+        low = frames[level].entries + 1;
+        high = frames[level].entries + countlimit->count - 1;
+        while (low <= high) {
+            mid = low + (high - low) / 2;
+            if (mid->hash > *hash)
+                high = mid - 1;
+            else
+                low = mid + 1;
+        }
+        frames[level].at = low - 1;
+        block = frames[level].at->block & DX_BLOCK_MASK;
+        if (block >= dir->size / BLOCK_SIZE) {
+            ERROR("Index entry refers to block %d beyond end of directory inode %d\n", block, dir->inode_nr);
+            return EINVAL;
+        }
+    }
+    return 0;
+}
+
+/*
+ * After a leaf block has been searched without success, determine whether the next
+ * leaf block might contain further entries with the same hash value and
+ * advance the frames to this leaf if that is the case
+ * Parameter:
+ * @dir - the directory
+ * @frames - the frames as filled by dx_probe
+ * @levels - the number of frames
+ * @hash - the hash value
+ * @block - the next leaf block will be stored here
+ * Return value:
+ * 0 if there is a leaf block to be searched
+ * -1 if there is no further leaf block to be searched
+ * EIO if an index block could not be read
+ */
+static int dx_next_leaf(inode_t* dir, dx_frame_t* frames, int levels, u32 hash, u32* block) {
+    int level = levels - 1;
+    int rc;
+    /*
+     * Move to the next entry, going up as long as we are at the end of an index block
+     */
+    while (1) {
+        frames[level].at++;
+        if (frames[level].at < frames[level].entries + ((ext2_dx_countlimit_t*) frames[level].entries)->count)
+            break;
+        if (0 == level)
+            return -1;
+        level--;
+    }
+    if ((frames[level].at->hash & ~0x1) != hash)
+        return -1;
+    /*
+     * Walk down again to the leaf level
+     */
+    while (level < levels - 1) {
+        *block = frames[level].at->block & DX_BLOCK_MASK;
+        level++;
+        if ((rc = dx_read_block(dir, *block, frames[level].data)))
+            return rc;
+        frames[level].block = *block;
+        frames[level].entries = (ext2_dx_entry_t*) (frames[level].data + EXT2_DX_NODE_OFFSET);
+        frames[level].at = frames[level].entries;
+    }
+    *block = frames[level].at->block & DX_BLOCK_MASK;
+    return 0;
+}
+
+/*
+ * Search a directory block for an entry with a given name
+ * Parameter:
+ * @data - the directory block
+ * @name - the name, not necessarily null terminated
+ * @length - the length of the name
+ * @offset - the offset of the entry within the block will be stored here
+ * @preceding - the offset of the preceding entry within the block will be stored here
+ * Return value:
+ * 0 if the entry has been found
+ * -1 if the entry is not contained in the block
+ * EIO if the block is damaged
+ */
+static int search_block(u8* data, char* name, int length, u32* offset, u32* preceding) {
+    ext2_direntry_t* entry;
+    u32 pos = 0;
+    u32 prev = 0;
+    while (pos < BLOCK_SIZE) {
+        if (0 == dx_valid_entry(data, pos))
+            return EIO;
+        entry = (ext2_direntry_t*) (data + pos);
+        if ((entry->inode) && (entry->name_len == length)
+                && (0 == strncmp((char*) (data + pos + sizeof(ext2_direntry_t)), name, length))) {
+            *offset = pos;
+            *preceding = prev;
+            return 0;
+        }
+        prev = pos;
+        pos += entry->rec_len;
+    }
+    return -1;
+}
+
+/*
+ * Locate the directory block which contains the entry for a name. If the directory is
+ * indexed, only the leaf blocks for the hash value of the name are searched, otherwise all
+ * blocks of the directory are searched
+ * Parameter:
+ * @dir - the directory
+ * @name - the name, not necessarily null terminated
+ * @length - the length of the name
+ * @data - buffer of BLOCK_SIZE bytes which will receive the block containing the entry
+ * @block - the logical block number of this block within the directory will be stored here
+ * @offset - the offset of the entry within the block will be stored here
+ * @preceding - the offset of the preceding entry within the block will be stored here
+ * Return value:
+ * 0 if the entry has been found
+ * -1 if there is no entry with this name
+ * EIO if the directory could not be read
+ * ENOMEM if we are running out of memory
+ */
+static int find_direntry(inode_t* dir, char* name, int length, u8* data, u32* block, u32* offset, u32* preceding) {
+    dx_frame_t frames[EXT2_DX_MAX_LEVELS];
+    int levels;
+    u32 hash;
+    int rc;
+    if (0 == dir->size)
+        return -1;
+    if (dx_is_indexed(dir)) {
+        rc = dx_probe(dir, name, length, &hash, frames, &levels);
+        if (0 == rc) {
+            *block = frames[levels - 1].at->block & DX_BLOCK_MASK;
+            while (1) {
+                if ((rc = dx_read_block(dir, *block, data)))
+                    break;
+                if (-1 != (rc = search_block(data, name, length, offset, preceding)))
+                    break;
+                if ((rc = dx_next_leaf(dir, frames, levels, hash, block)))
+                    break;
+            }
+        }
+        dx_release(frames, levels);
+        /*
+         * If the index cannot be used, fall back to a linear search
+         */
+        if (EINVAL != rc)
+            return rc;
+    }
+    for (*block = 0; *block < dir->size / BLOCK_SIZE; (*block)++) {
+        if ((rc = dx_read_block(dir, *block, data)))
+            return rc;
+        if (-1 != (rc = search_block(data, name, length, offset, preceding)))
+            return rc;
+    }
+    return -1;
+}
+
+/*
+ * Try to add a directory entry to a directory block and write the block back to
+ * disk if that was successful. Space is taken from an unused entry or from the free
+ * space at the end of an existing entry
+ * Parameter:
+ * @dir - the directory
+ * @data - the content of the block
+ * @block - the logical block number of the block within the directory
+ * @inode_nr - the inode number of the new entry
+ * @name - the name of the new entry
+ * Return value:
+ * 0 upon success
+ * -1 if there is not enough free space in the block
+ * EIO if the block is damaged or could not be written
+ */
+static int add_to_block(inode_t* dir, u8* data, u32 block, u32 inode_nr, char* name) {
+    ext2_direntry_t* entry;
+    ext2_direntry_t* new_entry;
+    u32 pos = 0;
+    u32 used;
+    u32 length = strlen(name);
+    u32 needed = DX_REC_LEN(length);
+    while (pos < BLOCK_SIZE) {
+        if (0 == dx_valid_entry(data, pos))
+            return EIO;
+        entry = (ext2_direntry_t*) (data + pos);
+        used = (entry->inode) ? DX_REC_LEN(entry->name_len) : 0;
+        if (entry->rec_len >= used + needed) {
+            new_entry = entry;
+            if (used) {
+                new_entry = (ext2_direntry_t*) (data + pos + used);
+                new_entry->rec_len = entry->rec_len - used;
+                entry->rec_len = used;
+            }
+            new_entry->inode = inode_nr;
+            new_entry->name_len = length;
+            new_entry->file_type = 0;
+            memcpy(((u8*) new_entry) + sizeof(ext2_direntry_t), (void*) name, length);
+            return dx_write_block(dir, block, data);
+        }
+        pos += entry->rec_len;
+    }
+    return -1;
+}
+
+/*
+ * Add an entry to an index block which has at least one free slot. The
+ * new entry is inserted behind the entry the frame points to
+ * Parameter:
+ * @frame - the frame describing the index block
+ * @hash - the hash value of the new entry
+ * @block - the block of the new entry
+ */
+static void dx_insert(dx_frame_t* frame, u32 hash, u32 block) {
+    ext2_dx_countlimit_t* countlimit = (ext2_dx_countlimit_t*) frame->entries;
+    ext2_dx_entry_t* new_entry = frame->at + 1;
+    memmove((void*) (new_entry + 1), (void*) new_entry,
+            (frame->entries + countlimit->count - new_entry) * sizeof(ext2_dx_entry_t));
+    new_entry->hash = hash;
+    new_entry->block = block;
+    countlimit->count++;
+}
+
+/*
+ * Set up an empty interior index block
+ * Parameter:
+ * @data - buffer of BLOCK_SIZE bytes
+ */
+static void dx_init_node(u8* data) {
+    ext2_direntry_t* fake = (ext2_direntry_t*) data;
+    memset((void*) data, 0, BLOCK_SIZE);
+    fake->rec_len = BLOCK_SIZE;
+}
+
+/*
+ * Make sure that the lowest index block on the path to a leaf has room for one
+ * more entry. If this block is full and is the root, a new level is added to the
+ * index. If it is an interior block, it is split into two blocks
+ * Parameter:
+ * @dir - the directory
+ * @frames - the frames filled by dx_probe
+ * @levels - the number of frames, will be updated
+ * Return value:
+ * 0 upon success
+ * ENOSPC if the index is full
+ * ENOMEM if we are running out of memory
+ * EIO if an I/O error occurred
+ */
+static int dx_make_room(inode_t* dir, dx_frame_t* frames, int* levels) {
+    dx_frame_t* frame = frames + *levels - 1;
+    ext2_dx_countlimit_t* countlimit = (ext2_dx_countlimit_t*) frame->entries;
+    ext2_dx_countlimit_t* parent;
+    ext2_dx_entry_t* new_entries;
+    u8* new_data;
+    ext2_dx_root_info_t* info;
+    u32 new_block;
+    u32 count1;
+    u32 count2;
+    u32 hash;
+    int rc;
+    if (countlimit->count < countlimit->limit)
+        return 0;
+    if (*levels == EXT2_DX_MAX_LEVELS) {
+        /*
+         * Split interior block - this requires a free slot in the parent
+         */
+        parent = (ext2_dx_countlimit_t*) (frame - 1)->entries;
+        if (parent->count == parent->limit) {
+            ERROR("Index of directory inode %d is full\n", dir->inode_nr);
+            return ENOSPC;
+        }
+        if (0 == (new_data = (u8*) kmalloc(BLOCK_SIZE)))
+            return ENOMEM;
+        count1 = countlimit->count / 2;
+        count2 = countlimit->count - count1;
+        hash = frame->entries[count1].hash;
+        dx_init_node(new_data);
+        new_entries = (ext2_dx_entry_t*) (new_data + EXT2_DX_NODE_OFFSET);
+        memcpy((void*) new_entries, (void*) (frame->entries + count1), count2 * sizeof(ext2_dx_entry_t));
+        ((ext2_dx_countlimit_t*) new_entries)->limit = dx_limit(*levels - 1);
+        ((ext2_dx_countlimit_t*) new_entries)->count = count2;
+        new_block = dir->size / BLOCK_SIZE;
+        if ((rc = dx_write_block(dir, new_block, new_data))) {
+            kfree((void*) new_data);
+            return rc;
+        }
+        countlimit->count = count1;
+        if ((rc = dx_write_block(dir, frame->block, frame->data))) {
+            kfree((void*) new_data);
+            return rc;
+        }
+        dx_insert(frame - 1, hash, new_block);
+        rc = dx_write_block(dir, (frame - 1)->block, (frame - 1)->data);
+        /*
+         * If the entry we have followed has been moved to the new block, continue with the new block
+         */
+        if (frame->at >= frame->entries + count1) {
+            frame->at = frame->entries + (frame->at - frame->entries - count1);
+            memcpy((void*) frame->data, (void*) new_data, BLOCK_SIZE);
+            frame->block = new_block;
+            (frame - 1)->at++;
+        }
+        kfree((void*) new_data);
+        return rc;
+    }
+    /*
+     * The root is full - move its entries into a new interior block
+     * and add one level to the index
+     */
+    info = (ext2_dx_root_info_t*) (frames[0].data + EXT2_DX_ROOT_INFO_OFFSET);
+    if (0 == (frames[1].data = (u8*) kmalloc(BLOCK_SIZE)))
+        return ENOMEM;
+    *levels = 2;
+    dx_init_node(frames[1].data);
+    frames[1].entries = (ext2_dx_entry_t*) (frames[1].data + EXT2_DX_NODE_OFFSET);
+    memcpy((void*) frames[1].entries, (void*) frames[0].entries, countlimit->count * sizeof(ext2_dx_entry_t));
+    ((ext2_dx_countlimit_t*) frames[1].entries)->limit = dx_limit(1);
+    frames[1].at = frames[1].entries + (frames[0].at - frames[0].entries);
+    frames[1].block = dir->size / BLOCK_SIZE;
+    if ((rc = dx_write_block(dir, frames[1].block, frames[1].data)))
+        return rc;
+    countlimit->count = 1;
+    frames[0].entries->block = frames[1].block;
+    frames[0].at = frames[0].entries;
+    info->indirect_levels++;
+    return dx_write_block(dir, 0, frames[0].data);
+}
+
+/*
+ * Fill a directory block with a subset of the entries of another block
+ * Parameter:
+ * @data - the block to be filled
+ * @source - the block from which the entries are taken
+ * @map - the entries sorted by hash value
+ * @first - the first entry in map to be copied
+ * @last - the entry in map following the last entry to be copied
+ */
+static void dx_fill_block(u8* data, u8* source, dx_map_t* map, int first, int last) {
+    ext2_direntry_t* entry = 0;
+    u32 pos = 0;
+    int i;
+    memset((void*) data, 0, BLOCK_SIZE);
+    for (i = first; i < last; i++) {
+        entry = (ext2_direntry_t*) (data + pos);
+        memcpy((void*) entry, (void*) (source + map[i].offset), map[i].size);
+        entry->rec_len = map[i].size;
+        pos += map[i].size;
+    }
+    /*
+     * Let last entry extend to the end of the block
+     */
+    if (entry)
+        entry->rec_len += BLOCK_SIZE - pos;
+    else
+        ((ext2_direntry_t*) data)->rec_len = BLOCK_SIZE;
+}
+
+/*
+ * Split a full leaf block of an indexed directory. The entries in the block are sorted
+ * by their hash value and the entries with the highest hash values, which make up
+ * about half of the used space, are moved to a new block which is appended to the directory. An
+ * index entry for the new block is added to the lowest index block which needs to have a free slot
+ * Parameter:
+ * @dir - the directory
+ * @frame - the frame describing the lowest index block
+ * @version - the hash version used by the index
+ * @data - the content of the leaf block, will be updated
+ * @block - the logical block number of the leaf block
+ * @new_data - buffer of BLOCK_SIZE bytes which will receive the content of the new block
+ * @split_hash - the lowest hash value in the new block will be stored here
+ * @new_block - the logical block number of the new block will be stored here
+ * Return value:
+ * 0 upon success
+ * ENOSPC if the block cannot be split
+ * ENOMEM if we are running out of memory
+ * EIO if an I/O error occurred
+ */
+static int split_leaf(inode_t* dir, dx_frame_t* frame, int version, u8* data, u32 block, u8* new_data,
+        u32* split_hash, u32* new_block) {
+    dx_map_t* map;
+    dx_map_t tmp;
+    ext2_direntry_t* entry;
+    u8* source;
+    u32 pos = 0;
+    u32 total = 0;
+    u32 size = 0;
+    int count = 0;
+    int split;
+    int i;
+    int j;
+    int rc;
+    if (0 == (map = (dx_map_t*) kmalloc(sizeof(dx_map_t) * (BLOCK_SIZE / DX_REC_LEN(1) + 1))))
+        return ENOMEM;
+    if (0 == (source = (u8*) kmalloc(BLOCK_SIZE))) {
+        kfree((void*) map);
+        return ENOMEM;
+    }
+    memcpy((void*) source, (void*) data, BLOCK_SIZE);
+    /*
+     * Collect all entries in use and sort them by hash value
+     */
+    while (pos < BLOCK_SIZE) {
+        if (0 == dx_valid_entry(source, pos)) {
+            kfree((void*) map);
+            kfree((void*) source);
+            return EIO;
+        }
+        entry = (ext2_direntry_t*) (source + pos);
+        if (entry->inode) {
+            map[count].hash = dx_hash(dir, (char*) (source + pos + sizeof(ext2_direntry_t)), entry->name_len, version);
+            map[count].offset = pos;
+            map[count].size = DX_REC_LEN(entry->name_len);
+            total += map[count].size;
+            count++;
+        }
+        pos += entry->rec_len;
+    }
+    if (count < 2) {
+        kfree((void*) map);
+        kfree((void*) source);
+        return ENOSPC;
+    }
+    for (i = 1; i < count; i++) {
+        tmp = map[i];
+        for (j = i; (j > 0) && (map[j - 1].hash > tmp.hash); j--)
+            map[j] = map[j - 1];
+        map[j] = tmp;
+    }
+    /*
+     * Move entries from the end of the sorted list until about half of the space is used
+     */
+    split = count;
+    while ((split > 1) && (size + map[split - 1].size <= total / 2)) {
+        split--;
+        size += map[split].size;
+    }
+    if (split == count)
+        split--;
+    *split_hash = map[split].hash;
+    dx_fill_block(data, source, map, 0, split);
+    dx_fill_block(new_data, source, map, split, count);
+    *new_block = dir->size / BLOCK_SIZE;
+    /*
+     * Write new block first so that the index never refers to a block which does not exist. If
+     * the lowest hash in the new block is also used in the old block, mark the index entry as
+     * continuation
+     */
+    if (0 == (rc = dx_write_block(dir, *new_block, new_data))) {
+        if (0 == (rc = dx_write_block(dir, block, data))) {
+            dx_insert(frame, *split_hash | ((map[split - 1].hash == *split_hash) ? 1 : 0), *new_block);
+            rc = dx_write_block(dir, frame->block, frame->data);
+        }
+    }
+    kfree((void*) map);
+    kfree((void*) source);
+    return rc;
+}
+
+/*
+ * Add an entry to an indexed directory
+ * Parameter:
+ * @dir - the directory
+ * @inode_nr - the inode number of the new entry
+ * @name - the name of the new entry
+ * Return value:
+ * 0 upon success
+ * EINVAL if the index cannot be used
+ * ENOSPC if the index is full
+ * ENOMEM if we are running out of memory
+ * EIO if an I/O error occurred
+ */
+static int dx_add_entry(inode_t* dir, u32 inode_nr, char* name) {
+    dx_frame_t frames[EXT2_DX_MAX_LEVELS];
+    int levels;
+    u32 hash;
+    u32 block;
+    u32 split_hash;
+    u32 new_block;
+    u8* data = 0;
+    u8* new_data = 0;
+    int rc;
+    if ((rc = dx_probe(dir, name, strlen(name), &hash, frames, &levels)))
+        goto out;
+    if ((0 == (data = (u8*) kmalloc(BLOCK_SIZE))) || (0 == (new_data = (u8*) kmalloc(BLOCK_SIZE)))) {
+        rc = ENOMEM;
+        goto out;
+    }
+    block = frames[levels - 1].at->block & DX_BLOCK_MASK;
+    if ((rc = dx_read_block(dir, block, data)))
+        goto out;
+    if (-1 != (rc = add_to_block(dir, data, block, inode_nr, name)))
+        goto out;
+    /*
+     * The leaf block is full - split it and add the entry to the block which
+     * covers its hash value
+     */
+    if ((rc = dx_make_room(dir, frames, &levels)))
+        goto out;
+    if ((rc = split_leaf(dir, frames + levels - 1, dx_version(dir, frames[0].data), data, block, new_data, &split_hash, &new_block)))
+        goto out;
+    if (hash >= split_hash)
+        rc = add_to_block(dir, new_data, new_block, inode_nr, name);
+    else
+        rc = add_to_block(dir, data, block, inode_nr, name);
+    if (-1 == rc) {
+        ERROR("No space in directory block after split\n");
+        rc = ENOSPC;
+    }
+out:
+    dx_release(frames, levels);
+    if (data)
+        kfree((void*) data);
+    if (new_data)
+        kfree((void*) new_data);
+    return rc;
+}
+
+/*
+ * Convert a directory which consists of one full block into an indexed directory. The
+ * entries apart from . and .. are moved into a new leaf block, and the first block is turned
+ * into the root of the index. Then the new entry is added to the directory
+ * Parameter:
+ * @dir - the directory
+ * @inode_nr - the inode number of the new entry
+ * @name - the name of the new entry
+ * Return value:
+ * 0 upon success
+ * EINVAL if the directory does not have the expected layout
+ * ENOMEM if we are running out of memory
+ * EIO if an I/O error occurred
+ */
+static int dx_make_indexed(inode_t* dir, u32 inode_nr, char* name) {
+    ext2_inode_data_t* ext2_inode_data = (ext2_inode_data_t*) dir->data;
+    ext2_superblock_t* ext2_super = ext2_inode_data->ext2_meta->ext2_super;
+    ext2_direntry_t* dot;
+    ext2_direntry_t dotdot;
+    ext2_dx_root_info_t* info;
+    ext2_dx_countlimit_t* countlimit;
+    dx_map_t* map;
+    u8* root;
+    u8* leaf;
+    u32 pos;
+    int count = 0;
+    int rc = EINVAL;
+    if (0 == (root = (u8*) kmalloc(BLOCK_SIZE)))
+        return ENOMEM;
+    if (0 == (leaf = (u8*) kmalloc(BLOCK_SIZE))) {
+        kfree((void*) root);
+        return ENOMEM;
+    }
+    if (0 == (map = (dx_map_t*) kmalloc(sizeof(dx_map_t) * (BLOCK_SIZE / DX_REC_LEN(1) + 1)))) {
+        kfree((void*) root);
+        kfree((void*) leaf);
+        return ENOMEM;
+    }
+    if ((rc = dx_read_block(dir, 0, root)))
+        goto out;
+    /*
+     * The block needs to start with the entries for . and ..
+     */
+    rc = EINVAL;
+    dot = (ext2_direntry_t*) root;
+    if ((0 == dx_valid_entry(root, 0)) || (1 != dot->name_len) || ('.' != root[sizeof(ext2_direntry_t)]))
+        goto out;
+    pos = dot->rec_len;
+    if ((pos >= BLOCK_SIZE) || (0 == dx_valid_entry(root, pos)) || (2 != ((ext2_direntry_t*) (root + pos))->name_len)
+            || (strncmp((char*) (root + pos + sizeof(ext2_direntry_t)), "..", 2)))
+        goto out;
+    memcpy((void*) &dotdot, (void*) (root + pos), sizeof(ext2_direntry_t));
+    pos += dotdot.rec_len;
+    /*
+     * Collect all remaining entries and move them to the new leaf
+     */
+    while (pos < BLOCK_SIZE) {
+        if (0 == dx_valid_entry(root, pos))
+            goto out;
+        if (((ext2_direntry_t*) (root + pos))->inode) {
+            map[count].offset = pos;
+            map[count].size = DX_REC_LEN(((ext2_direntry_t*) (root + pos))->name_len);
+            count++;
+        }
+        pos += ((ext2_direntry_t*) (root + pos))->rec_len;
+    }
+    dx_fill_block(leaf, root, map, 0, count);
+    /*
+     * Build root block
+     */
+    memset((void*) (root + DX_REC_LEN(1)), 0, BLOCK_SIZE - DX_REC_LEN(1));
+    dot->rec_len = DX_REC_LEN(1);
+    dotdot.rec_len = BLOCK_SIZE - DX_REC_LEN(1);
+    memcpy((void*) (root + DX_REC_LEN(1)), (void*) &dotdot, sizeof(ext2_direntry_t));
+    memcpy((void*) (root + DX_REC_LEN(1) + sizeof(ext2_direntry_t)), "..", 2);
+    info = (ext2_dx_root_info_t*) (root + EXT2_DX_ROOT_INFO_OFFSET);
+    info->hash_version = (ext2_super->s_def_hash_version <= EXT2_HASH_TEA) ? ext2_super->s_def_hash_version : EXT2_HASH_HALF_MD4;
+    info->info_length = sizeof(ext2_dx_root_info_t);
+    countlimit = (ext2_dx_countlimit_t*) (root + EXT2_DX_ROOT_INFO_OFFSET + sizeof(ext2_dx_root_info_t));
+    countlimit->limit = dx_limit(0);
+    countlimit->count = 1;
+    countlimit->block = 1;
+    /*
+     * Write leaf first, then root and finally mark inode as indexed
+     */
+    if ((rc = dx_write_block(dir, 1, leaf)))
+        goto out;
+    if ((rc = dx_write_block(dir, 0, root)))
+        goto out;
+    ext2_inode_data->ext2_inode->i_flags |= EXT2_INDEX_FL;
+    if ((rc = put_inode(ext2_inode_data->ext2_meta, dir)))
+        goto out;
+    rc = dx_add_entry(dir, inode_nr, name);
+out:
+    kfree((void*) root);
+    kfree((void*) leaf);
+    kfree((void*) map);
+    return rc;
+}
+
+/*
+ * Remove the index flag from a directory. This is done before the directory is
+ * modified without maintaining the index, so that other implementations will not use
+ * a stale index
+ * Parameter:
+ * @dir - the directory
+ * Return value:
+ * 0 upon success
+ * EIO if the inode could not be written
+ */
+static int dx_drop_index(inode_t* dir) {
+    ext2_inode_data_t* ext2_inode_data = (ext2_inode_data_t*) dir->data;
+    if (0 == (ext2_inode_data->ext2_inode->i_flags & EXT2_INDEX_FL))
+        return 0;
+    EXT2_DEBUG("Removing index from directory inode %d\n", dir->inode_nr);
+    ext2_inode_data->ext2_inode->i_flags &= ~EXT2_INDEX_FL;
+    return put_inode(ext2_inode_data->ext2_meta, dir);
+}
+
+/****************************************************************************************
+ * The following functions handle directory operations                                  *
+ ****************************************************************************************/
+
+/*
+ * Get the next directory entry from an inode, starting at a given byte offset within
+ * the directory. As a directory entry never crosses a block boundary, the fixed part of
+ * the entry and the name are read with one single read operation. Entries with inode
+ * number zero are skipped
+ * Parameter:
+ * @inode - the inode from which we read the entry
+ * @offset - offset within the directory at which we start, will be advanced to the
+ * offset of the entry following the returned entry
+ * @direntry - the directory entry to be filled
+ * Return value:
+ * 0 upon success
+ * EIO if the directory inode could not be read
+ * -1 if there are no further directory entries
+ */
+int fs_ext2_next_direntry(struct _inode_t* inode, off_t* offset,
+        direntry_t* direntry) {
+    u8 buffer[sizeof(ext2_direntry_t) + FILE_NAME_MAX];
+    ext2_direntry_t* ext2_direntry = (ext2_direntry_t*) buffer;
+    ssize_t bytes;
+    u32 name_len;
+    /*
+     * If size of inode is zero, the directory has been removed, but is still
+     * present on the disk as there are still pending references to it. Return -1
+     */
+    if (0 == inode->size) {
+        return -1;
+    }
+    while (*offset < inode->size) {
+        bytes = BLOCK_SIZE - (*offset % BLOCK_SIZE);
+        if (bytes > sizeof(buffer))
+            bytes = sizeof(buffer);
+        bytes = fs_ext2_inode_read(inode, bytes, *offset, (void*) buffer);
+        if (bytes < (ssize_t) sizeof(ext2_direntry_t)) {
+            ERROR("Could not read directory entry from inode (%d, %d)\n", inode->dev, inode->inode_nr);
+            return EIO;
+        }
+        if (0 == ext2_direntry->rec_len) {
+            PANIC("Got invalid directory inode entry with length zero at offset %d in inode %d\n", *offset,
+                    inode->inode_nr);
+            return EIO;
+        }
+        /*
+         * Verify that length is a multiple of 4
+         */
+        if (ext2_direntry->rec_len % sizeof(u32)) {
+            PANIC("Length of directory entry at offset %d in inode %d is %d - not a multiple of 4\n", *offset,
+                    inode->inode_nr, ext2_direntry->rec_len);
+            return EIO;
+        }
+        *offset += ext2_direntry->rec_len;
+        /*
+         * Ignore directory entries with inode number set to zero
+         */
+        if (ext2_direntry->inode) {
+            name_len = ext2_direntry->name_len;
+            if (name_len > FILE_NAME_MAX - 1)
+                name_len = FILE_NAME_MAX - 1;
+            if (sizeof(ext2_direntry_t) + name_len > bytes) {
+                ERROR("Could not read file name from directory inode\n");
+                return EIO;
+            }
+            direntry->inode_nr = ext2_direntry->inode;
+            memcpy(direntry->name, buffer + sizeof(ext2_direntry_t), name_len);
+            (direntry->name)[name_len] = 0;
+            EXT2_DEBUG("Found entry with inode nr %d\n", direntry->inode_nr);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Get a directory entry from an inode
+ * Parameter:
+ * @inode - the inode from which we read the entry
+ * @index - the index of the entry within the directory, starting with zero
+ * Return value:
+ * 0 upon success
+ * EIO if the directory inode could not be read
+ * -1 if the directory entry could not be found
+ */
+int fs_ext2_get_direntry(struct _inode_t* inode, off_t index,
+        direntry_t* direntry) {
+    off_t offset = 0;
+    int rc;
+    EXT2_DEBUG("Starting walk of directory\n");
+    while (0 == (rc = fs_ext2_next_direntry(inode, &offset, direntry))) {
+        if (0 == index)
+            return 0;
+        index--;
+    }
+    return rc;
+}
+
+/*
+ * Look up a name in a directory. If the directory is indexed, only the leaf
+ * blocks which can contain the name are read
+ * Parameter:
+ * @dir - the directory
+ * @name - the name, not necessarily null terminated
+ * @length - the length of the name
+ * @inode_nr - the inode number of the entry will be stored here
+ * Return value:
+ * 0 if the entry has been found
+ * -1 if there is no entry with this name
+ * EIO if the directory could not be read
+ * ENOMEM if we are running out of memory
+ */
+int fs_ext2_lookup(struct _inode_t* dir, char* name, int length, ino_t* inode_nr) {
+    u8* data;
+    u32 block;
+    u32 offset;
+    u32 preceding;
+    int rc;
+    if ((length <= 0) || (length > FILE_NAME_MAX))
+        return -1;
+    if (0 == (data = (u8*) kmalloc(BLOCK_SIZE))) {
+        ERROR("Could not allocate memory for directory block\n");
+        return ENOMEM;
+    }
+    if (0 == (rc = find_direntry(dir, name, length, data, &block, &offset, &preceding)))
+        *inode_nr = ((ext2_direntry_t*) (data + offset))->inode;
+    kfree((void*) data);
+    return rc;
+}
+
+/*
+ * Perform some validations on a directory entry and a directory
+ * Parameter:
+ * @ext2_direntry - the entry to be validated
+ * @dir - the directory to be validated
+ * Return value:
+ * 1 if a problem has been found
+ * 0 if all validations are successful
+ */
+static int validate_direntry(ext2_direntry_t* direntry, inode_t* dir) {
+    if (direntry->rec_len % 4) {
+        ERROR("Record length of entry for inode %d in directory inode %d is not a multiple of four!\n",
+                direntry->inode, dir->inode_nr);
+        return 1;
+    }
+    if (dir->size % BLOCK_SIZE) {
+        ERROR("Size of directory inode %d is not a multiple of the block size\n", dir->inode_nr);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * This function will try to splice a new directory entry into an existing entry by making use
+ * of free space between the end of the file name and the end of the entry.
+ * Parameter:
+ * @existing_entry - the existing entry
+ * @new_entry - the new entry
+ * @dir - the inode representing the directory
+ * @offset - the offset in bytes of the existing entry within the directory inode
+ * @name - the name of the inode described by the new entry
+ * Return value:
+ * 0 if the operation could not be completed because the existing entry is too small
+ * -1 if an error occurred
+ * 1 if the operation could be completed
+ */
+static int splice_direntry(ext2_direntry_t* existing_entry, ext2_direntry_t* new_entry, inode_t* dir, u32 offset, char* name) {
+    u32 first_free_byte;
+    void* buffer;
+    if (validate_direntry(existing_entry, dir)) {
         ERROR("Entry at offset %d in directory inode %d is invalid!\n", offset, dir->inode_nr);
         return -1;
     }
@@ -2589,9 +4256,11 @@ static int update_direntry(inode_t* dir, int index, u32 inode_nr) {
 }
 
 /*
- * Utility function to create a directory entry for an inode. This function will first
+ * Utility function to create a directory entry for an inode. If the directory is indexed, the
+ * entry is added to the leaf block selected by the index. Otherwise this function will first
  * scan the directory to find an existing entry which is large enough so that it can be shrinked
- * to get space for the new entry. If that fails, a new block is allocated and added to the directory inode
+ * to get space for the new entry. If that fails, a new block is allocated and added to the directory inode,
+ * or the directory is converted into an indexed directory if the file system supports this
  * Parameter:
  * @dir - the inode representing the directory
  * @inode_nr - the number of the inode to be added
@@ -2601,6 +4270,7 @@ static int update_direntry(inode_t* dir, int index, u32 inode_nr) {
  * EIO if an error occurred
  * EINVAL if the length of the name exceeds FILE_NAME_MAX
  * ENOMEM if we are running out of memory
+ * ENOSPC if the index of an indexed directory is full
  * Note that we could improve this algorithm to also scan for empty directory entries
  * which come into existence when we remove the first entry in a directory block
  */
@@ -2626,6 +4296,17 @@ static int create_direntry(inode_t* dir, u32 inode_nr, char* name) {
         new_direntry.rec_len &= ~0x3;
         new_direntry.rec_len += 4;
     }
+    /*
+     * If the directory is indexed, use the index to locate the block into which
+     * the entry goes. If the index cannot be used, remove it as we are going to
+     * change the directory without maintaining it
+     */
+    if (dx_is_indexed(dir)) {
+        if (EINVAL != (rc = dx_add_entry(dir, inode_nr, name)))
+            return rc;
+    }
+    if (dx_drop_index(dir))
+        return EIO;
     /*
      * Now walk through directory entries and try to locate
      * an entry which has enough space left to be split in two parts
@@ -2654,9 +4335,16 @@ static int create_direntry(inode_t* dir, u32 inode_nr, char* name) {
             break;
     }
     /*
-     * If we get to this point, we have not been able to splice the entry
-     * into an existing entry and write a new entry which takes up an entire block
+     * If we get to this point, we have not been able to splice the entry into an
+     * existing entry. If the directory consists of one block and the file system supports
+     * directory indices, turn the directory into an indexed directory. Otherwise write a new
+     * entry which takes up an entire block
      */
+    if ((BLOCK_SIZE == dir->size) && (((ext2_inode_data_t*) dir->data)->ext2_meta->ext2_super->s_feature_compat
+            & EXT2_FEATURE_COMPAT_DIR_INDEX)) {
+        if (EINVAL != (rc = dx_make_indexed(dir, inode_nr, name)))
+            return rc;
+    }
     return append_direntry(dir, inode_nr, name);
  }
 
@@ -2819,8 +4507,9 @@ static int prep_dir_for_deletion(inode_t* dir, inode_t* parent, int flags) {
 
 /*
  * Unlink an inode, i.e. remove an existing directory entry.
- * We first walk the directory and locate the entry within the
- * linked list of directory entries. Then we adjust the record length
+ * We first locate the block which contains the entry, using the index
+ * if the directory is indexed, and the entry within the
+ * linked list of directory entries in this block. Then we adjust the record length
  * of the previous entry such that it points to the end of the entry to be
  * removed and write the previous entry back to disk.
  * If the entry to be removed is the first entry within a block, this will not
@@ -2847,91 +4536,69 @@ static int prep_dir_for_deletion(inode_t* dir, inode_t* parent, int flags) {
 int fs_ext2_unlink_inode(inode_t* dir, char* name, int flags) {
     ext2_direntry_t current_entry;
     ext2_direntry_t preceding_entry;
-    u32 preceding_offset = 0;
-    char current_name[FILE_NAME_MAX+1];
-    u32 offset = 0;
-    int found = 0;
+    u32 preceding_offset;
+    u32 offset;
+    u32 block;
+    u8* data;
     int rc;
     inode_t* removed_inode = 0;
     /*
-     * We start to walk through the directory until we find the
-     * entry we are looking for
+     * Locate the block which contains the entry we are looking for
      */
-    while (1) {
-        if (fs_ext2_inode_read(dir, sizeof(ext2_direntry_t), offset,
-                (void*) &current_entry) != sizeof(ext2_direntry_t)) {
-            ERROR("Could not read directory entry at offset %d\n", offset);
-            return EIO;
-        }
-        /*
-         * If this is a valid entry, get the name from disk
-         */
-        if (current_entry.name_len && current_entry.inode) {
-            if (fs_ext2_inode_read(dir, current_entry.name_len, offset+sizeof(ext2_direntry_t),(void*) current_name)
-                    != current_entry.name_len) {
-                ERROR("Could not read directory entry\n");
-                return EIO;
-            }
+    if (0 == (data = (u8*) kmalloc(BLOCK_SIZE))) {
+        ERROR("Could not allocate memory for directory block\n");
+        return ENOMEM;
+    }
+    rc = find_direntry(dir, name, strlen(name), data, &block, &offset, &preceding_offset);
+    if (rc) {
+        kfree((void*) data);
+        return (-1 == rc) ? ENOENT : rc;
+    }
+    memcpy((void*) &current_entry, (void*) (data + offset), sizeof(ext2_direntry_t));
+    memcpy((void*) &preceding_entry, (void*) (data + preceding_offset), sizeof(ext2_direntry_t));
+    kfree((void*) data);
+    offset += block * BLOCK_SIZE;
+    preceding_offset += block * BLOCK_SIZE;
+    /*
+     * Get reference to inode - we will need this later on when we
+     * adapt the reference count of the inode on disk
+     */
+    removed_inode = fs_ext2_get_inode(dir->dev, current_entry.inode);
+    if (0 == removed_inode) {
+        PANIC("Could not get pointer to removed inode\n");
+        return EIO;
+    }
+    EXT2_DEBUG("Found inode %s to be removed, inode_nr is %d in directory %d\n", name,
+            removed_inode->inode_nr, dir->inode_nr);
+    /*
+     * If this is a directory, prepare it for deletion, i.e. remove dot and dot-dot, and
+     * validate that there are no hard links other than the entry in dir and the dot entry
+     * pointing to the directory
+     */
+    if (S_ISDIR(removed_inode->mode)) {
+        if ((rc = prep_dir_for_deletion(removed_inode, dir, flags))) {
             /*
-             * Is this the inode we wish to remove?
+             * Validation failed
              */
-            if (0 == strncmp(name, current_name, strlen(name))) {
-                found = 1;
-                /*
-                 * Get reference to inode - we will need this later on when we
-                 * adapt the reference count of the inode on disk
-                 */
-                removed_inode = fs_ext2_get_inode(dir->dev, current_entry.inode);
-                EXT2_DEBUG("Found inode %s to be removed, inode_nr is %d in directory %d\n", name,
-                        removed_inode->inode_nr, dir->inode_nr);
-                /*
-                 * If this is a directory, prepare it for deletion, i.e. remove dot and dot-dot, and
-                 * validate that there are no hard links other than the entry in dir and the dot entry
-                 * pointing to the directory
-                 */
-                if (S_ISDIR(removed_inode->mode)) {
-                    if ((rc = prep_dir_for_deletion(removed_inode, dir, flags))) {
-                        /*
-                         * Validation failed
-                         */
-                        EXT2_DEBUG("Validation failed with rc %d\n", rc);
-                        removed_inode->iops->inode_release(removed_inode);
-                        return rc;
-                    }
-                }
-                /*
-                 * Invoke utility function to remove directory entry
-                 */
-                if (remove_direntry(&current_entry, &preceding_entry, dir, offset, preceding_offset)) {
-                    ERROR("Could not remove directory entry\n");
-                    if (removed_inode)
-                        removed_inode->iops->inode_release(removed_inode);
-                    return EIO;
-                }
-                break;
-            }
+            EXT2_DEBUG("Validation failed with rc %d\n", rc);
+            removed_inode->iops->inode_release(removed_inode);
+            return rc;
         }
-        /*
-         * Advance to next entry
-         */
-        preceding_offset = offset;
-        memcpy(&preceding_entry, &current_entry, sizeof(ext2_direntry_t));
-        offset += current_entry.rec_len;
-        if (offset >= dir->size)
-            break;
     }
-    if (0 == found)
-        return ENOENT;
+    /*
+     * Invoke utility function to remove directory entry
+     */
+    if (remove_direntry(&current_entry, &preceding_entry, dir, offset, preceding_offset)) {
+        ERROR("Could not remove directory entry\n");
+        removed_inode->iops->inode_release(removed_inode);
+        return EIO;
+    }
     /*
      * We have just removed an entry for the inode from a directory. We will therefore need
      * to reduce the link count within the ext2 inode by one. Note that reducing the link
      * count does not remove the file, this will only be done once the last reference to
      * the inode is dropped
      */
-    if (0 == removed_inode) {
-        PANIC("Could not get pointer to removed inode\n");
-        return EIO;
-    }
     if (dec_link_count(removed_inode)) {
         ERROR("Could not decrement link count\n");
         fs_ext2_inode_release(removed_inode);
@@ -2957,7 +4624,7 @@ int fs_ext2_unlink_inode(inode_t* dir, char* name, int flags) {
  */
 static ext2_inode_t* init_ext2_inode(int mode) {
     ext2_inode_t* ext2_inode = 0;
-    if (0 == (ext2_inode = (ext2_inode_t*) kmalloc(sizeof(ext2_inode_t)))) {
+    if (0 == (ext2_inode = (ext2_inode_t*) kmem_cache_alloc(&ext2_inode_cache))) {
         ERROR("Running out of memory\n");
         return 0;
     }
@@ -3107,7 +4774,7 @@ inode_t* fs_ext2_create_inode(inode_t* dir, char* name, int mode) {
         }
         else
             EXT2_DEBUG("Device full\n");
-        kfree((void*) ext2_inode);
+        kmem_cache_free(&ext2_inode_cache, ext2_inode);
         fs_ext2_release_superblock(ext2_metadata->super);
         return 0;
     }
@@ -3122,7 +4789,7 @@ inode_t* fs_ext2_create_inode(inode_t* dir, char* name, int mode) {
     */
     if (0 == (inode = init_inode(ext2_inode, ext2_metadata, inode_nr))) {
         ERROR("Could not initialize inode data structure\n");
-        kfree((void*) ext2_inode);
+        kmem_cache_free(&ext2_inode_cache, ext2_inode);
         /*
          * Call fs_ext2_release_superblock to drop reference
          * to ext2 metadata structure again properly
@@ -3135,8 +4802,8 @@ inode_t* fs_ext2_create_inode(inode_t* dir, char* name, int mode) {
      */
     if (0 == (ext2_inode_data = init_ext2_inode_data(inode, ext2_inode, ext2_metadata))) {
         fs_ext2_release_superblock(ext2_metadata->super);
-        kfree((void*) ext2_inode);
-        kfree((void*) inode);
+        kmem_cache_free(&ext2_inode_cache, ext2_inode);
+        kmem_cache_free(&inode_cache, inode);
         PANIC("Could not allocate memory\n");
         return 0;
     }
@@ -3197,41 +4864,89 @@ inode_t* fs_ext2_create_inode(inode_t* dir, char* name, int mode) {
 
 
 /*
- * Release an inode, i.e. decrement its reference count
- * and delete the inode if the reference count reaches zero
+ * Release an inode, i.e. decrement its reference count. If the reference
+ * count reaches zero, the inode is added to the LRU list of the inode cache
+ * so that it can be reused later on, and the least recently used inode is
+ * removed from the cache if the LRU list exceeds its maximum size. If
+ * in addition the link count of the inode is zero, the inode is deleted.
+ * When the last reference is dropped, i.e. when the file is closed, the
+ * blocks left in the preallocation window of the inode are released as well
  * Parameters:
  * @inode - the inode which is to be released
  * Locks:
+ * lock on the bucket of the inode hash table
  * lock on ext2 metadata structure for this inode
+ * sb_lock in ext2 metadata structure
  * Reference counts:
  * - decrease reference count of inode by one
  * - decrease reference count of associated superblock by one
  */
 void fs_ext2_inode_release(inode_t* inode) {
     u32 eflags;
+    u32 lru_eflags;
+    int wipe = 0;
+    ino_t victim = 0;
+    u32 prealloc_block = 0;
+    u32 prealloc_count = 0;
     KASSERT(inode);
     ext2_inode_data_t* idata = (ext2_inode_data_t*) inode->data;
     KASSERT(idata);
     ext2_metadata_t* meta = idata->ext2_meta;
+    ext2_inode_bucket_t* bucket = inode_bucket(meta, inode->inode_nr);
     EXT2_DEBUG("Releasing inode_nr %d on device %x\n", inode->inode_nr, inode->dev);
-    spinlock_get(&meta->lock, &eflags);
+    spinlock_get(&bucket->lock, &eflags);
     idata->reference_count--;
     if (0 == idata->reference_count) {
         EXT2_DEBUG("Reference count of inode dropped to zero\n");
-        LIST_REMOVE(meta->inodes_head, meta->inodes_tail, idata);
+        /*
+         * Take over the preallocation window - we return the blocks
+         * once we have dropped the lock
+         */
+        prealloc_block = idata->prealloc_block;
+        prealloc_count = idata->prealloc_count;
+        idata->prealloc_block = 0;
+        idata->prealloc_count = 0;
+        /*
+         * If the link count on disk is zero for the inode, remove it from the cache
+         * and from the disk. Otherwise move it to the LRU list
+         */
+        if (0 == idata->ext2_inode->i_link_count) {
+            unhash_inode(bucket, idata);
+            wipe = 1;
+        }
+        else {
+            spinlock_get(&meta->lock, &lru_eflags);
+            LIST_ADD_END(meta->lru_head, meta->lru_tail, idata);
+            idata->on_lru = 1;
+            meta->lru_count++;
+            if (meta->lru_count > EXT2_INODE_LRU_SIZE) {
+                victim = meta->lru_head->inode->inode_nr;
+                meta->lru_head->on_lru = 0;
+                LIST_REMOVE(meta->lru_head, meta->lru_tail, meta->lru_head);
+                meta->lru_count--;
+            }
+            spinlock_release(&meta->lock, &lru_eflags);
+        }
     }
-    spinlock_release(&meta->lock, &eflags);
-    /*
-     * If the reference count is now zero, deallocate inode. If in
-     * addition the link count on disk is zero for the inode,
-     * remove the inode on the disk as well.
-     */
-    if (0 == idata->reference_count) {
-        if (0 == idata->ext2_inode->i_link_count)
-            wipe_inode(inode);
+    spinlock_release(&bucket->lock, &eflags);
+    if (prealloc_count) {
+        if (deallocate_blocks(meta, prealloc_block, prealloc_count)) {
+            ERROR("Could not release preallocated blocks\n");
+        }
+    }
+    if (wipe) {
+        wipe_inode(inode);
         destroy_ext2_inode_data(idata);
         EXT2_DEBUG("Freeing idata (%x)\n", idata);
-        kfree(idata);
+        kmem_cache_free(&ext2_inode_data_cache, idata);
+    }
+    /*
+     * Remove the least recently used inode from the cache. We cannot do this
+     * while holding the lock on the bucket, as the victim might be located in
+     * a different bucket
+     */
+    if (victim) {
+        evict_inode(meta, victim);
     }
     /*
      * We still need the metadata up to this point, but
@@ -3253,6 +4968,7 @@ void fs_ext2_inode_release(inode_t* inode) {
  */
 int fs_ext2_print_cache_info() {
     int rc = 0;
+    int i;
     ext2_metadata_t* meta;
     ext2_inode_data_t* idata;
     PRINT("Ext2 inode and superblock cache info\n");
@@ -3263,13 +4979,19 @@ int fs_ext2_print_cache_info() {
         PRINT("------------------\n");
         PRINT("Device:         (%d, %d)\n", MAJOR(meta->device), MINOR(meta->device));
         PRINT("Ref. count:     %d\n", meta->reference_count);
+        PRINT("Inode cache:    %d hits, %d misses, %d unused inodes\n", meta->inode_hits, meta->inode_misses,
+                meta->lru_count);
         PRINT("Cached inodes:\n");
         PRINT("--------------\n");
-        LIST_FOREACH(meta->inodes_head, idata) {
-            rc += idata->reference_count;
-            PRINT("    Inode:       %d\n", idata->inode->inode_nr);
-            PRINT("    Mount point: %d\n", idata->inode->mount_point);
-            PRINT("    Ref. count:  %d\n", idata->reference_count);
+        for (i = 0; i < EXT2_INODE_HASH_BUCKETS; i++) {
+            for (idata = meta->inode_hash[i].head; idata; idata = idata->hash_next) {
+                rc += idata->reference_count;
+                if (0 == idata->reference_count)
+                    continue;
+                PRINT("    Inode:       %d\n", idata->inode->inode_nr);
+                PRINT("    Mount point: %d\n", idata->inode->mount_point);
+                PRINT("    Ref. count:  %d\n", idata->reference_count);
+            }
         }
     }
     return rc;
@@ -512,8 +512,11 @@ static void do_eoi(ir_context_t* ir_context) {
 /*
  * Handle exceptions, i.e. extract the vector from an IR
  * context and execute an exception handler if needed
+ * Parameter:
+ * @ir_context - the IR context
+ * @execution_level - the execution level on which the exception is handled
  */
-static void handle_exception(ir_context_t* ir_context) {
+static void handle_exception(ir_context_t* ir_context, int execution_level) {
     /*
      * If this is not an exception or trap, return
      */
@@ -521,7 +524,18 @@ static void handle_exception(ir_context_t* ir_context) {
         return;
     switch (ir_context->vector) {
         case IRQ_TRAP_PF:
-            mm_handle_page_fault(ir_context);
+            /*
+             * If the page fault is handled on system call level, the memory manager
+             * might need to read from a file to populate the page, so turn on interrupts
+             */
+            if (EXECUTION_LEVEL_SYSCALL == execution_level) {
+                sti();
+                mm_handle_page_fault(ir_context);
+                cli();
+            }
+            else {
+                mm_handle_page_fault(ir_context);
+            }
             break;
         case IRQ_TRAP_NM:
             pm_handle_nm_trap();
@@ -548,14 +562,17 @@ u32 irq_handle_interrupt(ir_context_t ir_context) {
     int rc = 0;
     isr_handler_t* isr_handler;
     int previous_execution_level = 0;
+    int execution_level;
     int restart = 0;
     int first_exec = 1;
     ir_context_t saved_ir_context;
     int debug_flag = 0;
     /*
-     * If debugger is running, ignore all interrupts except exceptions and the debugger IPI
+     * If debugger is running, ignore all interrupts except exceptions, the debugger IPI and
+     * TLB shootdowns, as the CPU which has sent these is waiting for them to complete
      */
-    if (debug_running() && (ir_context.vector >= 32) && (ir_context.vector != IPI_DEBUG)) {
+    if (debug_running() && (ir_context.vector >= 32) && (ir_context.vector != IPI_DEBUG)
+            && (ir_context.vector != IPI_TLB_SHOOTDOWN)) {
         do_eoi(&ir_context);
         return 0;
     }
@@ -572,7 +589,7 @@ u32 irq_handle_interrupt(ir_context_t ir_context) {
     /*
      * Determine new execution level and store old level on the stack
      */
-    pm_update_exec_level(&ir_context, &previous_execution_level);
+    execution_level = pm_update_exec_level(&ir_context, &previous_execution_level);
     while (restart || first_exec) {
         /*
          * Reset first execution flag and save interrupt context for later use when a restart is done
@@ -616,6 +633,11 @@ u32 irq_handle_interrupt(ir_context_t ir_context) {
                           debug_flag = 1;
                   }
             }
+            /*
+             * TLB shootdown requested by another CPU
+             */
+            if (IPI_TLB_SHOOTDOWN == ir_context.vector)
+                mm_handle_tlb_ipi();
             /*
              * Do EOI processing
              */
@@ -633,7 +655,7 @@ u32 irq_handle_interrupt(ir_context_t ir_context) {
          * Exception
          */
         else {
-            handle_exception(&ir_context);
+            handle_exception(&ir_context, execution_level);
         }
         /*
          * Give process manager a chance to handle signals
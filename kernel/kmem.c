@@ -0,0 +1,347 @@
+/*
+ * kmem.c
+ *
+ * This module implements object caches for fixed-size kernel objects which are allocated and freed
+ * frequently, like network messages, semaphores or inodes. For these objects, going through kmalloc
+ * is expensive, as each allocation walks the chunk list of the kernel heap while holding the global
+ * kernel heap lock.
+ *
+ * The objects of a cache are carved out of slabs. A slab is a block of memory taken from the kernel heap
+ * which is aligned to its size, so that the slab to which an object belongs can be located by rounding
+ * down the address of the object. Each slab starts with a header, followed by the objects. Free objects
+ * within a slab are chained through their first word. A cache keeps its slabs on three lists - slabs
+ * which are partially used, slabs which are full and slabs which are completely free. At most KMEM_FREE_SLABS
+ * free slabs are kept, any further slab which becomes free is returned to the kernel heap.
+ *
+ * On top of the slabs, each CPU has a stack of free objects for each cache. Objects are allocated from and freed
+ * to this stack with interrupts disabled, but without taking any lock. Only if the stack is empty,
+ * KMEM_CPU_CACHE_BATCH objects are moved from the slabs to the stack while holding the lock of the cache.
+ * Similarly, if the stack is full when an object is freed, KMEM_CPU_CACHE_BATCH objects are returned to their slabs.
+ *
+ * Caches are usually defined statically by the module using them, using the macro KMEM_CACHE_INITIALIZER.
+ * When the first object is allocated from a cache, the geometry of its slabs is determined and the cache
+ * is added to the list of all caches which is used to print statistics.
+ *
+ * Locks:
+ *
+ * - the spinlock cache->lock protects the slab lists and slab headers of a cache as well as its counters
+ * - the spinlock kmem_caches_lock protects the list of all caches
+ * - the per-CPU stacks are only accessed by the CPU to which they belong, with interrupts disabled
+ *
+ * The lock of a cache is never held while calling into the kernel heap. If both locks are needed,
+ * the lock of the cache needs to be acquired first.
+ */
+
+#include "kmem.h"
+#include "mm.h"
+#include "debug.h"
+#include "lists.h"
+#include "util.h"
+#include "smp.h"
+
+/*
+ * A local loglevel
+ */
+int __kmem_loglevel = 0;
+
+#define KMEM_DEBUG(...) do {if (__kmem_loglevel > 0 ) { kprintf("DEBUG at %s@%d (%s): ", __FILE__, __LINE__, __FUNCTION__); \
+        kprintf(__VA_ARGS__); }} while (0)
+
+/*
+ * Size of the slab header, rounded up so that the first object is aligned
+ */
+#define KMEM_SLAB_HEADER ((sizeof(kmem_slab_t) + KMEM_ALIGN - 1) & ~(KMEM_ALIGN - 1))
+
+/*
+ * Get the slab to which an object belongs
+ */
+#define KMEM_SLAB(cache, object) ((kmem_slab_t*) (((u32) (object)) & ~((cache)->slab_size - 1)))
+
+/*
+ * List of all caches which have been set up
+ */
+static kmem_cache_t* kmem_caches_head = 0;
+static kmem_cache_t* kmem_caches_tail = 0;
+static spinlock_t kmem_caches_lock = 0;
+
+/*
+ * Determine the size of the slabs of a cache and add the cache to the list of
+ * caches. The caller needs to hold the lock on the cache
+ * Parameter:
+ * @cache - the cache
+ * Locks:
+ * kmem_caches_lock
+ */
+static void cache_setup(kmem_cache_t* cache) {
+    u32 eflags;
+    cache->size = cache->object_size;
+    if (cache->size < sizeof(void*))
+        cache->size = sizeof(void*);
+    cache->size = (cache->size + KMEM_ALIGN - 1) & ~(KMEM_ALIGN - 1);
+    cache->slab_size = KMEM_SLAB_MIN_SIZE;
+    while ((cache->slab_size < KMEM_SLAB_MAX_SIZE)
+            && ((cache->slab_size - KMEM_SLAB_HEADER) / cache->size < KMEM_SLAB_MIN_OBJECTS))
+        cache->slab_size *= 2;
+    cache->objects_per_slab = (cache->slab_size - KMEM_SLAB_HEADER) / cache->size;
+    cache->ready = 1;
+    KMEM_DEBUG("Cache %s: object size %d, slab size %d, %d objects per slab\n", cache->name, cache->size,
+            cache->slab_size, cache->objects_per_slab);
+    spinlock_get(&kmem_caches_lock, &eflags);
+    LIST_ADD_END(kmem_caches_head, kmem_caches_tail, cache);
+    spinlock_release(&kmem_caches_lock, &eflags);
+}
+
+/*
+ * Allocate a new slab for a cache from the kernel heap and chain all its objects
+ * into the free list of the slab. The caller must not hold the lock on the cache
+ * Parameter:
+ * @cache - the cache
+ * Return value:
+ * the new slab or 0 if no memory was available
+ */
+static kmem_slab_t* slab_create(kmem_cache_t* cache) {
+    kmem_slab_t* slab;
+    u8* object;
+    int i;
+    if (0 == (slab = (kmem_slab_t*) kmalloc_aligned(cache->slab_size, cache->slab_size)))
+        return 0;
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->free = 0;
+    for (i = cache->objects_per_slab - 1; i >= 0; i--) {
+        object = ((u8*) slab) + KMEM_SLAB_HEADER + i * cache->size;
+        *((void**) object) = slab->free;
+        slab->free = (void*) object;
+    }
+    return slab;
+}
+
+/*
+ * Move up to KMEM_CPU_CACHE_BATCH objects from the slabs of a cache to the stack
+ * of the current CPU, allocating a new slab if needed. This function needs to be
+ * called with interrupts disabled
+ * Parameter:
+ * @cache - the cache
+ * @cpu_cache - the stack of the current CPU
+ * Locks:
+ * cache->lock
+ * Cross-monitor function calls:
+ * kmalloc_aligned
+ */
+static void cache_refill(kmem_cache_t* cache, kmem_cpu_cache_t* cpu_cache) {
+    u32 eflags;
+    kmem_slab_t* slab;
+    void* object;
+    spinlock_get(&cache->lock, &eflags);
+    if (0 == cache->ready)
+        cache_setup(cache);
+    if (0 == cache->objects_per_slab) {
+        spinlock_release(&cache->lock, &eflags);
+        return;
+    }
+    if ((0 == cache->partial_head) && (0 == cache->free_head)) {
+        /*
+         * Release the lock while calling into the kernel heap. Another CPU might
+         * add a slab in the meantime, this is not a problem as the additional
+         * slab simply ends up on the free list
+         */
+        spinlock_release(&cache->lock, &eflags);
+        slab = slab_create(cache);
+        spinlock_get(&cache->lock, &eflags);
+        if (slab) {
+            LIST_ADD_END(cache->free_head, cache->free_tail, slab);
+            cache->slabs++;
+            cache->free_slabs++;
+        }
+    }
+    while (cpu_cache->count < KMEM_CPU_CACHE_BATCH) {
+        /*
+         * Prefer partially used slabs so that free slabs can be returned
+         */
+        if (0 == (slab = cache->partial_head)) {
+            if (0 == (slab = cache->free_head))
+                break;
+            LIST_REMOVE(cache->free_head, cache->free_tail, slab);
+            cache->free_slabs--;
+            LIST_ADD_END(cache->partial_head, cache->partial_tail, slab);
+        }
+        object = slab->free;
+        slab->free = *((void**) object);
+        slab->in_use++;
+        cpu_cache->objects[cpu_cache->count] = object;
+        cpu_cache->count++;
+        if (0 == slab->free) {
+            LIST_REMOVE(cache->partial_head, cache->partial_tail, slab);
+            LIST_ADD_END(cache->full_head, cache->full_tail, slab);
+        }
+    }
+    cache->refills++;
+    spinlock_release(&cache->lock, &eflags);
+}
+
+/*
+ * Return KMEM_CPU_CACHE_BATCH objects from the stack of the current CPU to their
+ * slabs. Slabs which become free are returned to the kernel heap if the cache already
+ * has KMEM_FREE_SLABS free slabs. This function needs to be called with interrupts disabled
+ * Parameter:
+ * @cache - the cache
+ * @cpu_cache - the stack of the current CPU
+ * Locks:
+ * cache->lock
+ * Cross-monitor function calls:
+ * kfree
+ */
+static void cache_drain(kmem_cache_t* cache, kmem_cpu_cache_t* cpu_cache) {
+    u32 eflags;
+    kmem_slab_t* slab;
+    kmem_slab_t* release = 0;
+    void* object;
+    int i;
+    spinlock_get(&cache->lock, &eflags);
+    for (i = 0; (i < KMEM_CPU_CACHE_BATCH) && (cpu_cache->count > 0); i++) {
+        cpu_cache->count--;
+        object = cpu_cache->objects[cpu_cache->count];
+        slab = KMEM_SLAB(cache, object);
+        if (0 == slab->free) {
+            LIST_REMOVE(cache->full_head, cache->full_tail, slab);
+            LIST_ADD_END(cache->partial_head, cache->partial_tail, slab);
+        }
+        *((void**) object) = slab->free;
+        slab->free = object;
+        slab->in_use--;
+        if (0 == slab->in_use) {
+            LIST_REMOVE(cache->partial_head, cache->partial_tail, slab);
+            if (cache->free_slabs < KMEM_FREE_SLABS) {
+                LIST_ADD_END(cache->free_head, cache->free_tail, slab);
+                cache->free_slabs++;
+            }
+            else {
+                slab->next = release;
+                release = slab;
+                cache->slabs--;
+            }
+        }
+    }
+    cache->drains++;
+    spinlock_release(&cache->lock, &eflags);
+    while (release) {
+        slab = release->next;
+        KMEM_DEBUG("Returning slab %x of cache %s to kernel heap\n", release, cache->name);
+        kfree((void*) release);
+        release = slab;
+    }
+}
+
+/*
+ * Allocate an object from a cache
+ * Parameter:
+ * @cache - the cache
+ * Return value:
+ * a pointer to the object or 0 if no memory is available
+ * Locks:
+ * cache->lock (only if the stack of the current CPU needs to be refilled)
+ * Cross-monitor function calls:
+ * kmalloc_aligned
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    u32 eflags;
+    kmem_cpu_cache_t* cpu_cache;
+    void* object = 0;
+    save_eflags(&eflags);
+    cli();
+    cpu_cache = cache->cpu_cache + smp_get_cpu();
+    if (0 == cpu_cache->count)
+        cache_refill(cache, cpu_cache);
+    else
+        cpu_cache->hits++;
+    if (cpu_cache->count) {
+        cpu_cache->count--;
+        object = cpu_cache->objects[cpu_cache->count];
+        cpu_cache->allocs++;
+    }
+    restore_eflags(&eflags);
+    if (0 == object) {
+        ERROR("Could not allocate object from cache %s\n", cache->name);
+    }
+    return object;
+}
+
+/*
+ * Return an object to its cache
+ * Parameter:
+ * @cache - the cache from which the object has been allocated
+ * @object - the object
+ * Locks:
+ * cache->lock (only if the stack of the current CPU needs to be drained)
+ * Cross-monitor function calls:
+ * kfree
+ */
+void kmem_cache_free(kmem_cache_t* cache, void* object) {
+    u32 eflags;
+    kmem_cpu_cache_t* cpu_cache;
+    if (0 == object)
+        return;
+    KASSERT(cache->ready);
+    KASSERT(KMEM_SLAB(cache, object)->cache == cache);
+    save_eflags(&eflags);
+    cli();
+    cpu_cache = cache->cpu_cache + smp_get_cpu();
+    if (KMEM_CPU_CACHE_SIZE == cpu_cache->count)
+        cache_drain(cache, cpu_cache);
+    cpu_cache->objects[cpu_cache->count] = object;
+    cpu_cache->count++;
+    cpu_cache->frees++;
+    restore_eflags(&eflags);
+}
+
+/*
+ * Get usage statistics for a cache
+ * Parameter:
+ * @cache - the cache
+ * @stats - structure which will be filled with the statistics
+ * Locks:
+ * cache->lock
+ */
+void kmem_cache_get_stats(kmem_cache_t* cache, kmem_cache_stats_t* stats) {
+    u32 eflags;
+    int cpu;
+    spinlock_get(&cache->lock, &eflags);
+    stats->object_size = cache->size;
+    stats->slabs = cache->slabs;
+    stats->objects = cache->slabs * cache->objects_per_slab;
+    stats->refills = cache->refills;
+    stats->drains = cache->drains;
+    stats->cached = 0;
+    stats->allocs = 0;
+    stats->frees = 0;
+    stats->hits = 0;
+    for (cpu = 0; cpu < SMP_MAX_CPU; cpu++) {
+        stats->cached += cache->cpu_cache[cpu].count;
+        stats->allocs += cache->cpu_cache[cpu].allocs;
+        stats->frees += cache->cpu_cache[cpu].frees;
+        stats->hits += cache->cpu_cache[cpu].hits;
+    }
+    stats->active = stats->allocs - stats->frees;
+    spinlock_release(&cache->lock, &eflags);
+}
+
+/***************************************************************
+ * Everything below this line is for debugging only            *
+ **************************************************************/
+
+/*
+ * Print statistics for all caches which have been used so far
+ */
+void kmem_print_stats() {
+    kmem_cache_t* cache;
+    kmem_cache_stats_t stats;
+    PRINT("Object cache statistics\n");
+    PRINT("-----------------------\n");
+    LIST_FOREACH(kmem_caches_head, cache) {
+        kmem_cache_get_stats(cache, &stats);
+        PRINT("%s: size %d, slabs %d, active objects %d (of %d), cached %d\n", cache->name,
+                stats.object_size, stats.slabs, stats.active, stats.objects, stats.cached);
+        PRINT("    allocs %d, frees %d, hits %d, refills %d, drains %d\n", stats.allocs, stats.frees,
+                stats.hits, stats.refills, stats.drains);
+    }
+}
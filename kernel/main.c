@@ -56,10 +56,16 @@
  *                             device
  *                             driver
  *                               |
+ *                          Set up block             <--- bc_init()
+ *                             cache
+ *                               |
  *                             Set up                <--- fs_init()
  *                              file
  *                             systems
  *                               |
+ *                          Set up swap              <--- mm_swap_init()
+ *                             device
+ *                               |
  *                      Migrate stack to kernel
  *                          stack for task 0
  *                               |
@@ -176,12 +182,14 @@ static char* __module = "BOOT  ";
 
 
 /*
- * This is the idle task
+ * This is the idle task. When there is nothing else to do, it zeroes
+ * pages for the memory manager
  */
 static void idle() {
     while (1) {
         sched_yield();
-        asm("hlt");
+        if (0 == mm_refill_zero_pool())
+            asm("hlt");
     }
 }
 
@@ -198,6 +206,8 @@ static void go_idle() {
     int rc;
     sysmon_init();
     wq_init();
+    bc_start_flusher();
+    bc_start_readahead();
     net_init();
     rc = __ctOS_fork();
     if (rc) {
@@ -298,8 +308,11 @@ void run(u32 magic, u32 multiboot_ptr) {
     MSG("Initializing device driver\n");
     dm_init();
     KASSERT(0 == mm_validate());
+    MSG("Setting up block cache\n");
+    bc_init();
     MSG("Setting up file system\n");
     fs_init(DEVICE_NONE);
+    mm_swap_init();
     /*
      * Note that after this point, the following is no longer allowed
      * for code in run:
@@ -52,9 +52,27 @@
  *
  * - the structure phys_mem_layout contains information on the layout of the physical memory
  * - the bitmask phys_mem keeps track of used and free physical pages
+ * - the free physical pages are organized in blocks of 2^order pages by a buddy allocator, see below
+ * - for each CPU, the array magazines contains a small stack of free pages from which single pages are allocated.
+ *   Each magazine has its own lock. This lock is usually only taken by the CPU owning the magazine and therefore
+ *   not contended, other CPUs only take it to drain the magazine when they run out of memory
+ * - the array phys_ref holds reference counts for physical pages which are shared copy-on-write between address spaces
+ * - for each CPU, the array tlb_mailbox contains pending TLB shootdown requests, and the array tlb_active_pid the address
+ *   space which the CPU uses
+ * - the array zero_pool holds physical pages which have already been filled with zeroes. It is filled by the idle tasks via
+ *   mm_refill_zero_pool and used by mm_get_zeroed_page whenever a new page in the user area needs to be zeroed
+ * - the array swap_ref holds the number of page table entries which refer to each slot on the swap device, and the
+ *   structure swap_inflight describes the page which is currently written to the swap device (see the section on
+ *   swapping below)
  * - an instance of heap_t contains the metadata for the common kernel heap
  * - corresponding to each process, there is an instance of the structure address_space_t which describes the virtual address
  *   space of this process
+ * - attached to each address space, there is a list of user segments, i.e. regions in the user area which are populated
+ *   on demand when a page fault occurs. This list is changed by exec and exit processing, when no other task of the
+ *   process is active, by fork before the new process starts to run and by the mmap and munmap system calls. As only
+ *   kernel threads can be created within a process, these system calls cannot race with a page fault in user space of
+ *   the same process. Elements are added to and removed from the list while holding the lock of the address space, so
+ *   that do_sbrk can safely check for conflicts with existing mappings
  * - corresponding to each task, there is an instance of the structure stack_allocator_t which is used to reserve a part of the
  *   kernel stack of the process for this thread. The stack allocators are accessible from the address space structure as a linked
  *   list
@@ -71,9 +89,16 @@
  *   to zero a physical page before using it
  * - the lock st_lock is used to protect the list of stack allocators for a given process
  * In addition, there are a few cross-process data structures and locks protecting them:
- * - phys_mem_lock - protect bitmap of available physical pages
+ * - phys_mem_lock - protect bitmap of available physical pages, buddy allocator and reference counts
+ * - magazines[cpu].lock - protect the page magazine of a CPU. It can be taken wherever phys_mem_lock can be taken,
+ *   and phys_mem_lock is the only lock which is acquired while holding it
  * - kernel_heap_lock - protect kernel heap metadata
  * - address_spaces_lock - protect list of address spaces. Each address space itself is again protected by a lock.
+ * - tlb_mailbox[cpu].lock - protect the TLB shootdown requests for a CPU. No other lock is acquired while holding this lock
+ * - zero_pool_lock - protect the pool of zeroed pages. No other lock is acquired while holding this lock
+ * - swap_lock - protect the reference counts of the slots on the swap device. No other lock is acquired while holding this lock
+ * - swap_mutex - a semaphore which serializes all reads from and writes to the swap device. It is only taken by code
+ *   which may sleep and is never taken while holding one of the spinlocks above
  *
  * To avoid deadlocks, only certain orders of getting and acquiring locks are allowed. These rules are summarized in the following chart,
  * where an arrow A ---> B means that if you own lock A, you can safely get lock B in addition (this does not mean that having A is a
@@ -110,31 +135,41 @@
  *
  * b) things are more difficult in case access which was previously granted is denied by the change. Suppose again that a thread running
  * on CPU A removes a page mapping and another thread in the same address space running on CPU B tries to access the page. If the mapping
- * is still in the TLB of CPU B, a wrong address translation will take space. In this case, an IPI would be required to inform the remote
- * CPU about the invalidation of the page table entry. Similarly, a thread could be migrated to another CPU and try to access the page after
- * the migration, with the same result. However, ctOS does currently not use this for the following reason.
+ * is still in the TLB of CPU B, a wrong address translation will take place. In this case, an IPI is required to inform the remote
+ * CPU about the invalidation of the page table entry ("TLB shootdown").
  *
- * There are only three situations in which a page is unmapped.
+ * To know which CPUs need to be informed, the array tlb_active_pid records for each CPU the address space which it uses. It is updated
+ * by the process manager via mm_tlb_switch whenever a task switch is prepared. As the following load of CR3 flushes the TLB, a CPU can
+ * only hold TLB entries for user space pages of the address space recorded there. A thread which migrates to another CPU therefore
+ * never sees stale entries.
  *
- * a) sometimes, pages above the kernel stack are mapped and unmapped temporarily to access physical pages not mapped into the address
- *    space of the current process. However, access to these pages is restricted to a few lines of code with no possibility of migrating
- *    the task to another CPU (no blocking / sleeping), thus no special action is required here.
- * b) when a kernel thread exits, its kernel stack space is unmapped. Thus if thread B tries to access the kernel stack of task A after
- *    task A has terminated, it could use an outdated mapping. Note that a thread can easily and legally access another threads stack,
- *    this will for instance happen if thread A spawns thread B, passing a reference to a local variable as argument or putting a
- *    reference to the stack into a shared data structure. However, when thread A exits, this data would become invalid anyway as the
- *    stack is rolled back, thus this type of access AFTER a task has exited would be considered a bug anyway. As the kernel stack is not
- *    readable for user space code, we assume that this type of access does not happen in the kernel. Thus we also do not implement a
- *    remote TLB invalidation in this case.
- * c) finally, user space pages are unmapped when a process exits. In this case, however, the exit processing will make sure that all but
- *    one task within the process complete before the pages are actually unmapped. The last task will never return to user space again.
- *    Thus the user part of the address space is only accessed by one CPU at this point and no TLB invalidation on other CPUs is needed
- *    (note, however, that file system operations like closing all open files can lead to a migration to another CPU, however only kernel
- *    pages which are not unmapped will be accessed in this case).
+ * Pages which are affected by a change are collected in a batch (mm_tlb_batch_t) after the local TLB entry has been invalidated. When the
+ * batch is flushed, the pages are placed into the mailbox of each CPU which uses the address space, and one IPI with vector
+ * IPI_TLB_SHOOTDOWN is sent to each of these CPUs. The receiving CPU invalidates the pages one by one or, if more than MM_TLB_FLUSH_THRESHOLD
+ * pages have been requested, simply reloads CR3. The sender waits until all CPUs have acknowledged the request and only then releases the
+ * physical pages which were mapped by the invalidated entries, so that no other CPU can access a page after it has been reused. While
+ * waiting, the sender processes its own mailbox, as two CPUs might send a shootdown to each other at the same time with interrupts disabled.
+ * For the same reason, a batch must never be flushed while holding a spinlock - the remote CPU might spin for this lock with interrupts
+ * disabled.
  *
- * This is the reason why an IPI mechanism to invalidate TLBs ("TLB shootdown") is not implemented by ctOS at the moment. Should any of
- * the assumptions taken above change (if, for instance, we decide to migrate tasks to other CPUs while they are running or when we
- * implement a version of the sbrk system call which can actually give back memory to the system), this needs to be revisited.
+ * Shootdowns are currently done in the following situations:
+ *
+ * a) when pages are unmapped by munmap or when the user area is removed by exec or exit
+ * b) when a copy-on-write page is replaced by a private copy, as other CPUs might still read the old page
+ * c) when a process forks and its user space pages are write protected (see mm_clone_pt). Here the entire TLB is flushed on all other
+ *    CPUs using the address space once the page tables have been cloned. Note that until this has happened, another thread could still
+ *    write to a page via a stale entry, and the child will then see this change
+ *
+ * No shootdown is done for pages above the kernel stack which are mapped temporarily to access physical pages not mapped into the
+ * address space of the current process, as access to these pages is restricted to a few lines of code with no possibility of
+ * migrating the task to another CPU. Similarly, when a kernel thread exits, its kernel stack is unmapped without a shootdown. Any
+ * access to the stack of a task after this task has exited would be a bug anyway.
+ *
+ * If the CPU supports PGE, all pages in the common area are mapped as global pages, so that their TLB entries are not flushed
+ * when CR3 is reloaded during a task switch. This is safe as the common area is identical in all address spaces and a mapping
+ * in the common area is never changed or removed once it has been established - the kernel heap only grows, and memory mapped
+ * I/O regions are mapped once during initialization. Note that a reload of CR3 does not remove global entries, so a full flush
+ * requested via a shootdown only affects the user space and the private kernel area, which is exactly what is needed.
  *
  */
 
@@ -151,6 +186,12 @@
 #include "params.h"
 #include "kerrno.h"
 #include "smp.h"
+#include "apic.h"
+#include "cpu.h"
+#include "fs.h"
+#include "pagecache.h"
+#include "dm.h"
+#include "lib/sys/mman.h"
 
 static char* __module = "MEM   ";
 
@@ -181,21 +222,6 @@ static int have_ramdisk = 0;
  */
 static phys_mem_layout_t phys_mem_layout;
 
-/*
- * The variable start_search marks the page at which the next search for
- * free physical memory is started and is maintained according to the
- * following algorithm
- * - initially the value is 0
- * - when we search for a free page, we start at this page
- * - we then search until we find the first free page from there, allocate this page and set start_search
- *   to the next page
- * - when a page is returned to the pool, start_search is set to this page if this
- * page was below start_search
- * This makes sure that at any point in time, all pages below that value
- * are in use
- */
-static u32 start_search = 0;
-
 /*
  * This is a bitmask describing usage of physical memory
  * A set bit indicates that the page is in use
@@ -203,6 +229,135 @@ static u32 start_search = 0;
 static u8 phys_mem[MM_PHYS_MEM_PAGES / 8];
 static spinlock_t phys_mem_lock;
 
+/*
+ * Free physical memory is managed by a buddy allocator. A block of order k consists of 2^k
+ * contiguous pages and starts at a page number which is a multiple of 2^k, so that the block
+ * with number b at order k contains the pages b*2^k,...,(b+1)*2^k-1. Its buddy is the block b^1,
+ * and two free buddies are merged into the block b/2 at order k+1.
+ *
+ * For each order, the free blocks are recorded in a bitmap with one bit per block which is set if the block
+ * is free. To locate a free block without scanning, each bitmap is supplemented by three summary bitmaps. A bit
+ * in the summary at level n+1 is set if the corresponding 32 bit word at level n is not zero. As there are at
+ * most 2^20 blocks per order, the summary at level 3 fits into one word, and a free block is found by descending
+ * from there in four steps. The bitmaps of all orders are stored in the arrays buddy_l0 - buddy_l2, starting at
+ * the offsets in buddy_offset
+ */
+#define BUDDY_PAGES (1 << 20)
+#define BUDDY_L0_WORDS (2 * BUDDY_PAGES / 32)
+#define BUDDY_L1_WORDS (2 * BUDDY_PAGES / 1024)
+#define BUDDY_L2_WORDS (2 * 32 + MM_BUDDY_ORDERS)
+#define BUDDY_WORDS(bits) (((bits) + 31) / 32)
+static u32 buddy_l0[BUDDY_L0_WORDS];
+static u32 buddy_l1[BUDDY_L1_WORDS];
+static u32 buddy_l2[BUDDY_L2_WORDS];
+static u32 buddy_l3[MM_BUDDY_ORDERS];
+static u32 buddy_offset[3][MM_BUDDY_ORDERS];
+
+/*
+ * Number of free blocks per order
+ */
+static u32 buddy_free_blocks[MM_BUDDY_ORDERS];
+
+/*
+ * Per-CPU magazines of free pages
+ */
+static page_magazine_t magazines[SMP_MAX_CPU];
+
+/*
+ * Per-CPU mailboxes for TLB shootdown requests
+ */
+static tlb_mailbox_t tlb_mailbox[SMP_MAX_CPU];
+
+/*
+ * The address space which each CPU uses, i.e. the process whose page table directory is in CR3 or will be
+ * loaded into CR3 when the CPU returns from the current interrupt. As loading CR3 flushes the TLB, only these
+ * CPUs can hold TLB entries for user space pages of a process
+ */
+static u32 tlb_active_pid[SMP_MAX_CPU];
+
+/*
+ * Pool of physical pages which have already been filled with zeroes by the idle tasks,
+ * protected by zero_pool_lock
+ */
+static u32 zero_pool[MM_ZERO_POOL_SIZE];
+static int zero_pool_count = 0;
+static u32 zero_pool_hits = 0;
+static u32 zero_pool_misses = 0;
+static u32 zero_pool_filled = 0;
+static spinlock_t zero_pool_lock;
+
+/*
+ * Set if 4 MB pages are used, i.e. if the CPU supports PSE and this has not been turned off by
+ * the kernel parameter pse. The counters record how many 4 MB pages have been mapped into the user
+ * area and how many of them had to be split into 4 kB pages again
+ */
+static int large_pages = 0;
+static u32 large_pages_mapped = 0;
+static u32 large_pages_split = 0;
+
+/*
+ * Set if pages in the common area are mapped as global pages, i.e. if the CPU supports PGE and this has
+ * not been turned off by the kernel parameter pge
+ */
+static int global_pages = 0;
+
+/*
+ * The swap device and the number of slots of one page on it. For each slot, swap_ref holds the number
+ * of page table entries referring to it, protected by swap_lock. The clock hand (swap_hand_pid, swap_hand_page)
+ * is the position at which the next scan for a page to be swapped out starts, and swap_buffer is used for
+ * all transfers to and from the device. Both are protected by swap_mutex
+ */
+static dev_t swap_dev = DEVICE_NONE;
+static u32 swap_slots = 0;
+static u32 swap_used = 0;
+static u32 swap_next_slot = 0;
+static u16 swap_ref[MM_SWAP_MAX_SLOTS];
+static spinlock_t swap_lock;
+static semaphore_t swap_mutex;
+static u8 __attribute__ ((aligned (MM_PAGE_SIZE))) swap_buffer[MM_PAGE_SIZE];
+static u32 swap_hand_pid = 0;
+static u32 swap_hand_page = MM_COMMON_AREA_SIZE;
+static u32 swap_outs = 0;
+static u32 swap_ins = 0;
+static u32 swap_second_chances = 0;
+static u32 swap_cancelled = 0;
+static u32 swap_rollbacks = 0;
+
+/*
+ * The page which is currently written to the swap device. While active is set, the page table entry
+ * refers to the slot already, but the physical page has not yet been released, so that an access to the
+ * page can simply restore the original entry. This is protected by the page table lock of the process
+ * to which the page belongs
+ */
+static struct {
+    int active;                 // set while the page is written
+    int cancelled;              // set if the original entry has been restored
+    u32 pid;                    // the process
+    u32 page;                   // virtual address of the page
+    u32 slot;                   // the slot to which the page is written
+    pte_t pte;                  // the original page table entry
+} swap_inflight;
+
+/*
+ * A page table entry for a page which has been written to the swap device
+ */
+#define MM_PTE_SWAPPED(pte) ((0 == (pte)->p) && (pte)->swapped)
+
+/*
+ * Reference counts for physical pages which are shared copy-on-write between several
+ * address spaces. An entry is the number of references to a page in addition to the first
+ * one, i.e. it is zero for all pages which are mapped only once. This is also protected
+ * by phys_mem_lock
+ */
+static u16 phys_ref[MM_PHYS_MEM_PAGES];
+
+/*
+ * Statistics on write accesses to copy-on-write pages: the number of pages which had to be
+ * copied and the number of pages which were no longer shared and could simply be made writable
+ */
+static u32 cow_copies = 0;
+static u32 cow_reuses = 0;
+
 /*
  * This structure holds the kernel heap
  */
@@ -238,6 +393,13 @@ static u8 __attribute__ ((aligned (MM_PAGE_SIZE))) common_kernel_stack[MM_PAGE_S
  * Forward declarations
  */
 static int access_allowed(u32 virtual_address, pte_t* ptd, int sv, int rw);
+static int mm_resolve_cow(u32 address);
+static int mm_load_page(u32 address, int may_sleep);
+static u32 zero_pool_take(int stats);
+static void swap_slot_share(u32 slot);
+static void swap_slot_put(u32 slot);
+static int mm_swap_cancel(u32 pid, pte_t* pte);
+static int mm_swap_in(u32 page_base, int may_sleep);
 
 /****************************************************************************************
  * The following functions constitute the physical memory manager                       *
@@ -360,11 +522,137 @@ static void locate_ramdisk() {
 }
 
 /*
- * Initialize bitmask of physical pages
- * Parameters:
- * @info_block_ptr - address of multiboot information block
+ * Mark a block as free in the bitmaps of the buddy allocator. The caller needs
+ * to hold the lock phys_mem_lock
+ * Parameter:
+ * @order - the order of the block
+ * @block - the number of the block
+ */
+static void buddy_mark_free(int order, u32 block) {
+    u32 i0 = block / 32;
+    u32 i1 = i0 / 32;
+    u32 i2 = i1 / 32;
+    buddy_l0[buddy_offset[0][order] + i0] |= (1 << (block % 32));
+    buddy_l1[buddy_offset[1][order] + i1] |= (1 << (i0 % 32));
+    buddy_l2[buddy_offset[2][order] + i2] |= (1 << (i1 % 32));
+    buddy_l3[order] |= (1 << i2);
+    buddy_free_blocks[order]++;
+}
+
+/*
+ * Remove a free block from the bitmaps of the buddy allocator, updating the
+ * summary bitmaps if needed. The caller needs to hold the lock phys_mem_lock
+ * Parameter:
+ * @order - the order of the block
+ * @block - the number of the block
+ */
+static void buddy_mark_used(int order, u32 block) {
+    u32 i0 = block / 32;
+    u32 i1 = i0 / 32;
+    u32 i2 = i1 / 32;
+    buddy_free_blocks[order]--;
+    buddy_l0[buddy_offset[0][order] + i0] &= ~(1 << (block % 32));
+    if (buddy_l0[buddy_offset[0][order] + i0])
+        return;
+    buddy_l1[buddy_offset[1][order] + i1] &= ~(1 << (i0 % 32));
+    if (buddy_l1[buddy_offset[1][order] + i1])
+        return;
+    buddy_l2[buddy_offset[2][order] + i2] &= ~(1 << (i1 % 32));
+    if (buddy_l2[buddy_offset[2][order] + i2])
+        return;
+    buddy_l3[order] &= ~(1 << i2);
+}
+
+/*
+ * Check whether a block is free. The caller needs to hold the lock phys_mem_lock
+ * Parameter:
+ * @order - the order of the block
+ * @block - the number of the block
+ * Return value:
+ * 1 if the block is free
+ * 0 otherwise
+ */
+static int buddy_is_free(int order, u32 block) {
+    if (block >= (BUDDY_PAGES >> order))
+        return 0;
+    return (buddy_l0[buddy_offset[0][order] + block / 32] >> (block % 32)) & 0x1;
+}
+
+/*
+ * Locate the free block with the lowest number for a given order.
+ * The caller needs to hold the lock phys_mem_lock
+ * Parameter:
+ * @order - the order
+ * @block - the number of the block will be stored here
+ * Return value:
+ * 1 if a free block was found
+ * 0 if there is no free block of this order
+ */
+static int buddy_first_free(int order, u32* block) {
+    u32 i;
+    if (0 == buddy_l3[order])
+        return 0;
+    i = __builtin_ctz(buddy_l3[order]);
+    i = i * 32 + __builtin_ctz(buddy_l2[buddy_offset[2][order] + i]);
+    i = i * 32 + __builtin_ctz(buddy_l1[buddy_offset[1][order] + i]);
+    *block = i * 32 + __builtin_ctz(buddy_l0[buddy_offset[0][order] + i]);
+    return 1;
+}
+
+/*
+ * Add a block of pages to the free blocks of the buddy allocator, merging it
+ * with its buddy as long as the buddy is free as well. The caller needs to
+ * hold the lock phys_mem_lock
+ * Parameter:
+ * @page - the number of the first page of the block
+ * @order - the order of the block
+ */
+static void buddy_insert(u32 page, int order) {
+    u32 block = page >> order;
+    while ((order < MM_BUDDY_MAX_ORDER) && buddy_is_free(order, block ^ 1)) {
+        buddy_mark_used(order, block ^ 1);
+        block = block >> 1;
+        order++;
+    }
+    buddy_mark_free(order, block);
+}
+
+/*
+ * Set up the buddy allocator from the bitmask of physical pages
+ */
+static void buddy_init() {
+    int order;
+    u32 words[3];
+    u32 total[3] = {0, 0, 0};
+    u32 page;
+    int level;
+    memset(buddy_l0, 0, sizeof(buddy_l0));
+    memset(buddy_l1, 0, sizeof(buddy_l1));
+    memset(buddy_l2, 0, sizeof(buddy_l2));
+    for (order = 0; order <= MM_BUDDY_MAX_ORDER; order++) {
+        words[0] = BUDDY_WORDS(BUDDY_PAGES >> order);
+        words[1] = BUDDY_WORDS(words[0]);
+        words[2] = BUDDY_WORDS(words[1]);
+        for (level = 0; level < 3; level++) {
+            buddy_offset[level][order] = total[level];
+            total[level] += words[level];
+        }
+        buddy_l3[order] = 0;
+        buddy_free_blocks[order] = 0;
+    }
+    KASSERT(total[0] <= BUDDY_L0_WORDS);
+    KASSERT(total[1] <= BUDDY_L1_WORDS);
+    KASSERT(total[2] <= BUDDY_L2_WORDS);
+    for (page = 0; page < sizeof(phys_mem) * 8; page++) {
+        if (0 == BITFIELD_GET_BIT(phys_mem, page))
+            buddy_insert(page, 0);
+    }
+}
+
+/*
+ * Initialize bitmask of physical pages and the buddy allocator
  */
-static void phys_mem_init() {
+void phys_mem_init() {
     int i;
     u32 j;
     /*
@@ -374,6 +662,8 @@ static void phys_mem_init() {
     for (j = 0; j < MM_PHYS_MEM_PAGES / 8; j++)
         phys_mem[j]=0xff;
     spinlock_init(&phys_mem_lock);
+    for (j = 0; j < SMP_MAX_CPU; j++)
+        spinlock_init(&magazines[j].lock);
     /*
      * Next we go through the tables provided by the GRUB2
      * boot loader and mark all pages as available which
@@ -397,162 +687,469 @@ static void phys_mem_init() {
      * intial RAM disk - if any
      */
     locate_ramdisk();
+    /*
+     * and build the lists of free blocks
+     */
+    buddy_init();
 }
 
 /*
- * This function returns a free physical page in memory
- * and marks it as used. The page is returned by providing its base address
- * If no free page could be found 0 is returned
+ * Allocate a block of 2^order physically contiguous pages. The caller needs to
+ * hold the lock phys_mem_lock
+ * Parameter:
+ * @order - the order of the block
  * Return value:
- * the base address of the physical page
+ * the number of the first page of the block
+ * 0 if no block of this size is available
+ */
+static u32 buddy_alloc(int order) {
+    int k = order;
+    u32 block = 0;
+    u32 page;
+    u32 i;
+    while ((k <= MM_BUDDY_MAX_ORDER) && (0 == buddy_first_free(k, &block)))
+        k++;
+    if (k > MM_BUDDY_MAX_ORDER)
+        return 0;
+    buddy_mark_used(k, block);
+    /*
+     * Split the block until we have reached the requested order, returning
+     * the upper half to the free blocks in each step
+     */
+    while (k > order) {
+        k--;
+        block = block << 1;
+        buddy_mark_free(k, block + 1);
+    }
+    page = block << order;
+    for (i = page; i < page + (1 << order); i++)
+        BITFIELD_SET_BIT(phys_mem, i);
+    phys_mem_layout.available -= (1 << order);
+    return page;
+}
+
+/*
+ * Return a block of 2^order pages to the buddy allocator. The caller needs to
+ * hold the lock phys_mem_lock
+ * Parameter:
+ * @page - the number of the first page of the block
+ * @order - the order of the block
+ */
+static void buddy_free(u32 page, int order) {
+    u32 i;
+    if (0 == BITFIELD_GET_BIT(phys_mem, page)) {
+        ERROR("Trying to release physical page %x which is not in use\n", MM_PAGE_START(page));
+        return;
+    }
+    for (i = page; i < page + (1 << order); i++)
+        BITFIELD_CLEAR_BIT(phys_mem, i);
+    phys_mem_layout.available += (1 << order);
+    buddy_insert(page, order);
+}
+
+/*
+ * Return pages from a magazine to the buddy allocator. The caller needs to hold
+ * the lock on the magazine
+ * Parameter:
+ * @magazine - the magazine
+ * @pages - number of pages to return
  * Locks:
  * phys_mem_lock
  */
-static u32 mm_get_phys_page_impl() {
-    u32 page = 0;
+static void magazine_drain(page_magazine_t* magazine, int pages) {
     u32 flags;
     spinlock_get(&phys_mem_lock, &flags);
-    page = start_search;
-    if (__mm_log)
-        PRINT("Starting search at page no. %x\n", start_search);
-    while ((BITFIELD_GET_BIT(phys_mem, page)) && (page < MM_PHYS_MEM_PAGES)) {
-        page++;
+    while ((pages > 0) && (magazine->count > 0)) {
+        magazine->count--;
+        buddy_free(magazine->pages[magazine->count], 0);
+        pages--;
     }
-    if (MM_PHYS_MEM_PAGES == page) {
-        ERROR("No physical page left, started search at %x, resuming search at beginning\n", start_search);
-        page = 0;
-        start_search = 0;
-        while ((BITFIELD_GET_BIT(phys_mem, page)) && (page < MM_PHYS_MEM_PAGES)) {
-            page++;
-        }
-        if (MM_PHYS_MEM_PAGES == page)  {
-            ERROR("Did not find page at second attempt, giving up\n");
-            spinlock_release(&phys_mem_lock, &flags);
-            return 0;
-        }
-    }
-    BITFIELD_SET_BIT(phys_mem, page);
-    start_search = page + 1;
-    phys_mem_layout.available--;
+    magazine->drains++;
     spinlock_release(&phys_mem_lock, &flags);
-    MM_DEBUG("Returning physical page %x\n", page);
-    return MM_PAGE_START(page);
 }
-/*
- * Function pointer to allow for stubbing
- */
-u32 (*mm_get_phys_page)() = mm_get_phys_page_impl;
 
 /*
- * This function releases a used physical page and
- * returns it into the pool of available pages
+ * Refill a magazine with MM_MAGAZINE_BATCH pages from the buddy allocator or less if
+ * there are not enough free pages. The caller needs to hold the lock on the magazine
  * Parameter:
- * @page_base - physical base address of page to be released
+ * @magazine - the magazine of the current CPU
  * Locks:
  * phys_mem_lock
  */
-static void mm_put_phys_page_impl(u32 page_base) {
+static void magazine_refill(page_magazine_t* magazine) {
     u32 flags;
+    u32 page;
     spinlock_get(&phys_mem_lock, &flags);
-    BITFIELD_CLEAR_BIT(phys_mem, MM_PAGE(page_base));
-    phys_mem_layout.available++;
-    if (MM_PAGE(page_base) < start_search)
-        start_search = MM_PAGE(page_base);
+    while (magazine->count < MM_MAGAZINE_BATCH) {
+        if (0 == (page = buddy_alloc(0)))
+            break;
+        magazine->pages[magazine->count] = page;
+        magazine->count++;
+    }
+    magazine->refills++;
     spinlock_release(&phys_mem_lock, &flags);
 }
+
 /*
- * Function pointer to allow for stubbing
+ * Return the pages in the magazines of all CPUs to the buddy allocator. This is done
+ * if an allocation fails, as the pages cached in the magazines would otherwise
+ * not be available to the allocating CPU
+ * Return value:
+ * the number of pages returned to the buddy allocator
+ * Locks:
+ * lock on each magazine
+ * phys_mem_lock
  */
-void (*mm_put_phys_page)(u32 page) = mm_put_phys_page_impl;
-
-/****************************************************************************************
- * Everything below this line is about managing the virtual memory of a process. The    *
- * first group of functions provides basic services to manipulate page tables and       *
- * page table directories                                                               *
- ***************************************************************************************/
+static int magazines_drain_all() {
+    u32 flags;
+    int cpu;
+    int pages = 0;
+    for (cpu = 0; cpu < SMP_MAX_CPU; cpu++) {
+        if (0 == magazines[cpu].count)
+            continue;
+        spinlock_get(&magazines[cpu].lock, &flags);
+        if (magazines[cpu].count) {
+            pages += magazines[cpu].count;
+            magazine_drain(magazines + cpu, magazines[cpu].count);
+        }
+        spinlock_release(&magazines[cpu].lock, &flags);
+    }
+    return pages;
+}
 
 /*
- * Get a pointer to the page table directory of an arbitrary process
- * This function should only be called once paging has been enabled
- * It is addressed via a function pointer to allow for stubbing
+ * Allocate a block of 2^order physically contiguous pages, for instance for a
+ * DMA buffer. The block is aligned to its size. If no block is available, the
+ * pages in the magazines of all CPUs are returned to the buddy allocator
+ * and the allocation is tried again
  * Parameter:
- * @pid - the process id for which the PTD is requested
+ * @order - the order of the block, at most MM_BUDDY_MAX_ORDER
  * Return value:
- * pointer to the page table directory of the  process. As
- * the PTD is located below the kernel BSS end, this is at the same
- * time the physical and virtual address of the PTD
+ * the physical base address of the block
+ * 0 if no block of the requested size is available
+ * Locks:
+ * phys_mem_lock
  */
-static pte_t* mm_get_ptd_for_pid_impl(u32 pid) {
-    return proc_ptd[pid];
+u32 mm_get_phys_pages(int order) {
+    u32 page;
+    u32 flags;
+    if ((order < 0) || (order > MM_BUDDY_MAX_ORDER))
+        return 0;
+    spinlock_get(&phys_mem_lock, &flags);
+    page = buddy_alloc(order);
+    spinlock_release(&phys_mem_lock, &flags);
+    if ((0 == page) && (magazines_drain_all())) {
+        spinlock_get(&phys_mem_lock, &flags);
+        page = buddy_alloc(order);
+        spinlock_release(&phys_mem_lock, &flags);
+    }
+    if (0 == page) {
+        ERROR("No block of order %d left\n", order);
+        return 0;
+    }
+    MM_DEBUG("Returning block of order %d at page %x\n", order, page);
+    return MM_PAGE_START(page);
 }
-pte_t* (*mm_get_ptd_for_pid)() = mm_get_ptd_for_pid_impl;
 
+/*
+ * Release a block of pages which has been allocated with mm_get_phys_pages
+ * Parameter:
+ * @page_base - physical base address of the block
+ * @order - the order which has been used to allocate the block
+ * Locks:
+ * phys_mem_lock
+ */
+void mm_put_phys_pages(u32 page_base, int order) {
+    u32 flags;
+    if ((order < 0) || (order > MM_BUDDY_MAX_ORDER) || (MM_PAGE(page_base) % (1 << order))) {
+        ERROR("Invalid block at %x, order %d\n", page_base, order);
+        return;
+    }
+    spinlock_get(&phys_mem_lock, &flags);
+    buddy_free(MM_PAGE(page_base), order);
+    spinlock_release(&phys_mem_lock, &flags);
+}
 
 /*
- * Get a pointer to the page table directory of the currently running process
- * This function should only be called once paging has been enabled
- * It is addressed via a function pointer to allow for stubbing
+ * Take a page from the magazine of the current CPU and refill the magazine
+ * from the buddy allocator if it is empty
  * Return value:
- * pointer to the page table directory of the current process. As
- * the PTD is located below the kernel BSS end, this is at the same
- * time the physical and virtual address of the PTD
+ * the page number or 0 if no page is left
+ * Locks:
+ * lock on the magazine
+ * phys_mem_lock (only when the magazine needs to be refilled)
  */
-static pte_t* mm_get_ptd_impl() {
-    return proc_ptd[pm_get_pid()];
+static u32 magazine_get_page() {
+    u32 flags;
+    u32 page = 0;
+    page_magazine_t* magazine = magazines + smp_get_cpu();
+    spinlock_get(&magazine->lock, &flags);
+    if (0 == magazine->count)
+        magazine_refill(magazine);
+    else
+        magazine->hits++;
+    if (magazine->count) {
+        magazine->count--;
+        page = magazine->pages[magazine->count];
+    }
+    spinlock_release(&magazine->lock, &flags);
+    return page;
 }
-pte_t* (*mm_get_ptd)() = mm_get_ptd_impl;
-
 
 /*
- * Get the virtual address of a page table.
- * If paging is not yet enabled, this function will simply
- * extract the address of a page table from the page table directory entry
- * at offset @offset and return it.
- * If paging is enabled, it will use the mapping of the page tables
- * into the upper 4 MB of the virtual address space
- * Parameters:
- * @ptd: pointer to the page table directory to use
- * @ptd_offset: offset of the page table entry in the PTD which we are interested in
- * @pg_enabled: set this to 1 to indicate that paging has already been enabled
+ * This function returns a free physical page in memory
+ * and marks it as used. The page is returned by providing its base address
+ * If no free page could be found 0 is returned. The page is taken from the
+ * magazine of the current CPU, which is refilled from the buddy allocator if
+ * it is empty. If the buddy allocator is empty as well, the magazines of the
+ * other CPUs are drained and the allocation is tried again
  * Return value:
- * a pointer to the virtual address of the requested page table
+ * the base address of the physical page
+ * Locks:
+ * lock on the magazine of the current CPU
+ * phys_mem_lock (only when the magazine needs to be refilled)
+ * lock on the magazines of the other CPUs (only if no free page is left)
  */
-static pte_t* mm_get_pt_address_impl(pte_t* ptd, int ptd_offset, int pg_enabled) {
-    if (0 == pg_enabled)
-        return (pte_t*) ((ptd[ptd_offset].page_base) * MM_PAGE_SIZE);
-    else
-        return (pte_t*) MM_VIRTUAL_PT_ENTRY(ptd_offset, 0);
+static u32 mm_get_phys_page_impl() {
+    u32 page;
+    page = magazine_get_page();
+    if ((0 == page) && (magazines_drain_all()))
+        page = magazine_get_page();
+    /*
+     * If everything else fails, use a page from the pool of zeroed pages
+     */
+    if (0 == page)
+        page = MM_PAGE(zero_pool_take(0));
+    if (0 == page) {
+        ERROR("No physical page left\n");
+        return 0;
+    }
+    MM_DEBUG("Returning physical page %x\n", page);
+    return MM_PAGE_START(page);
 }
 /*
- * Access via function pointers to ease stubbing
+ * Function pointer to allow for stubbing
  */
-pte_t* (*mm_get_pt_address)(pte_t* ptd, int ptd_offset, int pg_enabled) =
-        mm_get_pt_address_impl;
+u32 (*mm_get_phys_page)() = mm_get_phys_page_impl;
 
 /*
- * Temporarily attach a physical page to the virtual address space of the current
- * process and return the virtual address
- * Parameters:
- * @phys_page: the base address of the physical page which needs to be mapped
- * Return value:
- * virtual address of newly mapped page
+ * This function releases a used physical page and
+ * returns it into the pool of available pages. If the page
+ * is shared copy-on-write with another address space, only
+ * the reference count is decreased. Otherwise the page is
+ * put into the magazine of the current CPU, and half of the
+ * magazine is returned to the buddy allocator if it is full
+ * Parameter:
+ * @page_base - physical base address of page to be released
  * Locks:
- * sp_lock - lock to protect special page slots
+ * lock on the magazine of the current CPU
+ * phys_mem_lock (only for shared pages or when the magazine needs to be drained)
  */
-static u32 mm_attach_page_impl(u32 phys_page) {
-    u32 first_reserved_page = MM_VIRTUAL_TOS + 1;
-    pte_t* ptd = (pte_t*) mm_get_ptd();
-    pte_t* pt;
-    u32 page;
-    u32 used_page = 0;
+static void mm_put_phys_page_impl(u32 page_base) {
     u32 flags;
-    spinlock_t* sp_lock;
+    page_magazine_t* magazine;
     /*
-     * In this function, we assume that the reserved pages directly above the kernel
-     * stack are within the same 4 MB entry as the kernel stack itself in our
-     * virtual address space, so that the page table for this area exists, and that
-     * all reserved pages are within the same 4 MB area. Thus to map a page, we do
-     * not need to set up a new page table but can reuse the one set up for the kernel stack.
+     * If the reference count is zero, the caller holds the only reference
+     * to the page, so nobody else can change the reference count and we can
+     * read it without getting the lock
+     */
+    if (phys_ref[MM_PAGE(page_base)]) {
+        spinlock_get(&phys_mem_lock, &flags);
+        if (phys_ref[MM_PAGE(page_base)]) {
+            phys_ref[MM_PAGE(page_base)]--;
+            spinlock_release(&phys_mem_lock, &flags);
+            return;
+        }
+        spinlock_release(&phys_mem_lock, &flags);
+    }
+    magazine = magazines + smp_get_cpu();
+    spinlock_get(&magazine->lock, &flags);
+    if (MM_MAGAZINE_SIZE == magazine->count)
+        magazine_drain(magazine, MM_MAGAZINE_BATCH);
+    magazine->pages[magazine->count] = MM_PAGE(page_base);
+    magazine->count++;
+    spinlock_release(&magazine->lock, &flags);
+}
+/*
+ * Function pointer to allow for stubbing
+ */
+void (*mm_put_phys_page)(u32 page) = mm_put_phys_page_impl;
+
+/*
+ * Get statistics on the magazine of a CPU
+ * Parameter:
+ * @cpu - the CPU
+ * @stats - structure which will be filled with the statistics
+ */
+void mm_get_magazine_stats(int cpu, mm_magazine_stats_t* stats) {
+    stats->pages = magazines[cpu].count;
+    stats->hits = magazines[cpu].hits;
+    stats->refills = magazines[cpu].refills;
+    stats->drains = magazines[cpu].drains;
+}
+
+/*
+ * Get the number of free blocks of a given order in the buddy allocator
+ * Parameter:
+ * @order - the order
+ * Return value:
+ * the number of free blocks
+ */
+u32 mm_phys_free_blocks(int order) {
+    if ((order < 0) || (order > MM_BUDDY_MAX_ORDER))
+        return 0;
+    return buddy_free_blocks[order];
+}
+
+/*
+ * Add a reference to a physical page which is in use, so that the
+ * page is only returned to the pool once mm_put_phys_page has been
+ * called once more for each additional reference
+ * Parameter:
+ * @page_base - physical base address of the page
+ * Locks:
+ * phys_mem_lock
+ */
+static void mm_share_phys_page(u32 page_base) {
+    u32 flags;
+    spinlock_get(&phys_mem_lock, &flags);
+    phys_ref[MM_PAGE(page_base)]++;
+    spinlock_release(&phys_mem_lock, &flags);
+}
+
+/*
+ * Check whether a physical page which has been shared copy-on-write
+ * is still referenced by more than one address space and update
+ * the copy-on-write statistics accordingly
+ * Parameter:
+ * @page_base - physical base address of the page
+ * Return value:
+ * 1 if the page is only referenced once
+ * 0 if the page is still shared
+ * Locks:
+ * phys_mem_lock
+ */
+static int mm_phys_page_exclusive(u32 page_base) {
+    u32 flags;
+    int rc;
+    spinlock_get(&phys_mem_lock, &flags);
+    rc = (0 == phys_ref[MM_PAGE(page_base)]);
+    if (rc)
+        cow_reuses++;
+    else
+        cow_copies++;
+    spinlock_release(&phys_mem_lock, &flags);
+    return rc;
+}
+
+/*
+ * Check whether a physical page which is owned by the kernel, for instance a page of
+ * the page cache, is currently mapped into the address space of at least one process
+ * Parameter:
+ * @page_base - physical base address of the page
+ * Return value:
+ * 1 if there are additional references to the page
+ * 0 otherwise
+ * Locks:
+ * phys_mem_lock
+ */
+int mm_phys_page_mapped(u32 page_base) {
+    u32 flags;
+    int rc;
+    spinlock_get(&phys_mem_lock, &flags);
+    rc = (0 != phys_ref[MM_PAGE(page_base)]);
+    spinlock_release(&phys_mem_lock, &flags);
+    return rc;
+}
+
+/****************************************************************************************
+ * Everything below this line is about managing the virtual memory of a process. The    *
+ * first group of functions provides basic services to manipulate page tables and       *
+ * page table directories                                                               *
+ ***************************************************************************************/
+
+/*
+ * Get a pointer to the page table directory of an arbitrary process
+ * This function should only be called once paging has been enabled
+ * It is addressed via a function pointer to allow for stubbing
+ * Parameter:
+ * @pid - the process id for which the PTD is requested
+ * Return value:
+ * pointer to the page table directory of the  process. As
+ * the PTD is located below the kernel BSS end, this is at the same
+ * time the physical and virtual address of the PTD
+ */
+static pte_t* mm_get_ptd_for_pid_impl(u32 pid) {
+    return proc_ptd[pid];
+}
+pte_t* (*mm_get_ptd_for_pid)() = mm_get_ptd_for_pid_impl;
+
+
+/*
+ * Get a pointer to the page table directory of the currently running process
+ * This function should only be called once paging has been enabled
+ * It is addressed via a function pointer to allow for stubbing
+ * Return value:
+ * pointer to the page table directory of the current process. As
+ * the PTD is located below the kernel BSS end, this is at the same
+ * time the physical and virtual address of the PTD
+ */
+static pte_t* mm_get_ptd_impl() {
+    return proc_ptd[pm_get_pid()];
+}
+pte_t* (*mm_get_ptd)() = mm_get_ptd_impl;
+
+
+/*
+ * Get the virtual address of a page table.
+ * If paging is not yet enabled, this function will simply
+ * extract the address of a page table from the page table directory entry
+ * at offset @offset and return it.
+ * If paging is enabled, it will use the mapping of the page tables
+ * into the upper 4 MB of the virtual address space
+ * Parameters:
+ * @ptd: pointer to the page table directory to use
+ * @ptd_offset: offset of the page table entry in the PTD which we are interested in
+ * @pg_enabled: set this to 1 to indicate that paging has already been enabled
+ * Return value:
+ * a pointer to the virtual address of the requested page table
+ */
+static pte_t* mm_get_pt_address_impl(pte_t* ptd, int ptd_offset, int pg_enabled) {
+    if (0 == pg_enabled)
+        return (pte_t*) ((ptd[ptd_offset].page_base) * MM_PAGE_SIZE);
+    else
+        return (pte_t*) MM_VIRTUAL_PT_ENTRY(ptd_offset, 0);
+}
+/*
+ * Access via function pointers to ease stubbing
+ */
+pte_t* (*mm_get_pt_address)(pte_t* ptd, int ptd_offset, int pg_enabled) =
+        mm_get_pt_address_impl;
+
+/*
+ * Temporarily attach a physical page to the virtual address space of the current
+ * process and return the virtual address
+ * Parameters:
+ * @phys_page: the base address of the physical page which needs to be mapped
+ * Return value:
+ * virtual address of newly mapped page
+ * Locks:
+ * sp_lock - lock to protect special page slots
+ */
+static u32 mm_attach_page_impl(u32 phys_page) {
+    u32 first_reserved_page = MM_VIRTUAL_TOS + 1;
+    pte_t* ptd = (pte_t*) mm_get_ptd();
+    pte_t* pt;
+    u32 page;
+    u32 used_page = 0;
+    u32 flags;
+    spinlock_t* sp_lock;
+    /*
+     * In this function, we assume that the reserved pages directly above the kernel
+     * stack are within the same 4 MB entry as the kernel stack itself in our
+     * virtual address space, so that the page table for this area exists, and that
+     * all reserved pages are within the same 4 MB area. Thus to map a page, we do
+     * not need to set up a new page table but can reuse the one set up for the kernel stack.
      * Make sure that this is true
      */
     KASSERT(MM_RESERVED_PAGES + MM_STACK_PAGES <= MM_PT_ENTRIES);
@@ -582,7 +1179,7 @@ static u32 mm_attach_page_impl(u32 phys_page) {
     /*
      * Map page by adding an entry to the page table
      */
-    pt[PT_OFFSET(used_page)] = pte_create(MM_READ_WRITE, MM_SUPERVISOR_PAGE, 0, phys_page);
+    pt[PT_OFFSET(used_page)] = pte_create(MM_READ_WRITE, MM_SUPERVISOR_PAGE, 0, 0, phys_page);
     invlpg(used_page);
     spinlock_release(sp_lock, &flags);
     if (used_page)
@@ -605,53 +1202,313 @@ static void mm_detach_page_impl(u32 virt_page) {
 }
 void (*mm_detach_page)(u32) = mm_detach_page_impl;
 
+/****************************************************************************************
+ * Pool of zeroed pages                                                                 *
+ ***************************************************************************************/
+
 /*
- * Map a given virtual address (32 bit base address of page) into a given
- * physical page (32 bit page address of page). The function performs the following
- * tasks:
- * - determine the entry in the page table directory which is relevant for the virtual address
- * - use the present bit in the page table directory to find out whether a page table exists
- * for this area
- * - if not, allocate a physical page and create an empty page table directory
- * - add an entry to the page table directory
- * This function can be used before paging has been enabled and after
- * paging has been enabled
- * Also note that this function assumes that the page table directory passed
- * as first argument is the page table directory of the current process
- * in case paging has already been enabled
+ * Take a page from the pool of zeroed pages
  * Parameter:
- * @pd - page table directory
- * @phys_base - the base address of the physical page
- * @virtual_base - the base address of the virtual page
- * @rw - read/write bit
- * @us - user/supervisor bit
- * @pcd - pcd bit
- * @pid - pid, used to determine the page table lock
+ * @stats - update the hit and miss counters of the pool. This is only done for requests
+ * from mm_get_zeroed_page, not if mm_get_phys_page falls back to the pool when out of memory
+ * Return value:
+ * the physical address of the page or 0 if the pool is empty
+ * Locks:
+ * zero_pool_lock
+ */
+static u32 zero_pool_take(int stats) {
+    u32 eflags;
+    u32 phys_page = 0;
+    spinlock_get(&zero_pool_lock, &eflags);
+    if (zero_pool_count) {
+        zero_pool_count--;
+        phys_page = zero_pool[zero_pool_count];
+        if (stats)
+            zero_pool_hits++;
+    }
+    else if (stats) {
+        zero_pool_misses++;
+    }
+    spinlock_release(&zero_pool_lock, &eflags);
+    return phys_page;
+}
+
+/*
+ * Fill a physical page with zeroes
+ * Parameter:
+ * @phys_page - physical address of the page
  * Return value:
- * ENOMEM if no memory available for new page table
  * 0 upon success
+ * ENOMEM if the page could not be attached
+ */
+static int mm_zero_page(u32 phys_page) {
+    u32 virt_page;
+    if (0 == (virt_page = mm_attach_page(phys_page)))
+        return ENOMEM;
+    memset((void*) virt_page, 0, MM_PAGE_SIZE);
+    mm_detach_page(virt_page);
+    return 0;
+}
+
+/*
+ * Get a physical page which is filled with zeroes. The page is taken from the pool of zeroed
+ * pages if possible, otherwise a new page is allocated and zeroed
+ * Return value:
+ * the physical address of the page or 0 if no page could be allocated
+ * Cross-monitor function calls:
+ * mm_get_phys_page
+ */
+u32 mm_get_zeroed_page() {
+    u32 phys_page;
+    if ((phys_page = zero_pool_take(1)))
+        return phys_page;
+    if (0 == (phys_page = mm_get_phys_page()))
+        return 0;
+    if (mm_zero_page(phys_page)) {
+        mm_put_phys_page(phys_page);
+        return 0;
+    }
+    return phys_page;
+}
+
+/*
+ * Zero one page and add it to the pool of zeroed pages. This is called by the idle tasks, so that
+ * pages are zeroed by CPUs which have nothing else to do. To not withhold memory from the rest of
+ * the system, nothing is done if less than MM_ZERO_POOL_MIN_FREE pages are free
+ * Return value:
+ * 1 if a page has been added to the pool
+ * 0 if the pool is full or no page could be added
  * Locks:
- * pt_lock - lock to protect page table structure
+ * zero_pool_lock
+ * Cross-monitor function calls:
+ * mm_get_phys_page
+ * mm_put_phys_page
+ */
+int mm_refill_zero_pool() {
+    u32 eflags;
+    u32 phys_page;
+    u32 free_pages = 0;
+    int order;
+    if (zero_pool_count >= MM_ZERO_POOL_SIZE)
+        return 0;
+    for (order = 0; order <= MM_BUDDY_MAX_ORDER; order++)
+        free_pages += mm_phys_free_blocks(order) << order;
+    if (free_pages <= MM_ZERO_POOL_MIN_FREE)
+        return 0;
+    if (0 == (phys_page = mm_get_phys_page()))
+        return 0;
+    if (mm_zero_page(phys_page)) {
+        mm_put_phys_page(phys_page);
+        return 0;
+    }
+    spinlock_get(&zero_pool_lock, &eflags);
+    if (zero_pool_count < MM_ZERO_POOL_SIZE) {
+        zero_pool[zero_pool_count] = phys_page;
+        zero_pool_count++;
+        zero_pool_filled++;
+        phys_page = 0;
+    }
+    spinlock_release(&zero_pool_lock, &eflags);
+    if (phys_page) {
+        mm_put_phys_page(phys_page);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Get statistics on the pool of zeroed pages
+ * Parameter:
+ * @stats - structure which will be filled with the statistics
+ */
+void mm_get_zero_pool_stats(mm_zero_pool_stats_t* stats) {
+    stats->pages = zero_pool_count;
+    stats->hits = zero_pool_hits;
+    stats->misses = zero_pool_misses;
+    stats->filled = zero_pool_filled;
+}
+
+/*
+ * Split a 4 MB page in the user area into 4 kB pages, i.e. replace the entry in the page table directory
+ * by a new page table which maps the same physical pages with the same access rights. This is needed
+ * before a part of a 4 MB page is unmapped or turned into a copy-on-write page. As the translation does not
+ * change, other CPUs can continue to use their TLB entries for the 4 MB page until the access rights of one
+ * of the 4 kB pages are changed, which comes with its own TLB shootdown. The caller needs to hold the page
+ * table lock. 4 MB pages in the common area are never split, as the page tables of the common area are
+ * shared by all processes
+ * Parameter:
+ * @pd - the page table directory of the current process
+ * @virtual_base - an address within the 4 MB page
+ * Return value:
+ * 0 upon success
+ * ENOMEM if no page table could be allocated
  * Cross-monitor function calls:
+ * mm_get_phys_page
+ * mm_put_phys_page
  * mm_attach_page
  * mm_detach_page
- * mm_get_phys_page
  */
-int mm_map_page(pte_t* pd, u32 phys_base, u32 virtual_base, u8 rw, u8 us,
-        u8 pcd, u32 pid) {
-    u8 pg_enabled;
+static int mm_split_large_page(pte_t* pd, u32 virtual_base) {
+    pte_t pde = pd[PTD_OFFSET(virtual_base)];
+    u32 pt_phys;
     pte_t* pt;
+    int i;
+    if (PTD_OFFSET(virtual_base) < MM_SHARED_PAGE_TABLES) {
+        PANIC("Trying to split 4 MB page at %x within common area\n", virtual_base);
+    }
+    if (0 == (pt_phys = mm_get_phys_page())) {
+        ERROR("Could not allocate physical page for page table\n");
+        return ENOMEM;
+    }
+    if (0 == (pt = (pte_t*) mm_attach_page(pt_phys))) {
+        mm_put_phys_page(pt_phys);
+        return ENOMEM;
+    }
+    for (i = 0; i < MM_PT_ENTRIES; i++) {
+        pt[i] = pte_create(pde.rw, pde.us, pde.pcd, 0, pde.page_base * MM_PAGE_SIZE + i * MM_PAGE_SIZE);
+        pt[i].a = pde.a;
+        pt[i].d = pde.d;
+    }
+    mm_detach_page((u32) pt);
+    pd[PTD_OFFSET(virtual_base)] = pte_create(MM_READ_WRITE, MM_USER_PAGE, 0, 0, pt_phys);
+    invlpg(MM_VIRTUAL_PT_ENTRY(PTD_OFFSET(virtual_base), 0));
+    invlpg(virtual_base);
+    large_pages_split++;
+    return 0;
+}
+
+/*
+ * Make sure that an address in the user area of the current process is not mapped by a 4 MB page,
+ * splitting the 4 MB page if needed
+ * Parameter:
+ * @address - the virtual address
+ * Return value:
+ * 0 upon success
+ * ENOMEM if the 4 MB page could not be split
+ * Locks:
+ * pt_lock - page table lock of the current process
+ */
+static int mm_split_large_page_at(u32 address) {
+    pte_t* pd = mm_get_ptd();
     u32 flags;
-    u32 tmp_page;
-    u32 page_table_base;
-    spinlock_t* pt_lock;
-    pg_enabled = get_cr0() >> 31;
-    MM_DEBUG("Requested mapping for virtual page %x, rw = %d, us = %d\n", virtual_base, rw, us);
-    /*
-     * Get lock on page tables of current process
+    int rc = 0;
+    spinlock_t* pt_lock = &(mem_locks[pm_get_pid()].pt_lock);
+    spinlock_get(pt_lock, &flags);
+    if (pd[PTD_OFFSET(address)].p && pd[PTD_OFFSET(address)].ps)
+        rc = mm_split_large_page(pd, address);
+    spinlock_release(pt_lock, &flags);
+    return rc;
+}
+
+/*
+ * Map a 4 MB page filled with zeroes into the user area of the current process. This is only done if 4 MB
+ * pages are used and there is no page table yet for the 4 MB area, i.e. if no page in the area has been
+ * mapped yet. The caller is responsible for making sure that the entire area is supposed to be mapped
+ * Parameter:
+ * @virtual_base - the base address of the area, needs to be aligned to a 4 MB boundary
+ * Return value:
+ * 0 if the 4 MB page has been mapped
+ * EINVAL if 4 MB pages are not used or the area is already partially mapped
+ * ENOMEM if no free block of 4 MB was available
+ * Locks:
+ * pt_lock - page table lock of the current process
+ * Cross-monitor function calls:
+ * mm_get_phys_pages
+ * mm_put_phys_pages
+ * mm_attach_page
+ * mm_detach_page
+ */
+static int mm_map_large_page(u32 virtual_base) {
+    pte_t* pd = mm_get_ptd();
+    u32 phys_base;
+    u32 flags;
+    int i;
+    spinlock_t* pt_lock = &(mem_locks[pm_get_pid()].pt_lock);
+    if ((0 == large_pages) || (virtual_base % MM_LARGE_PAGE_SIZE) || (pd[PTD_OFFSET(virtual_base)].p))
+        return EINVAL;
+    /*
+     * Check first whether there is a free block at all, as we silently fall back to 4 kB pages
+     */
+    if (0 == mm_phys_free_blocks(MM_LARGE_PAGE_ORDER))
+        return ENOMEM;
+    if (0 == (phys_base = mm_get_phys_pages(MM_LARGE_PAGE_ORDER)))
+        return ENOMEM;
+    for (i = 0; i < MM_PT_ENTRIES; i++) {
+        if (mm_zero_page(phys_base + i * MM_PAGE_SIZE)) {
+            mm_put_phys_pages(phys_base, MM_LARGE_PAGE_ORDER);
+            return ENOMEM;
+        }
+    }
+    spinlock_get(pt_lock, &flags);
+    /*
+     * Another task in this process might have mapped a page in this area in the meantime
+     */
+    if (pd[PTD_OFFSET(virtual_base)].p) {
+        spinlock_release(pt_lock, &flags);
+        mm_put_phys_pages(phys_base, MM_LARGE_PAGE_ORDER);
+        return EINVAL;
+    }
+    pd[PTD_OFFSET(virtual_base)] = pde_create_large(MM_READ_WRITE, MM_USER_PAGE, 0, 0, phys_base);
+    invlpg(virtual_base);
+    large_pages_mapped++;
+    spinlock_release(pt_lock, &flags);
+    return 0;
+}
+
+/*
+ * Map a given virtual address (32 bit base address of page) into a given
+ * physical page (32 bit page address of page). The function performs the following
+ * tasks:
+ * - determine the entry in the page table directory which is relevant for the virtual address
+ * - use the present bit in the page table directory to find out whether a page table exists
+ * for this area
+ * - if not, allocate a physical page and create an empty page table directory
+ * - if the area is mapped by a 4 MB page, split it into 4 kB pages first
+ * - add an entry to the page table directory, marking it as global if it is located in the common area and global pages are used
+ * This function can be used before paging has been enabled and after
+ * paging has been enabled
+ * Also note that this function assumes that the page table directory passed
+ * as first argument is the page table directory of the current process
+ * in case paging has already been enabled
+ * Parameter:
+ * @pd - page table directory
+ * @phys_base - the base address of the physical page
+ * @virtual_base - the base address of the virtual page
+ * @rw - read/write bit
+ * @us - user/supervisor bit
+ * @pcd - pcd bit
+ * @pid - pid, used to determine the page table lock
+ * Return value:
+ * ENOMEM if no memory available for new page table
+ * 0 upon success
+ * Locks:
+ * pt_lock - lock to protect page table structure
+ * Cross-monitor function calls:
+ * mm_attach_page
+ * mm_detach_page
+ * mm_get_phys_page
+ */
+int mm_map_page(pte_t* pd, u32 phys_base, u32 virtual_base, u8 rw, u8 us,
+        u8 pcd, u32 pid) {
+    u8 pg_enabled;
+    pte_t* pt;
+    u32 flags;
+    u32 tmp_page;
+    u32 page_table_base;
+    spinlock_t* pt_lock;
+    pg_enabled = get_cr0() >> 31;
+    MM_DEBUG("Requested mapping for virtual page %x, rw = %d, us = %d\n", virtual_base, rw, us);
+    /*
+     * Get lock on page tables of current process
      */
     pt_lock = &(mem_locks[pid].pt_lock);
     spinlock_get(pt_lock, &flags);
+    if (pd[PTD_OFFSET(virtual_base)].p && pd[PTD_OFFSET(virtual_base)].ps) {
+        if (mm_split_large_page(pd, virtual_base)) {
+            spinlock_release(pt_lock, &flags);
+            return ENOMEM;
+        }
+    }
     if (0 == pd[PTD_OFFSET(virtual_base)].p) {
         /*
          * No page table for this area yet. Get one
@@ -684,7 +1541,7 @@ int mm_map_page(pte_t* pd, u32 phys_base, u32 virtual_base, u8 rw, u8 us,
          * and add it to the page table directory. Note that this assignment is an atomic
          * operation on x86, thus the page table directory is valid at each point in time
          */
-        pd[PTD_OFFSET(virtual_base)] = pte_create(rw, MM_USER_PAGE, pcd,
+        pd[PTD_OFFSET(virtual_base)] = pte_create(rw, MM_USER_PAGE, pcd, 0,
                 page_table_base);
         /*
          * The page table is now mapped into our virtual address space. However, to make
@@ -706,7 +1563,8 @@ int mm_map_page(pte_t* pd, u32 phys_base, u32 virtual_base, u8 rw, u8 us,
      */
     pt = mm_get_pt_address(pd, PTD_OFFSET(virtual_base), pg_enabled);
     MM_DEBUG("Address of page table is %x\n", pt);
-    pt[PT_OFFSET(virtual_base)] = pte_create(rw, us, pcd, phys_base);
+    pt[PT_OFFSET(virtual_base)] = pte_create(rw, us, pcd,
+            global_pages && (virtual_base < MM_COMMON_AREA_SIZE), phys_base);
     MM_DEBUG("Address of page table entry is %x\n", &(pt[PT_OFFSET(virtual_base)]));
     MM_DEBUG("Added entry, pte->us = %d\n", pt[PT_OFFSET(virtual_base)].us);
     /*
@@ -720,108 +1578,877 @@ int mm_map_page(pte_t* pd, u32 phys_base, u32 virtual_base, u8 rw, u8 us,
 }
 
 /*
- * Remove a given virtual page from the virtual address
- * space represented by the passed page table directory
- * and free the used physical page
- * This function can be used before paging has been enabled and after
- * paging has been enabled
- * Also note that this function assumes that the page table directory passed
- * as first argument is the page table directory of the current process
- * in case paging has already been enabled
+ * Remove a given virtual page from the virtual address space represented by the passed page table
+ * directory. The physical page is released right away or, if a batch is given, added to the batch
+ * and released when the batch is flushed
+ * If the page is part of a 4 MB page, the entire 4 MB page is removed, so callers which remove only a
+ * part of a 4 MB page need to split it first. In this case, a batch is flushed before the block is released
+ * If the page has been swapped out, only the reference to its slot on the swap device is dropped
+ * Parameter:
+ * @pd - a pointer to the page table directory to be used
+ * @virtual_base - the base of the page to be unmapped
+ * @pid - pid, used to locate the lock for the page table
+ * @batch - the batch or 0
+ * Locks:
+ * pt_lock - lock to protect page table of current process
+ * Cross-monitor function calls:
+ * mm_put_phys_page
+ * mm_put_phys_pages
+ * mm_tlb_batch_flush
+ * swap_slot_put
+ */
+static void mm_remove_mapping(pte_t* pd, u32 virtual_base, u32 pid, mm_tlb_batch_t* batch) {
+    u8 pg_enabled;
+    pte_t* pt;
+    u32 flags;
+    u32 phys_page;
+    spinlock_t* pt_lock;
+    pg_enabled = get_cr0() >> 31;
+    /*
+     * If we have a ramdisk, verify that we do not
+     * by accident unmap any of its pages
+     */
+    if (virt_ramdisk_end > virt_ramdisk_start) {
+        if ((virtual_base >= virt_ramdisk_start) && (virtual_base <= virt_ramdisk_end)) {
+            PANIC("Trying to unmap page %x within RAMDISK (%x - %x)", virtual_base, virt_ramdisk_start, virt_ramdisk_end);
+        }
+    }
+    /*
+     * Make sure that there is room in the batch before we get the lock, as
+     * a flush must not be done while holding a spinlock
+     */
+    if (batch && (MM_TLB_BATCH_PAGES == batch->count))
+        mm_tlb_batch_flush(batch);
+    /*
+     * Get lock on page tables of current process
+     */
+    pt_lock = &(mem_locks[pid].pt_lock);
+    spinlock_get(pt_lock, &flags);
+    if (pd[PTD_OFFSET(virtual_base)].p && pd[PTD_OFFSET(virtual_base)].ps) {
+        if (PTD_OFFSET(virtual_base) < MM_SHARED_PAGE_TABLES) {
+            PANIC("Trying to unmap page %x within 4 MB page in common area\n", virtual_base);
+        }
+        phys_page = pd[PTD_OFFSET(virtual_base)].page_base * MM_PAGE_SIZE;
+        pd[PTD_OFFSET(virtual_base)].p = 0;
+        pd[PTD_OFFSET(virtual_base)].ps = 0;
+        if (1 == pg_enabled)
+            invlpg(virtual_base);
+        spinlock_release(pt_lock, &flags);
+        if (batch) {
+            mm_tlb_batch_add(batch, virtual_base, 0);
+            mm_tlb_batch_flush(batch);
+        }
+        mm_put_phys_pages(phys_page, MM_LARGE_PAGE_ORDER);
+        return;
+    }
+    if (pd[PTD_OFFSET(virtual_base)].p) {
+        /*
+         * Get pointer to page table
+         */
+        pt = mm_get_pt_address(pd, PTD_OFFSET(virtual_base), pg_enabled);
+        if (MM_PTE_SWAPPED(pt + PT_OFFSET(virtual_base))) {
+            /*
+             * The page has been swapped out, so we only release the slot
+             */
+            swap_slot_put(pt[PT_OFFSET(virtual_base)].page_base);
+            pt[PT_OFFSET(virtual_base)].swapped = 0;
+            spinlock_release(pt_lock, &flags);
+            return;
+        }
+        /*
+         * Mark page as unused and flush TLB if needed
+         */
+        pt[PT_OFFSET(virtual_base)].p = 0;
+        if (1 == pg_enabled)
+            invlpg(virtual_base);
+        /*
+         * Release physical page
+         */
+        phys_page = pt[PT_OFFSET(virtual_base)].page_base * MM_PAGE_SIZE;
+        if (batch)
+            mm_tlb_batch_add(batch, virtual_base, phys_page);
+        else
+            mm_put_phys_page(phys_page);
+    }
+    spinlock_release(pt_lock, &flags);
+}
+
+/*
+ * Remove a given virtual page from the virtual address
+ * space represented by the passed page table directory
+ * and free the used physical page
+ * This function can be used before paging has been enabled and after
+ * paging has been enabled
+ * Also note that this function assumes that the page table directory passed
+ * as first argument is the page table directory of the current process
+ * in case paging has already been enabled
+ * The TLBs of other CPUs are not updated, use mm_remove_mapping with a batch
+ * for pages which other CPUs might still access
+ * Parameter:
+ * @pd - a pointer to the page table directory to be used
+ * @virtual_base - the base of the page to be unmapped
+ * @pid - pid, used to locate the lock for the page table
+ * Return value:
+ * 0 upon success
+ * Locks:
+ * pt_lock - lock to protect page table of current process
+ * Cross-monitor function calls:
+ * mm_put_phys_page
+ */
+int mm_unmap_page(pte_t* pd, u32 virtual_base, u32 pid) {
+    mm_remove_mapping(pd, virtual_base, pid, 0);
+    return 0;
+}
+
+/****************************************************************************************
+ * TLB shootdown                                                                        *
+ ***************************************************************************************/
+
+/*
+ * Record that a CPU is about to switch to the address space of a process. This is called by the
+ * process manager with interrupts disabled when a task switch is prepared. The new value of CR3 is
+ * loaded when the interrupt handler returns, which flushes all TLB entries of the previous address space
+ * Parameter:
+ * @cpuid - the CPU
+ * @pid - the process whose address space the CPU will use
+ */
+void mm_tlb_switch(int cpuid, u32 pid) {
+    atomic_store(tlb_active_pid + cpuid, pid);
+}
+
+/*
+ * Initialize a batch of TLB invalidations for the address space of the current process
+ * Parameter:
+ * @batch - the batch
+ */
+void mm_tlb_batch_init(mm_tlb_batch_t* batch) {
+    batch->pid = pm_get_pid();
+    batch->count = 0;
+    batch->flush_all = 0;
+}
+
+/*
+ * Add a page to a batch of TLB invalidations. The caller is expected to have changed the page table
+ * entry and to have invalidated the TLB entry on the local CPU. If the batch is full, it is flushed first
+ * Parameter:
+ * @batch - the batch
+ * @page - virtual address of the page
+ * @phys_page - physical page which is released after the batch has been flushed or 0
+ * Cross-monitor function calls:
+ * mm_tlb_batch_flush
+ */
+void mm_tlb_batch_add(mm_tlb_batch_t* batch, u32 page, u32 phys_page) {
+    if (MM_TLB_BATCH_PAGES == batch->count)
+        mm_tlb_batch_flush(batch);
+    batch->pages[batch->count] = MM_PAGE_START(MM_PAGE(page));
+    batch->phys_pages[batch->count] = phys_page;
+    batch->count++;
+}
+
+/*
+ * Process the requests in the mailbox of a CPU, i.e. invalidate the requested pages or reload CR3
+ * and acknowledge the requests. Interrupts need to be disabled when calling this function
+ * Parameter:
+ * @cpuid - the current CPU
+ * Locks:
+ * tlb_mailbox[cpuid].lock
+ */
+static void mm_tlb_process_mailbox(int cpuid) {
+    tlb_mailbox_t* mailbox = tlb_mailbox + cpuid;
+    u32 pages[MM_TLB_FLUSH_THRESHOLD];
+    u32 requested;
+    u32 flags;
+    int count;
+    int flush_all;
+    int i;
+    spinlock_get(&mailbox->lock, &flags);
+    requested = mailbox->requested;
+    count = mailbox->count;
+    flush_all = mailbox->flush_all;
+    for (i = 0; i < count; i++)
+        pages[i] = mailbox->pages[i];
+    mailbox->count = 0;
+    mailbox->flush_all = 0;
+    spinlock_release(&mailbox->lock, &flags);
+    if (requested == mailbox->done)
+        return;
+    if (flush_all) {
+        reload_cr3();
+        mailbox->full_flushes++;
+    }
+    else {
+        for (i = 0; i < count; i++)
+            invlpg(pages[i]);
+        mailbox->invalidated += count;
+    }
+    atomic_store(&mailbox->done, requested);
+}
+
+/*
+ * Flush a batch of TLB invalidations, i.e. make sure that no other CPU holds a TLB entry for one
+ * of the pages in the batch any more, and release the physical pages in the batch.
+ *
+ * The requests are placed in the mailbox of each CPU which currently uses the address space, and a
+ * single IPI is sent to each of these CPUs. If the mailbox then holds more than MM_TLB_FLUSH_THRESHOLD pages,
+ * the CPU will reload CR3 instead of invalidating the pages one by one. We wait until all CPUs have
+ * acknowledged the request. While waiting, we process requests in our own mailbox as another CPU might
+ * wait for us at the same time with interrupts disabled.
+ *
+ * This function must not be called while holding a spinlock, as another CPU could be spinning for the lock
+ * with interrupts disabled and would then never acknowledge the request
+ * Parameter:
+ * @batch - the batch
+ * Locks:
+ * tlb_mailbox[cpu].lock for all CPUs which use the address space
+ * Cross-monitor function calls:
+ * mm_put_phys_page
+ */
+void mm_tlb_batch_flush(mm_tlb_batch_t* batch) {
+    u32 eflags;
+    u32 flags;
+    u32 ticket[SMP_MAX_CPU];
+    int target[SMP_MAX_CPU];
+    tlb_mailbox_t* mailbox;
+    int self;
+    int cpu;
+    int i;
+    if ((0 == batch->count) && (0 == batch->flush_all))
+        return;
+    save_eflags(&eflags);
+    cli();
+    self = smp_get_cpu();
+    /*
+     * Make sure that the changes to the page tables are visible to other
+     * CPUs before we check which CPUs use the address space
+     */
+    smp_mb();
+    for (cpu = 0; cpu < smp_get_cpu_count(); cpu++) {
+        target[cpu] = 0;
+        if ((cpu == self) || (atomic_load(tlb_active_pid + cpu) != batch->pid))
+            continue;
+        mailbox = tlb_mailbox + cpu;
+        spinlock_get(&mailbox->lock, &flags);
+        if (batch->flush_all || (mailbox->count + batch->count > MM_TLB_FLUSH_THRESHOLD)) {
+            mailbox->flush_all = 1;
+        }
+        else {
+            for (i = 0; i < batch->count; i++)
+                mailbox->pages[mailbox->count++] = batch->pages[i];
+        }
+        ticket[cpu] = ++mailbox->requested;
+        spinlock_release(&mailbox->lock, &flags);
+        target[cpu] = 1;
+        apic_send_ipi(cpu_get_apic_id(cpu), 0, IPI_TLB_SHOOTDOWN, 0);
+        tlb_mailbox[self].ipis++;
+    }
+    for (cpu = 0; cpu < smp_get_cpu_count(); cpu++) {
+        if (target[cpu]) {
+            while ((int) (atomic_load(&tlb_mailbox[cpu].done) - ticket[cpu]) < 0)
+                mm_tlb_process_mailbox(self);
+        }
+    }
+    restore_eflags(&eflags);
+    /*
+     * Now no CPU can access the physical pages via the old mappings any more
+     */
+    for (i = 0; i < batch->count; i++) {
+        if (batch->phys_pages[i])
+            mm_put_phys_page(batch->phys_pages[i]);
+    }
+    batch->count = 0;
+    batch->flush_all = 0;
+}
+
+/*
+ * Handle a TLB shootdown IPI
+ */
+void mm_handle_tlb_ipi() {
+    mm_tlb_process_mailbox(smp_get_cpu());
+}
+
+/*
+ * Get statistics on TLB shootdowns for a CPU
+ * Parameter:
+ * @cpu - the CPU
+ * @stats - structure which will be filled with the statistics
+ */
+void mm_get_tlb_stats(int cpu, mm_tlb_stats_t* stats) {
+    stats->ipis = tlb_mailbox[cpu].ipis;
+    stats->invalidated = tlb_mailbox[cpu].invalidated;
+    stats->full_flushes = tlb_mailbox[cpu].full_flushes;
+}
+
+
+
+/*
+ * Return the physical address for a given virtual address
+ * Parameter:
+ * @virtual - the virtual address
+ * Return value:
+ * the physical address or 0 if the page is not mapped
+ */
+u32 mm_virt_to_phys(u32 virtual) {
+    pte_t* ptd = (pte_t*) mm_get_ptd();
+    /*
+     * First make sure that we have a page table for this address
+     */
+    if (0 == ptd[PTD_OFFSET(virtual)].p)
+        return 0;
+    if (ptd[PTD_OFFSET(virtual)].ps)
+        return ptd[PTD_OFFSET(virtual)].page_base * MM_PAGE_SIZE + (virtual % MM_LARGE_PAGE_SIZE);
+    pte_t* pt = mm_get_pt_address(ptd, PTD_OFFSET(virtual), 1);
+    if (0 == pt[PT_OFFSET(virtual)].p)
+        return 0;
+    return pt[PT_OFFSET(virtual)].page_base * MM_PAGE_SIZE + (virtual % MM_PAGE_SIZE);
+}
+
+/*
+ * This function will determine whether a given virtual address is mapped
+ * into the address space of the currently active process
+ * Parameter:
+ * @virtual_base - the base address of the page to be checked
+ * Return value:
+ * 1 if the page is mapped
+ * 0 if it is not mapped
+ */
+static int mm_page_mapped_impl(u32 virtual_base) {
+    pte_t* ptd = mm_get_ptd();
+    pte_t* pt;
+    if (0 == ptd[PTD_OFFSET(virtual_base)].p) {
+        return 0;
+    }
+    if (ptd[PTD_OFFSET(virtual_base)].ps) {
+        return 1;
+    }
+    pt = mm_get_pt_address(ptd, PTD_OFFSET(virtual_base), get_cr0() >> 31);
+    if (0 == pt[PT_OFFSET(virtual_base)].p)
+        return 0;
+    return 1;
+}
+int (*mm_page_mapped)(u32) = mm_page_mapped_impl;
+
+/*
+ * Get the page table entry for a virtual address in the address space of the currently
+ * active process. The caller is responsible for holding the page table lock if the entry
+ * is changed
+ * Parameter:
+ * @virtual_base - the virtual address
+ * Return value:
+ * a pointer to the page table entry or 0 if there is no page table for this address, which
+ * includes addresses mapped by a 4 MB page
+ */
+static pte_t* mm_get_pte(u32 virtual_base) {
+    pte_t* ptd = mm_get_ptd();
+    if ((0 == ptd[PTD_OFFSET(virtual_base)].p) || (ptd[PTD_OFFSET(virtual_base)].ps)) {
+        return 0;
+    }
+    return mm_get_pt_address(ptd, PTD_OFFSET(virtual_base), get_cr0() >> 31) + PT_OFFSET(virtual_base);
+}
+
+/****************************************************************************************
+ * Swapping                                                                             *
+ ***************************************************************************************/
+
+/*
+ * If a swap device has been configured with the kernel parameter swap, anonymous pages in the user area
+ * are written to it when memory runs low. The device is divided into slots of one page. A page table entry
+ * for a page which has been swapped out has the present bit cleared, the software bit swapped set and holds
+ * the number of the slot instead of the page base, while rw keeps the original access rights. A fork copies
+ * such an entry and adds a reference to the slot.
+ *
+ * Pages are swapped out synchronously by mm_swap_reserve, which is called by code which may sleep before it
+ * allocates memory. Victims are selected by a clock which moves over the user area of all processes, clearing the
+ * accessed bit of each candidate and selecting the first candidate whose accessed bit is already clear. Only pages
+ * below the area reserved for the user space stack which are not shared copy-on-write, not part of a shared
+ * mapping and not mapped from the page cache are candidates.
+ *
+ * As the kernel accesses user space buffers with interrupts disabled once it has validated them, for instance
+ * when copying data into the buffer of a pipe reader, a page must not disappear while a task of its process
+ * is executing a system call. Therefore only processes whose tasks are all executing in user space are scanned,
+ * and the page table entry is changed before the page is written and the execution level of the tasks is checked
+ * again afterwards. If a task has entered the kernel in the meantime, the original entry is restored. Until then,
+ * the page is in flight (see swap_inflight), and any access to it, even with interrupts disabled, restores the
+ * original entry as well. A task which enters the kernel after the check finds the entry for the slot when it
+ * validates the buffer and reads the page back from the swap device in mm_swap_in.
+ */
+
+/*
+ * Create a page table entry referring to a slot on the swap device
+ * Parameter:
+ * @rw - the access rights of the page
+ * @slot - the slot
+ * Return value:
+ * the page table entry
+ */
+static pte_t mm_swap_pte(u8 rw, u32 slot) {
+    pte_t pte = pte_create(rw, MM_USER_PAGE, 0, 0, slot * MM_PAGE_SIZE);
+    pte.p = 0;
+    pte.swapped = 1;
+    return pte;
+}
+
+/*
+ * Allocate a free slot on the swap device. The slot is returned with one reference
+ * Return value:
+ * the slot or -1 if no free slot is left
+ * Locks:
+ * swap_lock
+ */
+static int swap_slot_get() {
+    u32 flags;
+    u32 slot;
+    u32 i;
+    spinlock_get(&swap_lock, &flags);
+    for (i = 0; i < swap_slots; i++) {
+        slot = (swap_next_slot + i) % swap_slots;
+        if (0 == swap_ref[slot]) {
+            swap_ref[slot] = 1;
+            swap_used++;
+            swap_next_slot = (slot + 1) % swap_slots;
+            spinlock_release(&swap_lock, &flags);
+            return slot;
+        }
+    }
+    spinlock_release(&swap_lock, &flags);
+    return -1;
+}
+
+/*
+ * Add a reference to a slot on the swap device
+ * Parameter:
+ * @slot - the slot
+ * Locks:
+ * swap_lock
+ */
+static void swap_slot_share(u32 slot) {
+    u32 flags;
+    spinlock_get(&swap_lock, &flags);
+    swap_ref[slot]++;
+    spinlock_release(&swap_lock, &flags);
+}
+
+/*
+ * Drop a reference to a slot on the swap device, the slot is free again when the last reference is gone
+ * Parameter:
+ * @slot - the slot
+ * Locks:
+ * swap_lock
+ */
+static void swap_slot_put(u32 slot) {
+    u32 flags;
+    spinlock_get(&swap_lock, &flags);
+    KASSERT(swap_ref[slot]);
+    swap_ref[slot]--;
+    if (0 == swap_ref[slot])
+        swap_used--;
+    spinlock_release(&swap_lock, &flags);
+}
+
+/*
+ * Transfer a slot from or to the swap device, using swap_buffer. The caller needs to hold swap_mutex
+ * Parameter:
+ * @slot - the slot
+ * @write - 1 to write to the device, 0 to read from it
+ * Return value:
+ * 0 upon success
+ * EIO if the transfer failed
+ */
+static int swap_rw(u32 slot, int write) {
+    blk_dev_ops_t* ops = dm_get_blk_dev_ops(MAJOR(swap_dev));
+    ssize_t blocks = MM_PAGE_SIZE / BLOCK_SIZE;
+    ssize_t rc;
+    if (0 == ops)
+        return EIO;
+    if (write)
+        rc = ops->write(MINOR(swap_dev), blocks, slot * blocks, swap_buffer);
+    else
+        rc = ops->read(MINOR(swap_dev), blocks, slot * blocks, swap_buffer);
+    if (MM_PAGE_SIZE != rc) {
+        ERROR("Could not %s slot %d of swap device, rc = %d\n", write ? "write" : "read", slot, rc);
+        return EIO;
+    }
+    return 0;
+}
+
+/*
+ * Restore the original page table entry if the page table entry refers to the page which is currently
+ * written to the swap device. The caller needs to hold the page table lock of the process
+ * Parameter:
+ * @pid - the process to which the page table entry belongs
+ * @pte - the page table entry
+ * Return value:
+ * 1 if the entry has been restored
+ * 0 otherwise
+ * Locks:
+ * swap_lock
+ */
+static int mm_swap_cancel(u32 pid, pte_t* pte) {
+    if (swap_inflight.active && (swap_inflight.pid == pid) && MM_PTE_SWAPPED(pte)
+            && (pte->page_base == swap_inflight.slot) && (0 == swap_inflight.cancelled)) {
+        *pte = swap_inflight.pte;
+        swap_inflight.cancelled = 1;
+        swap_cancelled++;
+        swap_slot_put(swap_inflight.slot);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Scan the user area of a process for a page to be swapped out, starting at the clock hand. The accessed bit of
+ * each candidate is cleared, and the first candidate whose accessed bit is clear is selected. Its page table entry
+ * is replaced by an entry for the slot and recorded in swap_inflight. The caller needs to hold swap_mutex
  * Parameter:
- * @pd - a pointer to the page table directory to be used
- * @virtual_base - the base of the page to be unmapped
- * @pid - pid, used to locate the lock for the page table
+ * @pid - the process
+ * @slot - the slot to which the page will be written
  * Return value:
- * 0 upon success
+ * 1 if a page has been selected
+ * 0 if the clock hand has reached the end of the user area of the process
  * Locks:
- * pt_lock - lock to protect page table of current process
+ * pt_lock[pid]
+ * Cross-monitor function calls:
+ * mm_attach_page
+ * mm_detach_page
+ */
+static int mm_swap_select_page(u32 pid, u32 slot) {
+    pte_t* ptd = proc_ptd[pid];
+    pte_t* pt;
+    pte_t* pte;
+    u32 page = swap_hand_page;
+    u32 flags;
+    int offset;
+    int found = 0;
+    spinlock_t* pt_lock = &(mem_locks[pid].pt_lock);
+    while ((0 == found) && (page < MM_MMAP_TOP)) {
+        offset = PTD_OFFSET(page);
+        spinlock_get(pt_lock, &flags);
+        if ((0 == ptd[offset].p) || ptd[offset].ps) {
+            spinlock_release(pt_lock, &flags);
+            page = MM_AREA_START(offset + 1);
+            continue;
+        }
+        if (0 == (pt = (pte_t*) mm_attach_page(ptd[offset].page_base * MM_PAGE_SIZE))) {
+            spinlock_release(pt_lock, &flags);
+            break;
+        }
+        while ((page < MM_MMAP_TOP) && (PTD_OFFSET(page) == offset)) {
+            pte = pt + PT_OFFSET(page);
+            if (pte->p && pte->us && (0 == pte->cow) && (0 == pte->shared) && (0 == phys_ref[pte->page_base])) {
+                if (pte->a) {
+                    pte->a = 0;
+                    swap_second_chances++;
+                }
+                else {
+                    swap_inflight.pte = *pte;
+                    swap_inflight.pid = pid;
+                    swap_inflight.page = page;
+                    swap_inflight.slot = slot;
+                    swap_inflight.cancelled = 0;
+                    swap_inflight.active = 1;
+                    *pte = mm_swap_pte(pte->rw, slot);
+                    found = 1;
+                }
+            }
+            page += MM_PAGE_SIZE;
+            if (found)
+                break;
+        }
+        mm_detach_page((u32) pt);
+        spinlock_release(pt_lock, &flags);
+    }
+    swap_hand_page = page;
+    return found;
+}
+
+/*
+ * Swap out the next page of a process selected by the clock. The page is unmapped on all CPUs before its content is
+ * copied, then it is written to the swap device. Afterwards the original entry is restored if the write failed or a
+ * task of the process has entered the kernel in the meantime, otherwise the physical page is released. The caller needs
+ * to hold swap_mutex
+ * Parameter:
+ * @pid - the process
+ * Return value:
+ * 0 if a physical page has been released
+ * EAGAIN if a page has been selected, but is still mapped
+ * ENOENT if the clock hand has reached the end of the user area of the process
+ * ENOSPC if the swap device is full
+ * EIO if the page could not be written
+ * Locks:
+ * pt_lock[pid]
  * Cross-monitor function calls:
+ * mm_swap_select_page
+ * mm_tlb_batch_flush
+ * mm_attach_page
+ * mm_detach_page
+ * pm_proc_in_user_space
  * mm_put_phys_page
  */
-int mm_unmap_page(pte_t* pd, u32 virtual_base, u32 pid) {
-    u8 pg_enabled;
+static int mm_swap_out_page(u32 pid) {
+    mm_tlb_batch_t batch;
+    pte_t* ptd = proc_ptd[pid];
     pte_t* pt;
+    pte_t* pte;
+    u32 phys_page;
+    u32 virt_page;
     u32 flags;
-    spinlock_t* pt_lock;
-    pg_enabled = get_cr0() >> 31;
+    int slot;
+    int rc = 0;
+    int in_user_space;
+    int offset;
+    int restored = 0;
+    spinlock_t* pt_lock = &(mem_locks[pid].pt_lock);
+    if ((slot = swap_slot_get()) < 0)
+        return ENOSPC;
+    if (0 == mm_swap_select_page(pid, slot)) {
+        swap_slot_put(slot);
+        return ENOENT;
+    }
+    phys_page = swap_inflight.pte.page_base * MM_PAGE_SIZE;
     /*
-     * If we have a ramdisk, verify that we do not
-     * by accident unmap any of its pages
+     * Other CPUs might still write to the page via their TLBs, so do a shootdown before we take the copy
      */
-    if (virt_ramdisk_end > virt_ramdisk_start) {
-        if ((virtual_base >= virt_ramdisk_start) && (virtual_base <= virt_ramdisk_end)) {
-            PANIC("Trying to unmap page %x within RAMDISK (%x - %x)", virtual_base, virt_ramdisk_start, virt_ramdisk_end);
-        }
+    mm_tlb_batch_init(&batch);
+    batch.pid = pid;
+    mm_tlb_batch_add(&batch, swap_inflight.page, 0);
+    mm_tlb_batch_flush(&batch);
+    if (0 == (virt_page = mm_attach_page(phys_page))) {
+        rc = ENOMEM;
+    }
+    else {
+        memcpy(swap_buffer, (void*) virt_page, MM_PAGE_SIZE);
+        mm_detach_page(virt_page);
+        rc = swap_rw(slot, 1);
     }
     /*
-     * Get lock on page tables of current process
+     * The change of the page table entry needs to be visible before we check the execution level, as a
+     * task which enters the kernel after the check needs to see the entry for the slot
      */
-    pt_lock = &(mem_locks[pid].pt_lock);
+    smp_mb();
+    in_user_space = pm_proc_in_user_space(pid);
     spinlock_get(pt_lock, &flags);
-    if (pd[PTD_OFFSET(virtual_base)].p) {
-        /*
-         * Get pointer to page table
-         */
-        pt = mm_get_pt_address(pd, PTD_OFFSET(virtual_base), pg_enabled);
-        /*
-         * Mark page as unused and flush TLB if needed
-         */
-        pt[PT_OFFSET(virtual_base)].p = 0;
-        if (1 == pg_enabled)
-            invlpg(virtual_base);
-        /*
-         * Release physical page
-         */
-        mm_put_phys_page(pt[PT_OFFSET(virtual_base)].page_base * MM_PAGE_SIZE);
+    offset = PTD_OFFSET(swap_inflight.page);
+    if ((0 == swap_inflight.cancelled) && ptd[offset].p && (0 == ptd[offset].ps)) {
+        if ((pt = (pte_t*) mm_attach_page(ptd[offset].page_base * MM_PAGE_SIZE))) {
+            pte = pt + PT_OFFSET(swap_inflight.page);
+            if (MM_PTE_SWAPPED(pte) && (pte->page_base == slot) && (rc || (0 == in_user_space))) {
+                *pte = swap_inflight.pte;
+                restored = 1;
+            }
+            mm_detach_page((u32) pt);
+        }
+        else {
+            ERROR("Could not attach page table of process %d\n", pid);
+        }
     }
+    restored |= swap_inflight.cancelled;
+    swap_inflight.active = 0;
     spinlock_release(pt_lock, &flags);
+    if (restored) {
+        if (0 == swap_inflight.cancelled) {
+            swap_rollbacks++;
+            swap_slot_put(slot);
+        }
+        return rc ? rc : EAGAIN;
+    }
+    /*
+     * The entry refers to the slot or has been removed by the process in the meantime, in both
+     * cases the physical page is no longer used
+     */
+    mm_put_phys_page(phys_page);
+    swap_outs++;
     return 0;
 }
 
+/*
+ * Swap out pages until the given number of pages plus MM_SWAP_MIN_FREE pages is available or
+ * no more candidates are found. The caller needs to hold swap_mutex
+ * Parameter:
+ * @pages - the number of pages needed
+ * Cross-monitor function calls:
+ * mm_swap_out_page
+ * pm_proc_in_user_space
+ */
+static void mm_swap_reclaim(u32 pages) {
+    u32 visited = 0;
+    int rc;
+    /*
+     * The clock does up to two revolutions without finding a page, so that pages whose
+     * accessed bit has been cleared during the first revolution get their second chance
+     */
+    while ((mm_phys_mem_available() / 4 < pages + MM_SWAP_MIN_FREE) && (visited < 2 * PM_MAX_PROCESS)) {
+        if (address_space[swap_hand_pid].valid && pm_proc_in_user_space(swap_hand_pid)) {
+            rc = mm_swap_out_page(swap_hand_pid);
+            if (0 == rc) {
+                visited = 0;
+                continue;
+            }
+            if (EAGAIN == rc)
+                continue;
+            if (ENOENT != rc)
+                return;
+        }
+        swap_hand_pid = (swap_hand_pid + 1) % PM_MAX_PROCESS;
+        swap_hand_page = MM_COMMON_AREA_SIZE;
+        visited++;
+    }
+}
 
+/*
+ * Make sure that a given number of physical pages is available by swapping out pages if needed. This does nothing if
+ * no swap device is configured or if interrupts are disabled, and it must not be called while holding a spinlock
+ * Parameter:
+ * @pages - the number of pages which the caller is about to allocate
+ * Cross-monitor function calls:
+ * mm_swap_reclaim
+ */
+void mm_swap_reserve(u32 pages) {
+    if ((0 == swap_slots) || (0 == IRQ_ENABLED(get_eflags())))
+        return;
+    if (mm_phys_mem_available() / 4 >= pages + MM_SWAP_MIN_FREE)
+        return;
+    sem_down(&swap_mutex);
+    mm_swap_reclaim(pages);
+    sem_up(&swap_mutex);
+}
 
 /*
- * Return the physical address for a given virtual address
+ * Bring back a page of the current process which has been swapped out. If the page is still in flight, the original
+ * page table entry is restored, otherwise a new physical page is allocated and filled from the swap device, which
+ * requires that we may sleep
  * Parameter:
- * @virtual - the virtual address
+ * @page_base - the virtual address of the page
+ * @may_sleep - 1 if we may read from the swap device
  * Return value:
- * the physical address or 0 if the page is not mapped
+ * 0 if the access can be repeated
+ * EFAULT if the page needs to be read, but may_sleep is 0
+ * ENOMEM if no physical page was available
+ * EIO if the swap device could not be read
+ * Locks:
+ * pt_lock - page table lock of the current process
+ * Cross-monitor function calls:
+ * mm_swap_reclaim
+ * mm_get_phys_page
+ * mm_put_phys_page
+ * mm_attach_page
+ * mm_detach_page
  */
-u32 mm_virt_to_phys(u32 virtual) {
-    pte_t* ptd = (pte_t*) mm_get_ptd();
+static int mm_swap_in(u32 page_base, int may_sleep) {
+    u32 pid = pm_get_pid();
+    u32 flags;
+    u32 slot = 0;
+    u32 phys_page = 0;
+    u32 virt_page;
+    u8 rw = 0;
+    int swapped = 0;
+    int mapped = 0;
+    int rc = 0;
+    pte_t* pte;
+    spinlock_t* pt_lock = &(mem_locks[pid].pt_lock);
+    spinlock_get(pt_lock, &flags);
+    pte = mm_get_pte(page_base);
+    if (pte && mm_swap_cancel(pid, pte)) {
+        spinlock_release(pt_lock, &flags);
+        invlpg(page_base);
+        return 0;
+    }
+    spinlock_release(pt_lock, &flags);
+    if (0 == may_sleep)
+        return EFAULT;
+    sem_down(&swap_mutex);
+    mm_swap_reclaim(1);
     /*
-     * First make sure that we have a page table for this address
+     * Another task of this process might have read the page while we were waiting
      */
-    if (0 == ptd[PTD_OFFSET(virtual)].p)
-        return 0;
-    pte_t* pt = mm_get_pt_address(ptd, PTD_OFFSET(virtual), 1);
-    if (0 == pt[PT_OFFSET(virtual)].p)
+    spinlock_get(pt_lock, &flags);
+    pte = mm_get_pte(page_base);
+    if (pte && MM_PTE_SWAPPED(pte)) {
+        swapped = 1;
+        slot = pte->page_base;
+        rw = pte->rw;
+    }
+    spinlock_release(pt_lock, &flags);
+    if (0 == swapped) {
+        sem_up(&swap_mutex);
         return 0;
-    return pt[PT_OFFSET(virtual)].page_base * MM_PAGE_SIZE + (virtual % MM_PAGE_SIZE);
+    }
+    if (0 == (phys_page = mm_get_phys_page()))
+        rc = ENOMEM;
+    else if (swap_rw(slot, 0))
+        rc = EIO;
+    else if (0 == (virt_page = mm_attach_page(phys_page)))
+        rc = ENOMEM;
+    else {
+        memcpy((void*) virt_page, swap_buffer, MM_PAGE_SIZE);
+        mm_detach_page(virt_page);
+        spinlock_get(pt_lock, &flags);
+        pte = mm_get_pte(page_base);
+        if (pte && MM_PTE_SWAPPED(pte) && (pte->page_base == slot)) {
+            *pte = pte_create(rw, MM_USER_PAGE, 0, 0, phys_page);
+            mapped = 1;
+        }
+        invlpg(page_base);
+        spinlock_release(pt_lock, &flags);
+    }
+    if (mapped) {
+        swap_slot_put(slot);
+        swap_ins++;
+    }
+    else if (phys_page) {
+        mm_put_phys_page(phys_page);
+    }
+    sem_up(&swap_mutex);
+    return rc;
 }
 
 /*
- * This function will determine whether a given virtual address is mapped
- * into the address space of the currently active process
+ * Check whether a page of the current process has been swapped out
  * Parameter:
- * @virtual_base - the base address of the page to be checked
+ * @virtual_base - the base address of the page
  * Return value:
- * 1 if the page is mapped
- * 0 if it is not mapped
+ * 1 if the page table entry refers to a slot on the swap device
+ * 0 otherwise
  */
-static int mm_page_mapped_impl(u32 virtual_base) {
-    pte_t* ptd = mm_get_ptd();
-    pte_t* pt;
-    if (0 == ptd[PTD_OFFSET(virtual_base)].p) {
-        return 0;
+static int mm_page_swapped(u32 virtual_base) {
+    pte_t* pte = mm_get_pte(virtual_base);
+    return (pte && MM_PTE_SWAPPED(pte));
+}
+
+/*
+ * Initialize swapping. If the kernel parameter swap names a block device, the first swap_size kB of this device are
+ * used as swap device. This needs to be called once the device drivers have been initialized
+ */
+void mm_swap_init() {
+    dev_t dev = params_get_int("swap");
+    u32 slots = params_get_int("swap_size") / (MM_PAGE_SIZE / 1024);
+    blk_dev_ops_t* ops;
+    spinlock_init(&swap_lock);
+    sem_init(&swap_mutex, 1);
+    if ((0 == dev) || (0 == slots))
+        return;
+    ops = dm_get_blk_dev_ops(MAJOR(dev));
+    if ((0 == ops) || (0 == ops->open) || ops->open(MINOR(dev))) {
+        ERROR("Could not open swap device %x\n", dev);
+        return;
     }
-    pt = mm_get_pt_address(ptd, PTD_OFFSET(virtual_base), get_cr0() >> 31);
-    if (0 == pt[PT_OFFSET(virtual_base)].p)
-        return 0;
-    return 1;
+    swap_dev = dev;
+    swap_slots = MIN(slots, MM_SWAP_MAX_SLOTS);
+    MSG("Using %d kB of device %x as swap device\n", swap_slots * (MM_PAGE_SIZE / 1024), dev);
+}
+
+/*
+ * Get statistics on the swap device
+ * Parameter:
+ * @stats - structure which will be filled with the statistics
+ */
+void mm_get_swap_stats(mm_swap_stats_t* stats) {
+    stats->slots = swap_slots;
+    stats->used = swap_used;
+    stats->swap_outs = swap_outs;
+    stats->swap_ins = swap_ins;
+    stats->second_chances = swap_second_chances;
+    stats->cancelled = swap_cancelled;
+    stats->rollbacks = swap_rollbacks;
 }
-int (*mm_page_mapped)(u32) = mm_page_mapped_impl;
 
 /****************************************************************************************
  * Functions for the initialization of the memory manager and the first process         *
@@ -838,6 +2465,9 @@ static void mm_init_locks() {
         spinlock_init(&mem_locks[i].sp_lock);
         spinlock_init(&mem_locks[i].pt_lock);
     }
+    for (i = 0; i < SMP_MAX_CPU; i++)
+        spinlock_init(&tlb_mailbox[i].lock);
+    spinlock_init(&zero_pool_lock);
 }
 
 /*
@@ -850,10 +2480,16 @@ static void mm_init_locks() {
  * - the upper 4 MB of memory are set up to contain the page tables themselves
  * - map stack area
  * All mappings are done with rw=1, us=0
+ * If the CPU supports PSE and the kernel parameter pse is not 0, all 4 MB areas which are entirely
+ * covered by the one-to-one mapping or by the ramdisk are mapped by 4 MB pages instead of page tables.
+ * To make this possible for the ramdisk, its virtual start address is then chosen such that it has
+ * the same offset within a 4 MB page as its physical start address
+ * If the CPU supports PGE and the kernel parameter pge is not 0, all mappings within the common area
+ * are marked global and PGE is turned on in CR4
  * When the page tables have been initialized, the physical address of the PTD
  * is loaded into CR3
  * In total we will therefore request the following physical pages:
- * MM_SHARED_PAGE_TABLES for the shared page tables
+ * MM_SHARED_PAGE_TABLES for the shared page tables (less the areas mapped by 4 MB pages)
  * 1 page table for the area immediately below 0xffffffff - 4 MB
  * MM_STACK_PAGES_TASK pages for the stack
  * --> in total, 1 + MM_SHARED_PAGE_TABLES + MM_STACK_PAGES are used
@@ -863,6 +2499,9 @@ static void mm_init_locks() {
  */
 void mm_init_page_tables() {
     u32 page;
+    u32 area;
+    u32 kernel_end;
+    u32 ramdisk_size;
     int i;
     pte_t* ptd_root;
     pte_t* pt;
@@ -878,25 +2517,55 @@ void mm_init_page_tables() {
     if (phys_mem_layout.kernel_end + MIN_HEAP_BYTES > MM_MEMIO_END) {
         PANIC("Kernel BSS section ends at %x, not enough room left for kernel heap and RAM disk\n", phys_mem_layout.kernel_end);
     }
+    /*
+     * Determine whether we use 4 MB pages and global pages
+     */
+    large_pages = (params_get_int("pse") && cpu_has_feature(0, CPUID_FEATURE_PSE)) ? 1 : 0;
+    global_pages = (params_get_int("pge") && cpu_has_feature(0, CPUID_FEATURE_PGE)) ? 1 : 0;
+    kernel_end = MM_PAGE_END(MM_PAGE(mm_get_bss_end()));
+    /*
+     * The ramdisk is mapped right above the kernel BSS section. If its physical
+     * memory contains at least one aligned 4 MB block, move it up a bit so that this
+     * block can be mapped by a 4 MB page
+     */
+    virt_ramdisk_start = (MM_PAGE(mm_get_bss_end()) + 1) * MM_PAGE_SIZE;
+    ramdisk_size = phys_mem_layout.ramdisk_end - phys_mem_layout.ramdisk_start;
+    area = (phys_mem_layout.ramdisk_start + MM_LARGE_PAGE_SIZE - 1) & ~(MM_LARGE_PAGE_SIZE - 1);
+    if (large_pages && (phys_mem_layout.ramdisk_end > phys_mem_layout.ramdisk_start)
+            && (area + MM_LARGE_PAGE_SIZE <= phys_mem_layout.ramdisk_end)) {
+        virt_ramdisk_start += (MM_PAGE_START(MM_PAGE(phys_mem_layout.ramdisk_start)) - virt_ramdisk_start)
+                % MM_LARGE_PAGE_SIZE;
+    }
     /*
      * Initialize the first MM_SHARED_PAGE_TABLES entries
      */
     for (i = 0; i < MM_SHARED_PAGE_TABLES; i++) {
+        area = MM_AREA_START(i);
+        if (large_pages && (area + MM_LARGE_PAGE_SIZE - 1 <= kernel_end)) {
+            ptd_root[i] = pde_create_large(1, 0, 0, global_pages, area);
+            continue;
+        }
+        if (large_pages && (area >= virt_ramdisk_start) && (area - virt_ramdisk_start + MM_LARGE_PAGE_SIZE <= ramdisk_size)
+                && (0 == (phys_mem_layout.ramdisk_start + (area - virt_ramdisk_start)) % MM_LARGE_PAGE_SIZE)) {
+            ptd_root[i] = pde_create_large(1, 0, 0, global_pages, phys_mem_layout.ramdisk_start + (area - virt_ramdisk_start));
+            continue;
+        }
         if (0 == (pt = (pte_t*) mm_get_phys_page())) {
             PANIC("Could not get memory for shared page table\n");
             return;
         }
         memset((void*) pt, 0, sizeof(pte_t) * MM_PT_ENTRIES);
-        ptd_root[i] = pte_create(1, 0, 0, (u32) pt);
+        ptd_root[i] = pte_create(1, 0, 0, 0, (u32) pt);
     }
     /*
      * First do one-to-one mapping for all pages up to the end of the kernel bss section
      * As this is within the common area, this should not allocate any additional physical page
      */
     page = 0;
-    while (MM_PAGE_END(page) <= MM_PAGE_END(MM_PAGE(mm_get_bss_end()))) {
-        mm_map_page(ptd_root, MM_PAGE_START(page), MM_PAGE_START(page),
-                MM_READ_WRITE, MM_SUPERVISOR_PAGE, 0, 0);
+    while (MM_PAGE_END(page) <= kernel_end) {
+        if (0 == ptd_root[PTD_OFFSET(MM_PAGE_START(page))].ps)
+            mm_map_page(ptd_root, MM_PAGE_START(page), MM_PAGE_START(page),
+                    MM_READ_WRITE, MM_SUPERVISOR_PAGE, 0, 0);
         page++;
     }
     /*
@@ -904,7 +2573,6 @@ void mm_init_page_tables() {
      * still within the common area
      */
     page = 0;
-    virt_ramdisk_start = (MM_PAGE(mm_get_bss_end()) + 1) * MM_PAGE_SIZE;
     /*
      * Current end of ramdisk - we increase this in the following loop
      * so that it will have the correct value after finishing the loop
@@ -912,9 +2580,10 @@ void mm_init_page_tables() {
     virt_ramdisk_end = virt_ramdisk_start;
     while (phys_mem_layout.ramdisk_start + MM_PAGE_SIZE * page
             < phys_mem_layout.ramdisk_end) {
-        mm_map_page(ptd_root, phys_mem_layout.ramdisk_start + page
-                * MM_PAGE_SIZE, virt_ramdisk_start + MM_PAGE_SIZE * page,
-                MM_READ_WRITE, MM_SUPERVISOR_PAGE, 0, 0);
+        if (0 == ptd_root[PTD_OFFSET((virt_ramdisk_start + MM_PAGE_SIZE * page))].ps)
+            mm_map_page(ptd_root, phys_mem_layout.ramdisk_start + page
+                    * MM_PAGE_SIZE, virt_ramdisk_start + MM_PAGE_SIZE * page,
+                    MM_READ_WRITE, MM_SUPERVISOR_PAGE, 0, 0);
         virt_ramdisk_end = virt_ramdisk_start + MM_PAGE_SIZE * page;
         page++;
     }
@@ -926,7 +2595,7 @@ void mm_init_page_tables() {
      * Now set up the last entry in the PDT to point to itself to map pages tables
      * starting at 0xffc0:0000
      */
-    ptd_root[MM_PT_ENTRIES - 1] = pte_create(1, 0, 0, (u32) ptd_root);
+    ptd_root[MM_PT_ENTRIES - 1] = pte_create(1, 0, 0, 0, (u32) ptd_root);
     /*
      * Allocate physical pages for stack and map it
      * stack_page_v is the virtual address of the lowest page of the stack
@@ -943,8 +2612,12 @@ void mm_init_page_tables() {
         stack_page_v += MM_PAGE_SIZE;
     }
     /*
-     * Finally move physical address of PTD into CR3
+     * Finally turn on 4 MB pages and global pages if needed and move physical address of PTD into CR3
      */
+    if (large_pages)
+        put_cr4(get_cr4() | MM_CR4_PSE);
+    if (global_pages)
+        put_cr4(get_cr4() | MM_CR4_PGE);
     put_cr3((u32) ptd_root);
 }
 
@@ -963,6 +2636,9 @@ void mm_init_address_spaces() {
     address_space[0].tail = stack_allocator;
     address_space[0].end_data = MM_START_CODE - 1;
     address_space[0].brk = MM_START_CODE;
+    address_space[0].stack_base = MM_VIRTUAL_TOS_USER + 1;
+    address_space[0].segments_head = 0;
+    address_space[0].segments_tail = 0;
     spinlock_init(&(address_space[0].lock));
     stack_allocator[0].valid = 1;
     stack_allocator[0].next = 0;
@@ -1492,12 +3168,20 @@ int (*mm_copy_page)(u32, u32) = mm_copy_page_impl;
 
 /*
  * Clone a page table, i.e.:
- * for all entries in the user area and kernel stack in the source page table,
- * allocate a new physical page, copy its content
- * from the existing page and set up a mapping in the new page table
+ * - for all entries in the user area in the source page table, map the same physical
+ *   page into the new page table and increase its reference count. Pages which are writable
+ *   are write protected in both page tables and marked as copy-on-write, so that the
+ *   first write access in either process will create a private copy (see mm_resolve_cow),
+ *   unless they belong to a shared mapping
+ * - entries for pages which have been swapped out are copied, adding a reference to the slot on the swap device
+ * - for all entries in the kernel stack in the source page table,
+ *   allocate a new physical page, copy its content
+ *   from the existing page and set up a mapping in the new page table
+ * The source page table is assumed to belong to the currently active address space
  * It uses the following utility functions:
  * - mm_copy_page - copy a page
  * - mm_get_phys_page - allocate an unused physical page
+ * - mm_share_phys_page - add a reference to a physical page
  * Parameters:
  * @source_pt: the source page table to be cloned
  * @target_pt: a pointer to the target page table
@@ -1517,6 +3201,15 @@ static int mm_clone_pt(pte_t* source_pt, pte_t* target_pt, u32 pt_base) {
     u32 page_top_current_stack = stack_allocator[pm_get_task_id()].highest_page;
     for (page = 0; page < MM_PT_ENTRIES; page++) {
         page_base = pt_base + MM_PAGE_SIZE * page;
+        /*
+         * A page which has been swapped out shares the slot on the swap device, unless it is still
+         * in flight - in this case we restore the original entry and share the physical page
+         */
+        if (MM_PTE_SWAPPED(source_pt + page) && (0 == mm_swap_cancel(pm_get_pid(), source_pt + page))) {
+            target_pt[page] = source_pt[page];
+            swap_slot_share(source_pt[page].page_base);
+            continue;
+        }
         if ((source_pt[page].p == 1) && (page_base < MM_VIRTUAL_TOS)) {
             do_clone = 1;
             /*
@@ -1527,7 +3220,21 @@ static int mm_clone_pt(pte_t* source_pt, pte_t* target_pt, u32 pt_base) {
                 if (!((page_base >= page_base_current_stack) && (page_base
                         <= page_top_current_stack)))
                     do_clone = 0;
-            if (do_clone) {
+            if (do_clone && (page_base <= MM_VIRTUAL_TOS_USER)) {
+                /*
+                 * User space page - share physical page. Note that a page which is read-only
+                 * and not marked as copy-on-write is simply shared and remains read-only, and that
+                 * a page of a shared mapping remains writable in both address spaces
+                 */
+                if (source_pt[page].rw && (0 == source_pt[page].shared)) {
+                    source_pt[page].rw = 0;
+                    source_pt[page].cow = 1;
+                    invlpg(page_base);
+                }
+                target_pt[page] = source_pt[page];
+                mm_share_phys_page(source_pt[page].page_base * MM_PAGE_SIZE);
+            }
+            else if (do_clone) {
                 /*
                  * Allocate new physical page and map it into target page table
                  */
@@ -1536,7 +3243,7 @@ static int mm_clone_pt(pte_t* source_pt, pte_t* target_pt, u32 pt_base) {
                     return ENOMEM;
                 }
                 target_pt[page] = pte_create(source_pt[page].rw,
-                        source_pt[page].us, source_pt[page].pcd, phys_page);
+                        source_pt[page].us, source_pt[page].pcd, 0, phys_page);
                 /* Copy content of original page into new page */
                 rc = mm_copy_page(page_base, phys_page);
                 if (rc) {
@@ -1555,7 +3262,9 @@ static int mm_clone_pt(pte_t* source_pt, pte_t* target_pt, u32 pt_base) {
  * - for each page mapping,
  *   - if the page is in the common area, copy the link to the page table into
  *     the target page table directory
- *   - if the page is in the user area or the kernel stack, clone the page, i.e. allocate a new physical
+ *   - if the page is in the user area, share the physical page copy-on-write, creating a new page table
+ *     if necessary
+ *   - if the page is in the kernel stack, clone the page, i.e. allocate a new physical
  *     page and copy its contents, create a new page table if necessary and add the mapping accordingly,
  *     but only do this is the page is within the stack area of the currently active task
  * - set up the remaining mappings in the private system area
@@ -1598,6 +3307,12 @@ int mm_clone_ptd(pte_t* source_ptd, pte_t* target_ptd, u32 phys_target_ptd) {
          * */
         if ((MM_AREA_START(ptd_offset) <= MM_VIRTUAL_TOS)
                 && (source_ptd[ptd_offset].p == 1)) {
+            /*
+             * Pages are shared copy-on-write one by one, so 4 MB pages need to be split first
+             */
+            if (source_ptd[ptd_offset].ps && mm_split_large_page(source_ptd, MM_AREA_START(ptd_offset))) {
+                return ENOMEM;
+            }
             /*
              * Allocate a new page table and attach it to a temporary slot
              */
@@ -1614,7 +3329,7 @@ int mm_clone_ptd(pte_t* source_ptd, pte_t* target_ptd, u32 phys_target_ptd) {
              * Add new page table to target page table directory
              */
             target_ptd[ptd_offset] = pte_create(source_ptd[ptd_offset].rw,
-                    source_ptd[ptd_offset].us, source_ptd[ptd_offset].pcd,
+                    source_ptd[ptd_offset].us, source_ptd[ptd_offset].pcd, 0,
                     target_pt_phys);
             /*
              * Get pointer to source page table and clone page table
@@ -1632,7 +3347,7 @@ int mm_clone_ptd(pte_t* source_ptd, pte_t* target_ptd, u32 phys_target_ptd) {
      * to point to itself to map pages tables
      * starting at 0xffc0:0000
      */
-    target_ptd[MM_PT_ENTRIES - 1] = pte_create(1, 0, 0, (u32) phys_target_ptd);
+    target_ptd[MM_PT_ENTRIES - 1] = pte_create(1, 0, 0, 0, (u32) phys_target_ptd);
     return 0;
 }
 
@@ -1670,9 +3385,38 @@ static void mm_clone_address_space(int task_id, int new_task_id, int new_pid) {
     address_space[new_pid].valid = 1;
     address_space[new_pid].brk = address_space[pm_get_pid()].brk;
     address_space[new_pid].end_data = address_space[pm_get_pid()].end_data;
+    address_space[new_pid].stack_base = address_space[pm_get_pid()].stack_base;
+    address_space[new_pid].segments_head = 0;
+    address_space[new_pid].segments_tail = 0;
     spinlock_release(&address_spaces_lock, &flags);
 }
 
+/*
+ * Copy the list of user segments of the current process to a new process, so that pages which
+ * have not yet been populated can be populated in the new process as well
+ * Parameters:
+ * @new_pid - the id of the new process
+ * Return value:
+ * 0 upon success
+ * ENOMEM if no memory could be allocated
+ */
+static int mm_clone_user_segments(int new_pid) {
+    user_segment_t* segment;
+    user_segment_t* new_segment;
+    address_space_t* as = address_space + new_pid;
+    LIST_FOREACH(address_space[pm_get_pid()].segments_head, segment) {
+        if (0 == (new_segment = (user_segment_t*) kmalloc(sizeof(user_segment_t)))) {
+            ERROR("Could not allocate memory for user segment\n");
+            return ENOMEM;
+        }
+        *new_segment = *segment;
+        if (segment->inode)
+            new_segment->inode = segment->inode->iops->inode_clone(segment->inode);
+        LIST_ADD_END(as->segments_head, as->segments_tail, new_segment);
+    }
+    return 0;
+}
+
 /*
  * Clone an entire address space
  * and return the physical address of the new page table directory
@@ -1684,10 +3428,30 @@ static void mm_clone_address_space(int task_id, int new_task_id, int new_pid) {
  * @new_task_id - task id of new task, this will be used as id for the new stack allocator
  * Return value:
  * physical address of the new page table directory or 0 if operation failed
+ * Locks:
+ * pt_lock - page table lock of the current process
+ * Cross-monitor function calls:
+ * mm_swap_reserve
+ * mm_tlb_batch_flush
  *  */
 u32 mm_clone(int new_pid, int new_task_id) {
     pte_t* new_ptd;
     int rc;
+    u32 flags;
+    mm_tlb_batch_t batch;
+    spinlock_t* pt_lock = &(mem_locks[pm_get_pid()].pt_lock);
+    pte_t* ptd = mm_get_ptd();
+    int i;
+    u32 pages = MM_STACK_PAGES_TASK;
+    /*
+     * We need a new page table for each page table of the user area and the kernel stack
+     * and pages for the kernel stack, so swap out pages if needed before we get the lock
+     */
+    for (i = MM_SHARED_PAGE_TABLES; i < MM_PT_ENTRIES; i++) {
+        if (ptd[i].p)
+            pages++;
+    }
+    mm_swap_reserve(pages);
     /*
      * We will place our new page table directory within
      * the address space structure of the new process
@@ -1698,9 +3462,20 @@ u32 mm_clone(int new_pid, int new_task_id) {
     new_ptd = proc_ptd[new_pid];
     memset((void*) new_ptd, 0, sizeof(pte_t) * MM_PT_ENTRIES);
     /*
-     * Clone page table directory
+     * Clone page table directory. We hold the page table lock
+     * of the current process while doing this as we change the
+     * page table entries of the user space pages to read-only
+     */
+    spinlock_get(pt_lock, &flags);
+    rc = mm_clone_ptd(ptd, new_ptd, (u32) new_ptd);
+    spinlock_release(pt_lock, &flags);
+    /*
+     * Other threads of this process might still write to the pages which are now
+     * write protected via their TLBs, so flush the TLBs of all CPUs using this address space
      */
-    rc = mm_clone_ptd(mm_get_ptd(), new_ptd, (u32) new_ptd);
+    mm_tlb_batch_init(&batch);
+    batch.flush_all = 1;
+    mm_tlb_batch_flush(&batch);
     if (rc) {
         ERROR("mm_clone_ptd returned with rc=%d\n", rc);
         return 0;
@@ -1709,6 +3484,9 @@ u32 mm_clone(int new_pid, int new_task_id) {
      * And clone stack allocators and address space data structure
      */
     mm_clone_address_space(pm_get_task_id(), new_task_id, new_pid);
+    if (mm_clone_user_segments(new_pid)) {
+        return 0;
+    }
     return (u32) new_ptd;
 }
 
@@ -1727,12 +3505,16 @@ u32 mm_clone(int new_pid, int new_task_id) {
  *
  * Parameters:
  * @pid - the pid of the process for which page tables should be released
+ * Locks:
+ * pt_lock - page table lock of the process, as the swapper might scan the page tables at the same time
  *
  */
 void mm_release_page_tables(u32 pid) {
     pte_t* ptd = mm_get_ptd_for_pid(pid);
+    u32 flags;
     int i;
     KASSERT(ptd);
+    spinlock_get(&(mem_locks[pid].pt_lock), &flags);
     /*
      * For each entry in the page table directory which
      * does not point to the shared page tables for the common
@@ -1743,14 +3525,21 @@ void mm_release_page_tables(u32 pid) {
         if (ptd[i].p == 1) {
             /*
              * Only release physical memory if the entry does not
-             * point to the PTD itself
+             * point to the PTD itself. An entry for a 4 MB page should have
+             * been removed with the user area already, but we release the block
+             * if this did not happen
              */
             if (i != MM_PT_ENTRIES - 1) {
-                mm_put_phys_page(ptd[i].page_base * MM_PAGE_SIZE);
+                if (ptd[i].ps)
+                    mm_put_phys_pages(ptd[i].page_base * MM_PAGE_SIZE, MM_LARGE_PAGE_ORDER);
+                else
+                    mm_put_phys_page(ptd[i].page_base * MM_PAGE_SIZE);
             }
             ptd[i].p = 0;
+            ptd[i].ps = 0;
         }
     }
+    spinlock_release(&(mem_locks[pid].pt_lock), &flags);
 }
 
 
@@ -1844,15 +3633,27 @@ int mm_validate_buffer(u32 buffer, u32 len, int read_write) {
          * Validate mapping of that page
          */
         if (0 == mm_page_mapped(page_base)) {
-            MM_DEBUG("Page at %x is not mapped\n", page_base);
-            return -1;
+            /*
+             * The page might be part of a user segment which has not yet been populated
+             */
+            if (mm_load_page(page_base, 1)) {
+                MM_DEBUG("Page at %x is not mapped\n", page_base);
+                return -1;
+            }
         }
         /*
          * If page is mapped, check access
          */
         if (0 == access_allowed(page_base, mm_get_ptd(), 0, read_write)) {
-            MM_DEBUG("Page %x: access not allowed\n", page_base);
-            return -1;
+            /*
+             * If the page is shared copy-on-write, get a private copy now
+             */
+            if (read_write)
+                mm_swap_reserve(1);
+            if ((0 == read_write) || mm_resolve_cow(page_base)) {
+                MM_DEBUG("Page %x: access not allowed\n", page_base);
+                return -1;
+            }
         }
         /*
          * Move on to next page. For len > 0, we just advance page_base by one page. For
@@ -1903,7 +3704,9 @@ int mm_validate_buffer(u32 buffer, u32 len, int read_write) {
 /*
  * Utility function to allocate a region in user space.
  * The region requested needs to span a multiple of the page
- * size.
+ * size. The new pages are filled with zeroes. 4 MB areas which
+ * are entirely contained in the region and not yet mapped are
+ * mapped with a 4 MB page if possible
  * Parameters:
  * @region_base - the base address of the region to be mapped, must be aligned to a page boundary
  * @region_end - the last byte of the region to be mapped, region_end+1 must be a multiple of the page size
@@ -1925,15 +3728,21 @@ static int add_user_space_pages(u32 region_base, u32 region_end) {
         return EINVAL;
     }
     /*
-     * Validate that we leave at least MM_STACK_PAGES_TASK+1 pages for stack
+     * Validate that we do not reach into the area reserved for the user space stack
      */
-    if (MM_PAGE(region_end + 1) >= MM_PAGE(MM_VIRTUAL_TOS_USER) - MM_STACK_PAGES) {
+    if (MM_PAGE(region_end + 1) >= MM_PAGE(MM_VIRTUAL_TOS_USER) - MM_STACK_PAGES_USER_MAX) {
         ERROR("Conflict with user stack area\n");
         return EINVAL;
     }
-    for (page = region_base; page < region_end + 1; page++) {
+    page = region_base;
+    while (page < region_end + 1) {
+        if ((0 == page % MM_LARGE_PAGE_SIZE) && (page + MM_LARGE_PAGE_SIZE - 1 <= region_end)
+                && (0 == mm_map_large_page(page))) {
+            page += MM_LARGE_PAGE_SIZE;
+            continue;
+        }
         if (!mm_page_mapped(page)) {
-            if (0 == (phys_page = mm_get_phys_page())) {
+            if (0 == (phys_page = mm_get_zeroed_page())) {
                 ERROR("Out of physical memory\n");
                 return ENOMEM;
             }
@@ -1944,6 +3753,7 @@ static int add_user_space_pages(u32 region_base, u32 region_end) {
                 return ENOMEM;
             }
         }
+        page += MM_PAGE_SIZE;
     }
     return 0;
 }
@@ -1974,6 +3784,7 @@ u32 mm_map_user_segment(u32 region_base, u32 region_end) {
     /*
      * Do actual allocation
      */
+    mm_swap_reserve(MM_PAGE(region_end - region_base) + 1);
     if (add_user_space_pages(region_base, region_end)) {
         return 0;
     }
@@ -1989,11 +3800,92 @@ u32 mm_map_user_segment(u32 region_base, u32 region_end) {
     return region_base;
 }
 
+/*
+ * Add a region in user space which is populated on demand, i.e. when a page within the region
+ * is accessed for the first time. The pages between file_start and file_end are filled with
+ * data from the provided file, the pages up to mem_end are filled with zeroes. Like
+ * mm_map_user_segment, this should only be used while preparing a process for execution
+ * Parameters:
+ * @region_base - the base address of the region, must be aligned to a page boundary
+ * @region_end - the last byte of the region, region_end+1 must be a multiple of the page size
+ * @file_start - first address which is filled with data from the file
+ * @file_end - first address after the data from the file
+ * @mem_end - first address after the area which is filled with zeroes
+ * @offset - offset within the file from which the data at file_start is read
+ * @inode - the file, a reference to it is kept until the user area is torn down
+ * Return value:
+ * 0 upon success
+ * EINVAL if the arguments are not valid
+ * ENOMEM if no memory could be allocated
+ * Locks:
+ * lock on current address space
+ */
+int mm_add_user_segment(u32 region_base, u32 region_end, u32 file_start, u32 file_end, u32 mem_end, u32 offset,
+        inode_t* inode) {
+    u32 eflags;
+    int pid = pm_get_pid();
+    user_segment_t* segment;
+    if ((region_base < MM_START_CODE) || (region_base % MM_PAGE_SIZE) || ((region_end + 1) % MM_PAGE_SIZE)) {
+        ERROR("Invalid segment, region_base=%x, region_end=%x\n", region_base, region_end);
+        return EINVAL;
+    }
+    if (MM_PAGE(region_end + 1) >= MM_PAGE(MM_VIRTUAL_TOS_USER) - MM_STACK_PAGES_USER_MAX) {
+        ERROR("Conflict with user stack area\n");
+        return EINVAL;
+    }
+    if ((file_start < region_base) || (file_end < file_start) || (mem_end < file_end) || (mem_end > region_end + 1)) {
+        ERROR("Invalid layout of segment at %x\n", region_base);
+        return EINVAL;
+    }
+    if (0 == (segment = (user_segment_t*) kmalloc(sizeof(user_segment_t)))) {
+        ERROR("Could not allocate memory for user segment\n");
+        return ENOMEM;
+    }
+    segment->start = region_base;
+    segment->end = region_end;
+    segment->file_start = file_start;
+    segment->file_end = file_end;
+    segment->mem_end = mem_end;
+    segment->offset = offset;
+    segment->flags = MM_SEGMENT_READ | MM_SEGMENT_WRITE;
+    segment->inode = inode ? inode->iops->inode_clone(inode) : 0;
+    /*
+     * Add segment and update address space data if needed
+     */
+    spinlock_get(&address_space[pid].lock, &eflags);
+    LIST_ADD_END(address_space[pid].segments_head, address_space[pid].segments_tail, segment);
+    if (region_end > address_space[pid].end_data) {
+        address_space[pid].end_data = region_end;
+        address_space[pid].brk = region_end + 1;
+    }
+    spinlock_release(&address_space[pid].lock, &eflags);
+    return 0;
+}
+
+/*
+ * Locate a user segment of an address space which overlaps a given range
+ * Parameters:
+ * @as - the address space
+ * @lo - first address of the range
+ * @hi - last address of the range
+ * Return value:
+ * the first segment in the list which overlaps the range or 0 if there is none
+ */
+static user_segment_t* mm_find_segment(address_space_t* as, u32 lo, u32 hi) {
+    user_segment_t* segment;
+    LIST_FOREACH(as->segments_head, segment) {
+        if ((segment->start <= hi) && (segment->end >= lo))
+            return segment;
+    }
+    return 0;
+}
+
 /*
  * Increase the break of the currently running process. By definition, the break is the first unallocated
  * byte above the user space heap and is always a multiple of the page size. This function will
  * increase the break by at least the specified number of bytes and return the new break. Usually, this is more
- * than requested as the new break will again be page aligned.
+ * than requested as the new break will again be page aligned. The heap cannot grow into a mapping created
+ * by mmap
  * Parameters:
  * @size - number of bytes requested
  * Return value:
@@ -2002,14 +3894,20 @@ u32 mm_map_user_segment(u32 region_base, u32 region_end) {
  * Locks:
  * lock on current address space
  * Cross-monitor function calls:
+ * mm_swap_reserve
  * mm_map_page - via add user space pages
- * mm_get_phys_page - via add_user_space_pages
+ * mm_get_zeroed_page - via add_user_space_pages
  */
 u32 do_sbrk(u32 size) {
     u32 eflags;
     u32 old_brk;
     u32 new_brk;
     int pid = pm_get_pid();
+    /*
+     * Swap out pages if needed before we get the lock, as this might sleep
+     */
+    if (size)
+        mm_swap_reserve(MM_PAGE(size - 1) + 2);
     /*
      * Lock address space
      */
@@ -2025,10 +3923,15 @@ u32 do_sbrk(u32 size) {
     new_brk = old_brk + size;
     if (new_brk % MM_PAGE_SIZE)
         new_brk = (new_brk / MM_PAGE_SIZE) * MM_PAGE_SIZE + MM_PAGE_SIZE;
+    if ((new_brk < old_brk) || mm_find_segment(address_space + pid, old_brk, new_brk - 1)) {
+        spinlock_release(&address_space[pid].lock, &eflags);
+        return 0;
+    }
     /*
      * Do actual allocation
      */
     if (add_user_space_pages(old_brk, new_brk-1)) {
+        spinlock_release(&address_space[pid].lock, &eflags);
         return 0;
     }
     address_space[pid].brk = new_brk;
@@ -2037,7 +3940,290 @@ u32 do_sbrk(u32 size) {
 }
 
 /*
- * Initialize the user area and allocate MM_STACK_PAGES_TASK_USER pages for the user space stack
+ * Shorten a user segment so that it starts at a given address, adapting the parts filled
+ * from the file and with zeroes accordingly
+ * Parameters:
+ * @segment - the segment
+ * @start - the new start of the segment, needs to be page aligned
+ */
+static void mm_segment_cut_below(user_segment_t* segment, u32 start) {
+    u32 file_start = MAX(segment->file_start, start);
+    segment->offset += file_start - segment->file_start;
+    segment->file_start = file_start;
+    segment->file_end = MAX(segment->file_end, file_start);
+    segment->mem_end = MAX(segment->mem_end, file_start);
+    segment->start = start;
+}
+
+/*
+ * Shorten a user segment so that it ends below a given address
+ * Parameters:
+ * @segment - the segment
+ * @end - the first address which is no longer part of the segment, needs to be page aligned
+ */
+static void mm_segment_cut_above(user_segment_t* segment, u32 end) {
+    segment->file_start = MIN(segment->file_start, end);
+    segment->file_end = MIN(segment->file_end, end);
+    segment->mem_end = MIN(segment->mem_end, end);
+    segment->end = end - 1;
+}
+
+/*
+ * Write back all pages of a shared file mapping within a given range which are mapped and have
+ * been modified since they were populated. Data is only written within the part of the segment which
+ * is filled from the file, and the file is never extended. This might sleep
+ * Parameters:
+ * @segment - the segment
+ * @lo - first address of the range, needs to be page aligned
+ * @hi - last address of the range
+ * Cross-monitor function calls:
+ * fs_write_inode
+ */
+static void mm_write_back_segment(user_segment_t* segment, u32 lo, u32 hi) {
+    u32 page;
+    u32 from;
+    u32 to;
+    pte_t* pte;
+    if ((0 == (segment->flags & MM_SEGMENT_SHARED)) || (0 == segment->inode))
+        return;
+    for (page = lo; page < hi; page += MM_PAGE_SIZE) {
+        if (0 == mm_page_mapped(page))
+            continue;
+        pte = mm_get_pte(page);
+        if ((0 == pte) || (0 == pte->d))
+            continue;
+        from = MAX(page, segment->file_start);
+        to = MIN(page + MM_PAGE_SIZE, segment->file_end);
+        if (from >= to)
+            continue;
+        if (fs_write_inode(segment->inode, segment->offset + (from - segment->file_start), to - from,
+                (void*) from) < 0) {
+            ERROR("Could not write back page at %x\n", page);
+        }
+    }
+}
+
+/*
+ * Remove the mappings within a range of the user area of the current process (munmap system call). User
+ * segments which are entirely contained in the range are removed, segments which overlap the range only
+ * partially are shortened resp. split into two segments. Before a page is unmapped, it is written back to
+ * the file if it belongs to a shared file mapping and has been modified. Parts of the range which do not
+ * belong to a user segment are ignored
+ * Parameters:
+ * @addr - start of the range, needs to be page aligned
+ * @len - length of the range in bytes
+ * Return value:
+ * 0 upon success
+ * -EINVAL if the range is not valid
+ * -ENOMEM if no memory was available to split a segment or a 4 MB page
+ * Cross-monitor function calls:
+ * fs_write_inode
+ * mm_remove_mapping
+ * mm_tlb_batch_flush
+ */
+int do_munmap(u32 addr, u32 len) {
+    mm_tlb_batch_t batch;
+    u32 end;
+    u32 lo;
+    u32 hi;
+    u32 page;
+    u32 eflags;
+    user_segment_t* segment;
+    user_segment_t* next;
+    user_segment_t* new_segment;
+    address_space_t* as = address_space + pm_get_pid();
+    if ((0 == len) || (addr % MM_PAGE_SIZE) || (addr < MM_START_CODE) || (addr + len - 1 < addr))
+        return -EINVAL;
+    end = MM_PAGE_END(MM_PAGE(addr + len - 1));
+    if (end > MM_VIRTUAL_TOS_USER)
+        return -EINVAL;
+    /*
+     * 4 MB pages which are only partially contained in the range are split first
+     */
+    if (((addr % MM_LARGE_PAGE_SIZE) && mm_split_large_page_at(addr))
+            || (((end + 1) % MM_LARGE_PAGE_SIZE) && mm_split_large_page_at(end)))
+        return -ENOMEM;
+    mm_tlb_batch_init(&batch);
+    segment = as->segments_head;
+    while (segment) {
+        next = segment->next;
+        if ((segment->start > end) || (segment->end < addr)) {
+            segment = next;
+            continue;
+        }
+        /*
+         * If the range is in the middle of the segment, we need a second segment for the
+         * part above the range
+         */
+        if ((segment->start < addr) && (segment->end > end)) {
+            if (0 == (new_segment = (user_segment_t*) kmalloc(sizeof(user_segment_t)))) {
+                ERROR("Could not allocate memory for user segment\n");
+                mm_tlb_batch_flush(&batch);
+                return -ENOMEM;
+            }
+            *new_segment = *segment;
+            if (segment->inode)
+                new_segment->inode = segment->inode->iops->inode_clone(segment->inode);
+            mm_segment_cut_below(new_segment, end + 1);
+            spinlock_get(&as->lock, &eflags);
+            LIST_ADD_END(as->segments_head, as->segments_tail, new_segment);
+            spinlock_release(&as->lock, &eflags);
+        }
+        lo = MAX(segment->start, addr);
+        hi = MIN(segment->end, end);
+        mm_write_back_segment(segment, lo, hi);
+        for (page = lo; page < hi; page += MM_PAGE_SIZE) {
+            if (mm_page_mapped(page) || mm_page_swapped(page))
+                mm_remove_mapping(mm_get_ptd(), page, pm_get_pid(), &batch);
+        }
+        if ((lo == segment->start) && (hi == segment->end)) {
+            spinlock_get(&as->lock, &eflags);
+            LIST_REMOVE(as->segments_head, as->segments_tail, segment);
+            spinlock_release(&as->lock, &eflags);
+            if (segment->inode)
+                segment->inode->iops->inode_release(segment->inode);
+            kfree(segment);
+        }
+        else if (lo == segment->start) {
+            mm_segment_cut_below(segment, hi + 1);
+        }
+        else {
+            mm_segment_cut_above(segment, lo);
+        }
+        segment = next;
+    }
+    /*
+     * Other threads of the process might still use the pages via
+     * their TLBs, so the physical pages are only released after a shootdown
+     */
+    mm_tlb_batch_flush(&batch);
+    return 0;
+}
+
+/*
+ * Find a free area of the given size for a new mapping. Mappings are placed top-down, starting
+ * directly below MM_MMAP_TOP, and never below the program break
+ * Parameters:
+ * @as - the address space
+ * @size - size of the area in bytes, a multiple of the page size
+ * Return value:
+ * the base address of the area or 0 if no free area could be found
+ */
+static u32 mm_find_free_area(address_space_t* as, u32 size) {
+    u32 top = MM_MMAP_TOP;
+    u32 base;
+    user_segment_t* segment;
+    while (top >= size) {
+        base = top - size;
+        /*
+         * Place large areas at a 4 MB boundary so that they can be populated with 4 MB pages
+         */
+        if (large_pages && (size >= MM_LARGE_PAGE_SIZE))
+            base = base & ~(MM_LARGE_PAGE_SIZE - 1);
+        if (base < as->brk)
+            break;
+        if (0 == (segment = mm_find_segment(as, base, base + size - 1)))
+            return base;
+        top = segment->start;
+    }
+    return 0;
+}
+
+/*
+ * Map a file or anonymous memory into the user area of the current process (mmap system call). The
+ * mapping is added as a user segment and populated on demand by the page fault handler, i.e. pages
+ * of a file mapping are read from the file when they are accessed for the first time and anonymous
+ * pages are filled with zeroes. Pages of a mapping with MAP_SHARED remain shared with child processes
+ * after a fork, and modified pages of a shared file mapping are written back to the file when they
+ * are unmapped
+ * Parameters:
+ * @addr - the requested address, only used if MAP_FIXED is specified
+ * @len - length of the mapping in bytes
+ * @prot - PROT_NONE or a combination of PROT_READ, PROT_WRITE and PROT_EXEC
+ * @flags - either MAP_SHARED or MAP_PRIVATE, optionally combined with MAP_FIXED and MAP_ANONYMOUS
+ * @fd - the file descriptor of the file to be mapped, ignored for MAP_ANONYMOUS
+ * @offset - offset within the file, needs to be a multiple of the page size
+ * Return value:
+ * the address of the mapping upon success
+ * -EINVAL if the arguments are not valid
+ * -ENOMEM if the mapping does not fit into the user area or no memory was available
+ * -EBADF if fd is not a valid file descriptor
+ * -EACCES if the file has not been opened with the required access mode
+ * -ENODEV if the file is not a regular file
+ * Locks:
+ * lock on current address space
+ */
+u32 do_mmap(u32 addr, u32 len, int prot, int flags, int fd, u32 offset) {
+    u32 eflags;
+    u32 size;
+    u32 base;
+    int rc;
+    inode_t* inode = 0;
+    user_segment_t* segment;
+    address_space_t* as = address_space + pm_get_pid();
+    if ((0 == len) || (offset % MM_PAGE_SIZE))
+        return -EINVAL;
+    if (((flags & MAP_SHARED) && (flags & MAP_PRIVATE)) || (0 == (flags & (MAP_SHARED | MAP_PRIVATE))))
+        return -EINVAL;
+    if (len > MM_MMAP_TOP - MM_START_CODE)
+        return -ENOMEM;
+    size = MM_PAGE_START(MM_PAGE(len - 1) + 1);
+    if (flags & MAP_FIXED) {
+        if (addr % MM_PAGE_SIZE)
+            return -EINVAL;
+        if ((addr < as->brk) || (addr > MM_MMAP_TOP - size))
+            return -ENOMEM;
+    }
+    if (0 == (flags & MAP_ANONYMOUS)) {
+        if ((rc = fs_get_mappable_inode(fd, (flags & MAP_SHARED) && (prot & PROT_WRITE), &inode)))
+            return -rc;
+    }
+    if (0 == (segment = (user_segment_t*) kmalloc(sizeof(user_segment_t)))) {
+        ERROR("Could not allocate memory for user segment\n");
+        if (inode)
+            inode->iops->inode_release(inode);
+        return -ENOMEM;
+    }
+    /*
+     * A fixed mapping replaces any existing mapping in its range
+     */
+    if ((flags & MAP_FIXED) && (rc = do_munmap(addr, size))) {
+        kfree(segment);
+        if (inode)
+            inode->iops->inode_release(inode);
+        return rc;
+    }
+    spinlock_get(&as->lock, &eflags);
+    base = (flags & MAP_FIXED) ? addr : mm_find_free_area(as, size);
+    if (0 == base) {
+        spinlock_release(&as->lock, &eflags);
+        kfree(segment);
+        if (inode)
+            inode->iops->inode_release(inode);
+        return -ENOMEM;
+    }
+    segment->start = base;
+    segment->end = base + size - 1;
+    segment->file_start = base;
+    segment->file_end = inode ? base + len : base;
+    segment->mem_end = base + size;
+    segment->offset = offset;
+    segment->flags = 0;
+    if (prot & (PROT_READ | PROT_WRITE | PROT_EXEC))
+        segment->flags |= MM_SEGMENT_READ;
+    if (prot & PROT_WRITE)
+        segment->flags |= MM_SEGMENT_WRITE;
+    if (flags & MAP_SHARED)
+        segment->flags |= MM_SEGMENT_SHARED;
+    segment->inode = inode;
+    LIST_ADD_END(as->segments_head, as->segments_tail, segment);
+    spinlock_release(&as->lock, &eflags);
+    return base;
+}
+
+/*
+ * Initialize the user area and allocate MM_STACK_PAGES_TASK_USER pages for the user space stack. Further
+ * pages are added by mm_grow_stack when the stack grows
  * Note that this function will not unmap any pages. It does not do page table locking and should only
  * be called once per process
  * Return value:
@@ -2070,6 +4256,7 @@ u32 mm_init_user_area() {
     spinlock_get(&address_space[pid].lock, &eflags);
     address_space[pid].end_data = MM_START_CODE-1;
     address_space[pid].brk = MM_START_CODE;
+    address_space[pid].stack_base = MM_PAGE_START(MM_PAGE(MM_VIRTUAL_TOS_USER) - MM_STACK_PAGES_TASK_USER + 1);
     spinlock_release(&address_space[pid].lock, &eflags);
     return (MM_VIRTUAL_TOS_USER / 4) * 4;
 }
@@ -2077,24 +4264,54 @@ u32 mm_init_user_area() {
 /*
  * Remove all mappings for the user area of the currently active
  * address space, i.e. unmap all pages between the end of the common
- * area and the top of the user space stack area
+ * area and the top of the user space stack area, and remove all
+ * user segments. Modified pages of shared file mappings are written
+ * back to the file first, and slots on the swap device used by pages
+ * which have been swapped out are released
  */
 void mm_teardown_user_area() {
+    mm_tlb_batch_t batch;
     u32 page;
     pte_t* ptd;
+    user_segment_t* segment;
+    address_space_t* as = address_space + pm_get_pid();
     /*
      * Get pointer to page table directory
      */
     ptd = mm_get_ptd();
     KASSERT(ptd);
+    /*
+     * Write back modified pages of shared file mappings before the pages are unmapped
+     */
+    LIST_FOREACH(as->segments_head, segment) {
+        mm_write_back_segment(segment, segment->start, segment->end);
+    }
     /*
      * Walk all pages between end of common area and end of user
-     * space stack and remove mapping if needed
+     * space stack and remove mapping if needed. Areas for which
+     * no page table exists are skipped entirely
      */
-    for (page = MM_COMMON_AREA_SIZE; page < MM_VIRTUAL_TOS_USER; page += 4096) {
-        if (mm_page_mapped(page)) {
-            mm_unmap_page(ptd, page, pm_get_pid());
+    mm_tlb_batch_init(&batch);
+    page = MM_COMMON_AREA_SIZE;
+    while (page < MM_VIRTUAL_TOS_USER) {
+        if (0 == ptd[PTD_OFFSET(page)].p) {
+            page = MM_AREA_START(PTD_OFFSET(page) + 1);
+            continue;
+        }
+        if (mm_page_mapped(page) || mm_page_swapped(page)) {
+            mm_remove_mapping(ptd, page, pm_get_pid(), &batch);
         }
+        page += MM_PAGE_SIZE;
+    }
+    mm_tlb_batch_flush(&batch);
+    /*
+     * Release user segments
+     */
+    while ((segment = as->segments_head)) {
+        LIST_REMOVE(as->segments_head, as->segments_tail, segment);
+        if (segment->inode)
+            segment->inode->iops->inode_release(segment->inode);
+        kfree(segment);
     }
 }
 
@@ -2202,16 +4419,24 @@ static int access_allowed(u32 virtual_address, pte_t* ptd, int sv, int rw) {
     int rc = 1;
     MM_DEBUG("Using PTD at %x\n", ptd);
     /*
-     * Get pointer to page table
+     * For a 4 MB page, the entry in the page table directory contains the access rights
      */
-    pt = mm_get_pt_address(ptd, PTD_OFFSET(virtual_address), 1);
-    if (0 == pt) {
-        PANIC("Page table not mapped\n");
+    if (ptd[PTD_OFFSET(virtual_address)].ps) {
+        pte = ptd + PTD_OFFSET(virtual_address);
+    }
+    else {
+        /*
+         * Get pointer to page table
+         */
+        pt = mm_get_pt_address(ptd, PTD_OFFSET(virtual_address), 1);
+        if (0 == pt) {
+            PANIC("Page table not mapped\n");
+        }
+        /*
+         * Get page table entry
+         */
+        pte = pt+PT_OFFSET(virtual_address);
     }
-    /*
-     * Get page table entry
-     */
-    pte = pt+PT_OFFSET(virtual_address);
     MM_DEBUG("Address of page table entry is %x\n", pte);
     /*
      * Now check all flags. We assume that the WP bit in CR0 is set. Thus access
@@ -2227,6 +4452,384 @@ static int access_allowed(u32 virtual_address, pte_t* ptd, int sv, int rw) {
     return rc;
 }
 
+/*
+ * Extend the user space stack of the current process down to the page containing @address. All pages
+ * between this page and the currently mapped part of the stack are mapped and filled with zeroes.
+ * This is only done if the address is within the area of MM_STACK_PAGES_USER_MAX pages reserved for
+ * the stack, so that a stack which would grow beyond this limit leads to a SIGSEGV
+ * Parameter:
+ * @address - the virtual address which has been accessed
+ * Return value:
+ * 0 if the stack has been extended
+ * EFAULT if the address is not within the reserved stack area below the mapped part of the stack
+ * ENOMEM if no memory was available
+ * Locks:
+ * lock on current address space
+ * Cross-monitor function calls:
+ * mm_get_zeroed_page
+ * mm_map_page
+ */
+static int mm_grow_stack(u32 address) {
+    u32 eflags;
+    u32 page;
+    u32 phys_page;
+    u32 page_base = MM_PAGE_START(MM_PAGE(address));
+    int pid = pm_get_pid();
+    address_space_t* as = address_space + pid;
+    if ((address > MM_VIRTUAL_TOS_USER) || (MM_PAGE(address) <= MM_PAGE(MM_VIRTUAL_TOS_USER) - MM_STACK_PAGES_USER_MAX))
+        return EFAULT;
+    spinlock_get(&as->lock, &eflags);
+    if (page_base >= as->stack_base) {
+        spinlock_release(&as->lock, &eflags);
+        return EFAULT;
+    }
+    for (page = page_base; page < as->stack_base; page += MM_PAGE_SIZE) {
+        if (mm_page_mapped(page))
+            continue;
+        if (0 == (phys_page = mm_get_zeroed_page())) {
+            ERROR("No physical page left to extend user space stack\n");
+            spinlock_release(&as->lock, &eflags);
+            return ENOMEM;
+        }
+        if (mm_map_page(mm_get_ptd(), phys_page, page, MM_READ_WRITE, MM_USER_PAGE, 0, pid)) {
+            mm_put_phys_page(phys_page);
+            spinlock_release(&as->lock, &eflags);
+            return ENOMEM;
+        }
+    }
+    MM_DEBUG("Extended user space stack of process %d from %x to %x\n", pid, as->stack_base, page_base);
+    as->stack_base = page_base;
+    spinlock_release(&as->lock, &eflags);
+    return 0;
+}
+
+/*
+ * Set the software bits of the page table entry for a page of the user area which has just been mapped
+ * Parameter:
+ * @page_base - the virtual address of the page
+ * @shared - mark the page as part of a shared mapping so that it is not turned into a copy-on-write page by a fork
+ * @cow - mark the page as copy-on-write page
+ * Locks:
+ * pt_lock - page table lock of the current process
+ */
+static void mm_mark_page(u32 page_base, int shared, int cow) {
+    u32 eflags;
+    pte_t* pte;
+    spinlock_get(&(mem_locks[pm_get_pid()].pt_lock), &eflags);
+    if ((pte = mm_get_pte(page_base))) {
+        pte->shared = shared;
+        pte->cow = cow;
+    }
+    spinlock_release(&(mem_locks[pm_get_pid()].pt_lock), &eflags);
+}
+
+/*
+ * Map a page of a user segment which is entirely backed by a page aligned part of a file directly from
+ * the page cache, so that all processes mapping this part of the file share one physical page. Pages of
+ * shared mappings are mapped with the access rights of the segment. All other pages are mapped read-only,
+ * and as copy-on-write pages if the segment is writable, so that the first write access creates a private copy
+ * Parameter:
+ * @segment - the segment
+ * @page_base - the virtual address of the page
+ * Return value:
+ * 0 if the page has been mapped
+ * ENOMEM if the page could not be mapped
+ * EAGAIN if the page cache could not provide the page
+ * Cross-monitor function calls:
+ * fs_get_page
+ * pc_release_page
+ */
+static int mm_map_cached_page(user_segment_t* segment, u32 page_base) {
+    pc_page_t* page;
+    u32 phys_page;
+    int shared = (segment->flags & MM_SEGMENT_SHARED) ? 1 : 0;
+    int write = (segment->flags & MM_SEGMENT_WRITE) ? 1 : 0;
+    if (0 == (page = fs_get_page(segment->inode, segment->offset + (page_base - segment->file_start))))
+        return EAGAIN;
+    /*
+     * The additional reference to the physical page keeps the page cache from reusing
+     * the page as long as it is mapped
+     */
+    phys_page = page->phys;
+    mm_share_phys_page(phys_page);
+    pc_release_page(page);
+    if (mm_page_mapped(page_base)) {
+        mm_put_phys_page(phys_page);
+        return 0;
+    }
+    if (mm_map_page(mm_get_ptd(), phys_page, page_base, (shared && write) ? MM_READ_WRITE : MM_READ_ONLY,
+            MM_USER_PAGE, 0, pm_get_pid())) {
+        mm_put_phys_page(phys_page);
+        return ENOMEM;
+    }
+    mm_mark_page(page_base, shared, (write && !shared));
+    return 0;
+}
+
+/*
+ * Populate the entire 4 MB area containing a page of the user area with a single 4 MB page filled with zeroes.
+ * This is only done if the area is entirely covered by one private, writable user segment which does not read
+ * any data from a file within the area, if no other segment overlaps the area and if no page within the area
+ * has been populated yet
+ * Parameter:
+ * @as - the address space of the current process
+ * @page_base - the page which has been accessed
+ * Return value:
+ * 0 if the area has been populated
+ * EINVAL if the area cannot be mapped by a 4 MB page
+ * ENOMEM if no free block of 4 MB was available
+ */
+static int mm_load_large_page(address_space_t* as, u32 page_base) {
+    u32 area = page_base & ~(MM_LARGE_PAGE_SIZE - 1);
+    u32 area_end = area + MM_LARGE_PAGE_SIZE - 1;
+    user_segment_t* segment;
+    user_segment_t* match = 0;
+    if (0 == large_pages)
+        return EINVAL;
+    LIST_FOREACH(as->segments_head, segment) {
+        if ((segment->start > area_end) || (segment->end < area))
+            continue;
+        if (match)
+            return EINVAL;
+        match = segment;
+    }
+    if ((0 == match) || (match->start > area) || (match->end < area_end))
+        return EINVAL;
+    if ((match->flags & MM_SEGMENT_SHARED) || (0 == (match->flags & MM_SEGMENT_READ))
+            || (0 == (match->flags & MM_SEGMENT_WRITE)))
+        return EINVAL;
+    if (match->inode && (match->file_start <= area_end) && (match->file_end > area))
+        return EINVAL;
+    return mm_map_large_page(area);
+}
+
+/*
+ * Populate a page of the user area which is part of a user segment, i.e. allocate a physical page,
+ * fill it with data from the file or with zeroes and map it into the address space of the current
+ * process. The page is mapped writable if one of the segments containing it is writable, and pages of
+ * segments created by mmap with PROT_NONE are never populated. If the page is entirely backed by a page
+ * aligned part of a file and not part of any other segment, the page is taken from the page cache instead.
+ * If the page is part of a large anonymous area, the entire 4 MB area is populated at once (see mm_load_large_page).
+ * Reading from the file might sleep, so this must only be called with may_sleep = 1 if interrupts are
+ * enabled and no spinlocks are held
+ * If the address is not part of a user segment, but below the user space stack, the stack is extended. If the
+ * page has been swapped out, it is read back from the swap device
+ * Parameter:
+ * @address - the virtual address which has been accessed
+ * @may_sleep - set this to 1 if we can read from a file or the swap device
+ * Return value:
+ * 0 if the page has been mapped
+ * EFAULT if the address is neither part of a user segment nor of the stack area or data needs to be read,
+ * but may_sleep is 0
+ * ENOMEM if no memory was available
+ * EIO if the file or the swap device could not be read
+ */
+static int mm_load_page(u32 address, int may_sleep) {
+    u32 page_base = MM_PAGE_START(MM_PAGE(address));
+    u32 page_end = page_base + MM_PAGE_SIZE;
+    u32 phys_page;
+    u32 virt_page;
+    u32 lo;
+    u32 hi;
+    int found = 0;
+    int need_io = 0;
+    int rw = MM_READ_ONLY;
+    int shared = 0;
+    int rc;
+    u8* buffer = 0;
+    user_segment_t* segment;
+    user_segment_t* file_segment = 0;
+    address_space_t* as = address_space + pm_get_pid();
+    if (mm_page_swapped(page_base)) {
+        return mm_swap_in(page_base, may_sleep);
+    }
+    if (may_sleep) {
+        mm_swap_reserve(2);
+    }
+    LIST_FOREACH(as->segments_head, segment) {
+        if ((page_base >= segment->start) && (page_base <= segment->end) && (segment->flags & MM_SEGMENT_READ)) {
+            found++;
+            if (segment->flags & MM_SEGMENT_WRITE)
+                rw = MM_READ_WRITE;
+            if (segment->flags & MM_SEGMENT_SHARED)
+                shared = 1;
+            if (segment->inode && (segment->file_start < page_end) && (segment->file_end > page_base))
+                need_io = 1;
+            if (segment->inode && (segment->file_start <= page_base) && (segment->file_end >= page_end)
+                    && (0 == (segment->offset + (page_base - segment->file_start)) % MM_PAGE_SIZE))
+                file_segment = segment;
+        }
+    }
+    if (0 == found) {
+        return mm_grow_stack(address);
+    }
+    if (need_io && (0 == may_sleep)) {
+        return EFAULT;
+    }
+    if (0 == mm_load_large_page(as, page_base)) {
+        return 0;
+    }
+    if ((1 == found) && file_segment) {
+        if (EAGAIN != (rc = mm_map_cached_page(file_segment, page_base)))
+            return rc;
+        MM_DEBUG("Page cache could not provide page at %x, falling back to private copy\n", page_base);
+    }
+    /*
+     * If we need to read from the file, read into a buffer first, as we cannot keep
+     * a page attached while sleeping
+     */
+    if (need_io) {
+        if (0 == (buffer = (u8*) kmalloc(MM_PAGE_SIZE))) {
+            return ENOMEM;
+        }
+        memset(buffer, 0, MM_PAGE_SIZE);
+        LIST_FOREACH(as->segments_head, segment) {
+            if ((page_base < segment->start) || (page_base > segment->end) || (0 == (segment->flags & MM_SEGMENT_READ)))
+                continue;
+            lo = MAX(segment->file_start, page_base);
+            hi = MIN(segment->file_end, page_end);
+            if (segment->inode && (lo < hi)) {
+                if (fs_read_inode(segment->inode, segment->offset + (lo - segment->file_start), hi - lo,
+                        buffer + (lo - page_base)) < 0) {
+                    ERROR("Could not read page at %x from file\n", page_base);
+                    kfree(buffer);
+                    return EIO;
+                }
+            }
+            lo = MAX(segment->file_end, page_base);
+            hi = MIN(segment->mem_end, page_end);
+            if (lo < hi)
+                memset(buffer + (lo - page_base), 0, hi - lo);
+        }
+    }
+    if (buffer) {
+        if (0 == (phys_page = mm_get_phys_page())) {
+            ERROR("No physical page left to populate user segment\n");
+            kfree(buffer);
+            return ENOMEM;
+        }
+        if (0 == (virt_page = mm_attach_page(phys_page))) {
+            mm_put_phys_page(phys_page);
+            kfree(buffer);
+            return ENOMEM;
+        }
+        memcpy((void*) virt_page, buffer, MM_PAGE_SIZE);
+        kfree(buffer);
+        mm_detach_page(virt_page);
+    }
+    else if (0 == (phys_page = mm_get_zeroed_page())) {
+        ERROR("No physical page left to populate user segment\n");
+        return ENOMEM;
+    }
+    /*
+     * Another task in this process might have populated the page while we were
+     * reading from the file
+     */
+    if (mm_page_mapped(page_base)) {
+        mm_put_phys_page(phys_page);
+        return 0;
+    }
+    if (mm_map_page(mm_get_ptd(), phys_page, page_base, rw, MM_USER_PAGE, 0, pm_get_pid())) {
+        mm_put_phys_page(phys_page);
+        return ENOMEM;
+    }
+    /*
+     * Mark pages of shared mappings so that they are not turned into copy-on-write pages by a fork
+     */
+    if (shared)
+        mm_mark_page(page_base, 1, 0);
+    return 0;
+}
+
+/*
+ * Resolve a write access to a page which is shared copy-on-write. If the physical page
+ * is no longer shared with any other address space, the page is simply made writable again.
+ * Otherwise a new physical page is allocated, the content of the shared page is copied and the
+ * page table entry is changed to point to the new page with write access
+ * Note that no other address space can start to share the page while we hold the page table
+ * lock, as this only happens when the current process forks
+ * Parameter:
+ * @address - the virtual address which has been accessed
+ * Return value:
+ * 0 if the access can be repeated
+ * EFAULT if the page is not mapped or not a copy-on-write page
+ * ENOMEM if no physical page could be allocated for the copy
+ * Locks:
+ * pt_lock - page table lock of the current process
+ * Cross-monitor function calls:
+ * mm_get_phys_page
+ * mm_put_phys_page
+ * mm_copy_page
+ * mm_tlb_batch_flush
+ */
+static int mm_resolve_cow(u32 address) {
+    u32 page_base = MM_PAGE_START(MM_PAGE(address));
+    pte_t* ptd = mm_get_ptd();
+    pte_t* pte;
+    u32 old_page;
+    u32 new_page;
+    u32 flags;
+    mm_tlb_batch_t batch;
+    spinlock_t* pt_lock = &(mem_locks[pm_get_pid()].pt_lock);
+    mm_tlb_batch_init(&batch);
+    spinlock_get(pt_lock, &flags);
+    if (0 == ptd[PTD_OFFSET(page_base)].p) {
+        spinlock_release(pt_lock, &flags);
+        return EFAULT;
+    }
+    /*
+     * 4 MB pages are never shared copy-on-write, but another thread might have mapped
+     * one in the meantime, so we look at the entry in the page table directory
+     */
+    if (ptd[PTD_OFFSET(page_base)].ps)
+        pte = ptd + PTD_OFFSET(page_base);
+    else
+        pte = mm_get_pt_address(ptd, PTD_OFFSET(page_base), 1) + PT_OFFSET(page_base);
+    if (0 == pte->p) {
+        spinlock_release(pt_lock, &flags);
+        return EFAULT;
+    }
+    /*
+     * Another thread might have resolved the fault already
+     */
+    if (pte->rw) {
+        spinlock_release(pt_lock, &flags);
+        invlpg(page_base);
+        return 0;
+    }
+    if (0 == pte->cow) {
+        spinlock_release(pt_lock, &flags);
+        return EFAULT;
+    }
+    old_page = pte->page_base * MM_PAGE_SIZE;
+    if (mm_phys_page_exclusive(old_page)) {
+        pte->cow = 0;
+        pte->rw = 1;
+    }
+    else {
+        if (0 == (new_page = mm_get_phys_page())) {
+            ERROR("No physical page left to resolve copy-on-write access\n");
+            spinlock_release(pt_lock, &flags);
+            return ENOMEM;
+        }
+        if (mm_copy_page(page_base, new_page)) {
+            mm_put_phys_page(new_page);
+            spinlock_release(pt_lock, &flags);
+            return ENOMEM;
+        }
+        *pte = pte_create(MM_READ_WRITE, pte->us, pte->pcd, 0, new_page);
+        /*
+         * Other CPUs might still read the old page via their TLBs, so we
+         * release it only after a shootdown
+         */
+        mm_tlb_batch_add(&batch, page_base, old_page);
+    }
+    invlpg(page_base);
+    spinlock_release(pt_lock, &flags);
+    mm_tlb_batch_flush(&batch);
+    return 0;
+}
+
 /*
  * Page fault handler
  *
@@ -2235,15 +4838,23 @@ static int access_allowed(u32 virtual_address, pte_t* ptd, int sv, int rw) {
  *
  * 1) if the error is due to the usage of reserved bits in the page table,
  *    panic
- * 2) if the error has been caused by an instruction fetch, send SIGSEV to
+ * 2) if the page is not mapped, but part of a user segment, populate it and return. Data
+ *    is only read from a file if the interrupt manager has turned on interrupts, i.e. if
+ *    the fault is handled on system call level. If the page is within the area reserved
+ *    for the user space stack below the mapped part of the stack, extend the stack. If the
+ *    page has been swapped out, read it back from the swap device
+ * 3) if the error has been caused by an instruction fetch, send SIGSEV to
  *    the currently running process and return
- * 3) if the page is not mapped, then
+ * 4) if the page is not mapped, then
  *    a) panic if the error occurred in kernel mode
  *    b) send SIGSEV to the process and return if the error occurred in user
  *       mode
- * 4) in all other cases, get the page table entry for the specified linear
+ * 5) in all other cases, get the page table entry for the specified linear
  *    address and determine whether the entry matches the access. If yes,
- *    do invlpg and return. If no, panic
+ *    do invlpg and return. If no, check whether this is a write to a page
+ *    which is shared copy-on-write and resolve this. If that fails because
+ *    we are out of memory, send SIGKILL to the process. If the page is not
+ *    a copy-on-write page and the access happened in user mode, send SIGSEGV
  *
  */
 int mm_handle_page_fault(ir_context_t* ir_context) {
@@ -2253,6 +4864,7 @@ int mm_handle_page_fault(ir_context_t* ir_context) {
     int reserved_bits = 0;
     int instruction_fetch = 0;
     int allowed = 0;
+    int rc;
     u32 address = ir_context->cr2;
     /*
      * First determine the type of error using the following
@@ -2273,6 +4885,9 @@ int mm_handle_page_fault(ir_context_t* ir_context) {
         MM_DEBUG("Page fault handler: detected illegal state of page table entry, reserved bits are in use\n");
         return 1;
     }
+    else if (page_missing && (0 == mm_load_page(address, IRQ_ENABLED(get_eflags())))) {
+        return 0;
+    }
     else if (instruction_fetch) {
             MM_DEBUG("PF due to instruction fetch, killing process\n");
             do_kill(pm_get_pid(), __KSIGSEGV);
@@ -2291,6 +4906,7 @@ int mm_handle_page_fault(ir_context_t* ir_context) {
             debug_main(ir_context);
             PANIC("Debugger returned from PF exception\n");
         }
+        do_kill(pm_get_pid(), __KSIGSEGV);
     }
     else {
         /*
@@ -2301,6 +4917,25 @@ int mm_handle_page_fault(ir_context_t* ir_context) {
             invlpg(address);
             return 0;
         }
+        if (write_error) {
+            mm_swap_reserve(1);
+            rc = mm_resolve_cow(address);
+            if (0 == rc)
+                return 0;
+            if (ENOMEM == rc) {
+                ERROR("Out of memory during copy-on-write, killing process %d\n", pm_get_pid());
+                do_kill(pm_get_pid(), __KSIGKILL);
+                return 0;
+            }
+            /*
+             * A write to a read-only page in user mode, for instance to a mapping
+             * created without PROT_WRITE
+             */
+            if (0 == supervisor_mode) {
+                do_kill(pm_get_pid(), __KSIGSEGV);
+                return 0;
+            }
+        }
         return 1;
     }
     return 0;
@@ -2317,7 +4952,11 @@ u32 mm_phys_mem() {
  * Return the amount of available physical RAM in kb
  */
 u32 mm_phys_mem_available() {
-    return phys_mem_layout.available*4;
+    u32 pages = phys_mem_layout.available;
+    int cpu;
+    for (cpu = 0; cpu < SMP_MAX_CPU; cpu++)
+        pages += magazines[cpu].count;
+    return pages*4;
 }
 
 /***************************************************************
@@ -2398,13 +5037,38 @@ void mm_print_pmem() {
     PRINT("Top of physical memory:       %x (%d MB)\n", phys_mem_layout.mem_end, phys_mem_layout.mem_end/(1024*1024));
     PRINT("Available physical memory:    %d pages (%d MB)\n", phys_mem_layout.available, (phys_mem_layout.available*4)/1024);
     PRINT("Available low memory:         %d kB\n", *((u16*) 0x413));
+    PRINT("Copy-on-write pages copied:   %d\n", cow_copies);
+    PRINT("Copy-on-write pages reused:   %d\n", cow_reuses);
+    PRINT("Free blocks per order:        ");
+    for (i = 0; i <= MM_BUDDY_MAX_ORDER; i++)
+        PRINT("%d ", buddy_free_blocks[i]);
+    PRINT("\n");
+    PRINT("Per-CPU page magazines (CPU: pages in magazine / hits / refills / drains):\n");
+    for (i = 0; i < SMP_MAX_CPU; i++) {
+        if (magazines[i].refills)
+            PRINT("%d: %d / %d / %d / %d\n", i, magazines[i].count, magazines[i].hits,
+                    magazines[i].refills, magazines[i].drains);
+    }
+    PRINT("Zeroed pages in pool:         %d (hits: %d, misses: %d, filled: %d)\n", zero_pool_count, zero_pool_hits,
+            zero_pool_misses, zero_pool_filled);
+    PRINT("TLB shootdowns (CPU: IPIs sent / pages invalidated / full flushes):\n");
+    for (i = 0; i < smp_get_cpu_count(); i++) {
+        PRINT("%d: %d / %d / %d\n", i, tlb_mailbox[i].ipis, tlb_mailbox[i].invalidated,
+                tlb_mailbox[i].full_flushes);
+    }
+    PRINT("4 MB pages:                   %s (mapped into user area: %d, split: %d)\n",
+            large_pages ? "enabled" : "disabled", large_pages_mapped, large_pages_split);
+    PRINT("Global pages:                 %s\n", global_pages ? "enabled" : "disabled");
+    PRINT("Swap device:                  %x (slots: %d, used: %d)\n", swap_slots ? swap_dev : 0, swap_slots, swap_used);
+    PRINT("Pages swapped out / in:       %d / %d (second chances: %d, cancelled: %d, rolled back: %d)\n", swap_outs,
+            swap_ins, swap_second_chances, swap_cancelled, swap_rollbacks);
     PRINT("\n\nPage table usage per process (w/o common area):\n");
     PRINT("PID         # of allocated page tables\n");
     PRINT("--------------------------------------\n");
     for (i = 0; i < PM_MAX_PROCESS; i++) {
         count = 0;
         for (j = MM_SHARED_PAGE_TABLES; j < MM_PT_ENTRIES; j++) {
-            if (proc_ptd[i][j].p == 1) {
+            if ((proc_ptd[i][j].p == 1) && (0 == proc_ptd[i][j].ps)) {
                 count++;
                 if (!BITFIELD_GET_BIT(phys_mem, proc_ptd[i][j].page_base))
                     PRINT("WARNING: page table entry %d for process %d points to unreserved memory\n", j, i);
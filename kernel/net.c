@@ -62,6 +62,7 @@
 #include "lib/sys/ioctl.h"
 #include "lib/fcntl.h"
 #include "timer.h"
+#include "kmem.h"
 
 /*
  * This is the common loglevel for all network modules above the drivers
@@ -88,6 +89,11 @@ static unsigned int dns_servers[MAX_DNS_SERVERS];
 static u32 net_msg_created = 0;
 static u32 net_msg_destroyed = 0;
 
+/*
+ * Object cache for network messages. The data buffers have varying sizes and are taken from the kernel heap
+ */
+static kmem_cache_t net_msg_cache = KMEM_CACHE_INITIALIZER("net_msg", sizeof(net_msg_t));
+
 #define NET_DEBUG(...) do {if (__net_loglevel > 0 ) { kprintf("DEBUG at %s@%d (%s): ", __FILE__, __LINE__, __FUNCTION__); \
         kprintf(__VA_ARGS__); }} while (0)
 
@@ -107,10 +113,10 @@ static u32 net_msg_destroyed = 0;
  */
 net_msg_t* net_msg_create(u32 size, u32 headroom) {
     net_msg_t* net_msg = 0;
-    if (0 == (net_msg = (net_msg_t*) kmalloc(sizeof(net_msg_t))))
+    if (0 == (net_msg = (net_msg_t*) kmem_cache_alloc(&net_msg_cache)))
         return 0;
     if (0 == (net_msg->data = (u8*) kmalloc(size))) {
-        kfree((void*) net_msg);
+        kmem_cache_free(&net_msg_cache, net_msg);
         return 0;
     }
     net_msg->start = net_msg->data + MIN(headroom, size);
@@ -133,10 +139,10 @@ net_msg_t* net_msg_create(u32 size, u32 headroom) {
  */
 net_msg_t* net_msg_new(u32 size) {
     net_msg_t* net_msg = 0;
-    if (0 == (net_msg = (net_msg_t*) kmalloc(sizeof(net_msg_t))))
+    if (0 == (net_msg = (net_msg_t*) kmem_cache_alloc(&net_msg_cache)))
         return 0;
     if (0 == (net_msg->data = (u8*) kmalloc(size + NET_MIN_HEADROOM))) {
-        kfree((void*) net_msg);
+        kmem_cache_free(&net_msg_cache, net_msg);
         return 0;
     }
     net_msg->start = net_msg->data + NET_MIN_HEADROOM;
@@ -156,13 +162,13 @@ net_msg_t* net_msg_new(u32 size) {
  * the new network message or 0 if there was no free memory
  */
 net_msg_t* net_msg_clone(net_msg_t* net_msg) {
-    net_msg_t* clone = (net_msg_t*) kmalloc(sizeof(net_msg_t));
+    net_msg_t* clone = (net_msg_t*) kmem_cache_alloc(&net_msg_cache);
     if (0 == clone) {
         return 0;
     }
     memcpy((void*) clone, (void*) net_msg, sizeof(net_msg_t));
     if (0 == (clone->data = (u8*) kmalloc(net_msg->length))) {
-        kfree((void*) clone);
+        kmem_cache_free(&net_msg_cache, clone);
         return 0;
     }
     clone->start = clone->data + (net_msg->start - net_msg->data);
@@ -189,7 +195,7 @@ void net_msg_destroy(net_msg_t* net_msg) {
         kfree((void*) net_msg->data);
         net_msg->data = 0;
     }
-    kfree((void*) net_msg);
+    kmem_cache_free(&net_msg_cache, net_msg);
     atomic_incr(&net_msg_destroyed);
 }
 
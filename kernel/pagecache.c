@@ -0,0 +1,509 @@
+/*
+ * pagecache.c
+ *
+ * The page cache holds the content of regular files in page sized chunks. It is used by the generic
+ * file system layer when reading from a regular file and by the memory manager when a page of a memory
+ * mapped file or of an executable is accessed for the first time. As the data of a page is kept in a page
+ * aligned page of the kernel heap, the memory manager can map the physical page directly into the address
+ * space of a process instead of copying it. Thus all processes which map the same part of a file - in
+ * particular all processes which run the same program - share one physical copy of it, and a shared writable
+ * mapping and read() always see the same data.
+ *
+ * A page is identified by the device on which the file is located, the inode number of the file and the index
+ * of the page within the file, i.e. the offset divided by the page size. The cache consists of at most
+ * PC_MAX_PAGES pages which are kept in a hash table with PC_HASH_BUCKETS buckets. In addition, all pages are kept
+ * on an LRU list, with the least recently used page at the head. Memory for a page is only allocated when the
+ * page is used for the first time, and is never returned to the kernel heap. When all pages are in use, the least
+ * recently used page which is not currently in use is reused. A page is in use if its reference count is not
+ * zero or if the physical page is still mapped into the address space of a process. Pages which are no longer in
+ * the hash table are moved to the head of the LRU list so that they are reused first.
+ *
+ * When a page is not yet in the cache, the thread which adds it reads its content from the file. Other threads
+ * which look up the page in the meantime wait on the semaphore of the page until the data is available.
+ *
+ * The cache itself does not know whether its content is still up to date. It is the responsibility of the file
+ * system layer to keep the cache consistent. Pages are only read while holding at least the read lock on the inode,
+ * and any write to the file needs to be followed by a call of pc_update while still holding the write lock. When a file
+ * is truncated, pc_truncate needs to be called. As inode numbers are reused, all pages for an inode number need to be
+ * purged when a new file is created, and all pages of a device need to be purged when the device is unmounted. Writes
+ * are always done through the file system, i.e. the page cache does not keep dirty data, with the exception of pages which
+ * are part of a shared writable mapping - these are written back by the memory manager when the mapping is removed.
+ *
+ * All data structures of the cache are protected by the spinlock pc_lock.
+ */
+
+#include "pagecache.h"
+#include "debug.h"
+#include "locks.h"
+#include "lists.h"
+#include "mm.h"
+#include "util.h"
+#include "kerrno.h"
+#include "lib/string.h"
+
+/*
+ * A local loglevel
+ */
+int __pc_loglevel = 0;
+
+#define PC_DEBUG(...) do {if (__pc_loglevel > 0 ) { kprintf("DEBUG at %s@%d (%s): ", __FILE__, __LINE__, __FUNCTION__); \
+        kprintf(__VA_ARGS__); }} while (0)
+
+/*
+ * The pages, the hash table and the LRU list
+ */
+static pc_page_t pages[PC_MAX_PAGES];
+static pc_page_t* buckets[PC_HASH_BUCKETS];
+static pc_page_t* lru_head = 0;
+static pc_page_t* lru_tail = 0;
+static spinlock_t pc_lock;
+
+/*
+ * Statistics
+ */
+static u32 hits = 0;
+static u32 misses = 0;
+static u32 used = 0;
+static u32 allocated = 0;
+static u32 evictions = 0;
+
+/*
+ * Initialize the cache
+ */
+void pc_init() {
+    int i;
+    for (i = 0; i < PC_HASH_BUCKETS; i++) {
+        buckets[i] = 0;
+    }
+    lru_head = 0;
+    lru_tail = 0;
+    for (i = 0; i < PC_MAX_PAGES; i++) {
+        pages[i].data = 0;
+        pages[i].phys = 0;
+        pages[i].ref_count = 0;
+        pages[i].valid = 0;
+        pages[i].hashed = 0;
+        pages[i].hash_next = 0;
+        LIST_ADD_END(lru_head, lru_tail, pages + i);
+    }
+    hits = 0;
+    misses = 0;
+    used = 0;
+    allocated = 0;
+    evictions = 0;
+    spinlock_init(&pc_lock);
+}
+
+/*
+ * Compute the hash value of a page
+ * Parameter:
+ * @dev - the device
+ * @inode_nr - the inode number of the file
+ * @index - the index of the page within the file
+ * Return value:
+ * the index of the bucket
+ */
+static u32 pc_hash(dev_t dev, ino_t inode_nr, u32 index) {
+    return ((dev * 31 + inode_nr) * 31 + index) % PC_HASH_BUCKETS;
+}
+
+/*
+ * Locate a page in the cache. The caller needs to hold the lock
+ * Parameter:
+ * @bucket - the bucket
+ * @dev - the device
+ * @inode_nr - the inode number of the file
+ * @index - the index of the page within the file
+ * Return value:
+ * the page or 0 if the page is not in the cache
+ */
+static pc_page_t* lookup(u32 bucket, dev_t dev, ino_t inode_nr, u32 index) {
+    pc_page_t* page = buckets[bucket];
+    while (page) {
+        if ((page->dev == dev) && (page->inode_nr == inode_nr) && (page->index == index))
+            return page;
+        page = page->hash_next;
+    }
+    return 0;
+}
+
+/*
+ * Remove a page from its hash chain and move it to the head of the LRU list
+ * so that it is reused first. The caller needs to hold the lock
+ * Parameter:
+ * @page - the page
+ */
+static void drop_page(pc_page_t* page) {
+    pc_page_t* prev;
+    u32 bucket;
+    if (0 == page->hashed)
+        return;
+    bucket = pc_hash(page->dev, page->inode_nr, page->index);
+    if (buckets[bucket] == page) {
+        buckets[bucket] = page->hash_next;
+    }
+    else {
+        prev = buckets[bucket];
+        while (prev && (prev->hash_next != page))
+            prev = prev->hash_next;
+        if (prev)
+            prev->hash_next = page->hash_next;
+    }
+    page->hashed = 0;
+    page->hash_next = 0;
+    used--;
+    LIST_REMOVE(lru_head, lru_tail, page);
+    LIST_ADD_FRONT(lru_head, lru_tail, page);
+}
+
+/*
+ * Get a page which can be used to store new data. The least recently used page which is not in use
+ * is taken and removed from the hash table. If this page has never been used before, memory for it
+ * is allocated from the kernel heap. Pages which are not referenced, but still mapped into user space,
+ * are moved to the end of the LRU list as we come across them
+ * Return value:
+ * a page with reference count one which is not in the hash table or 0 if no page is available
+ * Locks:
+ * pc_lock
+ */
+static pc_page_t* get_free_page() {
+    u32 eflags;
+    int i;
+    u8* data;
+    pc_page_t* page;
+    pc_page_t* next;
+    pc_page_t* free_page = 0;
+    spinlock_get(&pc_lock, &eflags);
+    page = lru_head;
+    for (i = 0; (i < PC_MAX_PAGES) && page; i++) {
+        next = page->next;
+        if (0 == page->ref_count) {
+            if ((0 == page->data) || (0 == mm_phys_page_mapped(page->phys))) {
+                free_page = page;
+                break;
+            }
+            LIST_REMOVE(lru_head, lru_tail, page);
+            LIST_ADD_END(lru_head, lru_tail, page);
+        }
+        page = next;
+    }
+    if (0 == free_page) {
+        spinlock_release(&pc_lock, &eflags);
+        PC_DEBUG("No free page left\n");
+        return 0;
+    }
+    if (free_page->hashed) {
+        drop_page(free_page);
+        evictions++;
+    }
+    free_page->ref_count = 1;
+    spinlock_release(&pc_lock, &eflags);
+    if (0 == free_page->data) {
+        if (0 == (data = (u8*) kmalloc_aligned(MM_PAGE_SIZE, MM_PAGE_SIZE))) {
+            spinlock_get(&pc_lock, &eflags);
+            free_page->ref_count = 0;
+            spinlock_release(&pc_lock, &eflags);
+            return 0;
+        }
+        spinlock_get(&pc_lock, &eflags);
+        free_page->phys = mm_virt_to_phys((u32) data);
+        free_page->data = data;
+        allocated++;
+        spinlock_release(&pc_lock, &eflags);
+    }
+    return free_page;
+}
+
+/*
+ * Wait until the data of a page which has just been looked up has been read
+ * Parameter:
+ * @page - the page, with a reference held by the caller
+ * Return value:
+ * the page if the data is valid
+ * 0 if the data could not be read - in this case, the reference has been dropped
+ */
+static pc_page_t* wait_page(pc_page_t* page) {
+    if (0 == page->valid) {
+        sem_down(&page->mutex);
+        sem_up(&page->mutex);
+    }
+    if (0 == page->valid) {
+        pc_release_page(page);
+        return 0;
+    }
+    return page;
+}
+
+/*
+ * Get a page of a regular file from the cache. If the page is not yet in the cache,
+ * it is read from the file. The caller needs to hold at least a read lock on the inode
+ * and to release the page again using pc_release_page
+ * Parameter:
+ * @inode - the inode of the file
+ * @index - the index of the page within the file
+ * Return value:
+ * the page or 0 if no page was available or the data could not be read
+ * Locks:
+ * pc_lock
+ * Reference counts:
+ * increases reference count of the returned page by one
+ */
+pc_page_t* pc_get_page(inode_t* inode, u32 index) {
+    u32 eflags;
+    u32 bucket = pc_hash(inode->dev, inode->inode_nr, index);
+    u32 offset = index * MM_PAGE_SIZE;
+    ssize_t bytes = 0;
+    pc_page_t* page;
+    pc_page_t* new_page;
+    spinlock_get(&pc_lock, &eflags);
+    if ((page = lookup(bucket, inode->dev, inode->inode_nr, index))) {
+        page->ref_count++;
+        hits++;
+        LIST_REMOVE(lru_head, lru_tail, page);
+        LIST_ADD_END(lru_head, lru_tail, page);
+        spinlock_release(&pc_lock, &eflags);
+        return wait_page(page);
+    }
+    spinlock_release(&pc_lock, &eflags);
+    if (0 == (new_page = get_free_page()))
+        return 0;
+    spinlock_get(&pc_lock, &eflags);
+    /*
+     * Another thread might have added the page while we did not hold the lock
+     */
+    if ((page = lookup(bucket, inode->dev, inode->inode_nr, index))) {
+        new_page->ref_count = 0;
+        page->ref_count++;
+        hits++;
+        LIST_REMOVE(lru_head, lru_tail, page);
+        LIST_ADD_END(lru_head, lru_tail, page);
+        spinlock_release(&pc_lock, &eflags);
+        return wait_page(page);
+    }
+    misses++;
+    page = new_page;
+    page->dev = inode->dev;
+    page->inode_nr = inode->inode_nr;
+    page->index = index;
+    page->valid = 0;
+    sem_init(&page->mutex, 0);
+    page->hash_next = buckets[bucket];
+    buckets[bucket] = page;
+    page->hashed = 1;
+    used++;
+    LIST_REMOVE(lru_head, lru_tail, page);
+    LIST_ADD_END(lru_head, lru_tail, page);
+    spinlock_release(&pc_lock, &eflags);
+    /*
+     * Read data from the file. Data beyond the end of the file reads as zero
+     */
+    if (offset < (u32) inode->size) {
+        bytes = inode->iops->inode_read(inode, MIN(MM_PAGE_SIZE, inode->size - offset), offset, page->data);
+    }
+    if (bytes < 0) {
+        PC_DEBUG("Could not read page %d of inode %d\n", index, inode->inode_nr);
+        spinlock_get(&pc_lock, &eflags);
+        drop_page(page);
+        spinlock_release(&pc_lock, &eflags);
+        sem_up(&page->mutex);
+        pc_release_page(page);
+        return 0;
+    }
+    memset(page->data + bytes, 0, MM_PAGE_SIZE - bytes);
+    page->valid = 1;
+    sem_up(&page->mutex);
+    return page;
+}
+
+/*
+ * Release a page which has been obtained by pc_get_page
+ * Parameter:
+ * @page - the page
+ * Locks:
+ * pc_lock
+ */
+void pc_release_page(pc_page_t* page) {
+    u32 eflags;
+    spinlock_get(&pc_lock, &eflags);
+    KASSERT(page->ref_count > 0);
+    page->ref_count--;
+    spinlock_release(&pc_lock, &eflags);
+}
+
+/*
+ * Read from a regular file through the cache. If a page cannot be obtained from the cache,
+ * the remaining data is read from the file directly. The caller needs to hold at least a read
+ * lock on the inode
+ * Parameter:
+ * @inode - the inode of the file
+ * @offset - offset within the file at which we start to read
+ * @bytes - number of bytes to read
+ * @buffer - buffer to which data is written
+ * Return value:
+ * the number of bytes read
+ * a negative error code if reading from the file failed
+ */
+ssize_t pc_read(inode_t* inode, off_t offset, ssize_t bytes, void* buffer) {
+    ssize_t done = 0;
+    ssize_t chunk;
+    ssize_t rc;
+    u32 in_page;
+    pc_page_t* page;
+    if ((offset < 0) || (bytes < 0))
+        return -EINVAL;
+    if (offset >= inode->size)
+        return 0;
+    if (bytes > inode->size - offset)
+        bytes = inode->size - offset;
+    while (done < bytes) {
+        in_page = (offset + done) % MM_PAGE_SIZE;
+        chunk = MIN(MM_PAGE_SIZE - in_page, bytes - done);
+        if (0 == (page = pc_get_page(inode, (offset + done) / MM_PAGE_SIZE))) {
+            rc = inode->iops->inode_read(inode, bytes - done, offset + done, ((u8*) buffer) + done);
+            if (rc < 0)
+                return (done) ? done : rc;
+            return done + rc;
+        }
+        memcpy(((u8*) buffer) + done, page->data + in_page, chunk);
+        pc_release_page(page);
+        done += chunk;
+    }
+    return done;
+}
+
+/*
+ * Update the pages in the cache after data has been written to a file. Only pages
+ * which are already in the cache are updated. The caller needs to hold the write lock
+ * on the inode
+ * Parameter:
+ * @inode - the inode of the file
+ * @offset - offset within the file at which the data has been written
+ * @bytes - number of bytes written
+ * @data - the data which has been written
+ * Locks:
+ * pc_lock
+ */
+void pc_update(inode_t* inode, off_t offset, ssize_t bytes, void* data) {
+    u32 eflags;
+    u32 index;
+    u32 in_page;
+    ssize_t chunk;
+    ssize_t done = 0;
+    pc_page_t* page;
+    while (done < bytes) {
+        index = (offset + done) / MM_PAGE_SIZE;
+        in_page = (offset + done) % MM_PAGE_SIZE;
+        chunk = MIN(MM_PAGE_SIZE - in_page, bytes - done);
+        spinlock_get(&pc_lock, &eflags);
+        page = lookup(pc_hash(inode->dev, inode->inode_nr, index), inode->dev, inode->inode_nr, index);
+        if (page && page->valid)
+            page->ref_count++;
+        else
+            page = 0;
+        spinlock_release(&pc_lock, &eflags);
+        if (page) {
+            memcpy(page->data + in_page, ((u8*) data) + done, chunk);
+            pc_release_page(page);
+        }
+        done += chunk;
+    }
+}
+
+/*
+ * Adapt the cache after a file has been truncated. All pages which are entirely located
+ * beyond the new end of the file are removed and the remainder of the last page is filled
+ * with zeroes. The caller needs to hold the write lock on the inode
+ * Parameter:
+ * @dev - the device on which the file is located
+ * @inode_nr - the inode number of the file
+ * @size - the new size of the file
+ * Locks:
+ * pc_lock
+ */
+void pc_truncate(dev_t dev, ino_t inode_nr, off_t size) {
+    u32 eflags;
+    u32 offset;
+    int i;
+    spinlock_get(&pc_lock, &eflags);
+    for (i = 0; i < PC_MAX_PAGES; i++) {
+        if ((0 == pages[i].hashed) || (pages[i].dev != dev) || (pages[i].inode_nr != inode_nr))
+            continue;
+        offset = pages[i].index * MM_PAGE_SIZE;
+        if (offset >= (u32) size)
+            drop_page(pages + i);
+        else if ((offset + MM_PAGE_SIZE > (u32) size) && (pages[i].valid))
+            memset(pages[i].data + (size - offset), 0, offset + MM_PAGE_SIZE - size);
+    }
+    spinlock_release(&pc_lock, &eflags);
+}
+
+/*
+ * Remove all pages of a file from the cache. This needs to be called when a new
+ * file is created, as the inode number might have been used by a file which has been
+ * removed
+ * Parameter:
+ * @dev - the device on which the file is located
+ * @inode_nr - the inode number of the file
+ * Locks:
+ * pc_lock
+ */
+void pc_purge(dev_t dev, ino_t inode_nr) {
+    u32 eflags;
+    int i;
+    spinlock_get(&pc_lock, &eflags);
+    for (i = 0; i < PC_MAX_PAGES; i++) {
+        if ((pages[i].hashed) && (pages[i].dev == dev) && (pages[i].inode_nr == inode_nr))
+            drop_page(pages + i);
+    }
+    spinlock_release(&pc_lock, &eflags);
+}
+
+/*
+ * Remove all pages of a device from the cache. This needs to be called when
+ * a device is unmounted
+ * Parameter:
+ * @dev - the device
+ * Locks:
+ * pc_lock
+ */
+void pc_purge_dev(dev_t dev) {
+    u32 eflags;
+    int i;
+    spinlock_get(&pc_lock, &eflags);
+    for (i = 0; i < PC_MAX_PAGES; i++) {
+        if ((pages[i].hashed) && (pages[i].dev == dev))
+            drop_page(pages + i);
+    }
+    spinlock_release(&pc_lock, &eflags);
+}
+
+/*
+ * Get statistics on the cache
+ * Parameter:
+ * @stats - structure which will be filled with the statistics
+ */
+void pc_get_stats(pc_stats_t* stats) {
+    stats->hits = hits;
+    stats->misses = misses;
+    stats->pages = used;
+    stats->allocated = allocated;
+    stats->evictions = evictions;
+}
+
+/***************************************************************
+ * Everything below this line is for debugging only            *
+ **************************************************************/
+
+/*
+ * Print statistics of the page cache
+ */
+void pc_print_stats() {
+    pc_stats_t stats;
+    pc_get_stats(&stats);
+    PRINT("Page cache statistics\n");
+    PRINT("---------------------\n");
+    PRINT("Pages:          %d (allocated %d, maximum %d)\n", stats.pages, stats.allocated, PC_MAX_PAGES);
+    PRINT("Hits:           %d\n", stats.hits);
+    PRINT("Misses:         %d\n", stats.misses);
+    PRINT("Evictions:      %d\n", stats.evictions);
+}
@@ -42,6 +42,12 @@ static char parm_use_acpi[2];
 static char parm_use_msi[2];
 static char parm_irq_dlv[2];
 static char parm_smp[2];
+static char parm_bc_writeback[2];
+static char parm_pse[2];
+static char parm_pge[2];
+static char parm_swap[8];
+static char parm_swap_size[8];
+static char parm_sched_balance[2];
 
 /*
  *
@@ -65,6 +71,12 @@ static char parm_smp[2];
  * use_msi: use MSI whenever a device supports this
  * irq_dlv: 1 = fixed delivery mode to BSP. 2 = logical delivery mode, 3 = lowest priority
  * smp: 0 - only use BSP, 1 - try to bring up all CPUs in the system
+ * bc_writeback: 0 - block cache uses write-through, 1 - block cache uses write-back
+ * pse: 0 - map memory with 4 kB pages only, 1 - use 4 MB pages if the CPU supports PSE
+ * pge: 0 - flush the entire TLB on each task switch, 1 - mark pages in the common area global if the CPU supports PGE
+ * swap: device used to swap out pages of user space, 0 = no swapping
+ * swap_size: number of kB of the swap device which are used for swapping
+ * sched_balance: 0 - tasks stay on the CPU on which they have been enqueued, 1 - idle and underloaded CPUs steal tasks
  */
  
  
@@ -92,6 +104,12 @@ static kparm_t kparm[] = {
         { "use_msi", parm_use_msi, 1, "1", 1 },
         { "irq_dlv", parm_irq_dlv, 1, "1", 1 },
         { "smp", parm_smp, 1, "1", 1 },
+        { "bc_writeback", parm_bc_writeback, 1, "0", 0 },
+        { "pse", parm_pse, 1, "1", 1 },
+        { "pge", parm_pge, 1, "1", 1 },
+        { "swap", parm_swap, 6, "0", 0 },
+        { "swap_size", parm_swap_size, 6, "65536", 65536 },
+        { "sched_balance", parm_sched_balance, 1, "1", 1 },
 };
 
 #define NR_KPARM (sizeof(kparm) / sizeof(kparm_t))
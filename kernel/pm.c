@@ -580,8 +580,9 @@ int pm_switch_task(int task, ir_context_t* ir_context) {
     }
     /*
      * If the "floating" flag of the target task is set, this means that the task
-     * is already blocked, but the CPU on which it has been running has not yet processed
-     * the next interrupt after running block_task or block_task_intr, i.e. has not yet switched
+     * is already blocked (or has been preempted and moved to another CPU by the scheduler), but the CPU on which
+     * it has been running has not yet processed the next interrupt after running block_task or block_task_intr
+     * (or has not yet left the interrupt context in which it called pm_switch_task), i.e. has not yet switched
      * to another task. In particular, the saved_esp and saved_cr3 fields in the target task do not
      * yet point to a valid interrupt context and the kernel stack of the task is still in use.
      * Thus we need to wait until the flag is cleared before we can proceed and use the saved interrupt context
@@ -602,6 +603,12 @@ int pm_switch_task(int task, ir_context_t* ir_context) {
     KASSERT(0 == tasks[task].floating);
     KASSERT(TASK_STATUS_RUNNING == tasks[task].status);
     KASSERT(0 == IRQ_ENABLED(get_eflags()));
+    /*
+     * The scheduler has already put us back on a ready queue, and the load balancing might hand us over
+     * to another CPU before we have left the interrupt context. So mark ourselves as floating until
+     * pm_cleanup_task has run on this CPU
+     */
+    self->floating = 1;
     /*
      * Save current values of ESP and CR3
      */
@@ -620,6 +627,11 @@ int pm_switch_task(int task, ir_context_t* ir_context) {
     previous_proc[cpuid] = active_proc[cpuid];
     active_task[cpuid] = target->id;
     active_proc[cpuid] = target->proc->id;
+    /*
+     * Let the memory manager know which address space this CPU uses from now on
+     * so that TLB shootdowns reach it
+     */
+    mm_tlb_switch(cpuid, target->proc->id);
     /*
      * Put address of kernel stack of new task into
      * the task status segment (TSS)
@@ -1204,6 +1216,8 @@ static void activate_proc(proc_t* proc) {
  * Note: the following algorithm is used:
  * - if the interrupt vector is different from 0x80, the new execution level is always EXECUTION_LEVEL_IRQ
  * - if the interrupt vector is 0x80, a system call has been made, so the new execution level is EXECUTION_LEVEL_SYSCALL
+ * - a page fault which occurs while executing in user space or while executing a system call with interrupts enabled
+ *   is handled on level EXECUTION_LEVEL_SYSCALL as well, as populating the page might require reading from a file
  */
 int pm_update_exec_level(ir_context_t* ir_context, int* old_level) {
     task_t* self = tasks + pm_get_task_id();
@@ -1215,6 +1229,15 @@ int pm_update_exec_level(ir_context_t* ir_context, int* old_level) {
     if (SYSCALL_IRQ == ir_context->vector) {
         self->execution_level = EXECUTION_LEVEL_SYSCALL;
     }
+    else if ((IRQ_TRAP_PF == ir_context->vector) && ((EXECUTION_LEVEL_USER == *old_level)
+            || ((EXECUTION_LEVEL_SYSCALL == *old_level) && IRQ_ENABLED(ir_context->eflags)))) {
+        /*
+         * Populating a page might require reading from a file, so we handle a page fault
+         * like a system call if it occurred in user space or in a system call which could
+         * have been interrupted at this point
+         */
+        self->execution_level = EXECUTION_LEVEL_SYSCALL;
+    }
     else {
         self->execution_level = EXECUTION_LEVEL_IRQ;
     }
@@ -1255,6 +1278,41 @@ void pm_restore_exec_level(ir_context_t* ir_context, int old_level) {
     }
 }
 
+/*
+ * Check whether all tasks of a process are currently executing in user space. This is used by the
+ * memory manager before a page of the process is written to the swap device, as a task which executes
+ * a system call might access a page of the process with interrupts disabled once it has validated it
+ * Parameter:
+ * @pid - the process
+ * Return value:
+ * 1 if the process has at least one task and all its tasks are executing in user space
+ * 0 otherwise
+ * Locks:
+ * task_table_lock
+ */
+int pm_proc_in_user_space(int pid) {
+    u32 eflags;
+    int i;
+    int found = 0;
+    if ((pid <= 0) || (pid >= PM_MAX_PROCESS))
+        return 0;
+    if ((PROC_SLOT_USED != procs[pid].slot_usage) || procs[pid].force_exit)
+        return 0;
+    spinlock_get(&task_table_lock, &eflags);
+    for (i = 1; i < PM_MAX_TASK; i++) {
+        if ((TASK_SLOT_FREE == tasks[i].slot_usage) || (tasks[i].proc != procs + pid))
+            continue;
+        if ((TASK_SLOT_USED != tasks[i].slot_usage) || (TASK_STATUS_DONE == tasks[i].status)
+                || (EXECUTION_LEVEL_USER != tasks[i].execution_level)) {
+            found = 0;
+            break;
+        }
+        found = 1;
+    }
+    spinlock_release(&task_table_lock, &eflags);
+    return found;
+}
+
 /****************************************************************************************
  * The functions in the following section are about task and process life cycle. This   *
  * includes the initialization routine of the process manager where the first task and  *
@@ -2750,6 +2808,10 @@ int do_exec(char* path, char** argv, char** envp, ir_context_t* ir_context) {
             return ENOMEM;
         }
     }
+    /*
+     * Remove all pages and segments of the old program from the user area
+     */
+    mm_teardown_user_area();
     if (0 == (user_space_stack = mm_init_user_area())) {
         ERROR("Could not prepare user space for program execution\n");
         proc->force_exit = 1;
@@ -2758,11 +2820,8 @@ int do_exec(char* path, char** argv, char** envp, ir_context_t* ir_context) {
     /*
      * Fill user space stack with arguments. We allow only one page for
      * all arguments in total.
-     * NOTE: this only works because mm_init_user_area only maps new pages,
-     * but does not modify any pages or remove pages. Otherwise there would be
-     * the danger that the arguments which are located somewhere in the user pages
-     * have already been overwritten when we call setup_user_stack or - even worse - removed
-     * so that we would produce a page fault
+     * NOTE: this only works because we have copied the arguments and the environment
+     * to the kernel heap above, as the pages of the old program are gone at this point
      */
     if (setup_user_stack(&user_space_stack, myargv, myenv, MM_PAGE_SIZE)) {
         ERROR("Stack area not sufficient for arguments\n");
@@ -2785,7 +2844,7 @@ int do_exec(char* path, char** argv, char** envp, ir_context_t* ir_context) {
      * so that we will never return to user space
      */
     if (elf_load_executable(mypath, &entry_point, 0)) {
-        ERROR("Could not load executable %s\n", path);
+        ERROR("Could not load executable %s\n", mypath);
         proc->force_exit = 1;
         return ENOEXEC;
     }
@@ -3,6 +3,15 @@
  *
  * This module contains the scheduler code. The scheduler is responsible for determining the next task to run. It
  * does not perform the task switch - this is done by the process manager
+ *
+ * Each CPU has its own ready queues. A new runnable is placed on the CPU with the shortest queue, but as tasks block
+ * and exit, the queues can get out of balance later on. Therefore a CPU which is idle or has a significantly shorter
+ * queue than another CPU steals runnables from the queues of the busiest CPU, see balance() below. Runnables which
+ * have been added for a specific CPU using sched_enqueue_cpu and the idle tasks are never moved.
+ *
+ * Moving a runnable to a different CPU while the task is still switching away on the old CPU is safe, as the process
+ * manager marks a task as floating until the task switch has been completed and waits for this flag to be cleared
+ * before it switches to a task
  */
 
 #include "pm.h"
@@ -59,6 +68,15 @@ static u32 idle_last[SMP_MAX_CPU];
 static u32 busy_last[SMP_MAX_CPU];
 static int load[SMP_MAX_CPU];
 
+/*
+ * Load balancing
+ *
+ * balance_enabled - set at boot time from the kernel parameter sched_balance
+ * stolen - number of runnables which a CPU has taken over from other CPUs
+ */
+static int balance_enabled = 0;
+static u32 stolen[SMP_MAX_CPU];
+
 
 /****************************************************************************************
  * The following functions are used for initialization. Whereas sched_init() is being   *
@@ -77,6 +95,7 @@ void sched_init() {
         active[cpu] = 0;
         cpu_used[cpu] = 0;
         cpu_queue_length[cpu]=0;
+        stolen[cpu] = 0;
         for (i = 0; i <= SCHED_MAX_PRIO; i++) {
             queue[cpu][i].head = 0;
             queue[cpu][i].tail = 0;
@@ -95,10 +114,12 @@ void sched_init() {
     runnable[SMP_BSP_ID][0].priority = 0;
     runnable[SMP_BSP_ID][0].reschedule = 0;
     runnable[SMP_BSP_ID][0].quantum = SCHED_INIT_QUANTUM;
+    runnable[SMP_BSP_ID][0].bound = 1;
     /*
      * Task 0 is the idle task for the BSP
      */
     idle_task[SMP_BSP_ID]=0;
+    balance_enabled = params_get_int("sched_balance");
 }
 
 /*
@@ -130,6 +151,7 @@ void sched_add_idle_task(int task_id, int cpuid) {
         runnable[cpuid][task_id].quantum = SCHED_INIT_QUANTUM;
         runnable[cpuid][task_id].reschedule = 0;
         runnable[cpuid][task_id].priority = 0;
+        runnable[cpuid][task_id].bound = 1;
         active[cpuid]=runnable[cpuid] + task_id;
     }
     spinlock_release(&queue_lock[cpuid], &eflags);
@@ -170,10 +192,11 @@ static int get_next_cpu() {
  * @task_id -  the ID of the new runnable / task
  * @priority -  the priority with which we add the new runnable
  * @cpu - the target CPU (0 = BSP)
+ * @bound - if this is set, the runnable will not be moved to another CPU by the load balancing
  * Locks:
  * queue_lock
  */
-void sched_enqueue_cpu(int task_id, int priority, int cpuid) {
+static void enqueue(int task_id, int priority, int cpuid, int bound) {
     u32 flags;
     if ((task_id < 0)  || (task_id >= PM_MAX_TASK)) {
         ERROR("Invalid task id %x\n", task_id);
@@ -202,6 +225,8 @@ void sched_enqueue_cpu(int task_id, int priority, int cpuid) {
     runnable[cpuid][task_id].quantum = SCHED_INIT_QUANTUM;
     runnable[cpuid][task_id].reschedule = 0;
     runnable[cpuid][task_id].priority = priority;
+    runnable[cpuid][task_id].bound = bound;
+    runnable[cpuid][task_id].enqueued = idle[cpuid] + busy[cpuid];
     if (priority > active[cpuid]->priority) {
         active[cpuid]->reschedule = 1;
         /*
@@ -223,6 +248,18 @@ void sched_enqueue_cpu(int task_id, int priority, int cpuid) {
 
 }
 
+/*
+ * Add a new task to the ready queues for a specific CPU. The task is bound
+ * to this CPU, i.e. it will not be moved to another CPU by the load balancing
+ * Parameter:
+ * @task_id -  the ID of the new runnable / task
+ * @priority -  the priority with which we add the new runnable
+ * @cpu - the target CPU (0 = BSP)
+ */
+void sched_enqueue_cpu(int task_id, int priority, int cpuid) {
+    enqueue(task_id, priority, cpuid, 1);
+}
+
 /*
  * Add a new task to the ready queues. The CPU to be used will be selected
  * according to shortest processor queue length
@@ -239,7 +276,7 @@ void sched_enqueue(int task_id, int priority) {
     /*
      * and call delegate
      */
-    sched_enqueue_cpu(task_id, priority, cpuid);
+    enqueue(task_id, priority, cpuid, 0);
 }
 
 
@@ -319,6 +356,108 @@ int sched_get_queue_length(int cpuid) {
     return rc;
 }
 
+/****************************************************************************************
+ * The following functions implement the load balancing between the ready queues of the *
+ * individual CPUs                                                                      *
+ ***************************************************************************************/
+
+/*
+ * Steal runnables from the CPU with the longest ready queue and move them to the ready queues of the current CPU.
+ * This is done if the queue of the other CPU is at least SCHED_IMBALANCE entries longer than our own queue, and
+ * we take over half of the difference. Runnables are taken from the highest priority queues first, and we skip
+ * runnables which are bound to their CPU and runnables which have been added to the queue less than
+ * SCHED_CACHE_HOT_TICKS ticks ago. A runnable which has been moved starts over with this interval on its new CPU,
+ * so that it is not moved back and forth between two CPUs.
+ *
+ * The busiest CPU is determined without holding any locks, so the queue lengths are checked again once both
+ * locks have been acquired
+ *
+ * Parameter:
+ * @cpuid - the current CPU
+ * Return value:
+ * the number of runnables moved to the current CPU
+ * Locks:
+ * queue_lock of the current CPU and of the busiest CPU, acquired in the order of the CPU IDs
+ */
+static int balance(int cpuid) {
+    int cpu;
+    int busiest = -1;
+    int prio;
+    int task_id;
+    int moved = 0;
+    u32 max_length = 0;
+    u32 length;
+    u32 count;
+    u32 now;
+    u32 flags_low;
+    u32 flags_high;
+    runnable_t* item;
+    runnable_t* next;
+    /*
+     * Locate CPU with the longest queue
+     */
+    for (cpu = 0; cpu < SMP_MAX_CPU; cpu++) {
+        if ((cpu != cpuid) && (cpu_used[cpu])) {
+            length = atomic_load(&cpu_queue_length[cpu]);
+            if (length > max_length) {
+                max_length = length;
+                busiest = cpu;
+            }
+        }
+    }
+    if (-1 == busiest)
+        return 0;
+    if (max_length < atomic_load(&cpu_queue_length[cpuid]) + SCHED_IMBALANCE)
+        return 0;
+    /*
+     * Get both locks, lower CPU ID first to avoid deadlocks
+     */
+    spinlock_get(&queue_lock[MIN(cpuid, busiest)], &flags_low);
+    spinlock_get(&queue_lock[MAX(cpuid, busiest)], &flags_high);
+    if (cpu_queue_length[busiest] >= cpu_queue_length[cpuid] + SCHED_IMBALANCE) {
+        count = (cpu_queue_length[busiest] - cpu_queue_length[cpuid]) / 2;
+        now = idle[busiest] + busy[busiest];
+        for (prio = SCHED_MAX_PRIO; (prio >= 0) && (moved < count); prio--) {
+            item = queue[busiest][prio].head;
+            while (item && (moved < count)) {
+                next = item->next;
+                if ((0 == item->bound) && (now - item->enqueued >= SCHED_CACHE_HOT_TICKS)) {
+                    /*
+                     * Remove runnable from the queue of the busiest CPU and add
+                     * it to our queue with the same priority and the remaining quantum
+                     */
+                    task_id = item - runnable[busiest];
+                    LIST_REMOVE(queue[busiest][prio].head, queue[busiest][prio].tail, item);
+                    item->valid = 0;
+                    cpu_queue_length[busiest]--;
+                    runnable[cpuid][task_id].valid = 1;
+                    runnable[cpuid][task_id].quantum = item->quantum;
+                    runnable[cpuid][task_id].reschedule = 0;
+                    runnable[cpuid][task_id].priority = prio;
+                    runnable[cpuid][task_id].bound = 0;
+                    runnable[cpuid][task_id].enqueued = idle[cpuid] + busy[cpuid];
+                    LIST_ADD_END(queue[cpuid][prio].head, queue[cpuid][prio].tail, runnable[cpuid] + task_id);
+                    cpu_queue_length[cpuid]++;
+                    moved++;
+                    /*
+                     * Make sure that we switch to the new runnable soon if we are idle or
+                     * if it has a higher priority than what we are currently doing
+                     */
+                    if (active[cpuid]) {
+                        if ((active[cpuid] == runnable[cpuid] + idle_task[cpuid]) || (prio > active[cpuid]->priority))
+                            active[cpuid]->reschedule = 1;
+                    }
+                }
+                item = next;
+            }
+        }
+        stolen[cpuid] += moved;
+    }
+    spinlock_release(&queue_lock[MAX(cpuid, busiest)], &flags_high);
+    spinlock_release(&queue_lock[MIN(cpuid, busiest)], &flags_low);
+    return moved;
+}
+
 /****************************************************************************************
  * The following functions are the main entry points for the kernels interrupt handler  *
  * and perform the actual scheduling operations                                         *
@@ -370,6 +509,7 @@ int sched_schedule() {
          * for its new priority and refresh quantum if it was zero
          */
         LIST_ADD_END(queue[cpuid][active[cpuid]->priority].head, queue[cpuid][active[cpuid]->priority].tail, active[cpuid]);
+        active[cpuid]->enqueued = idle[cpuid] + busy[cpuid];
         cpu_queue_length[cpuid]++;
         if (active[cpuid]->quantum == 0)
             active[cpuid]->quantum = SCHED_INIT_QUANTUM;
@@ -400,6 +540,15 @@ int sched_schedule() {
     active[cpuid]->reschedule = 0;
     rc = active[cpuid] - runnable[cpuid];
     spinlock_release(&queue_lock[cpuid], &flags);
+    /*
+     * If we are about to run our idle task, try to get some work from another CPU first. If that
+     * works, balance() has set the reschedule flag of the idle task, so we will select one of the
+     * stolen runnables when we run again
+     */
+    if ((rc == idle_task[cpuid]) && (balance_enabled)) {
+        if (balance(cpuid))
+            return sched_schedule();
+    }
     return rc;
 }
 
@@ -411,6 +560,7 @@ void sched_do_tick() {
     u32 busy_ticks;
     u32 idle_ticks;
     int cpuid;
+    int is_idle = 1;
     u32 flags;
     /*
      * Make sure that we are not preempted and will therefore
@@ -441,8 +591,10 @@ void sched_do_tick() {
         if (active[cpuid] == runnable[cpuid] + idle_task[cpuid]) {
             idle[cpuid]++;
         }
-        else
+        else {
             busy[cpuid]++;
+            is_idle = 0;
+        }
     }
     else
         idle[cpuid]++;
@@ -461,6 +613,15 @@ void sched_do_tick() {
         idle_last[cpuid] = idle[cpuid];
     }
     spinlock_release(&queue_lock[cpuid], &flags);
+    /*
+     * Do load balancing at every tick if we are idle and every SCHED_BALANCE_TICKS
+     * ticks otherwise. Note that only this CPU updates idle and busy, so we can
+     * read them without holding the lock
+     */
+    if (balance_enabled) {
+        if ((is_idle) || (0 == ((idle[cpuid] + busy[cpuid]) % SCHED_BALANCE_TICKS)))
+            balance(cpuid);
+    }
 }
 
 
@@ -533,11 +694,11 @@ void sched_print() {
     PRINT("Hit ENTER to print CPU list\n");
     debug_getline(c,1);
     PRINT("\nCPUs:\n");
-    PRINT("ID  Queue length    Load\n");
-    PRINT("-------------------------\n");
+    PRINT("ID  Queue length    Load  Stolen\n");
+    PRINT("--------------------------------\n");
     for (cpu = 0; cpu < SMP_MAX_CPU; cpu++) {
         if (1 == cpu_used[cpu]) {
-            PRINT("%h  %h              %d\n", cpu, cpu_queue_length[cpu], load[cpu]);
+            PRINT("%h  %h              %d    %d\n", cpu, cpu_queue_length[cpu], load[cpu], stolen[cpu]);
         }
     }
 }
@@ -36,7 +36,7 @@
  * Macro to call validation function in memory manager
  */
 #define VALIDATE(buffer, len, rw) do {if ((EXECUTION_LEVEL_USER == previous_execution_level) && \
-        (mm_validate(buffer, len, rw))) return -EFAULT;} while(0);
+        (mm_validate_buffer((u32) (buffer), len, rw))) return -EFAULT;} while(0);
 
 /*
  * These are the entry points for all system calls
@@ -901,6 +901,50 @@ SYSENTRY(ftruncate) {
 }
 
 
+/*
+ * sync
+ */
+SYSENTRY(sync) {
+    return do_sync();
+}
+
+/*
+ * fsync
+ * Parameter:
+ * ebx - file descriptor
+ */
+SYSENTRY(fsync) {
+    return do_fsync(ir_context->ebx);
+}
+
+/*
+ * mmap
+ * Parameter:
+ * ebx - requested address
+ * ecx - length of the mapping
+ * edx - protection
+ * esi - flags
+ * edi - pointer to an array containing the file descriptor and the offset
+ */
+SYSENTRY(mmap) {
+    if (0 == ir_context->edi)
+        return -EFAULT;
+    VALIDATE(ir_context->edi, 2*sizeof(u32), 0);
+    return do_mmap(ir_context->ebx, ir_context->ecx, ir_context->edx, ir_context->esi,
+            *((u32*) ir_context->edi), *((u32*)(ir_context->edi + 4)));
+}
+
+/*
+ * munmap
+ * Parameter:
+ * ebx - start of the range to be unmapped
+ * ecx - length of the range
+ */
+SYSENTRY(munmap) {
+    return do_munmap(ir_context->ebx, ir_context->ecx);
+}
+
+
 /*
  * This array contains all system call entry points and defines the mapping of
  * system call numbers to functions
@@ -916,7 +960,8 @@ static st_handler_t systemcalls[] = { fork_entry,
         dup2_entry, fstat_entry, times_entry, getcwd_entry, tcgetattr_entry, time_entry, tcsetattr_entry, socket_entry,
         connect_entry, send_entry, recv_entry, listen_entry, bind_entry, accept_entry, select_entry, alarm_entry,
         sendto_entry, recvfrom_entry, setsockopt_entry, utime_entry, chmod_entry, getsockaddr_entry, mkdir_entry,
-        sigsuspend_entry, rename_entry, setsid_entry, getsid_entry, link_entry, ftruncate_entry, openat_entry, fchdir_entry};
+        sigsuspend_entry, rename_entry, setsid_entry, getsid_entry, link_entry, ftruncate_entry, openat_entry, fchdir_entry,
+        sync_entry, fsync_entry, mmap_entry, munmap_entry};
 
 #define SYSTEM_CALL_ENTRIES (sizeof(systemcalls) / sizeof(st_handler_t))
 
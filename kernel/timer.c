@@ -70,6 +70,7 @@
 #include "sysmon.h"
 #include "tcp.h"
 #include "ip.h"
+#include "blockcache.h"
 #include "lib/stddef.h"
 
 /*
@@ -164,6 +165,9 @@ static int timer_isr(ir_context_t* ir_context) {
         if (0 == ticks[0] % HZ) {
             ip_do_tick();
         }
+        if (0 == ticks[0] % (HZ * BC_FLUSH_SECONDS)) {
+            bc_do_tick();
+        }
     }
     /*
      * Check if there are any expired timed event control blocks
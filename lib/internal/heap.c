@@ -64,8 +64,157 @@ static int heap_validate_chunk(heap_chunk_header_t* header) {
     return 0;
 }
 
+/*
+ * Minimum alignment of all memory handed out by the heap. All sizes are rounded up to a multiple of
+ * this value so that, if the start of the heap is suitably aligned, each chunk starts at an aligned address
+ */
+#define HEAP_ALIGN 4
+
+/*
+ * Usable size of a chunk which is needed to store the links of a free chunk. Free chunks which are smaller
+ * are not placed on a bin, they are only reclaimed when one of their neighbours is freed
+ */
+#define HEAP_MIN_SIZE (sizeof(heap_chunk_links_t))
+
+/*
+ * Header and footer of a chunk
+ */
+#define HEAP_OVERHEAD (sizeof(heap_chunk_header_t) + 4)
+
+/*
+ * Get the links of a free chunk
+ */
+#define HEAP_LINKS(chunk) ((heap_chunk_links_t*) (((u32) (chunk)) + sizeof(heap_chunk_header_t)))
+
+/*
+ * Given the size of a free chunk, determine the bin on which it is placed. Small chunks are put
+ * on the bin size / __HEAP_SMALL_STEP, larger chunks on the bin given by the position of the highest
+ * bit set in size and the following bits
+ * Parameter:
+ * @size - size of the chunk
+ * Return value:
+ * index of the bin
+ */
+static int heap_bin_index(u32 size) {
+    int msb;
+    if (size < __HEAP_SMALL_LIMIT)
+        return size / __HEAP_SMALL_STEP;
+    msb = 31 - __builtin_clz(size);
+    return __HEAP_SMALL_LIMIT / __HEAP_SMALL_STEP + (msb - 8) * __HEAP_SUB_BINS
+            + ((size >> (msb - 2)) & (__HEAP_SUB_BINS - 1));
+}
+
+/*
+ * Given a requested size, determine the first bin on which all chunks are at least as big as the
+ * requested size. This is the bin which would hold the requested size, rounded up to the next bin boundary
+ * Parameter:
+ * @size - the requested size
+ * Return value:
+ * index of the bin or __HEAP_BINS if there is no such bin
+ */
+static int heap_search_index(u32 size) {
+    int msb;
+    if (size < __HEAP_SMALL_LIMIT)
+        return (size + __HEAP_SMALL_STEP - 1) / __HEAP_SMALL_STEP;
+    msb = 31 - __builtin_clz(size);
+    if (msb == 31)
+        return __HEAP_BINS;
+    return heap_bin_index(size + (1 << (msb - 2)) - 1);
+}
+
+/*
+ * Put a free chunk on the bin matching its size. Chunks which are too small to hold the
+ * links are not put on a bin
+ * Parameter:
+ * @heap - the heap
+ * @chunk - the chunk
+ */
+static void heap_bin_insert(heap_t* heap, heap_chunk_header_t* chunk) {
+    heap_chunk_links_t* links;
+    int size = heap_chunk_get_size(chunk);
+    int index;
+    if (size < (int) HEAP_MIN_SIZE)
+        return;
+    index = heap_bin_index(size);
+    links = HEAP_LINKS(chunk);
+    links->prev = 0;
+    links->next = heap->bins[index];
+    if (links->next)
+        HEAP_LINKS(links->next)->prev = chunk;
+    heap->bins[index] = chunk;
+    heap->bin_map[index / 32] |= (1U << (index % 32));
+}
+
+/*
+ * Remove a free chunk from its bin. This needs to be done before the size of a free chunk changes
+ * or the chunk is used
+ * Parameter:
+ * @heap - the heap
+ * @chunk - the chunk
+ */
+static void heap_bin_remove(heap_t* heap, heap_chunk_header_t* chunk) {
+    heap_chunk_links_t* links;
+    int size = heap_chunk_get_size(chunk);
+    int index;
+    if (size < (int) HEAP_MIN_SIZE)
+        return;
+    index = heap_bin_index(size);
+    links = HEAP_LINKS(chunk);
+    if (links->prev)
+        HEAP_LINKS(links->prev)->next = links->next;
+    else
+        heap->bins[index] = links->next;
+    if (links->next)
+        HEAP_LINKS(links->next)->prev = links->prev;
+    if (0 == heap->bins[index])
+        heap->bin_map[index / 32] &= ~(1U << (index % 32));
+}
+
+/*
+ * Find a free chunk with at least @size usable bytes. If the first chunk on the bin into which a chunk of the
+ * requested size would be sorted is big enough, we use it. Otherwise we use the bitmap of non-empty bins
+ * to locate the first bin which is guaranteed to only contain chunks which are big enough and
+ * take the first chunk from it. If there is no such bin, the bin into which a chunk of the requested
+ * size would be sorted might still contain a chunk which is big enough, so we search this bin for the
+ * best fit
+ * Parameter:
+ * @heap - the heap
+ * @size - the requested size
+ * Return value:
+ * a free chunk or 0 if no chunk could be found
+ */
+static heap_chunk_header_t* heap_find_chunk(heap_t* heap, u32 size) {
+    heap_chunk_header_t* chunk;
+    heap_chunk_header_t* best = 0;
+    u32 bits;
+    int index;
+    int word;
+    if (size >= 0x80000000)
+        return 0;
+    chunk = heap->bins[heap_bin_index(size)];
+    if ((chunk) && (heap_chunk_get_size(chunk) >= size))
+        return chunk;
+    index = heap_search_index(size);
+    for (word = index / 32; word < __HEAP_BINS / 32; word++) {
+        bits = heap->bin_map[word];
+        if (word == index / 32)
+            bits &= (~0U) << (index % 32);
+        if (bits)
+            return heap->bins[word * 32 + __builtin_ctz(bits)];
+    }
+    while (chunk) {
+        if (heap_chunk_get_size(chunk) >= size) {
+            if ((0 == best) || (heap_chunk_get_size(chunk) < heap_chunk_get_size(best)))
+                best = chunk;
+        }
+        chunk = HEAP_LINKS(chunk)->next;
+    }
+    return best;
+}
+
 /*
  * Utility function to check an entire heap for consistency
+ * This is only done if the validate flag of the heap is set, as we need to walk the entire heap
  * Parameters:
  * @heap - the heap to be checked
  * Return value:
@@ -75,16 +224,19 @@ static int heap_validate_chunk(heap_chunk_header_t* header) {
  * ENOHEADER if the header of a chunk is missing
  * EFOOTER if the footer address of a chunk does not match the actual footer
  * ESIZE if the chunk size is negative for one chunk
+ * EBIN if two adjacent chunks are free or the bins do not match the free chunks
  *
  */
 static int heap_validate(heap_t* heap) {
     int result;
-    int i = 0;
+    int index;
+    int free_chunks = 0;
+    int prev_free = 0;
+    heap_chunk_header_t* current;
     if (heap->validate==0)
         return 0;
-    heap_chunk_header_t* current = (heap_chunk_header_t*) heap->start;
+    current = (heap_chunk_header_t*) heap->start;
     while (current) {
-        i++;
         /* Verify that chunk stays with range given by heap */
         if ((u32) current > heap->current_top) {
             return __HEAP_ECHUNKRANGE;
@@ -100,8 +252,30 @@ static int heap_validate(heap_t* heap) {
         if (result) {
             return result;
         }
+        /* Free chunks are always merged with their neighbours */
+        if (0 == current->used) {
+            if (prev_free)
+                return __HEAP_EBIN;
+            if (heap_chunk_get_size(current) >= (int) HEAP_MIN_SIZE)
+                free_chunks++;
+        }
+        prev_free = (0 == current->used);
         current = heap_next_chunk(current);
     }
+    /* Check that each free chunk is on the right bin */
+    for (index = 0; index < __HEAP_BINS; index++) {
+        if ((0 == heap->bins[index]) != (0 == (heap->bin_map[index / 32] & (1U << (index % 32)))))
+            return __HEAP_EBIN;
+        current = heap->bins[index];
+        while (current) {
+            if ((current->used) || (heap_bin_index(heap_chunk_get_size(current)) != index))
+                return __HEAP_EBIN;
+            free_chunks--;
+            current = HEAP_LINKS(current)->next;
+        }
+    }
+    if (free_chunks)
+        return __HEAP_EBIN;
     return 0;
 }
 
@@ -161,12 +335,18 @@ static heap_chunk_header_t* heap_init_chunk(u32 first, u32 last) {
  */
 int __ctOS_heap_init(heap_t* heap, u32 first, u32 last, unsigned int(*extension)(unsigned int, unsigned int)) {
     heap_chunk_header_t* header;
+    int i;
     heap->start = first;
     heap->current_top = last;
     heap->extension = extension;
     heap->validate = 0;
+    for (i = 0; i < __HEAP_BINS; i++)
+        heap->bins[i] = 0;
+    for (i = 0; i < __HEAP_BINS / 32; i++)
+        heap->bin_map[i] = 0;
     header = heap_init_chunk(heap->start, heap->current_top);
     header->last = 1;
+    heap_bin_insert(heap, header);
     return heap_validate(heap);
 }
 
@@ -238,9 +418,11 @@ static u32 heap_get_aligned_address(heap_chunk_header_t* chunk, int alignment) {
 
 /*
  * Consume a free chunk, i.e. mark it as used
- * If alignment is not equal to 1, the chunk will be split into an upper part fulfilling
+ * The chunk must already have been removed from its bin
+ * If the chunk is not aligned as requested, the chunk will be split into an upper part fulfilling
  * the alignment and a lower part which is not aligned. The upper part will then be split
- * into a part servicing the request and a remainder
+ * into a part servicing the request and a remainder. Lower part and remainder are put back
+ * on the bins
  * Parameters:
  * @heap - the heap
  * @chunk - the chunk to be consumed
@@ -256,11 +438,6 @@ static void* heap_consume_chunk(heap_t* heap, heap_chunk_header_t* chunk,
     u32 offset;
     u32 base;
     u32 base_aligned;
-    int rc;
-    rc = heap_validate(heap);
-    if (rc) {
-        return 0;
-    }
     /* If splitting is necessary to fulfill alignment, we split first
      * into a lower part which is unaligned and an upper part which is aligned
      * We then continue to work with the upper part only
@@ -270,37 +447,24 @@ static void* heap_consume_chunk(heap_t* heap, heap_chunk_header_t* chunk,
         base_aligned = heap_get_aligned_address(chunk, alignment);
         offset = base_aligned - (u32) chunk - sizeof(heap_chunk_header_t);
         /* Split sizeof(heap_chunk_header_t) below this address */
-        rc = heap_chunk_split(chunk, offset);
-        if (rc) {
+        if (heap_chunk_split(chunk, offset)) {
             return 0;
         }
+        heap_bin_insert(heap, chunk);
         chunk = (heap_chunk_header_t*) (base_aligned
                 - sizeof(heap_chunk_header_t));
-        rc = heap_validate(heap);
-        if (rc) {
-            return 0;
-        }
     }
     /* Check whether splitting the chunk makes sense
      * We only do a split if the chunk is big enough
-     * to store the new header and footer
-     * and still has a size of more than 4 byte
+     * to store the new header and footer and the remainder
+     * is big enough to be placed on a bin
      */
-    if (heap_chunk_get_size(chunk) > (requested_size + 8
-            + sizeof(heap_chunk_header_t))) {
-        offset = requested_size + sizeof(heap_chunk_header_t) + 4;
-        rc = heap_chunk_split(chunk, offset);
-        if (rc) {
+    if (heap_chunk_get_size(chunk) >= (int) (requested_size + HEAP_OVERHEAD + HEAP_MIN_SIZE)) {
+        offset = requested_size + HEAP_OVERHEAD;
+        if (heap_chunk_split(chunk, offset)) {
             return 0;
         }
-        rc = heap_validate(heap);
-        if (rc) {
-            return 0;
-        }
-    }
-    rc = heap_validate(heap);
-    if (rc) {
-        return 0;
+        heap_bin_insert(heap, heap_next_chunk(chunk));
     }
     chunk->used = 1;
     return ((void*) chunk) + sizeof(heap_chunk_header_t);
@@ -342,86 +506,99 @@ static int heap_chunk_sufficient(heap_chunk_header_t* chunk, u32 requested,
     return 1;
 }
 
+/*
+ * Locate a free chunk which can service a request, taking alignment into account. As all chunks
+ * are aligned to HEAP_ALIGN, we can usually take any chunk which is big enough. For other alignments,
+ * we ask for a chunk which is big enough to hold the request even if we have to split off an
+ * unaligned lower part
+ * Parameters:
+ * @heap - the heap
+ * @size - number of requested bytes
+ * @alignment - requested alignment
+ * Return value:
+ * a suitable free chunk or 0
+ */
+static heap_chunk_header_t* heap_find_sufficient_chunk(heap_t* heap, u32 size, u32 alignment) {
+    heap_chunk_header_t* chunk = 0;
+    if (0 == (HEAP_ALIGN % alignment)) {
+        chunk = heap_find_chunk(heap, size);
+        if (heap_chunk_sufficient(chunk, size, alignment))
+            return chunk;
+    }
+    chunk = heap_find_chunk(heap, size + alignment + HEAP_OVERHEAD);
+    if (heap_chunk_sufficient(chunk, size, alignment))
+        return chunk;
+    return 0;
+}
+
 /*
  * Malloc
  * This function will allocate a part of the heap and return a pointer of it to the callee
  * The function will return memory allocated at @alignment bytes, i.e. the address returned
  * to the user will be a multiple of @alignment
- * First the linked list of chunks is scanned for a chunk which is big enough to fulfill the
+ * First the bins are searched for a free chunk which is big enough to fulfill the
  * request.
  * If no chunk is found, the extension function defined in the heap data structure is called
  * to enlarge the heap
  * Parameters:
  * @heap - the heap on which we operate
  * @size - number of requested bytes
+ * @alignment - requested alignment
  * Return value:
  * pointer to allocated memory or 0 if allocation failed
  */
 void* __ctOS_heap_malloc_aligned(heap_t* heap, u32 size, u32 alignment) {
-    heap_chunk_header_t* current = (heap_chunk_header_t*) heap->start;
+    heap_chunk_header_t* current;
     heap_chunk_header_t* last;
     u32 extension;
     u32 extension_size;
-    int rc;
     void* ptr;
-    if (0==size)
+    if ((0 == size) || (0 == alignment) || (size > 0x80000000))
         return 0;
-    /* First go through available chunks and search for a free
-     * chunk which is big enough, taking alignment into account
-     */
-    while (0 != current) {
-        if (heap_chunk_sufficient(current, size, alignment)) {
-            ptr = heap_consume_chunk(heap, current, size, alignment);
-            rc=heap_validate(heap);
-            if (rc) {
-                return 0;
-            }
-            if (heap_chunk_get_size((heap_chunk_header_t*)(ptr-sizeof(heap_chunk_header_t))) < size) {
-                return 0;
-            }
-            return ptr;
+    size = (size + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+    current = heap_find_sufficient_chunk(heap, size, alignment);
+    if (0 == current) {
+        /* If we got to this point, there is no free chunk
+         * so we need to request an extension
+         * First figure out how much space we need taking alignment into account
+         */
+        if (0 == (HEAP_ALIGN % alignment))
+            extension_size = size + HEAP_OVERHEAD;
+        else
+            extension_size = size + alignment + 2 * HEAP_OVERHEAD;
+        /*
+         * The extension function is supposed to return zero
+         * if no extension is possible
+         */
+        if (0 == heap->extension) {
+            return 0;
         }
-        current = heap_next_chunk(current);
-    }
-    /* If we got to this point, there is no free chunk
-     * so we need to request an extension
-     * First figure out how much space we need taking extension into account
-     */
-    if (1 == alignment)
-        extension_size = size + 4 + sizeof(heap_chunk_header_t);
-    else {
-        extension_size = heap_get_aligned_address(
-                (heap_chunk_header_t*) heap->current_top + 1, alignment)
-                - heap->current_top + size + 8;
-    }
-    /*
-     * The extension function is supposed to return zero
-     * if no extension is possible
-     */
-    if (0==heap->extension) {
-        return 0;
+        extension = heap->extension(extension_size, heap->current_top);
+        if (0 == extension)
+            return 0;
+        current = (heap_chunk_header_t*) (heap->current_top + 1);
+        /* Get pointer to last chunk in the old heap size */
+        last = (heap_chunk_header_t*) *((u32*) (heap->current_top - 3));
+        /* Set up new chunk and fix references in linked list */
+        heap_init_chunk((u32) current, extension);
+        last->last = 0;
+        current->last = 1;
+        heap->current_top = extension;
+        /* If the previous last chunk is free, merge */
+        if (0 == last->used) {
+            heap_bin_remove(heap, last);
+            heap_init_chunk((u32) last, extension);
+            last->last = 1;
+            current = last;
+        }
+        heap_bin_insert(heap, current);
+        current = heap_find_sufficient_chunk(heap, size, alignment);
+        if (0 == current)
+            return 0;
     }
-    extension = heap->extension(extension_size, heap->current_top);
-    if (0 == extension)
-        return 0;
-    current = (heap_chunk_header_t*) (heap->current_top + 1);
-    /* Get pointer to last chunk in the old heap size */
-    last = (heap_chunk_header_t*) *((u32*) (heap->current_top - 3));
-    /* Fix references in linked list */
-    last->last = 0;
-    current->last = 1;
-    /* Set up new header and footer */
-    heap_init_chunk(heap->current_top + 1, extension);
-    /* Adapt heap structure */
-    heap->current_top = extension;
-    heap_init_chunk((u32) current, heap->current_top);
-    /*finally consume and return new chunk */
+    heap_bin_remove(heap, current);
     ptr = heap_consume_chunk(heap, current, size, alignment);
-    rc=heap_validate(heap);
-    if (rc) {
-        return 0;
-    }
-    if (heap_chunk_get_size((heap_chunk_header_t*)(ptr-sizeof(heap_chunk_header_t))) < size) {
+    if (heap_validate(heap)) {
         return 0;
     }
     return ptr;
@@ -437,14 +614,15 @@ void* __ctOS_heap_malloc_aligned(heap_t* heap, u32 size, u32 alignment) {
  * pointer to allocated memory or 0 if allocation failed
  */
 void* __ctOS_heap_malloc(heap_t* heap, u32 size) {
-    return __ctOS_heap_malloc_aligned(heap, size, sizeof(unsigned int));
+    return __ctOS_heap_malloc_aligned(heap, size, HEAP_ALIGN);
 }
 
 /*
  * Free
  * This function will mark the chunk pointed to by ptr as unused.
- * If possible, it will also try to merge the returned chunk with adjacent chunks
- * to avoid memory fragmentation
+ * The chunk is merged with adjacent free chunks to avoid memory fragmentation
+ * and the result is put back on the bins. As free chunks are always merged, at most
+ * the two immediate neighbours can be free
  * Parameters:
  * @heap - the heap to operate on
  * @ptr - a pointer to a previously allocated memory
@@ -455,6 +633,8 @@ void __ctOS_heap_free(heap_t* heap, void* ptr) {
     heap_chunk_header_t* first_free;
     heap_chunk_header_t* last_free;
     u8 orig_last;
+    if (0 == header->used)
+        return;
     header->used = 0;
     first_free = header;
     last_free = header;
@@ -468,6 +648,7 @@ void __ctOS_heap_free(heap_t* heap, void* ptr) {
         if (1 == heap_next_chunk(last_free)->used)
             break;
         last_free = heap_next_chunk(last_free);
+        heap_bin_remove(heap, last_free);
     }
     /* Similarly make first_free point
      * to the last chunk equal to or before
@@ -479,6 +660,7 @@ void __ctOS_heap_free(heap_t* heap, void* ptr) {
         if (1 == heap_previous_chunk(first_free)->used)
             break;
         first_free = heap_previous_chunk((heap_chunk_header_t*) first_free);
+        heap_bin_remove(heap, first_free);
     }
     /* Merge the area between first_free and last_free
      * into one big chunk, mark it as unused and
@@ -487,6 +669,8 @@ void __ctOS_heap_free(heap_t* heap, void* ptr) {
     orig_last = last_free->last;
     heap_init_chunk((u32) first_free, ((u32) last_free->footer) + 3)->used = 0;
     first_free->last = orig_last;
+    heap_bin_insert(heap, first_free);
+    heap_validate(heap);
     return;
 }
 
@@ -518,8 +702,12 @@ void* __ctOS_heap_realloc(heap_t* heap, void* ptr, size_t size) {
     void* new_ptr = __ctOS_heap_malloc(heap, size);
     if (0==new_ptr)
         return 0;
-    __ctOS_heap_free(heap, ptr);
+    /*
+     * Copy before freeing the old object, as free places the links of the
+     * chunk in its first bytes
+     */
     for (i=0;i<old_size;i++)
         ((char*)new_ptr)[i]=((char*)ptr)[i];
+    __ctOS_heap_free(heap, ptr);
     return new_ptr;
 }
@@ -0,0 +1,15 @@
+/*
+ * mman.c
+ *
+ */
+
+#include "lib/os/syscalls.h"
+#include "lib/os/types.h"
+
+unsigned int __ctOS_mmap(void* addr, size_t len, int prot, int flags, int fd, off_t offset) {
+    return __ctOS_syscall(__SYSNO_MMAP, 6, addr, len, prot, flags, fd, offset);
+}
+
+int __ctOS_munmap(void* addr, size_t len) {
+    return __ctOS_syscall(__SYSNO_MUNMAP, 2, addr, len);
+}
@@ -84,4 +84,12 @@ pid_t __ctOS_getsid(pid_t pid) {
 
 int __ctOS_ftruncate(int fd, off_t size) {
     return __ctOS_syscall(__SYSNO_FTRUNCATE, 2, fd, size);
+}
+
+int __ctOS_sync() {
+    return __ctOS_syscall(__SYSNO_SYNC, 0);
+}
+
+int __ctOS_fsync(int fd) {
+    return __ctOS_syscall(__SYSNO_FSYNC, 1, fd);
 }
\ No newline at end of file
@@ -0,0 +1,61 @@
+/*
+ * mman.c
+ *
+ */
+
+#include "lib/sys/mman.h"
+#include "lib/os/oscalls.h"
+#include "lib/errno.h"
+
+/*
+ * Map a file or, if MAP_ANONYMOUS is specified, memory which is initially filled with zeroes
+ * into the address space of the calling process. Pages are only read from the file when they are
+ * accessed for the first time. If MAP_SHARED is specified, changes are written back to the file when
+ * the mapping is removed and the mapping is shared with child processes. Without MAP_FIXED, the
+ * argument addr is ignored
+ *
+ * Errors:
+ * EINVAL if len is zero, off is not a multiple of the page size or flags is not valid
+ * ENOMEM if there is not enough free space in the address space of the process
+ * EBADF if fildes is not a valid file descriptor
+ * EACCES if the file has not been opened for reading or PROT_WRITE and MAP_SHARED are requested
+ * for a file which has not been opened for reading and writing
+ * ENODEV if fildes does not refer to a regular file
+ *
+ * Returns:
+ * the address of the mapping upon success
+ * MAP_FAILED if an error occurred (then errno will be set)
+ */
+void* mmap(void* addr, size_t len, int prot, int flags, int fildes, off_t off) {
+    unsigned int rc = __ctOS_mmap(addr, len, prot, flags, fildes, off);
+    /*
+     * The last page of the address space is never part of the user area, so we
+     * can distinguish error codes from addresses
+     */
+    if (rc > (unsigned int) -4096) {
+        errno = -((int) rc);
+        return MAP_FAILED;
+    }
+    return (void*) rc;
+}
+
+/*
+ * Remove all mappings within the specified range of the address space of the calling process.
+ * Modified pages of shared file mappings are written back to the file
+ *
+ * Errors:
+ * EINVAL if addr is not a multiple of the page size or len is zero
+ * ENOMEM if a mapping needs to be split and no memory is available for this
+ *
+ * Returns:
+ * 0 upon success
+ * -1 if an error occurred (then errno will be set)
+ */
+int munmap(void* addr, size_t len) {
+    int rc = __ctOS_munmap(addr, len);
+    if (rc < 0) {
+        errno = -rc;
+        return -1;
+    }
+    return 0;
+}
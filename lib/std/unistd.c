@@ -684,11 +684,11 @@ int access(const char *path, int amode) {
 }
 
 /*
- * Sync file system. As currently, the file system does not maintain
- * any caches, this call does not do anything
+ * Sync file system, i.e. ask the kernel to write all modified
+ * blocks in the block cache back to disk
  */
 void sync() {
-
+    __ctOS_sync();
 }
 
 /*
@@ -783,9 +783,24 @@ int ftruncate(int fildes, off_t length) {
 }
 
 /*
- * Write buffered contents for a file to disk. As ctOS does not support buffering on the file 
- * system level, this function does nothing
+ * Write buffered contents for a file to disk. As the block cache does not keep track
+ * of the file to which a block belongs, this will write back all modified blocks on
+ * the device on which the file is located
+ *
+ * Errors:
+ * EBADF if the file descriptor is not valid
+ * EINVAL if the file descriptor does not refer to a file
+ * EIO if an IO error occurred
+ *
+ * Returns:
+ * 0 upon success
+ * -1 if an error occurred (then errno will be set)
  */
 int fsync(int fildes) {
+    int rc = __ctOS_fsync(fildes);
+    if (rc < 0) {
+        errno = -rc;
+        return -1;
+    }
     return 0;
 }
\ No newline at end of file
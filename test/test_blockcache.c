@@ -1,9 +1,10 @@
 /*
- * test_fs_ext2.c
+ * test_blockcache.c
  */
 
 #include "kunit.h"
 #include "fs_ext2.h"
+#include "blockcache.h"
 #include "drivers.h"
 #include "mm.h"
 #include "dm.h"
@@ -43,26 +44,41 @@ void trap() {
 
 }
 
+/*
+ * Stubs for locking functions. The semaphore stubs keep track of the
+ * value so that we detect a thread trying to acquire a mutex twice
+ */
 void sem_init(semaphore_t* sem, u32 value) {
-
+    sem->value = value;
 }
 void sem_up(semaphore_t* sem) {
-
+    sem->value++;
+}
+void mutex_up(semaphore_t* sem) {
+    sem->value = 1;
 }
 void __sem_down(semaphore_t* sem, char* file, int line) {
-
+    if (0 == sem->value) {
+        printf("Deadlock: semaphore already taken at %s@%d\n", file, line);
+        _exit(1);
+    }
+    sem->value--;
 }
 
 void spinlock_get(spinlock_t* spinlock, u32* eflags) {
-
+    if (*spinlock) {
+        printf("Deadlock: spinlock already taken\n");
+        _exit(1);
+    }
+    *spinlock = 1;
 }
 
 void spinlock_release(spinlock_t* spinlock, u32* eflags) {
-
+    *spinlock = 0;
 }
 
 void spinlock_init(spinlock_t* spinlock) {
-
+    *spinlock = 0;
 }
 
 void* kmalloc_aligned(u32 size, u32 alignment) {
@@ -72,12 +88,16 @@ void* kmalloc_aligned(u32 size, u32 alignment) {
 /*
  * Stub for read from device
  */
+static int device_reads = 0;
 ssize_t my_read(minor_dev_t minor, ssize_t blocks, ssize_t first_block, void* buffer) {
+    device_reads++;
     memcpy(buffer, image+first_block*1024, blocks*1024 );
     return blocks;
 }
 
+static int device_writes = 0;
 ssize_t my_write(minor_dev_t minor, ssize_t blocks, ssize_t first_block, void* buffer) {
+    device_writes++;
     memcpy(image+first_block*1024, buffer, blocks*1024 );
     return blocks;
 }
@@ -101,12 +121,28 @@ void kfree(void* addr) {
     free(addr);
 }
 
+/*
+ * Stubs for params_get_int and the system call interface. The
+ * parameter bc_writeback is taken from the variable write_back
+ */
+static int write_back = 0;
+unsigned int params_get_int(char* param) {
+    if (0 == strcmp(param, "bc_writeback"))
+        return write_back;
+    return 0;
+}
+
+unsigned int __ctOS_syscall(unsigned int __sysno, int argc, ...) {
+    return 1;
+}
+
 /*
  * Set up test image in memory
  */
 void setup() {
     image = (void*) malloc(TEST_IMAGE_SIZE);
     memset((void*) image, 0xee, TEST_IMAGE_SIZE);
+    bc_init();
 }
 
 
@@ -115,6 +151,8 @@ void setup() {
  */
 void reset() {
     memset((void*) image, 0xee, TEST_IMAGE_SIZE);
+    bc_invalidate(0);
+    bc_invalidate(DEVICE(MAJOR_RAMDISK, 0));
 }
 
 /*
@@ -357,6 +395,320 @@ int testcase9() {
     return 0;
 }
 
+/*
+ * Testcase 10:
+ * Tested function: bc_read_bytes
+ * Testcase: read the same block twice and verify that the second read
+ * is served from the cache
+ */
+int testcase10() {
+    u8 buffer[1024];
+    bc_stats_t before;
+    bc_stats_t after;
+    int reads;
+    reset();
+    bc_get_stats(&before);
+    reads = device_reads;
+    ASSERT(0 == bc_read_bytes(5, 1024, buffer, 0, 0));
+    ASSERT(reads + 1 == device_reads);
+    ASSERT(0 == bc_read_bytes(5, 100, buffer, 0, 10));
+    ASSERT(reads + 1 == device_reads);
+    bc_get_stats(&after);
+    ASSERT(after.misses == before.misses + 1);
+    ASSERT(after.hits == before.hits + 1);
+    return 0;
+}
+
+/*
+ * Testcase 11:
+ * Tested function: bc_write_bytes
+ * Testcase: a write updates the cached copy of a block as well as the device
+ */
+int testcase11() {
+    u8 buffer[1024];
+    u8 write_buffer[10];
+    int i;
+    int reads;
+    reset();
+    memset((void*) write_buffer, 0x11, 10);
+    ASSERT(0 == bc_read_bytes(7, 1024, buffer, 0, 0));
+    reads = device_reads;
+    ASSERT(0 == bc_write_bytes(7, 10, write_buffer, 0, 100));
+    for (i = 0; i < 10; i++)
+        ASSERT(((u8*) image)[7*1024 + 100 + i] == 0x11);
+    ASSERT(0 == bc_read_bytes(7, 1024, buffer, 0, 0));
+    for (i = 100; i < 110; i++)
+        ASSERT(buffer[i] == 0x11);
+    ASSERT(buffer[99] == 0xee);
+    ASSERT(buffer[110] == 0xee);
+    ASSERT(reads == device_reads);
+    reset();
+    return 0;
+}
+
+/*
+ * Testcase 12:
+ * Tested function: bc_read_bytes
+ * Testcase: read more blocks than the cache can hold and verify that buffers
+ * are evicted and reused
+ */
+int testcase12() {
+    u8 buffer[16];
+    bc_stats_t before;
+    bc_stats_t after;
+    int i;
+    int reads;
+    reset();
+    bc_get_stats(&before);
+    for (i = 0; i < BC_MAX_BUFFERS + 10; i++) {
+        ASSERT(0 == bc_read_bytes(i + 100, 16, buffer, 0, 0));
+    }
+    bc_get_stats(&after);
+    ASSERT(after.buffers == BC_MAX_BUFFERS);
+    ASSERT(after.evictions >= before.evictions + 10);
+    /*
+     * The first block we have read should have been evicted, the
+     * last block should still be there
+     */
+    reads = device_reads;
+    ASSERT(0 == bc_read_bytes(BC_MAX_BUFFERS + 109, 16, buffer, 0, 0));
+    ASSERT(reads == device_reads);
+    ASSERT(0 == bc_read_bytes(100, 16, buffer, 0, 0));
+    ASSERT(reads + 1 == device_reads);
+    reset();
+    return 0;
+}
+
+/*
+ * Testcase 13:
+ * Tested function: bc_invalidate
+ * Testcase: invalidate the cache for a device and verify that the next read goes to the device
+ */
+int testcase13() {
+    u8 buffer[16];
+    int reads;
+    reset();
+    ASSERT(0 == bc_read_bytes(3, 16, buffer, 0, 0));
+    ((u8*) image)[3*1024] = 0x22;
+    reads = device_reads;
+    ASSERT(0 == bc_read_bytes(3, 16, buffer, 0, 0));
+    ASSERT(reads == device_reads);
+    ASSERT(buffer[0] == 0xee);
+    bc_invalidate(0);
+    ASSERT(0 == bc_read_bytes(3, 16, buffer, 0, 0));
+    ASSERT(reads + 1 == device_reads);
+    ASSERT(buffer[0] == 0x22);
+    reset();
+    return 0;
+}
+
+/*
+ * Testcase 14:
+ * Tested functions: bc_write_bytes, bc_sync
+ * Testcase: in write-back mode, a write only goes to the cache until bc_sync is called
+ */
+int testcase14() {
+    u8 write_buffer[10];
+    u8 read_buffer[10];
+    bc_stats_t stats;
+    int i;
+    write_back = 1;
+    bc_init();
+    memset((void*) write_buffer, 0x33, 10);
+    ASSERT(0 == bc_write_bytes(20, 10, write_buffer, 0, 5));
+    ASSERT(((u8*) image)[20*1024 + 5] == 0xee);
+    ASSERT(0 == bc_read_bytes(20, 10, read_buffer, 0, 5));
+    for (i = 0; i < 10; i++)
+        ASSERT(read_buffer[i] == 0x33);
+    bc_get_stats(&stats);
+    ASSERT(1 == stats.dirty);
+    ASSERT(0 == stats.flushed);
+    /*
+     * A second write to the same block does not create a second
+     * dirty buffer
+     */
+    ASSERT(0 == bc_write_bytes(20, 1, write_buffer, 0, 0));
+    bc_get_stats(&stats);
+    ASSERT(1 == stats.dirty);
+    /*
+     * Sync for a different device should not touch the block
+     */
+    ASSERT(0 == bc_sync(1));
+    ASSERT(((u8*) image)[20*1024 + 5] == 0xee);
+    ASSERT(0 == bc_sync(0));
+    for (i = 0; i < 10; i++)
+        ASSERT(((u8*) image)[20*1024 + 5 + i] == 0x33);
+    ASSERT(((u8*) image)[20*1024] == 0x33);
+    ASSERT(((u8*) image)[20*1024 + 1] == 0xee);
+    bc_get_stats(&stats);
+    ASSERT(0 == stats.dirty);
+    ASSERT(1 == stats.flushed);
+    write_back = 0;
+    bc_init();
+    reset();
+    return 0;
+}
+
+/*
+ * Testcase 15:
+ * Tested functions: bc_write_bytes
+ * Testcase: in write-back mode, the cache is flushed if the number of dirty buffers
+ * exceeds the threshold and the flusher thread is not running
+ */
+int testcase15() {
+    u8 write_buffer[10];
+    bc_stats_t stats;
+    int i;
+    write_back = 1;
+    bc_init();
+    memset((void*) write_buffer, 0x44, 10);
+    for (i = 0; i < BC_DIRTY_THRESHOLD; i++) {
+        ASSERT(0 == bc_write_bytes(i + 100, 10, write_buffer, 0, 0));
+    }
+    bc_get_stats(&stats);
+    ASSERT(BC_DIRTY_THRESHOLD == stats.dirty);
+    ASSERT(((u8*) image)[100*1024] == 0xee);
+    ASSERT(0 == bc_write_bytes(BC_DIRTY_THRESHOLD + 100, 10, write_buffer, 0, 0));
+    bc_get_stats(&stats);
+    ASSERT(0 == stats.dirty);
+    for (i = 0; i <= BC_DIRTY_THRESHOLD; i++) {
+        ASSERT(((u8*) image)[(i + 100)*1024] == 0x44);
+    }
+    write_back = 0;
+    bc_init();
+    reset();
+    return 0;
+}
+
+/*
+ * Testcase 16:
+ * Tested functions: bc_read_bytes, bc_write_bytes
+ * Testcase: in write-back mode, dirty buffers are not evicted from the cache
+ */
+int testcase16() {
+    u8 write_buffer[10];
+    u8 read_buffer[10];
+    int i;
+    write_back = 1;
+    bc_init();
+    memset((void*) write_buffer, 0x55, 10);
+    ASSERT(0 == bc_write_bytes(30, 10, write_buffer, 0, 0));
+    for (i = 0; i < BC_MAX_BUFFERS + 10; i++) {
+        ASSERT(0 == bc_read_bytes(i + 100, 10, read_buffer, 0, 0));
+    }
+    ASSERT(((u8*) image)[30*1024] == 0xee);
+    ASSERT(0 == bc_read_bytes(30, 10, read_buffer, 0, 0));
+    for (i = 0; i < 10; i++)
+        ASSERT(read_buffer[i] == 0x55);
+    ASSERT(0 == bc_sync(DEVICE_NONE));
+    ASSERT(((u8*) image)[30*1024] == 0x55);
+    write_back = 0;
+    bc_init();
+    reset();
+    return 0;
+}
+
+/*
+ * Testcase 17:
+ * Tested functions: bc_prefetch, bc_ra_window_limit
+ * Testcase: as long as the read-ahead thread is not running, read-ahead requests are ignored
+ * and the read-ahead window is not limited
+ */
+int testcase17() {
+    int reads;
+    bc_stats_t stats;
+    reset();
+    reads = device_reads;
+    bc_prefetch(0, 40);
+    ASSERT(reads == device_reads);
+    bc_get_stats(&stats);
+    ASSERT(0 == stats.ra_reads);
+    ASSERT(BC_RA_MAX_WINDOW == bc_ra_window_limit());
+    return 0;
+}
+
+/*
+ * Testcase 18:
+ * Tested functions: bc_read_bytes
+ * Testcase: consecutive blocks which are not cached are read with one request
+ * per run, cached blocks in between split the run
+ */
+int testcase18() {
+    u8 buffer[10*1024];
+    int reads;
+    int i;
+    reset();
+    for (i = 0; i < 10; i++)
+        memset(((u8*) image) + (50 + i)*1024, i, 1024);
+    reads = device_reads;
+    ASSERT(0 == bc_read_bytes(50, 8*1024, buffer, 0, 512));
+    ASSERT(reads + 1 == device_reads);
+    for (i = 0; i < 8*1024; i++)
+        ASSERT(buffer[i] == (i + 512) / 1024);
+    bc_invalidate(0);
+    ASSERT(0 == bc_read_bytes(54, 10, buffer, 0, 0));
+    reads = device_reads;
+    ASSERT(0 == bc_read_bytes(50, 10*1024, buffer, 0, 0));
+    ASSERT(reads + 2 == device_reads);
+    for (i = 0; i < 10*1024; i++)
+        ASSERT(buffer[i] == i / 1024);
+    reset();
+    return 0;
+}
+
+/*
+ * Testcase 19:
+ * Tested functions: bc_write_bytes
+ * Testcase: in write-through mode, a write spanning several blocks is written
+ * to the device with one request
+ */
+int testcase19() {
+    u8 buffer[4*1024];
+    int writes;
+    int i;
+    reset();
+    memset((void*) buffer, 0x66, 4*1024);
+    writes = device_writes;
+    ASSERT(0 == bc_write_bytes(60, 4*1024, buffer, 0, 0));
+    ASSERT(writes + 1 == device_writes);
+    for (i = 0; i < 4*1024; i++)
+        ASSERT(((u8*) image)[60*1024 + i] == 0x66);
+    ASSERT(((u8*) image)[64*1024] == 0xee);
+    reset();
+    return 0;
+}
+
+/*
+ * Testcase 20:
+ * Tested functions: bc_write_bytes, bc_sync
+ * Testcase: in write-back mode, consecutive dirty blocks are flushed with one request
+ */
+int testcase20() {
+    u8 buffer[1024];
+    bc_stats_t stats;
+    int writes;
+    int i;
+    write_back = 1;
+    bc_init();
+    memset((void*) buffer, 0x77, 1024);
+    for (i = 0; i < 4; i++)
+        ASSERT(0 == bc_write_bytes(70 + i, 1024, buffer, 0, 0));
+    ASSERT(0 == bc_write_bytes(80, 1024, buffer, 0, 0));
+    writes = device_writes;
+    ASSERT(0 == bc_sync(0));
+    ASSERT(writes + 2 == device_writes);
+    for (i = 0; i < 4*1024; i++)
+        ASSERT(((u8*) image)[70*1024 + i] == 0x77);
+    ASSERT(((u8*) image)[80*1024] == 0x77);
+    bc_get_stats(&stats);
+    ASSERT(0 == stats.dirty);
+    ASSERT(5 == stats.flushed);
+    write_back = 0;
+    bc_init();
+    reset();
+    return 0;
+}
+
 int main() {
     INIT;
     setup();
@@ -369,6 +721,17 @@ int main() {
     RUN_CASE(7);
     RUN_CASE(8);
     RUN_CASE(9);
+    RUN_CASE(10);
+    RUN_CASE(11);
+    RUN_CASE(12);
+    RUN_CASE(13);
+    RUN_CASE(14);
+    RUN_CASE(15);
+    RUN_CASE(16);
+    RUN_CASE(17);
+    RUN_CASE(18);
+    RUN_CASE(19);
+    RUN_CASE(20);
     END;
 }
 
@@ -0,0 +1,274 @@
+/*
+ * test_dcache.c
+ */
+
+#include "kunit.h"
+#include "dcache.h"
+#include "vga.h"
+#include <stdio.h>
+
+void win_putchar(win_t* win, u8 c) {
+    printf("%c", c);
+}
+
+void trap() {
+
+}
+
+/*
+ * Stubs for locking functions
+ */
+void spinlock_get(spinlock_t* spinlock, u32* eflags) {
+    if (*spinlock) {
+        printf("Deadlock: spinlock already taken\n");
+        _exit(1);
+    }
+    *spinlock = 1;
+}
+
+void spinlock_release(spinlock_t* spinlock, u32* eflags) {
+    *spinlock = 0;
+}
+
+void spinlock_init(spinlock_t* spinlock) {
+    *spinlock = 0;
+}
+
+/*
+ * Testcase 1
+ * Tested function: dcache_lookup
+ * Testcase: lookup in an empty cache returns 0
+ */
+int testcase1() {
+    ino_t inode_nr;
+    dcache_init();
+    ASSERT(0 == dcache_lookup(1, 2, "test", 4, &inode_nr));
+    return 0;
+}
+
+/*
+ * Testcase 2
+ * Tested function: dcache_enter
+ * Testcase: add an entry and look it up again
+ */
+int testcase2() {
+    ino_t inode_nr = 0;
+    dcache_stats_t stats;
+    dcache_init();
+    dcache_enter(1, 2, "test", 4, 13);
+    ASSERT(1 == dcache_lookup(1, 2, "test", 4, &inode_nr));
+    ASSERT(13 == inode_nr);
+    dcache_get_stats(&stats);
+    ASSERT(1 == stats.hits);
+    ASSERT(1 == stats.entries);
+    return 0;
+}
+
+/*
+ * Testcase 3
+ * Tested function: dcache_lookup
+ * Testcase: names are compared with their full length and entries in other
+ * directories or on other devices are not found
+ */
+int testcase3() {
+    ino_t inode_nr = 0;
+    dcache_init();
+    dcache_enter(1, 2, "test", 4, 13);
+    ASSERT(0 == dcache_lookup(1, 2, "tes", 3, &inode_nr));
+    ASSERT(0 == dcache_lookup(1, 2, "testx", 5, &inode_nr));
+    ASSERT(0 == dcache_lookup(1, 3, "test", 4, &inode_nr));
+    ASSERT(0 == dcache_lookup(2, 2, "test", 4, &inode_nr));
+    /*
+     * The name does not need to be null terminated
+     */
+    ASSERT(1 == dcache_lookup(1, 2, "test/abc", 4, &inode_nr));
+    ASSERT(13 == inode_nr);
+    return 0;
+}
+
+/*
+ * Testcase 4
+ * Tested function: dcache_enter
+ * Testcase: add a negative entry
+ */
+int testcase4() {
+    ino_t inode_nr = 1;
+    dcache_stats_t stats;
+    dcache_init();
+    dcache_enter(1, 2, "test", 4, 0);
+    ASSERT(1 == dcache_lookup(1, 2, "test", 4, &inode_nr));
+    ASSERT(0 == inode_nr);
+    dcache_get_stats(&stats);
+    ASSERT(0 == stats.hits);
+    ASSERT(1 == stats.negative_hits);
+    return 0;
+}
+
+/*
+ * Testcase 5
+ * Tested function: dcache_enter
+ * Testcase: update an existing entry
+ */
+int testcase5() {
+    ino_t inode_nr = 0;
+    dcache_stats_t stats;
+    dcache_init();
+    dcache_enter(1, 2, "test", 4, 0);
+    dcache_enter(1, 2, "test", 4, 17);
+    ASSERT(1 == dcache_lookup(1, 2, "test", 4, &inode_nr));
+    ASSERT(17 == inode_nr);
+    dcache_get_stats(&stats);
+    ASSERT(1 == stats.entries);
+    return 0;
+}
+
+/*
+ * Testcase 6
+ * Tested function: dcache_remove
+ * Testcase: remove an entry
+ */
+int testcase6() {
+    ino_t inode_nr = 0;
+    dcache_stats_t stats;
+    dcache_init();
+    dcache_enter(1, 2, "test", 4, 13);
+    dcache_enter(1, 2, "other", 5, 14);
+    dcache_remove(1, 2, "test", 4);
+    ASSERT(0 == dcache_lookup(1, 2, "test", 4, &inode_nr));
+    ASSERT(1 == dcache_lookup(1, 2, "other", 5, &inode_nr));
+    ASSERT(14 == inode_nr);
+    dcache_get_stats(&stats);
+    ASSERT(1 == stats.entries);
+    return 0;
+}
+
+/*
+ * Testcase 7
+ * Tested function: dcache_enter
+ * Testcase: names longer than DCACHE_NAME_LEN are not cached
+ */
+int testcase7() {
+    ino_t inode_nr = 0;
+    char name[DCACHE_NAME_LEN + 1];
+    memset(name, 'a', DCACHE_NAME_LEN + 1);
+    dcache_init();
+    dcache_enter(1, 2, name, DCACHE_NAME_LEN + 1, 13);
+    ASSERT(0 == dcache_lookup(1, 2, name, DCACHE_NAME_LEN + 1, &inode_nr));
+    dcache_enter(1, 2, name, DCACHE_NAME_LEN, 13);
+    ASSERT(1 == dcache_lookup(1, 2, name, DCACHE_NAME_LEN, &inode_nr));
+    return 0;
+}
+
+/*
+ * Testcase 8
+ * Tested function: dcache_purge
+ * Testcase: remove all entries for a directory
+ */
+int testcase8() {
+    ino_t inode_nr = 0;
+    dcache_init();
+    dcache_enter(1, 2, "a", 1, 13);
+    dcache_enter(1, 2, "b", 1, 14);
+    dcache_enter(1, 3, "a", 1, 15);
+    dcache_enter(2, 2, "a", 1, 16);
+    dcache_purge(1, 2);
+    ASSERT(0 == dcache_lookup(1, 2, "a", 1, &inode_nr));
+    ASSERT(0 == dcache_lookup(1, 2, "b", 1, &inode_nr));
+    ASSERT(1 == dcache_lookup(1, 3, "a", 1, &inode_nr));
+    ASSERT(15 == inode_nr);
+    ASSERT(1 == dcache_lookup(2, 2, "a", 1, &inode_nr));
+    ASSERT(16 == inode_nr);
+    return 0;
+}
+
+/*
+ * Testcase 9
+ * Tested function: dcache_purge_dev
+ * Testcase: remove all entries for a device
+ */
+int testcase9() {
+    ino_t inode_nr = 0;
+    dcache_stats_t stats;
+    dcache_init();
+    dcache_enter(1, 2, "a", 1, 13);
+    dcache_enter(1, 3, "b", 1, 14);
+    dcache_enter(2, 2, "a", 1, 16);
+    dcache_purge_dev(1);
+    ASSERT(0 == dcache_lookup(1, 2, "a", 1, &inode_nr));
+    ASSERT(0 == dcache_lookup(1, 3, "b", 1, &inode_nr));
+    ASSERT(1 == dcache_lookup(2, 2, "a", 1, &inode_nr));
+    dcache_get_stats(&stats);
+    ASSERT(1 == stats.entries);
+    return 0;
+}
+
+/*
+ * Testcase 10
+ * Tested function: dcache_enter
+ * Testcase: when the cache is full, the least recently used entry is replaced
+ */
+int testcase10() {
+    ino_t inode_nr = 0;
+    dcache_stats_t stats;
+    char name[16];
+    int i;
+    dcache_init();
+    for (i = 0; i < DCACHE_ENTRIES; i++) {
+        sprintf(name, "f%d", i);
+        dcache_enter(1, 2, name, strlen(name), i + 1);
+    }
+    /*
+     * Use entry f0 so that f1 is now the least recently used entry
+     */
+    ASSERT(1 == dcache_lookup(1, 2, "f0", 2, &inode_nr));
+    dcache_enter(1, 2, "new", 3, 5000);
+    ASSERT(1 == dcache_lookup(1, 2, "f0", 2, &inode_nr));
+    ASSERT(1 == inode_nr);
+    ASSERT(0 == dcache_lookup(1, 2, "f1", 2, &inode_nr));
+    ASSERT(1 == dcache_lookup(1, 2, "new", 3, &inode_nr));
+    ASSERT(5000 == inode_nr);
+    dcache_get_stats(&stats);
+    ASSERT(DCACHE_ENTRIES == stats.entries);
+    return 0;
+}
+
+/*
+ * Testcase 11
+ * Tested function: dcache_enter
+ * Testcase: entries which have been removed are reused first
+ */
+int testcase11() {
+    ino_t inode_nr = 0;
+    char name[16];
+    int i;
+    dcache_init();
+    for (i = 0; i < DCACHE_ENTRIES; i++) {
+        sprintf(name, "f%d", i);
+        dcache_enter(1, 2, name, strlen(name), i + 1);
+    }
+    dcache_remove(1, 2, "f10", 3);
+    dcache_enter(1, 2, "new", 3, 5000);
+    /*
+     * f0 is still the least recently used entry, but should not have been replaced
+     */
+    ASSERT(1 == dcache_lookup(1, 2, "f0", 2, &inode_nr));
+    ASSERT(1 == inode_nr);
+    ASSERT(1 == dcache_lookup(1, 2, "new", 3, &inode_nr));
+    return 0;
+}
+
+int main() {
+    INIT;
+    RUN_CASE(1);
+    RUN_CASE(2);
+    RUN_CASE(3);
+    RUN_CASE(4);
+    RUN_CASE(5);
+    RUN_CASE(6);
+    RUN_CASE(7);
+    RUN_CASE(8);
+    RUN_CASE(9);
+    RUN_CASE(10);
+    RUN_CASE(11);
+    END;
+}
@@ -19,6 +19,7 @@
 
 #include "kunit.h"
 #include "fs.h"
+#include "pagecache.h"
 #include "vga.h"
 #include "locks.h"
 #include "pm.h"
@@ -489,6 +490,37 @@ char_dev_ops_t* dm_get_char_dev_ops(major_dev_t major) {
     return 0;
 }
 
+/*
+ * Stubs for the page cache
+ */
+void pc_init() {
+
+}
+
+ssize_t pc_read(inode_t* inode, off_t offset, ssize_t bytes, void* buffer) {
+    return inode->iops->inode_read(inode, bytes, offset, buffer);
+}
+
+pc_page_t* pc_get_page(inode_t* inode, u32 index) {
+    return 0;
+}
+
+void pc_update(inode_t* inode, off_t offset, ssize_t bytes, void* data) {
+
+}
+
+void pc_truncate(dev_t dev, ino_t inode_nr, off_t size) {
+
+}
+
+void pc_purge(dev_t dev, ino_t inode_nr) {
+
+}
+
+void pc_purge_dev(dev_t dev) {
+
+}
+
 /*
  * Stub for kmalloc/kfree
  */
@@ -727,6 +759,17 @@ int bc_open(dev_t dev) {
     return 0;
 }
 
+int bc_sync(dev_t dev) {
+    return 0;
+}
+
+void bc_invalidate(dev_t dev) {
+}
+
+u32 bc_ra_window_limit() {
+    return 0;
+}
+
 /*
  * Common setup function
  */
@@ -22,6 +22,7 @@
 #include "blockcache.h"
 #include "locks.h"
 #include "sys/stat.h"
+#include "kmem.h"
 #include <stdio.h>
 
 extern int __ext2_loglevel;
@@ -183,6 +184,29 @@ void kfree(void* addr) {
     free(addr);
 }
 
+/*
+ * Stubs for object caches
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    return malloc(cache->object_size);
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* object) {
+    free(object);
+}
+
+/*
+ * Stubs for params_get_int and the system call interface
+ * used by the block cache
+ */
+unsigned int params_get_int(char* param) {
+    return 0;
+}
+
+unsigned int __ctOS_syscall(unsigned int __sysno, int argc, ...) {
+    return 1;
+}
+
 void mutex_up(semaphore_t* mutex) {
 
 }
@@ -206,6 +230,10 @@ void reset() {
     }
     read(fd, image, TEST_IMAGE_SIZE);
     close(fd);
+    /*
+     * Make sure that the block cache does not return stale data
+     */
+    bc_invalidate(DEVICE(MAJOR_RAMDISK, 0));
 }
 
 /*
@@ -213,6 +241,7 @@ void reset() {
  */
 void setup() {
     int fd;
+    bc_init();
     bc_read = bc_read_stub;
     bc_write = bc_write_stub;
     ops.open = bc_oc_stub;
@@ -269,9 +298,13 @@ static int is_block_allocated(ext2_metadata_t* ext2_meta, u32 block_nr) {
         return -1;
     }
     /*
-     * Get entry in block group descriptor table and read block bitmap into
-     * memory
+     * Write back the cached bitmaps, then get entry in block group descriptor table and
+     * read block bitmap into memory
      */
+    if (fs_ext2_sync(ext2_meta->super)) {
+        printf("Could not write back bitmaps\n");
+        return -1;
+    }
     bgd = ext2_meta->bgdt+block_group_nr;
     if (bc_read_bytes(bgd->bg_block_bitmap, 1024, (void*) block_bitmap, ext2_meta->device, 0)) {
         printf("Could not read block bitmap from disk\n");
@@ -1312,38 +1345,48 @@ int testcase31() {
 /*
  * Testcase 32
  * Tested function: fs_ext2_inode_release
- * Testcase: get inode, then call release on it and check that cache is empty
+ * Testcase: get inode, then call release on it and check that the inode is kept in the cache
+ * with reference count zero and is reused when the inode is requested again
  */
 int testcase32() {
     superblock_t* super;
     inode_t* test;
+    inode_t* again;
     ext2_metadata_t* meta;
+    ext2_inode_data_t* idata;
+    int ref_count;
     fs_ext2_init();
     super = fs_ext2_get_superblock(DEVICE(MAJOR_RAMDISK, 0));
     ASSERT(super);
     meta = (ext2_metadata_t*) super->data;
     ASSERT(meta);
-    /*
-     * Cache should be empty at this point
-     */
-    ASSERT(0==meta->inodes_head);
+    ref_count = meta->reference_count;
     /*
      * Now get test inode
      */
     test = fs_ext2_get_inode(DEVICE(MAJOR_RAMDISK, 0), TEST_INODE);
     ASSERT(test);
-    ASSERT(1==((ext2_inode_data_t*)(test->data))->reference_count);
+    idata = (ext2_inode_data_t*) test->data;
+    ASSERT(1==idata->reference_count);
+    ASSERT(0==idata->on_lru);
+    ASSERT(ref_count + 1 == meta->reference_count);
     /*
-     * Now we should have one item in the list
-     */
-    ASSERT(meta->inodes_head);
-    ASSERT(0==meta->inodes_head->next);
-    /*
-     * Release inode - we should now have the same state as
-     * before calling fs_ext2_get_inode for test
+     * Release inode - the inode should now be on the LRU list
+     * and the reference to the superblock should be dropped
      */
     fs_ext2_inode_release(test);
-    ASSERT(0==meta->inodes_head);
+    ASSERT(0==idata->reference_count);
+    ASSERT(1==idata->on_lru);
+    ASSERT(idata==meta->lru_tail);
+    ASSERT(ref_count == meta->reference_count);
+    /*
+     * Get inode again - this should be served from the cache
+     */
+    again = fs_ext2_get_inode(DEVICE(MAJOR_RAMDISK, 0), TEST_INODE);
+    ASSERT(again==test);
+    ASSERT(1==idata->reference_count);
+    ASSERT(0==idata->on_lru);
+    fs_ext2_inode_release(again);
     return 0;
 }
 
@@ -3957,6 +4000,215 @@ int testcase87() {
     return 0;
 }
 
+/*
+ * Testcase 88
+ * Tested function: fs_ext2_next_direntry
+ * Testcase: walk the root directory using a cursor and verify that the same entries
+ * are returned as by fs_ext2_get_direntry
+ */
+int testcase88() {
+    superblock_t* super;
+    direntry_t direntry;
+    direntry_t by_index;
+    inode_t* root;
+    off_t offset = 0;
+    off_t last = 0;
+    int index = 0;
+    fs_ext2_init();
+    super = fs_ext2_get_superblock(DEVICE(MAJOR_RAMDISK, 0));
+    ASSERT(super);
+    root = super->get_inode(super->device, super->root);
+    ASSERT(root);
+    ASSERT(root->iops->inode_next_direntry);
+    while (0 == fs_ext2_next_direntry(root, &offset, &direntry)) {
+        ASSERT(offset > last);
+        last = offset;
+        ASSERT(0 == fs_ext2_get_direntry(root, index, &by_index));
+        ASSERT(by_index.inode_nr == direntry.inode_nr);
+        ASSERT(0 == strcmp(by_index.name, direntry.name));
+        index++;
+    }
+    ASSERT(index > 2);
+    ASSERT(0 != fs_ext2_get_direntry(root, index, &by_index));
+    ASSERT(-1 == fs_ext2_next_direntry(root, &offset, &direntry));
+    return 0;
+}
+
+/*
+ * Testcase 89
+ * Tested function: fs_ext2_dx_hash
+ * Testcase: verify hash values against values computed by debugfs (dx_hash) for all hash versions
+ */
+int testcase89() {
+    char* long_name = "file_with_a_longer_name_12345_and_even_longer_than_32_bytes";
+    ASSERT(0x32252546 == fs_ext2_dx_hash("hello", 5, EXT2_HASH_LEGACY, 0));
+    ASSERT(0x17c2ce3c == fs_ext2_dx_hash(long_name, strlen(long_name), EXT2_HASH_LEGACY, 0));
+    ASSERT(0x1746da32 == fs_ext2_dx_hash("hello", 5, EXT2_HASH_HALF_MD4, 0));
+    ASSERT(0xa4454fee == fs_ext2_dx_hash(long_name, strlen(long_name), EXT2_HASH_HALF_MD4, 0));
+    ASSERT(0x6f5bb1a8 == fs_ext2_dx_hash("hello", 5, EXT2_HASH_TEA, 0));
+    ASSERT(0xf63ad85c == fs_ext2_dx_hash(long_name, strlen(long_name), EXT2_HASH_TEA, 0));
+    /*
+     * For plain ASCII names, signed and unsigned hashes are the same
+     */
+    ASSERT(fs_ext2_dx_hash("hello", 5, EXT2_HASH_HALF_MD4_UNSIGNED, 0) == fs_ext2_dx_hash("hello", 5, EXT2_HASH_HALF_MD4, 0));
+    return 0;
+}
+
+/*
+ * Testcase 90
+ * Tested functions: fs_ext2_create_inode, fs_ext2_lookup, fs_ext2_unlink_inode
+ * Testcase: enable the directory index feature and create a large directory. Verify that the directory
+ * is turned into an indexed directory and that all entries can be found before and after removing some of them
+ */
+int testcase90() {
+    superblock_t* super;
+    ext2_metadata_t* meta;
+    inode_t* root;
+    inode_t* dir;
+    inode_t* inode;
+    ino_t inode_nr;
+    char name[64];
+    int i;
+    fs_ext2_init();
+    super = fs_ext2_get_superblock(DEVICE(MAJOR_RAMDISK, 0));
+    ASSERT(super);
+    meta = (ext2_metadata_t*) super->data;
+    meta->ext2_super->s_feature_compat |= EXT2_FEATURE_COMPAT_DIR_INDEX;
+    meta->ext2_super->s_def_hash_version = EXT2_HASH_HALF_MD4;
+    root = super->get_inode(super->device, super->root);
+    ASSERT(root);
+    dir = fs_ext2_create_inode(root, "htree", S_IFDIR | 0755);
+    ASSERT(dir);
+    for (i = 0; i < 2000; i++) {
+        sprintf(name, "entry_in_a_large_directory_%d", i);
+        inode = fs_ext2_create_inode(dir, name, S_IFREG | 0644);
+        ASSERT(inode);
+        fs_ext2_inode_release(inode);
+    }
+    ASSERT(((ext2_inode_data_t*) dir->data)->ext2_inode->i_flags & EXT2_INDEX_FL);
+    ASSERT(dir->size > BLOCK_SIZE);
+    for (i = 0; i < 2000; i++) {
+        sprintf(name, "entry_in_a_large_directory_%d", i);
+        ASSERT(0 == fs_ext2_lookup(dir, name, strlen(name), &inode_nr));
+    }
+    ASSERT(-1 == fs_ext2_lookup(dir, "entry_in_a_large_directory_", 27, &inode_nr));
+    for (i = 0; i < 2000; i += 2) {
+        sprintf(name, "entry_in_a_large_directory_%d", i);
+        ASSERT(0 == fs_ext2_unlink_inode(dir, name, 0));
+    }
+    for (i = 0; i < 2000; i++) {
+        sprintf(name, "entry_in_a_large_directory_%d", i);
+        ASSERT((i % 2 ? 0 : -1) == fs_ext2_lookup(dir, name, strlen(name), &inode_nr));
+    }
+    ASSERT(ENOENT == fs_ext2_unlink_inode(dir, "entry_in_a_large_directory_0", 0));
+    meta->ext2_super->s_feature_compat &= ~EXT2_FEATURE_COMPAT_DIR_INDEX;
+    fs_ext2_inode_release(dir);
+    fs_ext2_inode_release(root);
+    return 0;
+}
+
+/*
+ * Testcase 91
+ * Tested functions: fs_ext2_inode_write, fs_ext2_sync
+ * Testcase: write several blocks to a new file at once and verify that all blocks are allocated
+ * and marked as used in the block bitmap on disk once the bitmaps have been written back
+ */
+int testcase91() {
+    superblock_t* super;
+    ext2_metadata_t* meta;
+    ext2_inode_t* ext2_inode;
+    inode_t* root;
+    inode_t* inode;
+    u32 free_blocks;
+    char buffer[10 * 1024];
+    int i;
+    fs_ext2_init();
+    super = fs_ext2_get_superblock(DEVICE(MAJOR_RAMDISK, 0));
+    ASSERT(super);
+    ASSERT(super->sync);
+    meta = (ext2_metadata_t*) super->data;
+    root = super->get_inode(super->device, super->root);
+    ASSERT(root);
+    inode = fs_ext2_create_inode(root, "blockrun", S_IFREG | 0644);
+    ASSERT(inode);
+    ext2_inode = ((ext2_inode_data_t*) inode->data)->ext2_inode;
+    free_blocks = meta->ext2_super->s_free_blocks_count;
+    memset(buffer, 0xab, 10 * 1024);
+    ASSERT(10 * 1024 == fs_ext2_inode_write(inode, 10 * 1024, 0, buffer));
+    /*
+     * Blocks in the preallocation window of the inode are not free either
+     */
+    free_blocks -= ((ext2_inode_data_t*) inode->data)->prealloc_count;
+    ASSERT(free_blocks - 10 == meta->ext2_super->s_free_blocks_count);
+    ASSERT(20 == ext2_inode->i_blocks);
+    for (i = 0; i < 10; i++) {
+        ASSERT(ext2_inode->direct[i]);
+        ASSERT(1 == is_block_allocated(meta, ext2_inode->direct[i]));
+    }
+    ASSERT(0 == fs_ext2_inode_trunc(inode, 0));
+    ASSERT(free_blocks == meta->ext2_super->s_free_blocks_count);
+    fs_ext2_inode_release(inode);
+    ASSERT(0 == fs_ext2_unlink_inode(root, "blockrun", 0));
+    fs_ext2_inode_release(root);
+    return 0;
+}
+
+/*
+ * Testcase 92
+ * Tested functions: fs_ext2_inode_write, fs_ext2_inode_release
+ * Testcase: append to a file block by block and verify that the blocks are taken from the
+ * preallocation window of the inode and that the window is released with the last reference
+ */
+int testcase92() {
+    superblock_t* super;
+    ext2_metadata_t* meta;
+    ext2_inode_data_t* idata;
+    inode_t* root;
+    inode_t* inode;
+    u32 free_blocks;
+    u32 prealloc_block;
+    u32 prealloc_count;
+    char buffer[1024];
+    fs_ext2_init();
+    super = fs_ext2_get_superblock(DEVICE(MAJOR_RAMDISK, 0));
+    ASSERT(super);
+    meta = (ext2_metadata_t*) super->data;
+    root = super->get_inode(super->device, super->root);
+    ASSERT(root);
+    inode = fs_ext2_create_inode(root, "prealloc", S_IFREG | 0644);
+    ASSERT(inode);
+    idata = (ext2_inode_data_t*) inode->data;
+    ASSERT(0 == idata->prealloc_count);
+    free_blocks = meta->ext2_super->s_free_blocks_count;
+    memset(buffer, 0xcd, 1024);
+    ASSERT(1024 == fs_ext2_inode_write(inode, 1024, 0, buffer));
+    prealloc_block = idata->prealloc_block;
+    prealloc_count = idata->prealloc_count;
+    ASSERT(prealloc_count <= EXT2_PREALLOC_BLOCKS);
+    ASSERT(free_blocks - 1 - prealloc_count == meta->ext2_super->s_free_blocks_count);
+    if (prealloc_count) {
+        ASSERT(prealloc_block == idata->ext2_inode->direct[0] + 1);
+        ASSERT(1024 == fs_ext2_inode_write(inode, 1024, 1024, buffer));
+        ASSERT(prealloc_block == idata->ext2_inode->direct[1]);
+        ASSERT(prealloc_count - 1 == idata->prealloc_count);
+        ASSERT(1 == is_block_allocated(meta, idata->prealloc_block));
+    }
+    else {
+        ASSERT(1024 == fs_ext2_inode_write(inode, 1024, 1024, buffer));
+    }
+    /*
+     * Releasing the last reference returns the unused blocks
+     */
+    fs_ext2_inode_release(inode);
+    ASSERT(free_blocks - 2 == meta->ext2_super->s_free_blocks_count);
+    if (prealloc_count > 1)
+        ASSERT(0 == is_block_allocated(meta, prealloc_block + 1));
+    ASSERT(0 == fs_ext2_unlink_inode(root, "prealloc", 0));
+    ASSERT(free_blocks == meta->ext2_super->s_free_blocks_count);
+    fs_ext2_inode_release(root);
+    return 0;
+}
+
 int main() {
     INIT;
     setup();
@@ -4051,6 +4303,11 @@ int main() {
     RUN_CASE(85);
     RUN_CASE(86);
     RUN_CASE(87);
+    RUN_CASE(88);
+    RUN_CASE(89);
+    RUN_CASE(90);
+    RUN_CASE(91);
+    RUN_CASE(92);
     /*
      * Uncomment the following line to save a copy of the changed image back to disk as rdimage.new
      * for further analysis (for instance with fsck.ext2 -f -v)
@@ -42,6 +42,7 @@
 #include "lib/fcntl.h"
 #include "lib/sys/stat.h"
 #include "fs.h"
+#include "kmem.h"
 
 extern int __fs_loglevel;
 extern int __ext2_loglevel;
@@ -157,6 +158,17 @@ int net_socket_cancel_select(socket_t* socket, semaphore_t* sem) {
 void* kmalloc_aligned(u32 size, u32 alignment) {
     return 0;
 }
+
+/*
+ * Stubs for memory manager functions used by the page cache
+ */
+u32 mm_virt_to_phys(u32 virtual) {
+    return virtual;
+}
+
+int mm_phys_page_mapped(u32 page_base) {
+    return 0;
+}
 /*
  * Stubs for kmalloc/kfree
  */
@@ -167,6 +179,29 @@ void kfree(void* addr) {
     free(addr);
 }
 
+/*
+ * Stubs for object caches
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    return malloc(cache->object_size);
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* object) {
+    free(object);
+}
+
+/*
+ * Stubs for params_get_int and the system call interface
+ * used by the block cache
+ */
+unsigned int params_get_int(char* param) {
+    return 0;
+}
+
+unsigned int __ctOS_syscall(unsigned int __sysno, int argc, ...) {
+    return 1;
+}
+
 /*
  * Stub for kputchar
  * Set do_putchar to 1 to see inode
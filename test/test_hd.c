@@ -1,6 +1,7 @@
 #include "kunit.h"
 #include "hd.h"
 #include "vga.h"
+#include "kmem.h"
 #include <stdio.h>
 
 /*
@@ -71,6 +72,17 @@ void kfree(u32 addr) {
     free((void*) addr);
 }
 
+/*
+ * Stubs for object caches
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    return malloc(cache->object_size);
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* object) {
+    free(object);
+}
+
 
 /*
  * Utility function to initialize the queue
@@ -8,6 +8,8 @@
 #include "ktypes.h"
 #include "lib/os/heap.h"
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 static int extension_requested;
 static u32 new_top;
@@ -507,6 +509,131 @@ int testcase15() {
     return 0;
 }
 
+/*
+ * Testcase 16:
+ * Tested function: heap/__ctOS_heap_malloc, heap/__ctOS_heap_free
+ * Testcase: a freed chunk is reused by the next allocation of the same size and
+ * freed chunks are merged with their neighbours
+ */
+int testcase16() {
+    void* page;
+    heap_t heap;
+    void* a;
+    void* b;
+    void* c;
+    page = malloc(4096);
+    ASSERT(page);
+    ASSERT(0 == __ctOS_heap_init(&heap, (u32) page, (u32) page + 4095, 0));
+    heap.validate = 1;
+    a = __ctOS_heap_malloc(&heap, 100);
+    b = __ctOS_heap_malloc(&heap, 100);
+    c = __ctOS_heap_malloc(&heap, 100);
+    ASSERT(a);
+    ASSERT(b);
+    ASSERT(c);
+    __ctOS_heap_free(&heap, a);
+    __ctOS_heap_free(&heap, c);
+    ASSERT(a == __ctOS_heap_malloc(&heap, 100));
+    __ctOS_heap_free(&heap, a);
+    __ctOS_heap_free(&heap, b);
+    /*
+     * Now the entire heap should be one free chunk again
+     */
+    ASSERT(a == __ctOS_heap_malloc(&heap, 4096 - 2 * sizeof(heap_chunk_header_t) - 4));
+    free(page);
+    return 0;
+}
+
+/*
+ * Testcase 17:
+ * Tested function: heap/__ctOS_heap_malloc_aligned, heap/__ctOS_heap_free
+ * Testcase: run a random sequence of allocations and frees with validation turned on,
+ * check that the content of allocated memory is not overwritten and that in the end,
+ * all memory is merged into one chunk again
+ */
+int testcase17() {
+    void* page;
+    heap_t heap;
+    u8* ptr[64];
+    u32 size[64];
+    u32 i;
+    u32 j;
+    u32 slot;
+    u32 alignment;
+    page = malloc(65536);
+    ASSERT(page);
+    ASSERT(0 == __ctOS_heap_init(&heap, (u32) page, (u32) page + 65535, 0));
+    heap.validate = 1;
+    srand(17);
+    for (i = 0; i < 64; i++)
+        ptr[i] = 0;
+    for (i = 0; i < 2000; i++) {
+        slot = rand() % 64;
+        if (ptr[slot]) {
+            for (j = 0; j < size[slot]; j++)
+                ASSERT(ptr[slot][j] == (u8) slot);
+            __ctOS_heap_free(&heap, ptr[slot]);
+            ptr[slot] = 0;
+        }
+        else {
+            size[slot] = 1 + rand() % 700;
+            alignment = (rand() % 4) ? 4 : 1 + rand() % 64;
+            ptr[slot] = __ctOS_heap_malloc_aligned(&heap, size[slot], alignment);
+            ASSERT(ptr[slot]);
+            ASSERT(0 == ((u32) ptr[slot]) % alignment);
+            memset(ptr[slot], slot, size[slot]);
+        }
+    }
+    for (i = 0; i < 64; i++)
+        if (ptr[i])
+            __ctOS_heap_free(&heap, ptr[i]);
+    ASSERT(page + sizeof(heap_chunk_header_t) == __ctOS_heap_malloc(&heap, 65536 - 2 * sizeof(heap_chunk_header_t) - 4));
+    free(page);
+    return 0;
+}
+
+/*
+ * Testcase 18:
+ * Tested function: heap/__ctOS_heap_malloc, heap/__ctOS_heap_free
+ * Testcase: throughput benchmark - run a large number of random allocations and frees
+ * on a heap with many live objects and print the number of operations per second
+ */
+int testcase18() {
+    void* page;
+    heap_t heap;
+    void* ptr[1024];
+    u32 i;
+    u32 slot;
+    u32 ops = 0;
+    clock_t start;
+    clock_t elapsed;
+    page = malloc(4 * 1024 * 1024);
+    ASSERT(page);
+    ASSERT(0 == __ctOS_heap_init(&heap, (u32) page, (u32) page + 4 * 1024 * 1024 - 1, 0));
+    srand(18);
+    for (i = 0; i < 1024; i++)
+        ptr[i] = 0;
+    start = clock();
+    for (i = 0; i < 500000; i++) {
+        slot = rand() % 1024;
+        if (ptr[slot]) {
+            __ctOS_heap_free(&heap, ptr[slot]);
+            ptr[slot] = 0;
+        }
+        else {
+            ptr[slot] = __ctOS_heap_malloc(&heap, 8 + rand() % 2048);
+            ASSERT(ptr[slot]);
+        }
+        ops++;
+    }
+    elapsed = clock() - start;
+    elapsed = (elapsed / CLOCKS_PER_SEC) * 1000 + ((elapsed % CLOCKS_PER_SEC) * 1000) / CLOCKS_PER_SEC;
+    if (elapsed > 0)
+        printf("(%d operations in %d ms, %d operations per ms) ", ops, (int) elapsed, (int) (ops / elapsed));
+    free(page);
+    return 0;
+}
+
 int main() {
     INIT;
     RUN_CASE(1);
@@ -524,5 +651,8 @@ int main() {
     RUN_CASE(13);
     RUN_CASE(14);
     RUN_CASE(15);
+    RUN_CASE(16);
+    RUN_CASE(17);
+    RUN_CASE(18);
     END;
 }
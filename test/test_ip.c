@@ -11,6 +11,7 @@
 #include "ip.h"
 #include "lib/os/if.h"
 #include "kunit.h"
+#include "kmem.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -158,6 +159,17 @@ void kfree(u32 addr) {
     free((void*) addr);
 }
 
+/*
+ * Stubs for object caches
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    return malloc(cache->object_size);
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* object) {
+    free(object);
+}
+
 /*
  * Validate user space buffers
  */
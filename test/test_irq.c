@@ -81,6 +81,9 @@ int mm_handle_page_fault(ir_context_t* ir_context) {
     return 0;
 }
 
+void mm_handle_tlb_ipi() {
+}
+
 int smp_get_cpu() {
     return 0;
 }
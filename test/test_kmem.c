@@ -0,0 +1,262 @@
+/*
+ * test_kmem.c
+ */
+
+#include "kunit.h"
+#include "kmem.h"
+#include "vga.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+void win_putchar(win_t* win, u8 c) {
+    printf("%c", c);
+}
+
+void trap() {
+
+}
+
+/*
+ * Stubs for locking functions
+ */
+void spinlock_get(spinlock_t* spinlock, u32* eflags) {
+    if (*spinlock) {
+        printf("Deadlock: spinlock already taken\n");
+        _exit(1);
+    }
+    *spinlock = 1;
+}
+
+void spinlock_release(spinlock_t* spinlock, u32* eflags) {
+    *spinlock = 0;
+}
+
+void save_eflags(u32* eflags) {
+
+}
+
+void restore_eflags(u32* eflags) {
+
+}
+
+void cli() {
+
+}
+
+/*
+ * Stub for smp_get_cpu
+ */
+static int current_cpu = 0;
+int smp_get_cpu() {
+    return current_cpu;
+}
+
+/*
+ * Stubs for kmalloc_aligned and kfree which count the slabs which are
+ * taken from and returned to the kernel heap
+ */
+static int slabs_allocated = 0;
+static int slabs_freed = 0;
+static int heap_exhausted = 0;
+void* kmalloc_aligned(u32 size, u32 alignment) {
+    void* ptr;
+    if (heap_exhausted)
+        return 0;
+    if (posix_memalign(&ptr, alignment, size))
+        return 0;
+    slabs_allocated++;
+    return ptr;
+}
+
+void kfree(void* ptr) {
+    slabs_freed++;
+    free(ptr);
+}
+
+typedef struct {
+    u32 a;
+    u32 b;
+    u8 c[50];
+} test_object_t;
+
+/*
+ * Testcase 1
+ * Tested function: kmem_cache_alloc
+ * Testcase: allocate an object from an empty cache
+ */
+int testcase1() {
+    static kmem_cache_t cache = KMEM_CACHE_INITIALIZER("test", sizeof(test_object_t));
+    kmem_cache_stats_t stats;
+    test_object_t* object;
+    slabs_allocated = 0;
+    object = (test_object_t*) kmem_cache_alloc(&cache);
+    ASSERT(object);
+    ASSERT(0 == ((u32) object) % KMEM_ALIGN);
+    ASSERT(1 == slabs_allocated);
+    kmem_cache_get_stats(&cache, &stats);
+    ASSERT(64 == stats.object_size);
+    ASSERT(1 == stats.slabs);
+    ASSERT(1 == stats.active);
+    ASSERT(1 == stats.allocs);
+    ASSERT(KMEM_CPU_CACHE_BATCH - 1 == stats.cached);
+    ASSERT(stats.objects >= KMEM_SLAB_MIN_OBJECTS);
+    return 0;
+}
+
+/*
+ * Testcase 2
+ * Tested function: kmem_cache_alloc
+ * Testcase: allocate more objects than fit into one slab and verify that the objects do
+ * not overlap
+ */
+int testcase2() {
+    static kmem_cache_t cache = KMEM_CACHE_INITIALIZER("test", sizeof(test_object_t));
+    kmem_cache_stats_t stats;
+    test_object_t* objects[200];
+    int i;
+    int j;
+    for (i = 0; i < 200; i++) {
+        objects[i] = (test_object_t*) kmem_cache_alloc(&cache);
+        ASSERT(objects[i]);
+        objects[i]->a = i;
+        objects[i]->b = i;
+        memset(objects[i]->c, i, 50);
+    }
+    for (i = 0; i < 200; i++) {
+        ASSERT(i == objects[i]->a);
+        ASSERT(i == objects[i]->b);
+        ASSERT((u8) i == objects[i]->c[49]);
+        for (j = 0; j < i; j++)
+            ASSERT(objects[i] != objects[j]);
+    }
+    kmem_cache_get_stats(&cache, &stats);
+    ASSERT(200 == stats.active);
+    ASSERT(stats.slabs > 1);
+    ASSERT(stats.objects >= 200 + stats.cached);
+    return 0;
+}
+
+/*
+ * Testcase 3
+ * Tested function: kmem_cache_free
+ * Testcase: an object which has just been freed is handed out again by the next allocation
+ * on the same CPU
+ */
+int testcase3() {
+    static kmem_cache_t cache = KMEM_CACHE_INITIALIZER("test", sizeof(test_object_t));
+    kmem_cache_stats_t stats;
+    void* object;
+    object = kmem_cache_alloc(&cache);
+    kmem_cache_free(&cache, object);
+    ASSERT(object == kmem_cache_alloc(&cache));
+    kmem_cache_get_stats(&cache, &stats);
+    ASSERT(1 == stats.active);
+    ASSERT(2 == stats.allocs);
+    ASSERT(1 == stats.frees);
+    ASSERT(1 == stats.hits);
+    ASSERT(1 == stats.refills);
+    return 0;
+}
+
+/*
+ * Testcase 4
+ * Tested function: kmem_cache_free
+ * Testcase: when all objects are freed again, the per-CPU stack is drained and free
+ * slabs are returned to the kernel heap
+ */
+int testcase4() {
+    static kmem_cache_t cache = KMEM_CACHE_INITIALIZER("test", sizeof(test_object_t));
+    kmem_cache_stats_t stats;
+    void* objects[200];
+    int i;
+    slabs_allocated = 0;
+    slabs_freed = 0;
+    for (i = 0; i < 200; i++) {
+        objects[i] = kmem_cache_alloc(&cache);
+    }
+    for (i = 0; i < 200; i++) {
+        kmem_cache_free(&cache, objects[i]);
+    }
+    kmem_cache_get_stats(&cache, &stats);
+    ASSERT(0 == stats.active);
+    ASSERT(stats.cached <= KMEM_CPU_CACHE_SIZE);
+    ASSERT(stats.drains > 0);
+    ASSERT(slabs_freed > 0);
+    ASSERT(stats.slabs == slabs_allocated - slabs_freed);
+    /*
+     * At most KMEM_FREE_SLABS free slabs plus the slabs holding the objects on the per-CPU stack
+     * are left
+     */
+    ASSERT(stats.slabs < slabs_allocated);
+    return 0;
+}
+
+/*
+ * Testcase 5
+ * Tested function: kmem_cache_free
+ * Testcase: an object allocated on one CPU and freed on another CPU ends up on the stack of the
+ * second CPU
+ */
+int testcase5() {
+    static kmem_cache_t cache = KMEM_CACHE_INITIALIZER("test", sizeof(test_object_t));
+    kmem_cache_stats_t stats;
+    void* object;
+    current_cpu = 0;
+    object = kmem_cache_alloc(&cache);
+    current_cpu = 1;
+    kmem_cache_free(&cache, object);
+    ASSERT(object == kmem_cache_alloc(&cache));
+    current_cpu = 0;
+    ASSERT(object != kmem_cache_alloc(&cache));
+    kmem_cache_get_stats(&cache, &stats);
+    ASSERT(2 == stats.active);
+    ASSERT(KMEM_CPU_CACHE_BATCH - 2 == cache.cpu_cache[0].count);
+    ASSERT(0 == cache.cpu_cache[1].count);
+    return 0;
+}
+
+/*
+ * Testcase 6
+ * Tested function: kmem_cache_alloc
+ * Testcase: larger objects use larger slabs so that a slab holds at least KMEM_SLAB_MIN_OBJECTS objects
+ */
+int testcase6() {
+    static kmem_cache_t cache = KMEM_CACHE_INITIALIZER("test", 1024);
+    void* object;
+    object = kmem_cache_alloc(&cache);
+    ASSERT(object);
+    ASSERT(cache.slab_size > KMEM_SLAB_MIN_SIZE);
+    ASSERT(cache.objects_per_slab >= KMEM_SLAB_MIN_OBJECTS);
+    ASSERT(((u32) object) - (((u32) object) & ~(cache.slab_size - 1)) + 1024 <= cache.slab_size);
+    return 0;
+}
+
+/*
+ * Testcase 7
+ * Tested function: kmem_cache_alloc
+ * Testcase: allocation fails if no slab can be obtained from the kernel heap
+ */
+int testcase7() {
+    static kmem_cache_t cache = KMEM_CACHE_INITIALIZER("test", sizeof(test_object_t));
+    kmem_cache_stats_t stats;
+    heap_exhausted = 1;
+    ASSERT(0 == kmem_cache_alloc(&cache));
+    heap_exhausted = 0;
+    kmem_cache_get_stats(&cache, &stats);
+    ASSERT(0 == stats.slabs);
+    ASSERT(0 == stats.active);
+    ASSERT(kmem_cache_alloc(&cache));
+    return 0;
+}
+
+int main() {
+    INIT;
+    RUN_CASE(1);
+    RUN_CASE(2);
+    RUN_CASE(3);
+    RUN_CASE(4);
+    RUN_CASE(5);
+    RUN_CASE(6);
+    RUN_CASE(7);
+    END;
+}
@@ -30,6 +30,13 @@
 #include "vga.h"
 #include "locks.h"
 #include "lists.h"
+#include "fs.h"
+#include "pagecache.h"
+#include "cpu.h"
+#include "dm.h"
+#include "kerrno.h"
+#include "lib/os/signals.h"
+#include "lib/sys/mman.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -41,6 +48,7 @@ extern int mm_validate_address_spaces();
 extern void mm_init_address_spaces();
 extern int mm_clone_ptd(pte_t* source_ptd, pte_t* target_ptd,
         u32 phys_target_ptd);
+extern void phys_mem_init();
 
 extern int __mm_log;
 
@@ -62,20 +70,52 @@ void trap() {
     panic = 1;
 }
 
+static int swap_dev = 0;
 int params_get_int(char* name) {
     if (0 == strcmp("heap_validate", name))
         return 1;
+    else if (0 == strcmp("pse", name))
+        return 1;
+    else if (0 == strcmp("pge", name))
+        return 1;
+    else if (0 == strcmp("swap", name))
+        return swap_dev;
+    else if (0 == strcmp("swap_size", name))
+        return 64;
     else
         return 0;
 }
 
+/*
+ * Stub for cpu_has_feature. PSE is only reported if cpu_pse is set,
+ * PGE only if cpu_pge is set
+ */
+static int cpu_pse = 0;
+static int cpu_pge = 0;
+int cpu_has_feature(int cpuid, unsigned long long feature) {
+    if (CPUID_FEATURE_PSE == feature)
+        return cpu_pse;
+    if (CPUID_FEATURE_PGE == feature)
+        return cpu_pge;
+    return 0;
+}
+
 void debug_getline(void* c, int n) {
 
 }
 
 
+/*
+ * Memory map returned by the multiboot stub
+ */
+static memory_map_entry_t* test_mmap = 0;
+static int test_mmap_entries = 0;
+static int test_mmap_next = 0;
 int multiboot_get_next_mmap_entry(memory_map_entry_t* next) {
-    return 0;
+    if (test_mmap_next >= test_mmap_entries)
+        return 0;
+    *next = test_mmap[test_mmap_next++];
+    return 1;
 }
 
 int multiboot_locate_ramdisk(multiboot_ramdisk_info_block_t* ramdisk_info_block)  {
@@ -89,20 +129,99 @@ int pm_get_pid() {
     return 0;
 }
 
+static int last_signal = 0;
 int do_kill(int pid, int signal) {
+    last_signal = signal;
+    return 0;
+}
+
+/*
+ * Stub for file system functions
+ */
+ssize_t fs_read_inode(inode_t* inode, off_t offset, ssize_t bytes, void* buffer) {
+    return -1;
+}
+
+ssize_t fs_write_inode(inode_t* inode, off_t offset, ssize_t bytes, void* buffer) {
+    return -1;
+}
+
+int fs_get_mappable_inode(int fd, int write, inode_t** inode) {
+    return EBADF;
+}
+
+pc_page_t* fs_get_page(inode_t* inode, off_t offset) {
     return 0;
 }
 
+void pc_release_page(pc_page_t* page) {
+
+}
+
 int pm_get_pid_for_task_id(u32 task_id) {
     return 0;
 }
 
+/*
+ * Stub for pm_proc_in_user_space. Only process 1 can be in user space
+ */
+static int proc1_in_user_space = 0;
+int pm_proc_in_user_space(int pid) {
+    return (1 == pid) && proc1_in_user_space;
+}
+
+/*
+ * Stub for a block device used as swap device
+ */
+static u8 swap_disk[64 * 1024];
+static int swap_disk_open(minor_dev_t minor) {
+    return 0;
+}
+static ssize_t swap_disk_read(minor_dev_t minor, ssize_t blocks, ssize_t first_block, void* buffer) {
+    memcpy(buffer, swap_disk + first_block * BLOCK_SIZE, blocks * BLOCK_SIZE);
+    return blocks * BLOCK_SIZE;
+}
+static ssize_t swap_disk_write(minor_dev_t minor, ssize_t blocks, ssize_t first_block, void* buffer) {
+    memcpy(swap_disk + first_block * BLOCK_SIZE, buffer, blocks * BLOCK_SIZE);
+    return blocks * BLOCK_SIZE;
+}
+static blk_dev_ops_t swap_disk_ops = { swap_disk_open, 0, swap_disk_read, swap_disk_write };
+blk_dev_ops_t* dm_get_blk_dev_ops(major_dev_t major) {
+    return &swap_disk_ops;
+}
+
 static int my_task_id = 0;
 int pm_get_task_id() {
     return my_task_id;
 }
 
+static int current_cpu = 0;
 int smp_get_cpu() {
+    return current_cpu;
+}
+
+static int cpu_count = 1;
+int smp_get_cpu_count() {
+    return cpu_count;
+}
+
+int cpu_get_apic_id(int cpuid) {
+    return cpuid;
+}
+
+/*
+ * Stub for apic_send_ipi. A TLB shootdown IPI is handled right away
+ * by calling the handler on behalf of the target CPU
+ */
+static int ipis_sent = 0;
+int apic_send_ipi(u8 apic_id, u8 ipi, u8 vector, int deassert) {
+    int cpu = current_cpu;
+    ipis_sent++;
+    if (IPI_TLB_SHOOTDOWN == vector) {
+        current_cpu = apic_id;
+        mm_handle_tlb_ipi();
+        current_cpu = cpu;
+    }
     return 0;
 }
 
@@ -149,6 +268,8 @@ pte_t* mm_get_ptd_stub() {
     return test_ptd;
 }
 pte_t* (*mm_get_ptd_orig)();
+u32 (*mm_get_phys_page_orig)();
+void (*mm_put_phys_page_orig)(u32 page);
 pte_t* mm_get_ptd_for_pid_stub() {
     return test_ptd;
 }
@@ -190,6 +311,14 @@ u32 mm_get_bss_end_stub() {
     return 0x111200;
 }
 
+/*
+ * End of kernel bss section above 8 MB, so that the first two 4 MB
+ * areas are entirely covered by the kernel
+ */
+u32 mm_get_bss_end_large_stub() {
+    return 0x800200;
+}
+
 /*
  * Stub for mm_get_pt_address. This stub can operate in two modes
  * 1) if pg_enabled_override = 0 or paging is disabled, the function
@@ -245,10 +374,49 @@ void spinlock_release(spinlock_t* lock, u32* flags) {
 }
 void spinlock_init(spinlock_t* lock) {
 }
+void sem_init(semaphore_t* sem, u32 value) {
+}
+void __sem_down(semaphore_t* sem, char* file, int line) {
+}
+void sem_up(semaphore_t* sem) {
+}
 /*
  * Dummy for invalidation of TLB
  */
+static u32 eflags = 0;
+u32 get_eflags() {
+    return eflags;
+}
+
+void save_eflags(u32* flags) {
+
+}
+
+void restore_eflags(u32* flags) {
+
+}
+
+void cli() {
+
+}
+
+static int invlpg_called = 0;
 void invlpg(u32 virtual_address) {
+    invlpg_called++;
+}
+
+static int reload_cr3_called = 0;
+u32 reload_cr3() {
+    reload_cr3_called++;
+    return 0;
+}
+
+void atomic_store(u32* address, u32 value) {
+    *address = value;
+}
+
+u32 atomic_load(u32* address) {
+    return *address;
 }
 
 /*
@@ -258,6 +426,16 @@ static u32 cr3 = 0;
 void put_cr3(u32 _cr3) {
     cr3 = _cr3;
 }
+/*
+ * Stubs for access to CR4
+ */
+static u32 cr4 = 0;
+u32 get_cr4() {
+    return cr4;
+}
+void put_cr4(u32 _cr4) {
+    cr4 = _cr4;
+}
 /*
  * Stub for access to CR0
  */
@@ -278,6 +456,7 @@ extern void (*mm_detach_page)(u32);
 extern int (*mm_copy_page)(u32, u32);
 extern pte_t* (*mm_get_ptd)();
 extern pte_t* (*mm_get_ptd_for_pid)(u32);
+extern int (*mm_page_mapped)(u32);
 
 /*
  * Utility function to validate whether the physical
@@ -330,8 +509,8 @@ static int validate_address_space(pte_t* source_ptd, pte_t* target_ptd,
      * - they are mapped
      * - on the level of PTD entries, the attributes are the same as in the source
      * - on the level of PT entries, the attributes are the same as in the source
-     * - the physical base address of source and target are not the same
-     * - the physical pages pointed to by both page table entries have identical content
+     * - source and target share the physical page
+     * - pages which are shared copy-on-write are read-only
      */
     for (page = MM_PT_ENTRIES * MM_PAGE_SIZE * MM_SHARED_PAGE_TABLES; page
             <=MM_VIRTUAL_TOS_USER; page += 4096) {
@@ -351,8 +530,10 @@ static int validate_address_space(pte_t* source_ptd, pte_t* target_ptd,
                 ASSERT(source_pt[pt_offset].rw==target_pt[pt_offset].rw);
                 ASSERT(source_pt[pt_offset].pwt==target_pt[pt_offset].pwt);
                 ASSERT(source_pt[pt_offset].us==target_pt[pt_offset].us);
-                ASSERT(source_pt[pt_offset].page_base!=target_pt[pt_offset].page_base);
-                ASSERT(validate_page_content(source_pt+pt_offset, target_pt+pt_offset)==0);
+                ASSERT(source_pt[pt_offset].cow==target_pt[pt_offset].cow);
+                ASSERT(source_pt[pt_offset].page_base==target_pt[pt_offset].page_base);
+                if (source_pt[pt_offset].cow)
+                    ASSERT(0 == source_pt[pt_offset].rw);
             }
         }
     }
@@ -556,7 +737,7 @@ int testcase3() {
     /*
      * Create entry in PTD so that we do not start with an empty PTD
      */
-    ptd[ptd_offset] = pte_create(1, 0, 0, (u32) pt);
+    ptd[ptd_offset] = pte_create(1, 0, 0, 0, (u32) pt);
     /* Set up stub for physical page allocation
      * We set next_phys_page to zero as we do not expect any allocations
      * */
@@ -603,7 +784,7 @@ int testcase4() {
     /*
      * Create entry in PTD so that we do not start with an empty PTD
      */
-    ptd[ptd_offset] = pte_create(1, 0, 0, (u32) pt);
+    ptd[ptd_offset] = pte_create(1, 0, 0, 0, (u32) pt);
     /* Set up stub for physical page allocation
      * We set next_phys_page to zero as we do not expect any allocations
      * */
@@ -2346,6 +2527,878 @@ int testcase32() {
     return 0;
 }
 
+/*
+ * Testcase 33
+ * Tested function: mm_clone, mm_handle_page_fault
+ * Testcase: clone a process with a user space page and verify that the page is shared
+ * copy-on-write. Then simulate a write access in the parent, which needs to create
+ * a copy, and in the child, which can reuse the page
+ */
+int testcase33() {
+    pte_t* source_ptd;
+    pte_t* target_ptd;
+    pte_t* source_pt;
+    pte_t* target_pt;
+    ir_context_t ir_context;
+    u32 user_page = MM_START_CODE;
+    u32 phys;
+    u32 stack_top_page = (MM_VIRTUAL_TOS / MM_PAGE_SIZE) * MM_PAGE_SIZE;
+    u32 stack_bottom_page = stack_top_page - (MM_STACK_PAGES_TASK - 1)
+            * MM_PAGE_SIZE;
+    int nr_of_pages = 2 * (2 + MM_SHARED_PAGE_TABLES + MM_STACK_PAGES_TASK) + 6;
+    u32 my_mem = setup_phys_pages(nr_of_pages);
+    memset((void*) my_mem, 0, nr_of_pages * 4096);
+    mm_get_phys_page_called = 0;
+    mm_get_phys_page = mm_get_phys_page_stub;
+    my_task_id = 0;
+    paging_enabled = 1;
+    mm_get_pt_address = mm_get_pt_address_stub;
+    pg_enabled_override = 0;
+    mm_get_bss_end = mm_get_bss_end_stub;
+    mm_attach_page = mm_attach_page_stub;
+    mm_detach_page = mm_detach_page_stub;
+    mm_init_address_spaces();
+    mm_init_page_tables();
+    source_ptd = (pte_t*) cr3;
+    root_ptd = source_ptd;
+    mm_copy_page = mm_copy_page_stub;
+    test_ptd = (pte_t*) cr3;
+    mm_get_ptd = mm_get_ptd_stub;
+    /*
+     * Map a writable user space page and fill it
+     */
+    phys = mm_get_phys_page();
+    ASSERT(phys);
+    memset((void*) phys, 0xab, 4096);
+    ASSERT(0 == mm_map_page(source_ptd, phys, user_page, MM_READ_WRITE, MM_USER_PAGE, 0, 0));
+    /*
+     * Clone and verify that the page is shared read-only
+     */
+    target_ptd = (pte_t*) mm_clone(1, 1);
+    ASSERT(target_ptd);
+    ASSERT(0==validate_address_space(test_ptd, target_ptd, stack_bottom_page, stack_top_page));
+    source_pt = mm_get_pt_address_stub(source_ptd, PTD_OFFSET(user_page), 0);
+    target_pt = mm_get_pt_address_stub(target_ptd, PTD_OFFSET(user_page), 0);
+    ASSERT(phys == source_pt[PT_OFFSET(user_page)].page_base * MM_PAGE_SIZE);
+    ASSERT(phys == target_pt[PT_OFFSET(user_page)].page_base * MM_PAGE_SIZE);
+    ASSERT(0 == source_pt[PT_OFFSET(user_page)].rw);
+    ASSERT(1 == source_pt[PT_OFFSET(user_page)].cow);
+    /*
+     * Simulate write access by a user space program in the parent. As the page
+     * is still shared, this should create a copy
+     */
+    ir_context.cr2 = user_page + 100;
+    ir_context.cr3 = (u32) source_ptd;
+    ir_context.err_code = 0x7;
+    ASSERT(0 == mm_handle_page_fault(&ir_context));
+    ASSERT(1 == source_pt[PT_OFFSET(user_page)].rw);
+    ASSERT(0 == source_pt[PT_OFFSET(user_page)].cow);
+    ASSERT(phys != source_pt[PT_OFFSET(user_page)].page_base * MM_PAGE_SIZE);
+    ASSERT(0 == validate_page_content(source_pt + PT_OFFSET(user_page), target_pt + PT_OFFSET(user_page)));
+    ASSERT(0 == target_pt[PT_OFFSET(user_page)].rw);
+    /*
+     * Now do the same in the child. The page is no longer shared, so it should
+     * simply be made writable
+     */
+    test_ptd = target_ptd;
+    ir_context.cr3 = (u32) target_ptd;
+    ASSERT(0 == mm_handle_page_fault(&ir_context));
+    ASSERT(1 == target_pt[PT_OFFSET(user_page)].rw);
+    ASSERT(0 == target_pt[PT_OFFSET(user_page)].cow);
+    ASSERT(phys == target_pt[PT_OFFSET(user_page)].page_base * MM_PAGE_SIZE);
+    ASSERT(0 == cpulocks);
+    free((void*) my_mem);
+    return 0;
+}
+
+/*
+ * Testcase 34
+ * Tested function: mm_add_user_segment, mm_handle_page_fault
+ * Testcase: verify that invalid user segments are rejected and that a page fault for an
+ * unmapped page which is not part of a user segment leads to a SIGSEGV
+ */
+int testcase34() {
+    ir_context_t ir_context;
+    u32 user_page = MM_START_CODE;
+    int nr_of_pages = 2 + MM_SHARED_PAGE_TABLES + MM_STACK_PAGES_TASK + 6;
+    u32 my_mem = setup_phys_pages(nr_of_pages);
+    memset((void*) my_mem, 0, nr_of_pages * 4096);
+    mm_get_phys_page_called = 0;
+    mm_get_phys_page = mm_get_phys_page_stub;
+    my_task_id = 0;
+    paging_enabled = 1;
+    mm_get_pt_address = mm_get_pt_address_stub;
+    pg_enabled_override = 0;
+    mm_get_bss_end = mm_get_bss_end_stub;
+    mm_attach_page = mm_attach_page_stub;
+    mm_detach_page = mm_detach_page_stub;
+    mm_init_address_spaces();
+    mm_init_page_tables();
+    test_ptd = (pte_t*) cr3;
+    mm_get_ptd = mm_get_ptd_stub;
+    /*
+     * Segments below the start of the code area, not aligned to a page boundary,
+     * with an invalid layout or overlapping the stack area are rejected
+     */
+    ASSERT(EINVAL == mm_add_user_segment(MM_START_CODE - MM_PAGE_SIZE, MM_START_CODE - 1, MM_START_CODE - MM_PAGE_SIZE,
+            MM_START_CODE, MM_START_CODE, 0, 0));
+    ASSERT(EINVAL == mm_add_user_segment(user_page + 1, user_page + MM_PAGE_SIZE - 1, user_page + 1, user_page + 1,
+            user_page + 1, 0, 0));
+    ASSERT(EINVAL == mm_add_user_segment(user_page, user_page + MM_PAGE_SIZE - 1, user_page, user_page + 2,
+            user_page + 1, 0, 0));
+    ASSERT(EINVAL == mm_add_user_segment(user_page, user_page + MM_PAGE_SIZE - 1, user_page, user_page,
+            user_page + MM_PAGE_SIZE + 1, 0, 0));
+    ASSERT(EINVAL == mm_add_user_segment(user_page, MM_VIRTUAL_TOS_USER, user_page, user_page, user_page, 0, 0));
+    /*
+     * Simulate a read access to an unmapped page by a user space program. As no
+     * user segment covers this page, the process should receive SIGSEGV
+     */
+    last_signal = 0;
+    ir_context.cr2 = user_page + 100;
+    ir_context.cr3 = (u32) test_ptd;
+    ir_context.err_code = 0x4;
+    ASSERT(0 == mm_handle_page_fault(&ir_context));
+    ASSERT(0 == test_ptd[PTD_OFFSET(user_page)].p);
+    ASSERT(__KSIGSEGV == last_signal);
+    ASSERT(0 == cpulocks);
+    free((void*) my_mem);
+    return 0;
+}
+
+/*
+ * Testcase 35
+ * Tested function: mm_get_phys_pages, mm_put_phys_pages
+ * Testcase: allocate blocks of different orders from a free area of 16 pages, split
+ * larger blocks and verify that released blocks are merged with their buddies again
+ */
+int testcase35() {
+    memory_map_entry_t mmap[1];
+    u32 a;
+    u32 b;
+    u32 c;
+    mmap[0].base_addr_low = 0x100000;
+    mmap[0].base_addr_high = 0;
+    mmap[0].length_low = 16 * MM_PAGE_SIZE;
+    mmap[0].length_high = 0;
+    mmap[0].type = MB_MMAP_ENTRY_TYPE_FREE;
+    test_mmap = mmap;
+    test_mmap_entries = 1;
+    test_mmap_next = 0;
+    phys_mem_init();
+    test_mmap_entries = 0;
+    ASSERT(1 == mm_phys_free_blocks(4));
+    ASSERT(0 == mm_phys_free_blocks(0));
+    /*
+     * Allocate 8, 4 and 1 page. This should split the block of order 4
+     */
+    a = mm_get_phys_pages(3);
+    ASSERT(0x100000 == a);
+    b = mm_get_phys_pages(2);
+    ASSERT(0x108000 == b);
+    c = mm_get_phys_pages(0);
+    ASSERT(0x10c000 == c);
+    ASSERT(0 == mm_phys_free_blocks(4));
+    ASSERT(1 == mm_phys_free_blocks(1));
+    ASSERT(1 == mm_phys_free_blocks(0));
+    /*
+     * There is no block of order 2 left
+     */
+    ASSERT(0 == mm_get_phys_pages(2));
+    ASSERT(0 == mm_get_phys_pages(MM_BUDDY_MAX_ORDER + 1));
+    /*
+     * Release b and c - this should produce a block of order 3
+     */
+    mm_put_phys_pages(c, 0);
+    mm_put_phys_pages(b, 2);
+    ASSERT(1 == mm_phys_free_blocks(3));
+    ASSERT(0 == mm_phys_free_blocks(2));
+    ASSERT(0 == mm_phys_free_blocks(1));
+    ASSERT(0 == mm_phys_free_blocks(0));
+    /*
+     * and releasing a gives us the entire area back
+     */
+    mm_put_phys_pages(a, 3);
+    ASSERT(1 == mm_phys_free_blocks(4));
+    ASSERT(0 == mm_phys_free_blocks(3));
+    ASSERT(0 == cpulocks);
+    return 0;
+}
+
+/*
+ * Testcase 36
+ * Tested function: mm_get_phys_page, mm_put_phys_page
+ * Testcase: single pages are allocated from and released to the per-CPU magazine, which is
+ * refilled and drained in batches. An allocation of a larger block which fails drains the magazine.
+ * If no free page is left, pages in the magazine of another CPU are used
+ */
+int testcase36() {
+    memory_map_entry_t mmap[1];
+    mm_magazine_stats_t stats;
+    u32 pages[64];
+    u32 available;
+    int i;
+    mmap[0].base_addr_low = 0x100000;
+    mmap[0].base_addr_high = 0;
+    mmap[0].length_low = 64 * MM_PAGE_SIZE;
+    mmap[0].length_high = 0;
+    mmap[0].type = MB_MMAP_ENTRY_TYPE_FREE;
+    test_mmap = mmap;
+    test_mmap_entries = 1;
+    test_mmap_next = 0;
+    phys_mem_init();
+    test_mmap_entries = 0;
+    mm_get_phys_page = mm_get_phys_page_orig;
+    mm_put_phys_page = mm_put_phys_page_orig;
+    available = mm_phys_mem_available();
+    mm_get_magazine_stats(0, &stats);
+    ASSERT(0 == stats.pages);
+    /*
+     * The first allocation refills the magazine
+     */
+    pages[0] = mm_get_phys_page();
+    ASSERT(pages[0]);
+    mm_get_magazine_stats(0, &stats);
+    ASSERT(1 == stats.refills);
+    ASSERT(MM_MAGAZINE_BATCH - 1 == stats.pages);
+    for (i = 1; i < MM_MAGAZINE_SIZE + MM_MAGAZINE_BATCH; i++) {
+        pages[i] = mm_get_phys_page();
+        ASSERT(pages[i]);
+    }
+    mm_get_magazine_stats(0, &stats);
+    ASSERT((MM_MAGAZINE_SIZE + MM_MAGAZINE_BATCH) / MM_MAGAZINE_BATCH == stats.refills);
+    ASSERT(0 == stats.pages);
+    ASSERT(available - (MM_MAGAZINE_SIZE + MM_MAGAZINE_BATCH) * 4 == mm_phys_mem_available());
+    /*
+     * Release all pages again. When the magazine is full, half of it is drained
+     */
+    for (i = 0; i < MM_MAGAZINE_SIZE + MM_MAGAZINE_BATCH; i++) {
+        mm_put_phys_page(pages[i]);
+    }
+    mm_get_magazine_stats(0, &stats);
+    ASSERT(1 == stats.drains);
+    ASSERT(MM_MAGAZINE_SIZE == stats.pages);
+    ASSERT(available == mm_phys_mem_available());
+    /*
+     * A block of 64 pages can only be allocated if the magazine is drained
+     */
+    ASSERT(0x100000 == mm_get_phys_pages(6));
+    mm_get_magazine_stats(0, &stats);
+    ASSERT(0 == stats.pages);
+    mm_put_phys_pages(0x100000, 6);
+    ASSERT(1 == mm_phys_free_blocks(6));
+    /*
+     * Now let CPU 1 allocate all pages and put MM_MAGAZINE_BATCH pages back into its magazine
+     */
+    current_cpu = 1;
+    for (i = 0; i < 64; i++) {
+        pages[i] = mm_get_phys_page();
+        ASSERT(pages[i]);
+    }
+    for (i = 0; i < MM_MAGAZINE_BATCH; i++)
+        mm_put_phys_page(pages[i]);
+    ASSERT(available - (64 - MM_MAGAZINE_BATCH) * 4 == mm_phys_mem_available());
+    /*
+     * CPU 0 should still be able to get these pages
+     */
+    current_cpu = 0;
+    for (i = 0; i < MM_MAGAZINE_BATCH; i++) {
+        pages[i] = mm_get_phys_page();
+        ASSERT(pages[i]);
+    }
+    ASSERT(0 == mm_get_phys_page());
+    mm_get_magazine_stats(1, &stats);
+    ASSERT(0 == stats.pages);
+    ASSERT(1 == stats.drains);
+    for (i = 0; i < 64; i++)
+        mm_put_phys_page(pages[i]);
+    ASSERT(available == mm_phys_mem_available());
+    ASSERT(0 == cpulocks);
+    return 0;
+}
+
+/*
+ * Testcase 37
+ * Tested function: mm_handle_page_fault
+ * Testcase: a page fault below the mapped part of the user space stack extends the stack, a page
+ * fault below the area reserved for the stack leads to a SIGSEGV
+ */
+int testcase37() {
+    ir_context_t ir_context;
+    int errno;
+    u32 page;
+    u32 stack_base = MM_PAGE_START(MM_PAGE(MM_VIRTUAL_TOS_USER) - MM_STACK_PAGES_TASK_USER + 1);
+    int nr_of_pages = 2 + MM_SHARED_PAGE_TABLES + MM_STACK_PAGES_TASK + MM_STACK_PAGES_TASK_USER + 16;
+    u32 my_mem = setup_phys_pages(nr_of_pages);
+    memset((void*) my_mem, 0, nr_of_pages * 4096);
+    mm_get_phys_page_called = 0;
+    mm_get_phys_page = mm_get_phys_page_stub;
+    my_task_id = 0;
+    paging_enabled = 1;
+    mm_get_pt_address = mm_get_pt_address_stub;
+    pg_enabled_override = 0;
+    mm_get_bss_end = mm_get_bss_end_stub;
+    mm_attach_page = mm_attach_page_stub;
+    mm_detach_page = mm_detach_page_stub;
+    mm_init_address_spaces();
+    mm_init_page_tables();
+    test_ptd = (pte_t*) cr3;
+    mm_get_ptd = mm_get_ptd_stub;
+    ASSERT(MM_VIRTUAL_TOS_USER-3==mm_init_user_area());
+    ASSERT(virt_to_phys(test_ptd, stack_base, &errno));
+    ASSERT(0 == virt_to_phys(test_ptd, stack_base - MM_PAGE_SIZE, &errno));
+    /*
+     * Simulate a write access by a user space program three pages below the stack. This should
+     * map the three pages
+     */
+    last_signal = 0;
+    ir_context.cr2 = stack_base - 3 * MM_PAGE_SIZE + 100;
+    ir_context.cr3 = (u32) test_ptd;
+    ir_context.err_code = 0x6;
+    ASSERT(0 == mm_handle_page_fault(&ir_context));
+    ASSERT(0 == last_signal);
+    for (page = stack_base - 3 * MM_PAGE_SIZE; page < stack_base; page += MM_PAGE_SIZE)
+        ASSERT(virt_to_phys(test_ptd, page, &errno));
+    ASSERT(0 == virt_to_phys(test_ptd, stack_base - 4 * MM_PAGE_SIZE, &errno));
+    /*
+     * An access below the area reserved for the stack is not handled
+     */
+    ir_context.cr2 = MM_PAGE_START(MM_PAGE(MM_VIRTUAL_TOS_USER) - MM_STACK_PAGES_USER_MAX);
+    ASSERT(0 == mm_handle_page_fault(&ir_context));
+    ASSERT(__KSIGSEGV == last_signal);
+    ASSERT(0 == virt_to_phys(test_ptd, ir_context.cr2, &errno));
+    ASSERT(0 == cpulocks);
+    free((void*) my_mem);
+    return 0;
+}
+
+/*
+ * Testcase 38
+ * Tested functions: do_mmap, do_munmap
+ * Testcase: invalid arguments are rejected before any mapping is created, and unmapping a range
+ * which does not contain any mapping succeeds without changing the address space
+ */
+int testcase38() {
+    ir_context_t ir_context;
+    u32 user_page = MM_MMAP_TOP - MM_PAGE_SIZE;
+    int nr_of_pages = 2 + MM_SHARED_PAGE_TABLES + MM_STACK_PAGES_TASK + MM_STACK_PAGES_TASK_USER + 6;
+    u32 my_mem = setup_phys_pages(nr_of_pages);
+    memset((void*) my_mem, 0, nr_of_pages * 4096);
+    mm_get_phys_page_called = 0;
+    mm_get_phys_page = mm_get_phys_page_stub;
+    my_task_id = 0;
+    paging_enabled = 1;
+    mm_get_pt_address = mm_get_pt_address_stub;
+    pg_enabled_override = 0;
+    mm_get_bss_end = mm_get_bss_end_stub;
+    mm_attach_page = mm_attach_page_stub;
+    mm_detach_page = mm_detach_page_stub;
+    mm_init_address_spaces();
+    mm_init_page_tables();
+    test_ptd = (pte_t*) cr3;
+    mm_get_ptd = mm_get_ptd_stub;
+    ASSERT(MM_VIRTUAL_TOS_USER-3==mm_init_user_area());
+    /*
+     * Exactly one of MAP_SHARED and MAP_PRIVATE is required, the length must not be zero
+     * and the offset needs to be page aligned
+     */
+    ASSERT((u32) -EINVAL == do_mmap(0, MM_PAGE_SIZE, PROT_READ, MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    ASSERT((u32) -EINVAL == do_mmap(0, MM_PAGE_SIZE, PROT_READ, MAP_ANONYMOUS, -1, 0));
+    ASSERT((u32) -EINVAL == do_mmap(0, 0, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    ASSERT((u32) -EINVAL == do_mmap(0, MM_PAGE_SIZE, PROT_READ, MAP_PRIVATE, 3, 100));
+    /*
+     * Fixed mappings need to be page aligned and located between the break and MM_MMAP_TOP
+     */
+    ASSERT((u32) -EINVAL == do_mmap(user_page + 1, MM_PAGE_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0));
+    ASSERT((u32) -ENOMEM == do_mmap(user_page, 2 * MM_PAGE_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0));
+    ASSERT((u32) -ENOMEM == do_mmap(MM_START_CODE - MM_PAGE_SIZE, MM_PAGE_SIZE, PROT_READ,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0));
+    /*
+     * Errors of the file system are passed on
+     */
+    ASSERT((u32) -EBADF == do_mmap(0, MM_PAGE_SIZE, PROT_READ, MAP_PRIVATE, 3, 0));
+    /*
+     * munmap validates its arguments as well
+     */
+    ASSERT(-EINVAL == do_munmap(user_page + 1, MM_PAGE_SIZE));
+    ASSERT(-EINVAL == do_munmap(user_page, 0));
+    ASSERT(-EINVAL == do_munmap(MM_START_CODE - MM_PAGE_SIZE, MM_PAGE_SIZE));
+    ASSERT(0 == do_munmap(user_page, MM_PAGE_SIZE));
+    /*
+     * Nothing has been mapped, so an access to the page leads to a SIGSEGV
+     */
+    last_signal = 0;
+    ir_context.cr2 = user_page;
+    ir_context.cr3 = (u32) test_ptd;
+    ir_context.err_code = 0x4;
+    ASSERT(0 == mm_handle_page_fault(&ir_context));
+    ASSERT(__KSIGSEGV == last_signal);
+    ASSERT(0 == cpulocks);
+    free((void*) my_mem);
+    return 0;
+}
+
+/*
+ * Testcase 39: TLB shootdown
+ * A batch of pages is only sent to CPUs which use the address space, with one IPI per
+ * CPU. Large batches lead to a CR3 reload, and physical pages are released after the flush
+ */
+int testcase39() {
+    mm_tlb_batch_t batch;
+    mm_tlb_stats_t stats0;
+    mm_tlb_stats_t stats1;
+    mm_tlb_stats_t old_stats0;
+    mm_tlb_stats_t old_stats1;
+    int i;
+    mm_put_phys_page = mm_put_phys_page_stub;
+    cpu_count = 2;
+    current_cpu = 0;
+    ipis_sent = 0;
+    mm_tlb_switch(0, 0);
+    mm_tlb_switch(1, 0);
+    mm_get_tlb_stats(0, &old_stats0);
+    mm_get_tlb_stats(1, &old_stats1);
+    /*
+     * Three pages are invalidated one by one on CPU 1 with a single IPI
+     */
+    mm_tlb_batch_init(&batch);
+    for (i = 0; i < 3; i++)
+        mm_tlb_batch_add(&batch, 0x10000000 + i * MM_PAGE_SIZE + 10, 0);
+    mm_tlb_batch_add(&batch, 0x10010000, 0x200000);
+    last_released_page = 0;
+    invlpg_called = 0;
+    mm_tlb_batch_flush(&batch);
+    ASSERT(1 == ipis_sent);
+    ASSERT(4 == invlpg_called);
+    ASSERT(0x200000 == last_released_page);
+    ASSERT(0 == batch.count);
+    mm_get_tlb_stats(0, &stats0);
+    mm_get_tlb_stats(1, &stats1);
+    ASSERT(old_stats0.ipis + 1 == stats0.ipis);
+    ASSERT(old_stats1.invalidated + 4 == stats1.invalidated);
+    ASSERT(old_stats1.full_flushes == stats1.full_flushes);
+    /*
+     * Above the threshold, CPU 1 reloads CR3 instead
+     */
+    mm_tlb_batch_init(&batch);
+    for (i = 0; i <= MM_TLB_FLUSH_THRESHOLD; i++)
+        mm_tlb_batch_add(&batch, 0x10000000 + i * MM_PAGE_SIZE, 0);
+    invlpg_called = 0;
+    reload_cr3_called = 0;
+    mm_tlb_batch_flush(&batch);
+    ASSERT(2 == ipis_sent);
+    ASSERT(0 == invlpg_called);
+    ASSERT(1 == reload_cr3_called);
+    mm_get_tlb_stats(1, &stats1);
+    ASSERT(old_stats1.full_flushes + 1 == stats1.full_flushes);
+    /*
+     * A full batch is flushed automatically when the next page is added
+     */
+    mm_tlb_batch_init(&batch);
+    for (i = 0; i <= MM_TLB_BATCH_PAGES; i++)
+        mm_tlb_batch_add(&batch, 0x10000000 + i * MM_PAGE_SIZE, 0);
+    ASSERT(3 == ipis_sent);
+    ASSERT(1 == batch.count);
+    /*
+     * If CPU 1 switches to another address space, no IPI is needed, but
+     * the physical pages are still released
+     */
+    mm_tlb_switch(1, 1);
+    mm_tlb_batch_init(&batch);
+    mm_tlb_batch_add(&batch, 0x10000000, 0x300000);
+    mm_tlb_batch_flush(&batch);
+    ASSERT(3 == ipis_sent);
+    ASSERT(0x300000 == last_released_page);
+    mm_tlb_switch(1, 0);
+    cpu_count = 1;
+    mm_put_phys_page = mm_put_phys_page_orig;
+    ASSERT(0 == cpulocks);
+    return 0;
+}
+
+/*
+ * Testcase 40
+ * Tested function: mm_refill_zero_pool, mm_get_zeroed_page
+ * Testcase: pages zeroed in advance are handed out first, then pages are zeroed on
+ * demand. The pool is not refilled if memory is low, and an allocation which falls
+ * back to the pool does not change its statistics
+ */
+int testcase40() {
+    memory_map_entry_t mmap[1];
+    mm_zero_pool_stats_t old_stats;
+    mm_zero_pool_stats_t stats;
+    u32 pages[64];
+    u32 my_mem;
+    u32 page;
+    int i;
+    mmap[0].base_addr_low = 0x1000000;
+    mmap[0].base_addr_high = 0;
+    mmap[0].length_low = 16 * MM_PAGE_SIZE;
+    mmap[0].length_high = 0;
+    mmap[0].type = MB_MMAP_ENTRY_TYPE_FREE;
+    test_mmap = mmap;
+    test_mmap_entries = 1;
+    test_mmap_next = 0;
+    phys_mem_init();
+    my_mem = setup_phys_pages(MM_ZERO_POOL_SIZE + 2);
+    memset((void*) phys_page[0], 0xff, (MM_ZERO_POOL_SIZE + 2) * MM_PAGE_SIZE);
+    mm_get_phys_page_called = 0;
+    mm_get_phys_page = mm_get_phys_page_stub;
+    mm_put_phys_page = mm_put_phys_page_stub;
+    mm_attach_page = mm_attach_page_stub;
+    mm_detach_page = mm_detach_page_stub;
+    mm_get_zero_pool_stats(&old_stats);
+    ASSERT(0 == old_stats.pages);
+    /*
+     * Only 16 pages are free, so the pool is not filled
+     */
+    ASSERT(0 == mm_refill_zero_pool());
+    ASSERT(0 == mm_get_phys_page_called);
+    /*
+     * With enough free memory, pages are added until the pool is full
+     */
+    mmap[0].length_low = (MM_ZERO_POOL_MIN_FREE + 16) * MM_PAGE_SIZE;
+    test_mmap_next = 0;
+    phys_mem_init();
+    test_mmap_entries = 0;
+    for (i = 0; i < MM_ZERO_POOL_SIZE; i++)
+        ASSERT(1 == mm_refill_zero_pool());
+    ASSERT(0 == mm_refill_zero_pool());
+    ASSERT(MM_ZERO_POOL_SIZE == mm_get_phys_page_called);
+    mm_get_zero_pool_stats(&stats);
+    ASSERT(MM_ZERO_POOL_SIZE == stats.pages);
+    ASSERT(old_stats.filled + MM_ZERO_POOL_SIZE == stats.filled);
+    for (i = 0; i < MM_PAGE_SIZE; i++)
+        ASSERT(0 == ((u8*) phys_page[0])[i]);
+    /*
+     * Take all pages from the pool again
+     */
+    for (i = 0; i < MM_ZERO_POOL_SIZE; i++) {
+        page = mm_get_zeroed_page();
+        ASSERT(page == phys_page[MM_ZERO_POOL_SIZE - 1 - i]);
+    }
+    mm_get_zero_pool_stats(&stats);
+    ASSERT(0 == stats.pages);
+    ASSERT(old_stats.hits + MM_ZERO_POOL_SIZE == stats.hits);
+    /*
+     * Now the pool is empty and a new page is zeroed
+     */
+    page = mm_get_zeroed_page();
+    ASSERT(page == phys_page[MM_ZERO_POOL_SIZE]);
+    for (i = 0; i < MM_PAGE_SIZE; i++)
+        ASSERT(0 == ((u8*) page)[i]);
+    mm_get_zero_pool_stats(&stats);
+    ASSERT(old_stats.misses + 1 == stats.misses);
+    mm_get_phys_page = mm_get_phys_page_orig;
+    mm_put_phys_page = mm_put_phys_page_orig;
+    /*
+     * If mm_get_phys_page runs out of memory and falls back to the
+     * empty pool, this is not counted as a miss
+     */
+    mmap[0].length_low = 16 * MM_PAGE_SIZE;
+    test_mmap_next = 0;
+    phys_mem_init();
+    for (i = 0; i < 64; i++) {
+        if (0 == (pages[i] = mm_get_phys_page()))
+            break;
+    }
+    ASSERT(i < 64);
+    mm_get_zero_pool_stats(&old_stats);
+    ASSERT(0 == mm_get_phys_page());
+    mm_get_zero_pool_stats(&stats);
+    ASSERT(old_stats.misses == stats.misses);
+    ASSERT(old_stats.hits == stats.hits);
+    while (i > 0) {
+        i--;
+        mm_put_phys_page(pages[i]);
+    }
+    ASSERT(0 == cpulocks);
+    free((void*) my_mem);
+    return 0;
+}
+
+/*
+ * Testcase 41
+ * Tested function: mm_init_page_tables
+ * Testcase: if the CPU supports PSE, the 4 MB areas which are entirely covered by the kernel are
+ * mapped by 4 MB pages, and PSE is turned on in CR4
+ */
+int testcase41() {
+    int errno;
+    int i;
+    pte_t* ptd;
+    int nr_of_pages = 1 + MM_SHARED_PAGE_TABLES + MM_STACK_PAGES_TASK;
+    u32 my_mem = setup_phys_pages(nr_of_pages);
+    mm_get_phys_page_called = 0;
+    mm_get_phys_page = mm_get_phys_page_stub;
+    paging_enabled = 0;
+    mm_get_pt_address = mm_get_pt_address_stub;
+    pg_enabled_override = 0;
+    mm_get_bss_end = mm_get_bss_end_large_stub;
+    cpu_pse = 1;
+    cr4 = 0;
+    mm_init_page_tables();
+    /*
+     * No page tables are needed for the two 4 MB pages
+     */
+    ASSERT(nr_of_pages - 2 == mm_get_phys_page_called);
+    ASSERT(MM_CR4_PSE == (cr4 & MM_CR4_PSE));
+    ptd = (pte_t*) cr3;
+    for (i = 0; i < 2; i++) {
+        ASSERT(1 == ptd[i].p);
+        ASSERT(1 == ptd[i].ps);
+        ASSERT(0 == ptd[i].us);
+        ASSERT(1 == ptd[i].rw);
+        ASSERT(i * MM_LARGE_PAGE_SIZE == ptd[i].page_base * MM_PAGE_SIZE);
+    }
+    for (i = 2; i < MM_SHARED_PAGE_TABLES; i++) {
+        ASSERT(1 == ptd[i].p);
+        ASSERT(0 == ptd[i].ps);
+    }
+    /*
+     * The rest of the kernel is mapped by a page table
+     */
+    ASSERT(0x800000 == virt_to_phys(ptd, 0x800000, &errno));
+    ASSERT(0 == errno);
+    cpu_pse = 0;
+    mm_get_bss_end = mm_get_bss_end_stub;
+    mm_get_phys_page = mm_get_phys_page_orig;
+    free((void*) my_mem);
+    ASSERT(0 == cpulocks);
+    return 0;
+}
+
+/*
+ * Testcase 42
+ * Tested functions: mm_map_user_segment, mm_virt_to_phys, mm_unmap_page
+ * Testcase: a 4 MB area within a new user segment is mapped by a 4 MB page filled with zeroes,
+ * the remainder of the segment by 4 kB pages. Unmapping a page within the 4 MB page releases the
+ * entire block
+ */
+int testcase42() {
+    memory_map_entry_t mmap[1];
+    pte_t __attribute__ ((aligned(4096))) ptd[1024];
+    pte_t* root_ptd;
+    u32 large_mem;
+    u32 block;
+    u32 my_mem;
+    int i;
+    /*
+     * Set up page tables with PSE enabled first
+     */
+    my_mem = setup_phys_pages(1 + MM_SHARED_PAGE_TABLES + MM_STACK_PAGES_TASK + 4);
+    mm_get_phys_page_called = 0;
+    mm_get_phys_page = mm_get_phys_page_stub;
+    mm_put_phys_page = mm_put_phys_page_stub;
+    mm_attach_page = mm_attach_page_stub;
+    mm_detach_page = mm_detach_page_stub;
+    mm_get_pt_address = mm_get_pt_address_stub;
+    pg_enabled_override = 0;
+    paging_enabled = 0;
+    mm_get_bss_end = mm_get_bss_end_stub;
+    cpu_pse = 1;
+    mm_init_page_tables();
+    mm_init_address_spaces();
+    root_ptd = (pte_t*) cr3;
+    /*
+     * Physical memory consists of one free 4 MB block
+     */
+    large_mem = (u32) malloc(3 * MM_LARGE_PAGE_SIZE);
+    block = (large_mem + MM_LARGE_PAGE_SIZE - 1) & ~(MM_LARGE_PAGE_SIZE - 1);
+    memset((void*) block, 0xff, MM_LARGE_PAGE_SIZE);
+    mmap[0].base_addr_low = block;
+    mmap[0].base_addr_high = 0;
+    mmap[0].length_low = MM_LARGE_PAGE_SIZE;
+    mmap[0].length_high = 0;
+    mmap[0].type = MB_MMAP_ENTRY_TYPE_FREE;
+    test_mmap = mmap;
+    test_mmap_entries = 1;
+    test_mmap_next = 0;
+    phys_mem_init();
+    test_mmap_entries = 0;
+    ASSERT(1 == mm_phys_free_blocks(MM_LARGE_PAGE_ORDER));
+    /*
+     * Now map a segment which covers one 4 MB area and one page above it
+     */
+    memcpy((void*) ptd, (void*) root_ptd, sizeof(pte_t) * MM_PT_ENTRIES);
+    test_ptd = ptd;
+    mm_get_ptd = mm_get_ptd_stub;
+    paging_enabled = 1;
+    ASSERT(MM_START_CODE == mm_map_user_segment(MM_START_CODE, MM_START_CODE + MM_LARGE_PAGE_SIZE + MM_PAGE_SIZE - 1));
+    ASSERT(1 == ptd[PTD_OFFSET(MM_START_CODE)].p);
+    ASSERT(1 == ptd[PTD_OFFSET(MM_START_CODE)].ps);
+    ASSERT(1 == ptd[PTD_OFFSET(MM_START_CODE)].us);
+    ASSERT(1 == ptd[PTD_OFFSET(MM_START_CODE)].rw);
+    ASSERT(block == ptd[PTD_OFFSET(MM_START_CODE)].page_base * MM_PAGE_SIZE);
+    ASSERT(0 == mm_phys_free_blocks(MM_LARGE_PAGE_ORDER));
+    for (i = 0; i < MM_LARGE_PAGE_SIZE; i += 512)
+        ASSERT(0 == ((u8*) block)[i]);
+    ASSERT(1 == ptd[PTD_OFFSET(MM_START_CODE) + 1].p);
+    ASSERT(0 == ptd[PTD_OFFSET(MM_START_CODE) + 1].ps);
+    ASSERT(block + 0x123456 == mm_virt_to_phys(MM_START_CODE + 0x123456));
+    ASSERT(1 == mm_page_mapped(MM_START_CODE + MM_LARGE_PAGE_SIZE - MM_PAGE_SIZE));
+    /*
+     * Unmap one page of the 4 MB page
+     */
+    ASSERT(0 == mm_unmap_page(ptd, MM_START_CODE + MM_PAGE_SIZE, 0));
+    ASSERT(0 == ptd[PTD_OFFSET(MM_START_CODE)].p);
+    ASSERT(0 == mm_page_mapped(MM_START_CODE));
+    ASSERT(1 == mm_phys_free_blocks(MM_LARGE_PAGE_ORDER));
+    cpu_pse = 0;
+    paging_enabled = 0;
+    mm_get_ptd = mm_get_ptd_orig;
+    mm_get_phys_page = mm_get_phys_page_orig;
+    mm_put_phys_page = mm_put_phys_page_orig;
+    free((void*) large_mem);
+    free((void*) my_mem);
+    ASSERT(0 == cpulocks);
+    return 0;
+}
+
+/*
+ * Testcase 43
+ * Tested function: mm_init_page_tables
+ * Testcase: if the CPU supports PGE, all mappings in the common area - including 4 MB pages - are
+ * marked global, whereas the kernel stack is not, and PGE is turned on in CR4
+ */
+int testcase43() {
+    int i;
+    pte_t* ptd;
+    pte_t* pt;
+    int nr_of_pages = 1 + MM_SHARED_PAGE_TABLES + MM_STACK_PAGES_TASK;
+    u32 my_mem = setup_phys_pages(nr_of_pages);
+    mm_get_phys_page_called = 0;
+    mm_get_phys_page = mm_get_phys_page_stub;
+    paging_enabled = 0;
+    mm_get_pt_address = mm_get_pt_address_stub;
+    pg_enabled_override = 0;
+    mm_get_bss_end = mm_get_bss_end_large_stub;
+    cpu_pse = 1;
+    cpu_pge = 1;
+    cr4 = 0;
+    mm_init_page_tables();
+    ASSERT(MM_CR4_PGE == (cr4 & MM_CR4_PGE));
+    ASSERT(MM_CR4_PSE == (cr4 & MM_CR4_PSE));
+    ptd = (pte_t*) cr3;
+    /*
+     * The 4 MB pages are global
+     */
+    for (i = 0; i < 2; i++) {
+        ASSERT(1 == ptd[i].ps);
+        ASSERT(1 == ptd[i].g);
+    }
+    /*
+     * The page table for the rest of the kernel is not, but the pages mapped by it are
+     */
+    ASSERT(0 == ptd[2].ps);
+    ASSERT(0 == ptd[2].g);
+    pt = (pte_t*) (ptd[2].page_base * MM_PAGE_SIZE);
+    ASSERT(1 == pt[0].p);
+    ASSERT(1 == pt[0].g);
+    /*
+     * The kernel stack is private to the task and therefore not global
+     */
+    pt = (pte_t*) (ptd[PTD_OFFSET(MM_VIRTUAL_TOS)].page_base * MM_PAGE_SIZE);
+    ASSERT(1 == pt[PT_OFFSET(MM_VIRTUAL_TOS)].p);
+    ASSERT(0 == pt[PT_OFFSET(MM_VIRTUAL_TOS)].g);
+    cpu_pse = 0;
+    cpu_pge = 0;
+    mm_get_bss_end = mm_get_bss_end_stub;
+    mm_get_phys_page = mm_get_phys_page_orig;
+    free((void*) my_mem);
+    ASSERT(0 == cpulocks);
+    return 0;
+}
+
+/*
+ * Testcase 44
+ * Tested function: mm_swap_reserve, mm_handle_page_fault
+ * Testcase: clone a process with a user space page and let the child write to it, so that it owns the page.
+ * When memory is needed, the page of the child is written to the swap device, and a page fault in the child
+ * reads it back
+ */
+int testcase44() {
+    pte_t* source_ptd;
+    pte_t* target_ptd;
+    pte_t* target_pt;
+    ir_context_t ir_context;
+    mm_swap_stats_t stats;
+    u32 user_page = MM_START_CODE;
+    u32 phys;
+    int nr_of_pages = 2 * (2 + MM_SHARED_PAGE_TABLES + MM_STACK_PAGES_TASK) + 8;
+    u32 my_mem = setup_phys_pages(nr_of_pages);
+    memset((void*) my_mem, 0, nr_of_pages * 4096);
+    mm_get_phys_page_called = 0;
+    mm_get_phys_page = mm_get_phys_page_stub;
+    my_task_id = 0;
+    paging_enabled = 1;
+    mm_get_pt_address = mm_get_pt_address_stub;
+    pg_enabled_override = 0;
+    mm_get_bss_end = mm_get_bss_end_stub;
+    mm_attach_page = mm_attach_page_stub;
+    mm_detach_page = mm_detach_page_stub;
+    mm_init_address_spaces();
+    mm_init_page_tables();
+    source_ptd = (pte_t*) cr3;
+    root_ptd = source_ptd;
+    mm_copy_page = mm_copy_page_stub;
+    test_ptd = (pte_t*) cr3;
+    mm_get_ptd = mm_get_ptd_stub;
+    swap_dev = 0x300;
+    mm_swap_init();
+    /*
+     * Map a writable user space page, clone and let both processes write to it
+     */
+    phys = mm_get_phys_page();
+    ASSERT(phys);
+    memset((void*) phys, 0xab, 4096);
+    ASSERT(0 == mm_map_page(source_ptd, phys, user_page, MM_READ_WRITE, MM_USER_PAGE, 0, 0));
+    target_ptd = (pte_t*) mm_clone(1, 1);
+    ASSERT(target_ptd);
+    target_pt = mm_get_pt_address_stub(target_ptd, PTD_OFFSET(user_page), 0);
+    ir_context.cr2 = user_page + 100;
+    ir_context.cr3 = (u32) source_ptd;
+    ir_context.err_code = 0x7;
+    ASSERT(0 == mm_handle_page_fault(&ir_context));
+    test_ptd = target_ptd;
+    ir_context.cr3 = (u32) target_ptd;
+    ASSERT(0 == mm_handle_page_fault(&ir_context));
+    ASSERT(phys == target_pt[PT_OFFSET(user_page)].page_base * MM_PAGE_SIZE);
+    /*
+     * Now ask for more memory than available. The page of the child is accessed and gets a second chance first,
+     * then it is swapped out
+     */
+    target_pt[PT_OFFSET(user_page)].a = 1;
+    proc1_in_user_space = 1;
+    eflags = 1 << 9;
+    mm_swap_reserve(mm_phys_mem_available() / 4);
+    ASSERT(0 == target_pt[PT_OFFSET(user_page)].p);
+    ASSERT(1 == target_pt[PT_OFFSET(user_page)].swapped);
+    ASSERT(1 == target_pt[PT_OFFSET(user_page)].rw);
+    mm_get_swap_stats(&stats);
+    ASSERT(16 == stats.slots);
+    ASSERT(1 == stats.used);
+    ASSERT(1 == stats.swap_outs);
+    ASSERT(1 == stats.second_chances);
+    ASSERT(0xab == swap_disk[target_pt[PT_OFFSET(user_page)].page_base * MM_PAGE_SIZE + 100]);
+    /*
+     * A read access in the child brings the page back
+     */
+    proc1_in_user_space = 0;
+    ir_context.err_code = 0x4;
+    ASSERT(0 == mm_handle_page_fault(&ir_context));
+    ASSERT(1 == target_pt[PT_OFFSET(user_page)].p);
+    ASSERT(0 == target_pt[PT_OFFSET(user_page)].swapped);
+    ASSERT(1 == target_pt[PT_OFFSET(user_page)].rw);
+    ASSERT(0xab == *((u8*) (target_pt[PT_OFFSET(user_page)].page_base * MM_PAGE_SIZE + 100)));
+    mm_get_swap_stats(&stats);
+    ASSERT(0 == stats.used);
+    ASSERT(1 == stats.swap_ins);
+    eflags = 0;
+    swap_dev = 0;
+    ASSERT(0 == cpulocks);
+    free((void*) my_mem);
+    return 0;
+}
 
 int main() {
     INIT;
@@ -2353,6 +3406,8 @@ int main() {
      * Save original pointer to mm_get_ptd
      */
     mm_get_ptd_orig = mm_get_ptd;
+    mm_get_phys_page_orig = mm_get_phys_page;
+    mm_put_phys_page_orig = mm_put_phys_page;
     RUN_CASE(1);
     RUN_CASE(2);
     RUN_CASE(3);
@@ -2385,5 +3440,17 @@ int main() {
     RUN_CASE(30);
     RUN_CASE(31);
     RUN_CASE(32);
+    RUN_CASE(33);
+    RUN_CASE(34);
+    RUN_CASE(35);
+    RUN_CASE(36);
+    RUN_CASE(37);
+    RUN_CASE(38);
+    RUN_CASE(39);
+    RUN_CASE(40);
+    RUN_CASE(41);
+    RUN_CASE(42);
+    RUN_CASE(43);
+    RUN_CASE(44);
     END;
 }
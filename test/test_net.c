@@ -8,6 +8,7 @@
 #include "vga.h"
 #include "lib/os/route.h"
 #include "lib/limits.h"
+#include "kmem.h"
 
 extern int __net_loglevel;
 
@@ -149,6 +150,17 @@ void kfree(void* ptr) {
     free(ptr);
 }
 
+/*
+ * Stubs for object caches
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    return malloc(cache->object_size);
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* object) {
+    free(object);
+}
+
 int mm_validate_buffer(u32 buffer, u32 len, int rw) {
     return 0;
 }
@@ -8,6 +8,7 @@
 #include "vga.h"
 #include "net.h"
 #include "ip.h"
+#include "kmem.h"
 #include <limits.h>
 
 
@@ -133,6 +134,17 @@ void kfree(u32 addr) {
     free((void*) addr);
 }
 
+/*
+ * Stubs for object caches
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    return malloc(cache->object_size);
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* object) {
+    free(object);
+}
+
 /*
  * Validate user space buffers
  */
@@ -0,0 +1,375 @@
+/*
+ * test_pagecache.c
+ */
+
+#include "kunit.h"
+#include "pagecache.h"
+#include "mm.h"
+#include "kerrno.h"
+#include "vga.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+void win_putchar(win_t* win, u8 c) {
+    printf("%c", c);
+}
+
+void trap() {
+
+}
+
+/*
+ * Stubs for locking functions. The semaphore stubs keep track of the
+ * value so that we detect a thread trying to acquire a mutex twice
+ */
+void sem_init(semaphore_t* sem, u32 value) {
+    sem->value = value;
+}
+
+void sem_up(semaphore_t* sem) {
+    sem->value++;
+}
+
+void __sem_down(semaphore_t* sem, char* file, int line) {
+    if (0 == sem->value) {
+        printf("Deadlock: semaphore already taken at %s@%d\n", file, line);
+        _exit(1);
+    }
+    sem->value--;
+}
+
+void spinlock_get(spinlock_t* spinlock, u32* eflags) {
+    if (*spinlock) {
+        printf("Deadlock: spinlock already taken\n");
+        _exit(1);
+    }
+    *spinlock = 1;
+}
+
+void spinlock_release(spinlock_t* spinlock, u32* eflags) {
+    *spinlock = 0;
+}
+
+void spinlock_init(spinlock_t* spinlock) {
+    *spinlock = 0;
+}
+
+/*
+ * Stubs for kmalloc_aligned which can simulate an exhausted heap
+ */
+static int heap_exhausted = 0;
+void* kmalloc_aligned(u32 size, u32 alignment) {
+    void* ptr;
+    if (heap_exhausted)
+        return 0;
+    if (posix_memalign(&ptr, alignment, size))
+        return 0;
+    return ptr;
+}
+
+/*
+ * Stubs for memory manager functions. We treat virtual addresses as physical addresses,
+ * and a page is considered to be mapped into user space if its address is mapped_page
+ */
+static u32 mapped_page = 0;
+u32 mm_virt_to_phys(u32 virtual) {
+    return virtual;
+}
+
+int mm_phys_page_mapped(u32 page_base) {
+    return (page_base == mapped_page);
+}
+
+/*
+ * A file which is read by the page cache
+ */
+static u8* file_data = 0;
+static int reads = 0;
+static int read_error = 0;
+static ssize_t test_inode_read(inode_t* inode, ssize_t bytes, off_t offset, void* data) {
+    reads++;
+    if (read_error)
+        return -EIO;
+    if (offset >= inode->size)
+        return 0;
+    if (bytes > inode->size - offset)
+        bytes = inode->size - offset;
+    memcpy(data, file_data + offset, bytes);
+    return bytes;
+}
+
+static inode_ops_t test_iops;
+static inode_t test_inode;
+
+/*
+ * Set up the cache and a file of the given size
+ */
+static void setup(off_t size) {
+    int i;
+    pc_init();
+    if (file_data)
+        free(file_data);
+    file_data = (u8*) malloc(size);
+    for (i = 0; i < size; i++)
+        file_data[i] = (u8) (i % 251);
+    test_iops.inode_read = test_inode_read;
+    test_inode.iops = &test_iops;
+    test_inode.dev = 1;
+    test_inode.inode_nr = 12;
+    test_inode.size = size;
+    reads = 0;
+    read_error = 0;
+    heap_exhausted = 0;
+    mapped_page = 0;
+}
+
+/*
+ * Testcase 1
+ * Tested function: pc_read
+ * Testcase: read a part of a file twice, the second read is served from the cache
+ */
+int testcase1() {
+    u8 buffer[100];
+    pc_stats_t stats;
+    setup(3 * MM_PAGE_SIZE);
+    ASSERT(100 == pc_read(&test_inode, 10, 100, buffer));
+    ASSERT(0 == memcmp(buffer, file_data + 10, 100));
+    ASSERT(1 == reads);
+    memset(buffer, 0, 100);
+    ASSERT(100 == pc_read(&test_inode, 10, 100, buffer));
+    ASSERT(0 == memcmp(buffer, file_data + 10, 100));
+    ASSERT(1 == reads);
+    pc_get_stats(&stats);
+    ASSERT(1 == stats.hits);
+    ASSERT(1 == stats.misses);
+    ASSERT(1 == stats.pages);
+    return 0;
+}
+
+/*
+ * Testcase 2
+ * Tested function: pc_read
+ * Testcase: a read which spans several pages and the end of the file is truncated at the end of the file
+ */
+int testcase2() {
+    u8 buffer[3 * MM_PAGE_SIZE];
+    pc_stats_t stats;
+    setup(2 * MM_PAGE_SIZE + 100);
+    ASSERT(2 * MM_PAGE_SIZE + 50 == pc_read(&test_inode, 50, 3 * MM_PAGE_SIZE, buffer));
+    ASSERT(0 == memcmp(buffer, file_data + 50, 2 * MM_PAGE_SIZE + 50));
+    pc_get_stats(&stats);
+    ASSERT(3 == stats.pages);
+    ASSERT(0 == pc_read(&test_inode, 2 * MM_PAGE_SIZE + 100, 10, buffer));
+    return 0;
+}
+
+/*
+ * Testcase 3
+ * Tested function: pc_get_page
+ * Testcase: the part of the last page beyond the end of the file is filled with zeroes
+ */
+int testcase3() {
+    pc_page_t* page;
+    int i;
+    setup(MM_PAGE_SIZE + 100);
+    page = pc_get_page(&test_inode, 1);
+    ASSERT(page);
+    ASSERT(0 == ((u32) page->data) % MM_PAGE_SIZE);
+    ASSERT(page->phys == (u32) page->data);
+    ASSERT(0 == memcmp(page->data, file_data + MM_PAGE_SIZE, 100));
+    for (i = 100; i < MM_PAGE_SIZE; i++)
+        ASSERT(0 == page->data[i]);
+    ASSERT(1 == page->ref_count);
+    pc_release_page(page);
+    ASSERT(0 == page->ref_count);
+    return 0;
+}
+
+/*
+ * Testcase 4
+ * Tested function: pc_update
+ * Testcase: pages in the cache are updated, pages which are not in the cache are not added
+ */
+int testcase4() {
+    u8 buffer[MM_PAGE_SIZE];
+    u8 data[200];
+    pc_stats_t stats;
+    setup(2 * MM_PAGE_SIZE);
+    ASSERT(10 == pc_read(&test_inode, 0, 10, buffer));
+    memset(data, 0xab, 200);
+    pc_update(&test_inode, MM_PAGE_SIZE - 100, 200, data);
+    pc_get_stats(&stats);
+    ASSERT(1 == stats.pages);
+    ASSERT(100 == pc_read(&test_inode, MM_PAGE_SIZE - 100, 100, buffer));
+    ASSERT(0 == memcmp(buffer, data, 100));
+    ASSERT(1 == reads);
+    return 0;
+}
+
+/*
+ * Testcase 5
+ * Tested function: pc_truncate
+ * Testcase: pages beyond the new end of the file are removed and the rest of the last page is zeroed
+ */
+int testcase5() {
+    u8 buffer[3 * MM_PAGE_SIZE];
+    pc_page_t* page;
+    pc_stats_t stats;
+    int i;
+    setup(3 * MM_PAGE_SIZE);
+    ASSERT(3 * MM_PAGE_SIZE == pc_read(&test_inode, 0, 3 * MM_PAGE_SIZE, buffer));
+    pc_truncate(1, 12, MM_PAGE_SIZE + 10);
+    pc_get_stats(&stats);
+    ASSERT(2 == stats.pages);
+    test_inode.size = MM_PAGE_SIZE + 10;
+    reads = 0;
+    page = pc_get_page(&test_inode, 1);
+    ASSERT(page);
+    ASSERT(0 == reads);
+    ASSERT(0 == memcmp(page->data, file_data + MM_PAGE_SIZE, 10));
+    for (i = 10; i < MM_PAGE_SIZE; i++)
+        ASSERT(0 == page->data[i]);
+    pc_release_page(page);
+    return 0;
+}
+
+/*
+ * Testcase 6
+ * Tested functions: pc_purge, pc_purge_dev
+ * Testcase: remove all pages of a file resp. a device
+ */
+int testcase6() {
+    u8 buffer[10];
+    pc_stats_t stats;
+    setup(MM_PAGE_SIZE);
+    ASSERT(10 == pc_read(&test_inode, 0, 10, buffer));
+    test_inode.inode_nr = 13;
+    ASSERT(10 == pc_read(&test_inode, 0, 10, buffer));
+    test_inode.dev = 2;
+    ASSERT(10 == pc_read(&test_inode, 0, 10, buffer));
+    pc_purge(1, 12);
+    pc_get_stats(&stats);
+    ASSERT(2 == stats.pages);
+    pc_purge_dev(1);
+    pc_get_stats(&stats);
+    ASSERT(1 == stats.pages);
+    reads = 0;
+    ASSERT(10 == pc_read(&test_inode, 0, 10, buffer));
+    ASSERT(0 == reads);
+    test_inode.dev = 1;
+    ASSERT(10 == pc_read(&test_inode, 0, 10, buffer));
+    ASSERT(1 == reads);
+    return 0;
+}
+
+/*
+ * Testcase 7
+ * Tested function: pc_get_page
+ * Testcase: when the cache is full, the least recently used page is reused
+ */
+int testcase7() {
+    u8 buffer[10];
+    pc_stats_t stats;
+    int i;
+    setup((PC_MAX_PAGES + 1) * MM_PAGE_SIZE);
+    for (i = 0; i < PC_MAX_PAGES; i++)
+        ASSERT(10 == pc_read(&test_inode, i * MM_PAGE_SIZE, 10, buffer));
+    /*
+     * Use page 0 so that page 1 is now the least recently used page
+     */
+    ASSERT(10 == pc_read(&test_inode, 0, 10, buffer));
+    reads = 0;
+    ASSERT(10 == pc_read(&test_inode, PC_MAX_PAGES * MM_PAGE_SIZE, 10, buffer));
+    ASSERT(0 == memcmp(buffer, file_data + PC_MAX_PAGES * MM_PAGE_SIZE, 10));
+    ASSERT(1 == reads);
+    ASSERT(10 == pc_read(&test_inode, 0, 10, buffer));
+    ASSERT(1 == reads);
+    ASSERT(10 == pc_read(&test_inode, MM_PAGE_SIZE, 10, buffer));
+    ASSERT(2 == reads);
+    pc_get_stats(&stats);
+    ASSERT(PC_MAX_PAGES == stats.pages);
+    ASSERT(PC_MAX_PAGES == stats.allocated);
+    ASSERT(2 == stats.evictions);
+    return 0;
+}
+
+/*
+ * Testcase 8
+ * Tested function: pc_get_page
+ * Testcase: pages which are still referenced or mapped into user space are not reused
+ */
+int testcase8() {
+    u8 buffer[10];
+    pc_page_t* page0;
+    pc_page_t* page1;
+    int i;
+    setup((PC_MAX_PAGES + 2) * MM_PAGE_SIZE);
+    page0 = pc_get_page(&test_inode, 0);
+    ASSERT(page0);
+    page1 = pc_get_page(&test_inode, 1);
+    ASSERT(page1);
+    mapped_page = page1->phys;
+    pc_release_page(page1);
+    for (i = 2; i < PC_MAX_PAGES + 2; i++)
+        ASSERT(10 == pc_read(&test_inode, i * MM_PAGE_SIZE, 10, buffer));
+    reads = 0;
+    ASSERT(page0 == pc_get_page(&test_inode, 0));
+    ASSERT(page1 == pc_get_page(&test_inode, 1));
+    ASSERT(0 == reads);
+    pc_release_page(page0);
+    pc_release_page(page0);
+    pc_release_page(page1);
+    return 0;
+}
+
+/*
+ * Testcase 9
+ * Tested function: pc_read
+ * Testcase: if the file cannot be read, an error is returned and the page is not added to the cache
+ */
+int testcase9() {
+    u8 buffer[10];
+    pc_stats_t stats;
+    setup(MM_PAGE_SIZE);
+    read_error = 1;
+    ASSERT(-EIO == pc_read(&test_inode, 0, 10, buffer));
+    pc_get_stats(&stats);
+    ASSERT(0 == stats.pages);
+    read_error = 0;
+    ASSERT(10 == pc_read(&test_inode, 0, 10, buffer));
+    ASSERT(0 == memcmp(buffer, file_data, 10));
+    return 0;
+}
+
+/*
+ * Testcase 10
+ * Tested function: pc_read
+ * Testcase: if no memory is available for the cache, data is read directly from the file
+ */
+int testcase10() {
+    u8 buffer[2 * MM_PAGE_SIZE];
+    pc_stats_t stats;
+    setup(2 * MM_PAGE_SIZE);
+    heap_exhausted = 1;
+    ASSERT(2 * MM_PAGE_SIZE == pc_read(&test_inode, 0, 2 * MM_PAGE_SIZE, buffer));
+    ASSERT(0 == memcmp(buffer, file_data, 2 * MM_PAGE_SIZE));
+    pc_get_stats(&stats);
+    ASSERT(0 == stats.pages);
+    ASSERT(0 == stats.allocated);
+    return 0;
+}
+
+int main() {
+    INIT;
+    RUN_CASE(1);
+    RUN_CASE(2);
+    RUN_CASE(3);
+    RUN_CASE(4);
+    RUN_CASE(5);
+    RUN_CASE(6);
+    RUN_CASE(7);
+    RUN_CASE(8);
+    RUN_CASE(9);
+    RUN_CASE(10);
+    END;
+}
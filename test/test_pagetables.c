@@ -30,7 +30,7 @@ int check_common_fields(pte_t pte) {
  */
 int testcase1() {
     /* First set up entry with rw = 1 */
-    pte_t pte = pte_create(1, 0, 0, 0x100);
+    pte_t pte = pte_create(1, 0, 0, 0, 0x100);
     u32 pte_word = *((u32*) &pte);
     u8 rw = (pte_word >> 1) & 0x1;
     ASSERT(0==check_common_fields(pte));
@@ -38,7 +38,7 @@ int testcase1() {
     /* Now set up entry with rw = 0
      * and all other fields being the same
      */
-    pte = pte_create(0, 0, 0, 0x100);
+    pte = pte_create(0, 0, 0, 0, 0x100);
     pte_word = *((u32*) &pte);
     rw = (pte_word >> 1) & 0x1;
     ASSERT(0==rw);
@@ -50,7 +50,7 @@ int testcase1() {
  */
 int testcase2() {
     /* First set up entry with rw = 1 */
-    pte_t pte = pte_create(1, 1, 0, 0x100);
+    pte_t pte = pte_create(1, 1, 0, 0, 0x100);
     u32 pte_word = *((u32*) &pte);
     u8 us = (pte_word >> 2) & 0x1;
     ASSERT(0==check_common_fields(pte));
@@ -58,7 +58,7 @@ int testcase2() {
     /* Now set up entry with us = 0
      * and all other fields being the same
      */
-    pte = pte_create(1, 0, 0, 0x100);
+    pte = pte_create(1, 0, 0, 0, 0x100);
     pte_word = *((u32*) &pte);
     us = (pte_word >> 2) & 0x1;
     ASSERT(0==us);
@@ -70,7 +70,7 @@ int testcase2() {
  */
 int testcase3() {
     /* First set up entry with pcd = 1 */
-    pte_t pte = pte_create(0, 0, 1, 0x100);
+    pte_t pte = pte_create(0, 0, 1, 0, 0x100);
     u32 pte_word = *((u32*) &pte);
     u8 pcd = (pte_word >> 4) & 0x1;
     ASSERT(0==check_common_fields(pte));
@@ -78,7 +78,7 @@ int testcase3() {
     /* Now set up entry with us = 0
      * and all other fields being the same
      */
-    pte = pte_create(0, 0, 0, 0x100);
+    pte = pte_create(0, 0, 0, 0, 0x100);
     pte_word = *((u32*) &pte);
     pcd = (pte_word >> 4) & 0x1;
     ASSERT(0==pcd);
@@ -89,7 +89,7 @@ int testcase3() {
  * Testcase 4: check page base address
  */
 int testcase4() {
-    pte_t pte = pte_create(0, 0, 1, 0x10000);
+    pte_t pte = pte_create(0, 0, 1, 0, 0x10000);
     u32 pte_word = *((u32*) &pte);
     u32 page_base = (pte_word >> 12);
     ASSERT(0==check_common_fields(pte));
@@ -97,11 +97,85 @@ int testcase4() {
     return 0;
 }
 
+/*
+ * Testcase 5: check that the page size bit is clear in an ordinary entry
+ */
+int testcase5() {
+    pte_t pte = pte_create(1, 1, 0, 0, 0x400000);
+    u32 pte_word = *((u32*) &pte);
+    u8 ps = (pte_word >> 7) & 0x1;
+    ASSERT(0==check_common_fields(pte));
+    ASSERT(0==ps);
+    ASSERT(0==pte.ps);
+    return 0;
+}
+
+/*
+ * Testcase 6: create an entry for a 4 MB page and check page size bit, flags
+ * and base address
+ */
+int testcase6() {
+    pte_t pde = pde_create_large(1, 1, 0, 0, 0x1c00000);
+    u32 pde_word = *((u32*) &pde);
+    ASSERT(0==check_common_fields(pde));
+    ASSERT(1==((pde_word >> 7) & 0x1));
+    ASSERT(1==((pde_word >> 1) & 0x1));
+    ASSERT(1==((pde_word >> 2) & 0x1));
+    ASSERT(0==((pde_word >> 4) & 0x1));
+    ASSERT(0x1c00000==(pde_word & 0xfffff000));
+    ASSERT(1==pde.ps);
+    /*
+     * Bits 12 - 21 must be zero for a 4 MB page
+     */
+    ASSERT(0==((pde_word >> 12) & 0x3ff));
+    return 0;
+}
+
+/*
+ * Testcase 7: a base address which is not aligned to a 4 MB boundary
+ * is rounded down
+ */
+int testcase7() {
+    pte_t pde = pde_create_large(0, 0, 1, 0, 0x1c23000);
+    u32 pde_word = *((u32*) &pde);
+    ASSERT(0x1c00000==(pde_word & 0xfffff000));
+    ASSERT(0==((pde_word >> 1) & 0x1));
+    ASSERT(0==((pde_word >> 2) & 0x1));
+    ASSERT(1==((pde_word >> 4) & 0x1));
+    ASSERT(1==((pde_word >> 7) & 0x1));
+    return 0;
+}
+
+/*
+ * Testcase 8: check global flag for ordinary entries and 4 MB pages
+ */
+int testcase8() {
+    pte_t pte = pte_create(1, 0, 0, 1, 0x100);
+    u32 pte_word = *((u32*) &pte);
+    ASSERT(0==check_common_fields(pte));
+    ASSERT(1==((pte_word >> 8) & 0x1));
+    ASSERT(0==((pte_word >> 7) & 0x1));
+    ASSERT(1==pte.g);
+    pte = pte_create(1, 0, 0, 0, 0x100);
+    pte_word = *((u32*) &pte);
+    ASSERT(0==((pte_word >> 8) & 0x1));
+    pte = pde_create_large(1, 0, 0, 1, 0x400000);
+    pte_word = *((u32*) &pte);
+    ASSERT(1==((pte_word >> 8) & 0x1));
+    ASSERT(1==((pte_word >> 7) & 0x1));
+    ASSERT(0x400000==(pte_word & 0xfffff000));
+    return 0;
+}
+
 int main() {
     INIT;
     RUN_CASE(1);
     RUN_CASE(2);
     RUN_CASE(3);
     RUN_CASE(4);
+    RUN_CASE(5);
+    RUN_CASE(6);
+    RUN_CASE(7);
+    RUN_CASE(8);
     END;
 }
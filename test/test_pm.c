@@ -210,6 +210,12 @@ u32 mm_get_kernel_stack(u32 task_id) {
     return 0;
 }
 
+/*
+ * Stub for mm_tlb_switch
+ */
+void mm_tlb_switch(int cpuid, u32 pid) {
+}
+
 /*
  * Stub for gdt_update_tss
  */
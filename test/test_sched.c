@@ -4,6 +4,7 @@
 
 #include "kunit.h"
 #include <stdio.h>
+#include <string.h>
 #include "sched.h"
 #include "pm.h"
 #include "locks.h"
@@ -59,7 +60,10 @@ int cpu_get_apic_id(int cpuid) {
     return 0;
 }
 
+static int sched_balance = 0;
 int params_get_int(char* param) {
+    if (0 == strcmp(param, "sched_balance"))
+        return sched_balance;
     return 0;
 }
 
@@ -371,6 +375,122 @@ int testcase9() {
     return 0;
 }
 
+/*
+ * Testcase 10
+ * Tested function: sched_do_tick
+ * Verify that an idle CPU does not steal runnables which are bound
+ * to another CPU
+ */
+int testcase10() {
+    int i;
+    sched_balance = 1;
+    sched_init();
+    sched_add_idle_task(10, 1);
+    sched_enqueue_cpu(1, 0, 0);
+    sched_enqueue_cpu(2, 0, 0);
+    sched_enqueue_cpu(3, 0, 0);
+    ASSERT(3==sched_get_queue_length(0));
+    /*
+     * Let some time pass on both CPUs
+     */
+    for (i = 0; i < SCHED_BALANCE_TICKS; i++) {
+        cpuid = 0;
+        sched_do_tick();
+        cpuid = 1;
+        sched_do_tick();
+    }
+    ASSERT(3==sched_get_queue_length(0));
+    ASSERT(0==sched_get_queue_length(1));
+    ASSERT(10==sched_schedule());
+    cpuid = 0;
+    sched_balance = 0;
+    return 0;
+}
+
+/*
+ * Testcase 11
+ * Tested function: sched_do_tick
+ * Verify that an idle CPU steals half of the difference in queue length from the busiest
+ * CPU, starting with the highest priority, but only once the runnables are no longer cache-hot
+ */
+int testcase11() {
+    int i;
+    sched_balance = 1;
+    sched_init();
+    /*
+     * Add runnables while only the BSP is up, so that they all end up there
+     */
+    sched_enqueue(1, 1);
+    sched_enqueue(2, 3);
+    sched_enqueue(3, 2);
+    sched_enqueue(4, 0);
+    sched_add_idle_task(10, 1);
+    ASSERT(4==sched_get_queue_length(0));
+    ASSERT(0==sched_get_queue_length(1));
+    /*
+     * The runnables have just been added, so nothing should happen
+     */
+    cpuid = 1;
+    sched_do_tick();
+    ASSERT(4==sched_get_queue_length(0));
+    ASSERT(0==sched_get_queue_length(1));
+    /*
+     * Now let time pass on the BSP and tick again on CPU 1
+     */
+    cpuid = 0;
+    for (i = 0; i < SCHED_CACHE_HOT_TICKS; i++)
+        sched_do_tick();
+    cpuid = 1;
+    sched_do_tick();
+    ASSERT(2==sched_get_queue_length(0));
+    ASSERT(2==sched_get_queue_length(1));
+    /*
+     * CPU 1 should now run the stolen runnables with priority 3 and 2
+     */
+    ASSERT(2==sched_schedule());
+    sched_dequeue();
+    ASSERT(3==sched_schedule());
+    /*
+     * while the BSP runs the remaining ones
+     */
+    cpuid = 0;
+    sched_yield();
+    ASSERT(1==sched_schedule());
+    sched_balance = 0;
+    return 0;
+}
+
+/*
+ * Testcase 12
+ * Tested function: sched_schedule
+ * Verify that a CPU which is about to select its idle task steals a runnable from
+ * another CPU first
+ */
+int testcase12() {
+    int i;
+    sched_balance = 1;
+    sched_init();
+    sched_enqueue(1, 0);
+    sched_enqueue(2, 0);
+    sched_add_idle_task(10, 1);
+    cpuid = 0;
+    for (i = 0; i < SCHED_CACHE_HOT_TICKS; i++)
+        sched_do_tick();
+    /*
+     * Make CPU 1 go through the scheduler while it is idle
+     */
+    cpuid = 1;
+    sched_yield();
+    ASSERT(1==sched_schedule());
+    ASSERT(1==sched_get_queue_length(0));
+    ASSERT(1==sched_get_queue_length(1));
+    cpuid = 0;
+    sched_yield();
+    ASSERT(2==sched_schedule());
+    sched_balance = 0;
+    return 0;
+}
+
 int main() {
     INIT;
     RUN_CASE(1);
@@ -382,6 +502,9 @@ int main() {
     RUN_CASE(7);
     RUN_CASE(8);
     RUN_CASE(9);
+    RUN_CASE(10);
+    RUN_CASE(11);
+    RUN_CASE(12);
     END;
 }
 
@@ -152,6 +152,7 @@
 #include "lib/os/if.h"
 #include "lib/os/route.h"
 #include "lib/netinet/in.h"
+#include "kmem.h"
 #include <string.h>
 #include <unistd.h>
 
@@ -796,6 +797,17 @@ void kfree(u32 addr) {
     free((void*) addr);
 }
 
+/*
+ * Stubs for object caches
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    return malloc(cache->object_size);
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* object) {
+    free(object);
+}
+
 static int tcp_disable_cc = 0;
 int params_get_int(char* param) {
     if (0 == strcmp(param, "tcp_disable_cc"))
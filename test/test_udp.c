@@ -10,6 +10,7 @@
 #include "net.h"
 #include "eth.h"
 #include "lib/os/route.h"
+#include "kmem.h"
 
 #include <unistd.h>
 #include <stdlib.h>
@@ -288,6 +289,17 @@ void kfree(u32 addr) {
     free((void*) addr);
 }
 
+/*
+ * Stubs for object caches
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    return malloc(cache->object_size);
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* object) {
+    free(object);
+}
+
 /*
  * Stubs for params_get
  */
@@ -122,6 +122,18 @@ void kfree(void* addr) {
     free(addr);
 }
 
+/*
+ * Stubs for params_get_int and the system call interface
+ * used by the block cache
+ */
+unsigned int params_get_int(char* param) {
+    return 0;
+}
+
+unsigned int __ctOS_syscall(unsigned int __sysno, int argc, ...) {
+    return 1;
+}
+
 /*
  * Implementations of bc_write and bc_read which access our test image
  */
@@ -15,6 +15,8 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <setjmp.h>
+#include <sys/mman.h>
+#include <errno.h>
 
 extern char** environ;
 
@@ -464,9 +466,149 @@ int testcase9() {
 }
 
 
+/*
+ * Testcase 10
+ * Anonymous mappings: private mappings are copied on fork, shared mappings are shared
+ * with the child
+ */
+int testcase10() {
+    char* private;
+    char* shared;
+    pid_t pid;
+    int status;
+    private = (char*) mmap(0, 3 * 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT(MAP_FAILED != private);
+    shared = (char*) mmap(0, 4096, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    ASSERT(MAP_FAILED != shared);
+    ASSERT(0 == ((unsigned int) private) % 4096);
+    /*
+     * Anonymous pages are filled with zeroes
+     */
+    ASSERT(0 == private[0]);
+    ASSERT(0 == private[3 * 4096 - 1]);
+    ASSERT(0 == shared[100]);
+    private[4096] = 'a';
+    shared[0] = 'a';
+    pid = fork();
+    if (0 == pid) {
+        private[4096] = 'b';
+        shared[0] = 'b';
+        _exit(0);
+    }
+    ASSERT(pid > 0);
+    waitpid(pid, &status, 0);
+    ASSERT('a' == private[4096]);
+    ASSERT('b' == shared[0]);
+    /*
+     * Remove the page in the middle of the private mapping
+     */
+    ASSERT(0 == munmap(private + 4096, 4096));
+    ASSERT(0 == private[2 * 4096]);
+    ASSERT(0 == munmap(private, 3 * 4096));
+    ASSERT(0 == munmap(shared, 4096));
+    ASSERT(-1 == munmap(private + 1, 4096));
+    ASSERT(EINVAL == errno);
+    ASSERT(MAP_FAILED == mmap(0, 4096, PROT_READ, MAP_ANONYMOUS, -1, 0));
+    ASSERT(EINVAL == errno);
+    return 0;
+}
+
+/*
+ * Testcase 11
+ * File mappings: data is read from the file, changes to a private mapping are not written back,
+ * changes to a shared mapping are written back when the mapping is removed
+ */
+int testcase11() {
+    int fd;
+    int i;
+    char* map;
+    char buffer[16];
+    unlink("/tmp/testmisc_tc11");
+    fd = open("/tmp/testmisc_tc11", O_CREAT | O_RDWR, S_IRWXU);
+    ASSERT(fd >= 0);
+    for (i = 0; i < 4096 + 10; i++) {
+        buffer[0] = 'a' + (i % 26);
+        ASSERT(1 == write(fd, buffer, 1));
+    }
+    map = (char*) mmap(0, 4096 + 10, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ASSERT(MAP_FAILED != map);
+    ASSERT('a' == map[0]);
+    ASSERT('a' + (4096 % 26) == map[4096]);
+    ASSERT(0 == map[4096 + 10]);
+    map[0] = 'X';
+    ASSERT(0 == munmap(map, 4096 + 10));
+    /*
+     * Map the second page only
+     */
+    map = (char*) mmap(0, 10, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 4096);
+    ASSERT(MAP_FAILED != map);
+    ASSERT('a' + (4096 % 26) == map[0]);
+    map[1] = 'X';
+    ASSERT(0 == munmap(map, 10));
+    ASSERT(4096 == lseek(fd, 4096, SEEK_SET));
+    ASSERT(2 == read(fd, buffer, 2));
+    ASSERT('a' + (4096 % 26) == buffer[0]);
+    ASSERT('X' == buffer[1]);
+    ASSERT(0 == lseek(fd, 0, SEEK_SET));
+    ASSERT(1 == read(fd, buffer, 1));
+    ASSERT('a' == buffer[0]);
+    /*
+     * The file offset needs to be page aligned
+     */
+    ASSERT(MAP_FAILED == mmap(0, 10, PROT_READ, MAP_PRIVATE, fd, 10));
+    ASSERT(EINVAL == errno);
+    close(fd);
+    /*
+     * A shared writable mapping requires a file which is open for reading and writing
+     */
+    fd = open("/tmp/testmisc_tc11", O_RDONLY);
+    ASSERT(fd >= 0);
+    ASSERT(MAP_FAILED == mmap(0, 10, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    ASSERT(EACCES == errno);
+    close(fd);
+    unlink("/tmp/testmisc_tc11");
+    return 0;
+}
+
+
 /*
  * Main
  */
+/*
+ * Testcase 12
+ * Tested functions: mmap, read, write
+ * Testcase: a shared mapping of a full page of a file uses the page of the page cache, so that
+ * changes done via the mapping are visible to read() immediately and vice versa
+ */
+int testcase12() {
+    int fd;
+    int i;
+    char* map;
+    char buffer[16];
+    unlink("/tmp/testmisc_tc12");
+    fd = open("/tmp/testmisc_tc12", O_CREAT | O_RDWR, S_IRWXU);
+    ASSERT(fd >= 0);
+    for (i = 0; i < 4096; i++) {
+        buffer[0] = 'a' + (i % 26);
+        ASSERT(1 == write(fd, buffer, 1));
+    }
+    map = (char*) mmap(0, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ASSERT(MAP_FAILED != map);
+    ASSERT('a' == map[0]);
+    map[1] = 'X';
+    ASSERT(0 == lseek(fd, 0, SEEK_SET));
+    ASSERT(2 == read(fd, buffer, 2));
+    ASSERT('a' == buffer[0]);
+    ASSERT('X' == buffer[1]);
+    buffer[0] = 'Y';
+    ASSERT(1 == write(fd, buffer, 1));
+    ASSERT('Y' == map[2]);
+    ASSERT(0 == munmap(map, 4096));
+    close(fd);
+    unlink("/tmp/testmisc_tc12");
+    return 0;
+}
+
 int main() {
     INIT;
     RUN_CASE(1);
@@ -478,5 +620,8 @@ int main() {
     RUN_CASE(7);
     RUN_CASE(8);
     RUN_CASE(9);
+    RUN_CASE(10);
+    RUN_CASE(11);
+    RUN_CASE(12);
     END;
 }
@@ -10,6 +10,8 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <time.h>
+#include <sys/times.h>
 
 /*
  * Signal handler for SIGPIPE
@@ -821,6 +823,60 @@ int testcase15() {
 }
 
 
+/*
+ * Testcase 16: context switch benchmark - two processes pass a byte back and forth
+ * via two pipes, so that each round trip requires two task switches. Print the
+ * number of round trips per second. Compare the results with the kernel parameter
+ * pge=0 and pge=1 to see the effect of global pages for the common kernel area
+ */
+int testcase16() {
+    int ping[2];
+    int pong[2];
+    int pid;
+    int status;
+    int i;
+    int round_trips = 20000;
+    char buffer = 'a';
+    struct tms tms_buffer;
+    clock_t start;
+    clock_t elapsed;
+    ASSERT(0==pipe(ping));
+    ASSERT(0==pipe(pong));
+    pid = fork();
+    if (0==pid) {
+        /*
+         * This is the child - echo everything we receive
+         */
+        close(ping[1]);
+        close(pong[0]);
+        for (i=0;i<round_trips;i++) {
+            if (1!=read(ping[0], &buffer, 1))
+                _exit(1);
+            if (1!=write(pong[1], &buffer, 1))
+                _exit(1);
+        }
+        _exit(0);
+    }
+    close(ping[0]);
+    close(pong[1]);
+    start = times(&tms_buffer);
+    for (i=0;i<round_trips;i++) {
+        ASSERT(1==write(ping[1], &buffer, 1));
+        ASSERT(1==read(pong[0], &buffer, 1));
+    }
+    elapsed = times(&tms_buffer) - start;
+    ASSERT(pid==waitpid(pid, &status, 0));
+    ASSERT(WIFEXITED(status));
+    ASSERT(0==WEXITSTATUS(status));
+    close(ping[1]);
+    close(pong[0]);
+    elapsed = (elapsed / CLOCKS_PER_SEC) * 1000 + ((elapsed % CLOCKS_PER_SEC) * 1000) / CLOCKS_PER_SEC;
+    if (elapsed > 0)
+        printf("(%d round trips in %d ms, %d round trips per second) ", round_trips, (int) elapsed,
+                (int) ((round_trips * 1000) / elapsed));
+    return 0;
+}
+
 int main() {
     INIT;
     RUN_CASE(1);
@@ -838,5 +894,6 @@ int main() {
     RUN_CASE(13);
     RUN_CASE(14);
     RUN_CASE(15);
+    RUN_CASE(16);
     END;
 }